@@ -0,0 +1,176 @@
+import sys
+import re
+import struct
+import hashlib
+import argparse
+
+from elftools.elf.elffile import ELFFile
+from elftools.elf.constants import SH_FLAGS
+
+# Decodes the records written by components/binary-log (CONFIG_BINARY_LOG) from an SD segment,
+# a /get-log?since= dump or a raw ring copy. Needs the ELF of the build that wrote them, format
+# strings and strings in flash are stored only by address.
+#
+# header: u8 magic 0xB7, u8 type, u16 record length (header included), u32 ms since boot
+#   1 LOG       u32 format address, args
+#   2 LOG_TEXT  u8 format length, format, args
+#   3 TIME      u32 unix time
+#   4 BOOT      u8 length, ELF SHA-256 hex, u8 length, app version
+# args per conversion: '*' values u32 first, then integers u32 (u64 for ll, j), floats f64,
+# strings u8 0xFF + u32 address or u8 length + bytes
+
+MAGIC = 0xB7
+HEADER = struct.Struct("<BBHI")
+MAX_RECORD = 256
+TYPE_LOG, TYPE_LOG_TEXT, TYPE_TIME, TYPE_BOOT = 1, 2, 3, 4
+STRING_BY_ADDRESS = 0xFF
+
+CONVERSION = re.compile(r"%([-+ #0]*)(\*|\d+)?(?:\.(\*|\d*))?(hh|h|ll|l|L|q|j|z|t)?([diouxXeEfFgGaAcsp%])")
+
+
+class Firmware:
+    """Allocated sections of the ELF, to read strings by address"""
+
+    def __init__(self, path):
+        with open(path, "rb") as f:
+            raw = f.read()
+            f.seek(0)
+            elf = ELFFile(f)
+            self.sections = [(s["sh_addr"], s.data()) for s in elf.iter_sections()
+                             if s["sh_flags"] & SH_FLAGS.SHF_ALLOC and s["sh_type"] != "SHT_NOBITS"]
+        self.sha = hashlib.sha256(raw).hexdigest()
+
+    def string(self, addr):
+        for base, data in self.sections:
+            if base <= addr < base + len(data):
+                end = data.find(b"\0", addr - base)
+                return data[addr - base:end if end >= 0 else len(data)].decode("utf-8", "replace")
+        return "<0x%08x?>" % addr
+
+
+class Args:
+    def __init__(self, data):
+        self.data = data
+        self.pos = 0
+
+    def take(self, fmt):
+        size = struct.calcsize(fmt)
+        if self.pos + size > len(self.data):
+            self.pos = len(self.data)
+            return None
+        value = struct.unpack_from(fmt, self.data, self.pos)[0]
+        self.pos += size
+        return value
+
+    def string(self, firmware):
+        marker = self.take("<B")
+        if marker is None:
+            return None
+        if marker == STRING_BY_ADDRESS:
+            addr = self.take("<I")
+            return None if addr is None else firmware.string(addr)
+        text = self.data[self.pos:self.pos + marker]
+        self.pos += marker
+        return text.decode("utf-8", "replace")
+
+
+def format_log(fmt, args, firmware):
+    """C printf semantics over the recorded arguments, a record cut short prints empty conversions"""
+    def conversion(m):
+        flags, width, precision, length, conv = m.groups()
+        if conv == "%":
+            return "%"
+        if width == "*":
+            width = args.take("<i")
+            width = "" if width is None else str(width)
+        if precision == "*":
+            precision = args.take("<i")
+            precision = "" if precision is None else str(precision)
+        wide = length in ("ll", "j", "q")
+        unsigned = conv in "ouxX"
+
+        if conv == "s":
+            value = args.string(firmware)
+        elif conv in "eEfFgGaA":
+            value = args.take("<d")
+            conv = "e" if conv in "aA" else conv
+        elif conv == "p":
+            value = args.take("<I")
+            conv, flags = "x", flags + "#"
+        elif wide:
+            value = args.take("<Q" if unsigned else "<q")
+        else:
+            value = args.take("<I" if unsigned else "<i")
+        if value is None:
+            return ""
+        if conv == "c":
+            value, conv = chr(value & 0xFF), "s"
+        conv = "d" if conv in "iu" else conv
+        spec = "%" + flags + (width or "") + ("." + precision if precision is not None else "") + conv
+        return spec % value
+
+    return CONVERSION.sub(conversion, fmt)
+
+
+def records(data):
+    """Yields (type, ms, payload), skipping anything that does not parse as a record"""
+    pos = 0
+    while pos + HEADER.size <= len(data):
+        magic, rtype, length, ms = HEADER.unpack_from(data, pos)
+        if magic != MAGIC or not TYPE_LOG <= rtype <= TYPE_BOOT or not HEADER.size <= length <= MAX_RECORD \
+                or pos + length > len(data):
+            pos += 1        # Resync, e.g. a dump starting mid record
+            continue
+        yield rtype, ms, data[pos + HEADER.size:pos + length]
+        pos += length
+
+
+def decode(data, firmware, out):
+    checked = False
+    for rtype, ms, payload in records(data):
+        args = Args(payload)
+        if rtype == TYPE_LOG:
+            out.write(format_log(firmware.string(args.take("<I")), args, firmware))
+        elif rtype == TYPE_LOG_TEXT:
+            fmt = args.string(firmware) or ""
+            out.write(format_log(fmt, args, firmware))
+        elif rtype == TYPE_TIME:
+            out.write("#time %d\n" % args.take("<I"))
+        elif rtype == TYPE_BOOT:
+            sha = args.string(firmware) or ""
+            version = args.string(firmware) or ""
+            out.write("#boot %s elf %s\n" % (version, sha))
+            if not firmware.sha.startswith(sha):
+                sys.stderr.write("Warning: records from build %s (ELF %s), the ELF given is %s\n"
+                                 % (version, sha, firmware.sha[:len(sha)]))
+            checked = True
+    if not checked:
+        sys.stderr.write("Note: no boot record seen, the ELF could not be checked\n")
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Decode binary log records against the firmware ELF")
+    parser.add_argument("elf", help="ELF of the build that wrote the records")
+    parser.add_argument("input", nargs="+", help="SD segments (BLG00001.BIN ...) in order, or a /get-log dump")
+    parser.add_argument("-o", "--output", help="Write the text here instead of stdout")
+    args = parser.parse_args()
+
+    firmware = Firmware(args.elf)
+    data = b""
+    for path in args.input:
+        with open(path, "rb") as f:
+            chunk = f.read()
+        # A /get-log dump opens with a "#offset N" line
+        if chunk.startswith(b"#offset "):
+            chunk = chunk[chunk.index(b"\n") + 1:]
+        data += chunk
+
+    out = open(args.output, "w") if args.output else sys.stdout
+    decode(data, firmware, out)
+    if args.output:
+        out.close()
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
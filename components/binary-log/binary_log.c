@@ -0,0 +1,455 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "esp_app_desc.h"
+#include "esp_memory_utils.h"
+#include "sdkconfig.h"
+#include "binary_log.h"
+
+
+#define RING_SIZE       CONFIG_BINARY_LOG_RING_SIZE
+#define STRING_BY_ADDRESS   0xFF
+
+//head and tail run freely and wrap at 2^32, which keeps their distance only for a power of two
+_Static_assert((RING_SIZE & (RING_SIZE - 1)) == 0, "CONFIG_BINARY_LOG_RING_SIZE must be a power of two");
+
+
+//A conversion of the format string, e.g. "%-08lx"
+typedef struct {
+    const char* start;
+    size_t len;
+    char conv;
+    uint8_t stars;          //'*' width and precision, each an int argument ahead of the value
+    bool wide;              //ll or j, a 64 bit integer
+} conv_spec_t;
+
+static struct {
+    uint8_t ring[RING_SIZE];
+    uint32_t head;          //Total bytes ever written
+    uint32_t tail;          //Start of the oldest record still in the ring
+    portMUX_TYPE lock;      //Logs come from any task on either core
+    vprintf_like_t console; //What esp_log printed through before
+} s_binary_log = { .lock = portMUX_INITIALIZER_UNLOCKED };
+
+
+/// @brief Finds the next conversion, literal text before it is skipped over
+/// @return false at the end of the format
+static bool next_conversion(const char** fmt, const char** literal, size_t* literal_len, conv_spec_t* spec)
+{
+    const char* p = *fmt;
+    *literal = p;
+    while (*p != '\0' && (*p != '%' || p[1] == '%')) {
+        p += (*p == '%') ? 2 : 1;
+    }
+    *literal_len = p - *literal;
+    if (*p == '\0') {
+        *fmt = p;
+        return false;
+    }
+
+    memset(spec, 0, sizeof(*spec));
+    spec->start = p++;
+    while (*p != '\0' && strchr("-+ #0", *p)) p++;
+    for (; *p == '*' || (*p >= '0' && *p <= '9') || *p == '.'; p++) {
+        if (*p == '*') spec->stars++;
+    }
+    for (; *p != '\0' && strchr("hlLqjzt", *p); p++) {
+        if ((*p == 'l' && p[1] == 'l') || *p == 'j' || *p == 'q') spec->wide = true;
+    }
+    spec->conv = *p;
+    if (*p != '\0') p++;
+    spec->len = p - spec->start;
+    *fmt = p;
+    return true;
+}
+
+
+static bool is_float(char conv)
+{
+    return conv != '\0' && strchr("fFeEgGaA", conv) != NULL;
+}
+
+
+/* ---------- Encoding, the logging path ---------- */
+
+typedef struct {
+    uint8_t* buf;
+    size_t len;
+    bool full;
+} encoder_t;
+
+static void put(encoder_t* e, const void* data, size_t len)
+{
+    if (e->full || e->len + len > BINARY_LOG_MAX_RECORD) {
+        e->full = true;
+        return;
+    }
+    memcpy(e->buf + e->len, data, len);
+    e->len += len;
+}
+
+static void put_u32(encoder_t* e, uint32_t value)
+{
+    put(e, &value, 4);      //Both ESP32 families are little endian
+}
+
+static void put_string(encoder_t* e, const char* str)
+{
+    if (str == NULL) str = "(null)";
+
+    //Strings in flash outlive the record, so an address is enough
+    if (esp_ptr_in_drom(str)) {
+        uint8_t marker = STRING_BY_ADDRESS;
+        put(e, &marker, 1);
+        put_u32(e, (uint32_t)(uintptr_t)str);
+        return;
+    }
+    size_t n = strnlen(str, STRING_BY_ADDRESS - 1);
+    if (e->len + 1 + n > BINARY_LOG_MAX_RECORD) {
+        n = (e->len + 1 < BINARY_LOG_MAX_RECORD) ? BINARY_LOG_MAX_RECORD - e->len - 1 : 0;
+    }
+    uint8_t len = n;
+    put(e, &len, 1);
+    put(e, str, n);
+}
+
+
+static void ring_write(const uint8_t* record, size_t len)
+{
+    taskENTER_CRITICAL(&s_binary_log.lock);
+
+    //Oldest records go until the new one fits
+    while (s_binary_log.head + len - s_binary_log.tail > RING_SIZE) {
+        uint32_t at = s_binary_log.tail;
+        uint16_t old_len = s_binary_log.ring[(at + 2) % RING_SIZE] | (s_binary_log.ring[(at + 3) % RING_SIZE] << 8);
+        s_binary_log.tail += old_len;
+    }
+    for (size_t i = 0; i < len; i++) {
+        s_binary_log.ring[(s_binary_log.head + i) % RING_SIZE] = record[i];
+    }
+    s_binary_log.head += len;
+
+    taskEXIT_CRITICAL(&s_binary_log.lock);
+}
+
+
+static void record_begin(encoder_t* e, uint8_t* buf, binary_log_record_type_t type)
+{
+    e->buf = buf;
+    e->len = 0;
+    e->full = false;
+    uint8_t header[4] = { BINARY_LOG_MAGIC, type, 0, 0 };
+    put(e, header, sizeof(header));
+    put_u32(e, esp_log_timestamp());
+}
+
+static void record_end(encoder_t* e)
+{
+    e->buf[2] = e->len & 0xFF;
+    e->buf[3] = e->len >> 8;
+    ring_write(e->buf, e->len);
+}
+
+
+/// @brief Installed with esp_log_set_vprintf, stores the call instead of formatting it
+static int binary_log_vprintf(const char* fmt, va_list args)
+{
+    uint8_t buf[BINARY_LOG_MAX_RECORD];
+    encoder_t e;
+    va_list walk;
+    va_copy(walk, args);
+
+    if (esp_ptr_in_drom(fmt)) {
+        record_begin(&e, buf, BINARY_LOG_RECORD_LOG);
+        put_u32(&e, (uint32_t)(uintptr_t)fmt);
+    } else {
+        record_begin(&e, buf, BINARY_LOG_RECORD_LOG_TEXT);
+        put_string(&e, fmt);
+    }
+
+    const char* p = fmt;
+    const char* literal;
+    size_t literal_len;
+    conv_spec_t spec;
+    while (next_conversion(&p, &literal, &literal_len, &spec)) {
+        for (int i = 0; i < spec.stars; i++) {
+            put_u32(&e, (uint32_t)va_arg(walk, int));
+        }
+        if (spec.conv == 's') {
+            put_string(&e, va_arg(walk, const char*));
+        } else if (is_float(spec.conv)) {
+            double value = va_arg(walk, double);
+            put(&e, &value, 8);
+        } else if (spec.conv == 'p') {
+            put_u32(&e, (uint32_t)(uintptr_t)va_arg(walk, void*));
+        } else if (spec.wide) {
+            long long value = va_arg(walk, long long);
+            put(&e, &value, 8);
+        } else {
+            put_u32(&e, (uint32_t)va_arg(walk, int));
+        }
+    }
+    va_end(walk);
+    record_end(&e);
+
+#if CONFIG_BINARY_LOG_CONSOLE
+    if (s_binary_log.console != NULL) {
+        return s_binary_log.console(fmt, args);
+    }
+#endif
+    return 0;
+}
+
+
+void binary_log_mark_time(void)
+{
+    uint8_t buf[BINARY_LOG_HEADER_SIZE + 4];
+    encoder_t e;
+    record_begin(&e, buf, BINARY_LOG_RECORD_TIME);
+    put_u32(&e, (uint32_t)time(NULL));
+    record_end(&e);
+}
+
+
+esp_err_t binary_log_init(void)
+{
+    uint8_t buf[BINARY_LOG_MAX_RECORD];
+    char sha[17];
+    encoder_t e;
+
+    esp_app_get_elf_sha256(sha, sizeof(sha));
+    record_begin(&e, buf, BINARY_LOG_RECORD_BOOT);
+    uint8_t len = strlen(sha);
+    put(&e, &len, 1);
+    put(&e, sha, len);
+    const char* version = esp_app_get_description()->version;
+    len = strnlen(version, 32);
+    put(&e, &len, 1);
+    put(&e, version, len);
+    record_end(&e);
+
+    s_binary_log.console = esp_log_set_vprintf(binary_log_vprintf);
+    return ESP_OK;
+}
+
+
+/* ---------- Reading ---------- */
+
+void binary_log_snapshot_take(binary_log_snapshot_t* snap)
+{
+    taskENTER_CRITICAL(&s_binary_log.lock);
+    if (!snap->initialized) {
+        snap->cursor = s_binary_log.tail;
+        snap->initialized = true;
+    }
+    snap->end = s_binary_log.head;
+    taskEXIT_CRITICAL(&s_binary_log.lock);
+}
+
+
+/// @brief Copies the record at the snapshot cursor out of the ring
+/// @return its length, 0 when the snapshot is drained
+static size_t snapshot_next(binary_log_snapshot_t* snap, uint8_t* record, size_t size)
+{
+    size_t len = 0;
+
+    taskENTER_CRITICAL(&s_binary_log.lock);
+    //Records the ring dropped since the take are skipped
+    if ((int32_t)(snap->cursor - s_binary_log.tail) < 0) {
+        snap->cursor = s_binary_log.tail;
+    }
+    if ((int32_t)(snap->end - snap->cursor) > 0) {
+        uint32_t at = snap->cursor;
+        len = s_binary_log.ring[(at + 2) % RING_SIZE] | (s_binary_log.ring[(at + 3) % RING_SIZE] << 8);
+        if (len <= size) {
+            for (size_t i = 0; i < len; i++) {
+                record[i] = s_binary_log.ring[(at + i) % RING_SIZE];
+            }
+        }
+    }
+    taskEXIT_CRITICAL(&s_binary_log.lock);
+    return len;
+}
+
+
+size_t binary_log_snapshot_read(binary_log_snapshot_t* snap, void* buf, size_t len)
+{
+    size_t done = 0;
+    size_t n;
+    while ((n = snapshot_next(snap, (uint8_t*)buf + done, len - done)) > 0 && n <= len - done) {
+        done += n;
+        snap->cursor += n;
+    }
+    return done;
+}
+
+
+size_t binary_log_snapshot_read_text(binary_log_snapshot_t* snap, char* buf, size_t len)
+{
+    uint8_t record[BINARY_LOG_MAX_RECORD];
+    size_t done = 0;
+    size_t n;
+
+    while (done + 1 < len && (n = snapshot_next(snap, record, sizeof(record))) > 0) {
+        int text = binary_log_format(record, buf + done, len - done);
+        //A record that does not fit waits for the next read, unless it would never fit
+        if (text < 0 || (size_t)text >= len - done) {
+            if (done > 0) break;
+            text = len - 1;
+        }
+        done += text;
+        snap->cursor += n;
+    }
+    return done;
+}
+
+
+/* ---------- Formatting ---------- */
+
+typedef struct {
+    const uint8_t* p;
+    const uint8_t* end;
+} decoder_t;
+
+static bool take(decoder_t* d, void* out, size_t len)
+{
+    if (d->end - d->p < (ptrdiff_t)len) {
+        d->p = d->end;
+        return false;
+    }
+    memcpy(out, d->p, len);
+    d->p += len;
+    return true;
+}
+
+
+/// @brief Appends like snprintf, tracking the length the whole text needs
+static void emit(char* buf, size_t size, int* total, const char* fmt, ...)
+{
+    size_t at = (size_t)*total < size ? (size_t)*total : size;
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(buf + at, size - at, fmt, args);
+    va_end(args);
+    if (n > 0) *total += n;
+}
+
+
+/// @brief One conversion with its value taken from the record
+static void format_conversion(decoder_t* d, const conv_spec_t* spec, char* buf, size_t size, int* total)
+{
+    //'*' values are written into the spec, so each conversion is a single value snprintf
+    char one[24];
+    size_t o = 0;
+    for (size_t i = 0; i < spec->len && o + 12 < sizeof(one); i++) {
+        if (spec->start[i] == '*') {
+            int32_t star = 0;
+            take(d, &star, 4);
+            o += snprintf(one + o, sizeof(one) - o, "%ld", (long)star);
+        } else {
+            one[o++] = spec->start[i];
+        }
+    }
+    one[o] = '\0';
+
+    if (spec->conv == 's') {
+        uint8_t marker = 0;
+        take(d, &marker, 1);
+        if (marker == STRING_BY_ADDRESS) {
+            uint32_t addr = 0;
+            if (take(d, &addr, 4)) emit(buf, size, total, one, (const char*)(uintptr_t)addr);
+        } else {
+            char str[STRING_BY_ADDRESS];
+            size_t n = marker <= d->end - d->p ? marker : d->end - d->p;
+            take(d, str, n);
+            str[n] = '\0';
+            emit(buf, size, total, one, str);
+        }
+    } else if (is_float(spec->conv)) {
+        double value;
+        if (take(d, &value, 8)) emit(buf, size, total, one, value);
+    } else if (spec->conv == 'p') {
+        uint32_t value;
+        if (take(d, &value, 4)) emit(buf, size, total, one, (void*)(uintptr_t)value);
+    } else if (spec->wide) {
+        long long value;
+        if (take(d, &value, 8)) emit(buf, size, total, one, value);
+    } else {
+        uint32_t value;
+        if (take(d, &value, 4)) emit(buf, size, total, one, value);
+    }
+}
+
+
+int binary_log_format(const uint8_t* record, char* buf, size_t size)
+{
+    uint16_t len = record[2] | (record[3] << 8);
+    decoder_t d = { .p = record + BINARY_LOG_HEADER_SIZE, .end = record + len };
+    int total = 0;
+    if (size > 0) buf[0] = '\0';
+
+    const char* fmt = NULL;
+    char inline_fmt[STRING_BY_ADDRESS];
+    uint32_t value = 0;
+
+    switch (record[1]) {
+        case BINARY_LOG_RECORD_LOG:
+            take(&d, &value, 4);
+            fmt = (const char*)(uintptr_t)value;
+            break;
+
+        case BINARY_LOG_RECORD_LOG_TEXT: {
+            uint8_t n = 0;
+            take(&d, &n, 1);
+            n = n <= d.end - d.p ? n : d.end - d.p;
+            take(&d, inline_fmt, n);
+            inline_fmt[n] = '\0';
+            fmt = inline_fmt;
+            break;
+        }
+
+        case BINARY_LOG_RECORD_TIME:
+            take(&d, &value, 4);
+            emit(buf, size, &total, "#time %lu\n", (unsigned long)value);
+            return total;
+
+        case BINARY_LOG_RECORD_BOOT: {
+            char sha[STRING_BY_ADDRESS], version[STRING_BY_ADDRESS];
+            uint8_t n = 0;
+            take(&d, &n, 1);
+            take(&d, sha, n);
+            sha[n] = '\0';
+            n = 0;
+            take(&d, &n, 1);
+            take(&d, version, n);
+            version[n] = '\0';
+            emit(buf, size, &total, "#boot %s elf %s\n", version, sha);
+            return total;
+        }
+
+        default:
+            return 0;
+    }
+
+    const char* literal;
+    size_t literal_len;
+    conv_spec_t spec;
+    while (true) {
+        bool more = next_conversion(&fmt, &literal, &literal_len, &spec);
+        //Literal text in runs, "%%" folded to '%'
+        while (literal_len > 0) {
+            const char* pct = memchr(literal, '%', literal_len);
+            size_t run = pct ? (size_t)(pct - literal) + 1 : literal_len;
+            emit(buf, size, &total, "%.*s", (int)run, literal);
+            run += pct ? 1 : 0;
+            literal += run;
+            literal_len -= run;
+        }
+        if (!more) break;
+        format_conversion(&d, &spec, buf, size, &total);
+    }
+    return total;
+}
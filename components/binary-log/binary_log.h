@@ -0,0 +1,62 @@
+#ifndef BINARY_LOG_H
+#define BINARY_LOG_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "esp_err.h"
+
+
+/*
+ * Record layout, little endian, no padding:
+ * header: u8 magic 0xB7, u8 type, u16 record length (header included), u32 ms since boot
+ *   BINARY_LOG_RECORD_LOG       u32 format string address, args
+ *   BINARY_LOG_RECORD_LOG_TEXT  u8 format length, format, args        (format not in flash)
+ *   BINARY_LOG_RECORD_TIME      u32 unix time
+ *   BINARY_LOG_RECORD_BOOT      u8 length, ELF SHA-256 hex, u8 length, app version
+ * args, one per conversion of the format in order, '*' width and precision first:
+ *   integers, chars, pointers  u32, or u64 for ll and j
+ *   floating point             f64
+ *   strings                    u8 0xFF then u32 address when in flash, else u8 length then the bytes
+ * A record cut short at the size limit simply ends, its remaining conversions print empty.
+ */
+
+#define BINARY_LOG_MAGIC            0xB7
+#define BINARY_LOG_HEADER_SIZE      8
+#define BINARY_LOG_MAX_RECORD       256
+
+typedef enum {
+    BINARY_LOG_RECORD_LOG = 1,
+    BINARY_LOG_RECORD_LOG_TEXT,
+    BINARY_LOG_RECORD_TIME,
+    BINARY_LOG_RECORD_BOOT
+} binary_log_record_type_t;
+
+//Same use as log_snapshot_t, records from cursor up to where the ring was at take
+typedef struct {
+    bool initialized;
+    uint32_t cursor;
+    uint32_t end;
+} binary_log_snapshot_t;
+
+
+/// @brief Hooks esp_log and writes the boot record
+esp_err_t binary_log_init(void);
+
+/// @brief Records the wall clock, so ms since boot can be placed in time
+void binary_log_mark_time(void);
+
+void binary_log_snapshot_take(binary_log_snapshot_t* snap);
+
+/// @brief Copies whole records, as many as fit
+/// @return bytes copied, 0 once the snapshot is drained
+size_t binary_log_snapshot_read(binary_log_snapshot_t* snap, void* buf, size_t len);
+
+/// @brief Same as binary_log_snapshot_read but formats the records as text
+size_t binary_log_snapshot_read_text(binary_log_snapshot_t* snap, char* buf, size_t len);
+
+/// @brief Formats one record of this boot
+/// @return length the text needs, as snprintf
+int binary_log_format(const uint8_t* record, char* buf, size_t size);
+
+#endif
@@ -4,57 +4,83 @@
 #include <string.h>
 #include <esp_log.h>
 #include <esp_http_server.h>
+#include "esp_timer.h"
+#include "metrics.h"
 #include "bank_pool.h"  
+#include "sdkconfig.h"
 #include "http_server.h"
 
-#define         MAX_URIS                    5
+#define         MAX_URIS                    CONFIG_HTTP_SERVER_MAX_URIS
 #define         MAX_URI_LENGTH              15
 
-#define LOG_CHUNK_SIZE   256
+#define LOG_CHUNK_SIZE      CONFIG_HTTP_SERVER_CHUNK_SIZE
 
 
 
 typedef struct {
-    bool   is_last;
-    size_t len;
-    char   data[LOG_CHUNK_SIZE];
-} http_chunk_t;
-
-typedef struct {
-    char uri[MAX_URI_LENGTH];           // Points to user's string literal
+    char uri[MAX_URI_LENGTH];           // Copy of the user's string, null terminated
     request_callback callback;
     request_method_t method;     // HTTP_GET, HTTP_POST, etc.
+    bool keep_alive;             // Leave the connection open after the response
+    metric_t* latency[REQUEST_TRACE_MAX];   // Per hop latency from dispatch, no histogram for dispatch itself
 } http_uri_record_t;
 
 
 // Static pool
 
-#define MAX_ASYNC_REQUESTS 4
+#define MAX_ASYNC_REQUESTS  CONFIG_HTTP_SERVER_MAX_ASYNC_REQUESTS
+#define CHUNKS_PER_REQUEST  CONFIG_HTTP_SERVER_CHUNKS_PER_REQUEST
+
+typedef struct async_slot async_slot_t;
 
 typedef struct {
+    async_slot_t *slot;
+    const char *data;                   //Points either into chunk or into the caller's buffer
+    size_t len;
+    bool copied;                        //false when the data is sent by reference
+    chunk_release_callback release;     //Only for by reference jobs
+    void *release_arg;
+    char chunk[LOG_CHUNK_SIZE];         //Storage for copied data
+} http_send_job_t;
+
+
+//Each request owns its chunk+job pairs, so one busy response cannot starve another of chunks.
+//A job is taken and given back by its bit in jobs_free, a credit only says that some bit is set.
+//So a job whose queueing failed goes back without disturbing jobs still queued
+struct async_slot {
     httpd_req_t *req;
+    const http_uri_record_t *record;    //Route the request came in on
     bool response_started;
-} async_slot_t;
+    http_send_job_t jobs[CHUNKS_PER_REQUEST];
+    uint32_t jobs_free;                 //Bit i set while jobs[i] is not held by a producer or the server task
+    int64_t trace_us[REQUEST_TRACE_MAX];    //esp_timer time of each hop, 0 if the hop was not marked
+};
 
 
-typedef struct {
-    async_slot_t *slot;
-    http_chunk_t *chunk;
-} http_send_job_t;
+//Upper bounds in us of the latency histogram buckets, powers of two from 128 us to ~2 s
+static const uint32_t latency_bounds_us[]={
+    1UL<<7, 1UL<<8, 1UL<<9, 1UL<<10, 1UL<<11, 1UL<<12, 1UL<<13, 1UL<<14,
+    1UL<<15, 1UL<<16, 1UL<<17, 1UL<<18, 1UL<<19, 1UL<<20, 1UL<<21
+};
 
+static const char* trace_stage_names[REQUEST_TRACE_MAX]={
+    "dispatch", "event_post", "routine", "codec_send", "ack", "response"
+};
 
-#define LOG_CHUNK_POOL     4
-#define MAX_ASYNC_REQUESTS 4
-#define SEND_JOB_POOL      4   // usually same as chunk pool
 
-static http_chunk_t    g_chunk_objs[LOG_CHUNK_POOL];
-static bank_pool_handle_t g_chunk_bank;
+//How long a producer blocks for a free job before the chunk is counted as dropped
+#define CHUNK_WAIT_TIMEOUT_MS   CONFIG_HTTP_SERVER_CHUNK_WAIT_TIMEOUT_MS
 
 static async_slot_t    g_async_objs[MAX_ASYNC_REQUESTS];
 static bank_pool_handle_t g_async_bank;
 
-static http_send_job_t g_job_objs[SEND_JOB_POOL];
-static bank_pool_handle_t g_job_bank;
+//Free jobs per slot, producers block on it instead of dropping.
+//Kept outside the slot so that the bank pool never touches the semaphore
+static SemaphoreHandle_t g_job_credits[MAX_ASYNC_REQUESTS];
+static StaticSemaphore_t g_job_credits_buffers[MAX_ASYNC_REQUESTS];
+
+#define SLOT_JOB_CREDITS(slot)  (g_job_credits[(slot) - g_async_objs])
+#define ALL_JOBS_FREE           ((uint32_t)((1ULL << CHUNKS_PER_REQUEST) - 1))
 
 //This is to encapsulate the httpd_req_t type so that esp_http_server is in PRIV_REQUIRES
 //struct http_request {
@@ -67,8 +93,12 @@ static struct{
     //request_callback cb;
     http_uri_record_t uri_record[MAX_URIS];
     SemaphoreHandle_t pool_mutex;
+    portMUX_TYPE lock;                  //Guards the jobs_free bits
+    metric_t* chunks_sent;              //Chunked response flow control, see http_server_stats_t
+    metric_t* chunks_dropped;
+    metric_t* backpressure_waits;
     int uri_count;
-}http_server={0};
+}http_server={.lock=portMUX_INITIALIZER_UNLOCKED};
   
 
 
@@ -152,6 +182,84 @@ static void chunk_free(http_chunk_t *chunk)
 
 */
 
+static void http_server_trace_mark(http_request_t* req,request_trace_stage_t stage)
+{
+    if (req == NULL || stage >= REQUEST_TRACE_MAX) return;
+
+    ((async_slot_t *)req)->trace_us[stage] = esp_timer_get_time();
+}
+
+
+static esp_err_t http_server_get_query_value(http_request_t* req,const char* key,char* value,size_t size)
+{
+    if (req == NULL || key == NULL || value == NULL || size == 0) return ESP_ERR_INVALID_ARG;
+
+    //The async copy of the request keeps the whole URI, query included
+    const char *query = strchr(((async_slot_t *)req)->req->uri, '?');
+    if (query == NULL) return ESP_ERR_NOT_FOUND;
+
+    return httpd_query_key_value(query + 1, key, value, size);
+}
+
+
+/// @brief Folds the hops of a finished request into its endpoint's histograms
+static void trace_record(const async_slot_t *slot)
+{
+    if (slot->record == NULL) return;
+
+    int64_t start = slot->trace_us[REQUEST_TRACE_DISPATCH];
+    if (start == 0) return;
+
+    for (int stage = REQUEST_TRACE_DISPATCH + 1; stage < REQUEST_TRACE_MAX; stage++) {
+        if (slot->trace_us[stage] >= start) {
+            metrics_histogram_observe(slot->record->latency[stage], (uint32_t)(slot->trace_us[stage] - start));
+        }
+    }
+}
+
+
+static esp_err_t metrics_write_chunk(void *ctx, const void *data, size_t len)
+{
+    return httpd_resp_send_chunk((httpd_req_t *)ctx, data, len);
+}
+
+
+/// @brief GET /metrics, answered synchronously from the server task straight out of the registry.
+/// Prometheus text by default, the binary layout of metrics.h with ?format=bin
+static esp_err_t metrics_request_handler(httpd_req_t *req)
+{
+    char query[32];
+    char format[8] = "";
+
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK) {
+        httpd_query_key_value(query, "format", format, sizeof(format));
+    }
+
+    httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+
+    esp_err_t err;
+    if (strcmp(format, "bin") == 0) {
+        httpd_resp_set_type(req, "application/octet-stream");
+        err = metrics_render_binary(metrics_write_chunk, req);
+    } else {
+        httpd_resp_set_type(req, "text/plain; version=0.0.4");
+        err = metrics_render_text(metrics_write_chunk, req);
+    }
+
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "metrics render failed: %s", esp_err_to_name(err));
+        return err;
+    }
+    return httpd_resp_send_chunk(req, NULL, 0);
+}
+
+
+static bool slot_keep_alive(const async_slot_t *slot)
+{
+    return slot->record != NULL && slot->record->keep_alive;
+}
+
+
 static esp_err_t http_server_send_response(http_request_t* req, const char* data) {
     if (!req || !data) return ESP_ERR_INVALID_ARG;
 
@@ -163,12 +271,15 @@ static esp_err_t http_server_send_response(http_request_t* req, const char* data
     char resp[100];   // no malloc
     httpd_resp_set_type(request, "text/plain");
     httpd_resp_set_hdr(request, "Cache-Control", "no-cache");
-    httpd_resp_set_hdr(request, "Connection", "close");
+    if (!slot_keep_alive(asyn_request)) {
+        httpd_resp_set_hdr(request, "Connection", "close");
+    }
 
     httpd_resp_send_chunk(request, request->uri, HTTPD_RESP_USE_STRLEN);
     httpd_resp_send_chunk(request, ": ", 2);
     httpd_resp_send_chunk(request, data, HTTPD_RESP_USE_STRLEN);
     httpd_resp_send_chunk(request, NULL, 0);  // end
+    http_server_trace_mark(req, REQUEST_TRACE_RESPONSE);
 
     return ESP_OK;
 }
@@ -269,6 +380,7 @@ static esp_err_t http_server_send_status_error(httpd_req_t* req,
         case 405: status_text = "405 Method Not Allowed"; break;
         case 500: status_text = "500 Internal Server Error"; break;
         case 503: status_text = "503 Service Unavailable"; break;
+        case 504: status_text = "504 Gateway Timeout"; break;
         default:
             snprintf(status_str, sizeof(status_str), "%d Error", status_code);
             status_text = status_str;
@@ -294,6 +406,37 @@ static esp_err_t http_server_send_status_error(httpd_req_t* req,
     return httpd_resp_send(req, msg, strlen(msg));
 }
 
+static esp_err_t http_server_send_status_response(http_request_t* req, int status_code, const char* message) {
+    if (!req) return ESP_ERR_INVALID_ARG;
+
+    async_slot_t* asyn_request = (async_slot_t*)req;
+    if (!slot_keep_alive(asyn_request)) {
+        httpd_resp_set_hdr(asyn_request->req, "Connection", "close");
+    }
+    esp_err_t ret = http_server_send_status_error(asyn_request->req, status_code, message);
+    http_server_trace_mark(req, REQUEST_TRACE_RESPONSE);
+    return ret;
+}
+
+/// @brief Returns the whole per request arena in one go. All jobs of the slot have run by now,
+/// the credits are topped up anyway so that a slot can never come back short
+static void async_slot_reset(async_slot_t *slot)
+{
+    trace_record(slot);
+
+    slot->req = NULL;
+    slot->record = NULL;
+    slot->response_started = false;
+    slot->jobs_free = ALL_JOBS_FREE;
+
+    UBaseType_t free_jobs = uxSemaphoreGetCount(SLOT_JOB_CREDITS(slot));
+    while (free_jobs++ < CHUNKS_PER_REQUEST) {
+        xSemaphoreGive(SLOT_JOB_CREDITS(slot));
+    }
+
+    bank_free(g_async_bank, slot);
+}
+
 esp_err_t http_server_close_async_connection(http_request_t *req){
 
     esp_err_t ret=0;
@@ -312,7 +455,7 @@ esp_err_t http_server_close_async_connection(http_request_t *req){
     
 
 
-    bank_free(g_async_bank, (void*)asyn_request);
+    async_slot_reset(asyn_request);
     return ret;
 
 }
@@ -322,7 +465,7 @@ static void http_async_finalize_worker(void *arg)
     async_slot_t *slot = arg;
 
     ESP_LOGI(TAG, "Finalizing async slot %p for req %p", slot, slot->req);
-    bank_free(g_async_bank, slot);
+    async_slot_reset(slot);
 }
 
 static void http_async_close_worker(void *arg)
@@ -334,6 +477,7 @@ static void http_async_close_worker(void *arg)
     ESP_LOGI(TAG, "close worker slot %p for req %p", slot, slot->req);
 
     httpd_resp_send_chunk(req, NULL, 0);
+    http_server_trace_mark((http_request_t *)slot, REQUEST_TRACE_RESPONSE);
 
     ESP_LOGI(TAG, "HTTP CLOSE WORKER: marking async complete");
     int sockfd = httpd_req_to_sockfd(req);
@@ -341,8 +485,10 @@ static void http_async_close_worker(void *arg)
 
     httpd_req_async_handler_complete(req);
 
-
-    httpd_sess_trigger_close(http_server.server_handle, sockfd);
+    //Keep alive sessions stay open for the next request, idle ones are reaped by the LRU purge
+    if (!slot_keep_alive(slot)) {
+        httpd_sess_trigger_close(http_server.server_handle, sockfd);
+    }
 
     // Defer actual free
     httpd_queue_work(http_server.server_handle,
@@ -351,6 +497,44 @@ static void http_async_close_worker(void *arg)
 }
 
 
+/// @brief Takes a free job of the request, blocking the producer until the server task frees one.
+/// Must not be called from the server task itself, as that is the task that frees jobs
+/// @return NULL if no job became free within CHUNK_WAIT_TIMEOUT_MS
+static http_send_job_t *send_job_acquire(async_slot_t *slot)
+{
+    if (xSemaphoreTake(SLOT_JOB_CREDITS(slot), 0) != pdTRUE) {
+        metrics_counter_add(http_server.backpressure_waits, 1);
+        if (xSemaphoreTake(SLOT_JOB_CREDITS(slot), pdMS_TO_TICKS(CHUNK_WAIT_TIMEOUT_MS)) != pdTRUE) {
+            metrics_counter_add(http_server.chunks_dropped, 1);
+            ESP_LOGW(TAG, "No send job free after %d ms, chunk dropped", CHUNK_WAIT_TIMEOUT_MS);
+            return NULL;
+        }
+    }
+
+    //The credit guarantees a set bit
+    portENTER_CRITICAL(&http_server.lock);
+    int index = __builtin_ctz(slot->jobs_free);
+    slot->jobs_free &= ~(1UL << index);
+    portEXIT_CRITICAL(&http_server.lock);
+
+    http_send_job_t *job = &slot->jobs[index];
+    job->slot = slot;
+    return job;
+}
+
+
+static void send_job_release(http_send_job_t *job)
+{
+    async_slot_t *slot = job->slot;
+
+    portENTER_CRITICAL(&http_server.lock);
+    slot->jobs_free |= 1UL << (job - slot->jobs);
+    portEXIT_CRITICAL(&http_server.lock);
+
+    xSemaphoreGive(SLOT_JOB_CREDITS(slot));
+}
+
+
 static void http_async_data_worker(void *arg)
 {
     http_send_job_t *job = arg;
@@ -360,16 +544,21 @@ static void http_async_data_worker(void *arg)
     if (!slot->response_started) {
         httpd_resp_set_type(req, "text/plain");
         httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
-        httpd_resp_set_hdr(req, "Connection", "close");
+        if (!slot_keep_alive(slot)) {
+            httpd_resp_set_hdr(req, "Connection", "close");
+        }
         slot->response_started = true;
     }
 
     httpd_resp_send_chunk(req,
-                           job->chunk->data,
-                           job->chunk->len);
+                           job->data,
+                           job->len);
 
-    bank_free(g_chunk_bank, job->chunk);
-    bank_free(g_job_bank, job);
+    if (!job->copied && job->release) {
+        job->release(job->release_arg);
+    }
+    metrics_counter_add(http_server.chunks_sent, 1);
+    send_job_release(job);
 }
 
 
@@ -380,25 +569,25 @@ esp_err_t http_server_send_chunked_response(http_request_t *req,
 
     // -------- DATA --------
     if (data) {
-        http_chunk_t *chunk = bank_alloc(g_chunk_bank);
-        http_send_job_t *job = bank_alloc(g_job_bank);
-
-        if (!chunk || !job) {
-            //ESP_LOGI(TAG, "Failed to allocate chunk or job");
-            if (chunk) bank_free(g_chunk_bank, chunk);
-            if (job)   bank_free(g_job_bank, job);
-            return ESP_OK;   // best effort
+        //Blocks while the server task drains earlier chunks, so nothing is silently lost
+        http_send_job_t *job = send_job_acquire(slot);
+        if (!job) {
+            return ESP_ERR_TIMEOUT;
         }
 
-        strncpy(chunk->data, data, LOG_CHUNK_SIZE);
-        chunk->len = strnlen(chunk->data, LOG_CHUNK_SIZE);
-
-        job->slot  = slot;
-        job->chunk = chunk;
-
-        httpd_queue_work(http_server.server_handle,
-                         http_async_data_worker,
-                         job);
+        strncpy(job->chunk, data, LOG_CHUNK_SIZE);
+        job->data    = job->chunk;
+        job->len     = strnlen(job->chunk, LOG_CHUNK_SIZE);
+        job->copied  = true;
+        job->release = NULL;
+
+        if (httpd_queue_work(http_server.server_handle,
+                             http_async_data_worker,
+                             job) != ESP_OK) {
+            send_job_release(job);
+            metrics_counter_add(http_server.chunks_dropped, 1);
+            return ESP_FAIL;
+        }
         return ESP_OK;
     }
 
@@ -416,76 +605,147 @@ esp_err_t http_server_send_chunked_response(http_request_t *req,
 
 
 
+/// @brief Queues a chunk that is sent straight out of the caller's buffer, no copy and no size cap.
+/// The buffer is handed back through release once httpd_resp_send_chunk is done with it
+static esp_err_t http_server_send_chunked_response_ref(http_request_t *req,
+                                                       const void *data,
+                                                       size_t len,
+                                                       chunk_release_callback release,
+                                                       void *release_arg)
+{
+    if (!req) return ESP_ERR_INVALID_ARG;
+
+    //End of response goes through the same ordered close path
+    if (!data) {
+        return http_server_send_chunked_response(req, NULL);
+    }
+
+    http_send_job_t *job = send_job_acquire((async_slot_t *)req);
+    if (!job) {
+        return ESP_ERR_TIMEOUT;
+    }
+
+    job->copied = false;
+    job->data  = data;
+    job->len   = len;
+    job->release = release;
+    job->release_arg = release_arg;
+
+    if (httpd_queue_work(http_server.server_handle,
+                         http_async_data_worker,
+                         job) != ESP_OK) {
+        send_job_release(job);
+        metrics_counter_add(http_server.chunks_dropped, 1);
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+
+/// @brief Single entry point for all registered URIs.
+/// ESP-IDF has already matched the URI against its own table, so the matching record is
+/// handed over through user_ctx instead of being searched for again
 static esp_err_t master_request_handler(httpd_req_t *req){
-    // Extract server context from ESP-IDF user_ctx
    
     httpd_req_t *async_req;
+    http_uri_record_t* record=(http_uri_record_t*)req->user_ctx;
 
-    
-    
-    
-    // Linear search through registered URIs
-    for (size_t i = 0; i < http_server.uri_count; i++) {
-        if (strcmp(http_server.uri_record[i].uri, req->uri) == 0) {
-
-            ESP_LOGI(TAG,"record i %d, uri %s",i,req->uri);
-            // Found matching URI, call user callback
-
-
-            httpd_req_async_handler_begin(req, &async_req);
-            async_slot_t* async_slot =(async_slot_t*) bank_alloc(g_async_bank);
-            async_slot->response_started=false;
-            
-            
-            if(async_slot==NULL){
-                http_server_send_status_error(req,
-                                       503,
-                                       "Server Busy"); 
-                httpd_req_async_handler_complete(req);
-                return ESP_OK;
-            }
-            
-            
-            async_slot->req=async_req;
-            ESP_LOGI(TAG, "Allocated async slot %p for req %p", async_slot, async_slot->req);
-
-            //call the corresponding callback registered by the user_request 
-            http_server.uri_record[i].callback((http_request_t*)async_slot, async_req->uri);
-            return ESP_OK;
-        }
+    if(record==NULL){
+        http_server_send_error((http_request_t*)req, "404 Not Found");
+        return ESP_OK;
     }
-    
-    // No handler found
-    //http_request_t request={.req=req};
-    http_server_send_error((http_request_t*)req, "404 Not Found");
+
+    ESP_LOGI(TAG,"uri %s",req->uri);
+
+    async_slot_t* async_slot =(async_slot_t*) bank_alloc(g_async_bank);
+    if(async_slot==NULL){
+        http_server_send_status_error(req,
+                               503,
+                               "Server Busy"); 
+        return ESP_OK;
+    }
+
+    if(httpd_req_async_handler_begin(req, &async_req)!=ESP_OK){
+        bank_free(g_async_bank, async_slot);
+        http_server_send_status_error(req,
+                               500,
+                               "Async Begin Failed"); 
+        return ESP_OK;
+    }
+
+    async_slot->response_started=false;
+    async_slot->jobs_free=ALL_JOBS_FREE;
+    async_slot->record=record;
+    memset(async_slot->trace_us,0,sizeof(async_slot->trace_us));
+    async_slot->trace_us[REQUEST_TRACE_DISPATCH]=esp_timer_get_time();
+    async_slot->req=async_req;
+    ESP_LOGI(TAG, "Allocated async slot %p for req %p", async_slot, async_slot->req);
+
+    //call the corresponding callback registered by the user_request 
+    record->callback((http_request_t*)async_slot, async_req->uri);
     return ESP_OK;
 }
 
 
-static esp_err_t http_server_register_uri(const char* uri,request_method_t method,request_callback cb){
-    if(uri==NULL || cb==NULL || strlen(uri)>MAX_URI_LENGTH)
+static esp_err_t http_server_register_uri_ex(const char* uri,request_method_t method,request_callback cb,const uri_options_t* options){
+    if(uri==NULL || cb==NULL || strnlen(uri,MAX_URI_LENGTH)>=MAX_URI_LENGTH)
         return ESP_ERR_INVALID_ARG;
 
-    int uri_count=http_server.uri_count;
-    http_server.uri_record[uri_count].callback=cb;
-    memcpy(http_server.uri_record[uri_count].uri,uri,strlen(uri));
-    http_server.uri_record[uri_count].method=method;
+    if(http_server.uri_count>=MAX_URIS){
+        ESP_LOGE(TAG,"uri table full, %s not registered",uri);
+        return ESP_ERR_NO_MEM;
+    }
+
+    http_uri_record_t* record=&http_server.uri_record[http_server.uri_count];
+    record->callback=cb;
+    strlcpy(record->uri,uri,sizeof(record->uri));
+    record->method=method;
+    record->keep_alive=(options!=NULL) && options->keep_alive;
 
     
-    ESP_LOGI(TAG,"uri %s",http_server.uri_record[uri_count].uri);
-    // Register with ESP-IDF HTTP server
+    ESP_LOGI(TAG,"uri %s",record->uri);
+    // Register with ESP-IDF HTTP server. The record itself is the route, so dispatch needs no lookup
     httpd_uri_t esp_uri = {
-        .uri = http_server.uri_record[uri_count].uri,
+        .uri = record->uri,
         .method = HTTP_GET,     //The supplied methid not used as it requires enum type translation
         .handler = master_request_handler,
-        .user_ctx = NULL  // Pass our server context
+        .user_ctx = record
     };
 
+    esp_err_t ret=httpd_register_uri_handler(http_server.server_handle, &esp_uri);
+    if(ret!=ESP_OK){
+        memset(record,0,sizeof(*record));
+        return ret;
+    }
+
+    //Latency of each hop, labelled with the route
+    char labels[METRICS_LABELS_LENGTH];
+    for(int stage=REQUEST_TRACE_DISPATCH+1;stage<REQUEST_TRACE_MAX;stage++){
+        snprintf(labels,sizeof(labels),"uri=\"%s\",stage=\"%s\"",record->uri,trace_stage_names[stage]);
+        record->latency[stage]=metrics_register_histogram("http_request_latency_us",labels,
+                                                          "Time from dispatch to each hop of a request",
+                                                          latency_bounds_us,
+                                                          sizeof(latency_bounds_us)/sizeof(latency_bounds_us[0]));
+    }
 
-//    cb(NULL,"/close-gate");
-  //  cb(NULL,"/open-gate");
     http_server.uri_count++;
-    return httpd_register_uri_handler(http_server.server_handle, &esp_uri);
+    return ESP_OK;
+}
+
+
+static esp_err_t http_server_register_uri(const char* uri,request_method_t method,request_callback cb){
+    return http_server_register_uri_ex(uri,method,cb,NULL);
+}
+
+
+esp_err_t http_server_get_stats(http_server_stats_t* stats){
+    if(stats==NULL)
+        return ESP_ERR_INVALID_ARG;
+
+    stats->chunks_sent=(uint32_t)metrics_counter_read(http_server.chunks_sent);
+    stats->chunks_dropped=(uint32_t)metrics_counter_read(http_server.chunks_dropped);
+    stats->backpressure_waits=(uint32_t)metrics_counter_read(http_server.backpressure_waits);
+    return ESP_OK;
 }
 
 
@@ -502,42 +762,67 @@ esp_err_t http_server_init(http_server_config_t* config){
     httpd_config_t http_config = HTTPD_DEFAULT_CONFIG();
     http_config.max_open_sockets = config->max_connections;
     http_config.uri_match_fn = httpd_uri_match_wildcard;
+    //httpd's own table defaults to 8 handlers, every route here takes one
+    http_config.max_uri_handlers = MAX_URIS;
     http_config.server_port = config->port;
+    //Keep alive routes hold their sockets open, so when all are taken the least recently used one is closed
+    http_config.lru_purge_enable = true;
     
 
     http_server.interface.register_uri=http_server_register_uri;
+    http_server.interface.register_uri_ex=http_server_register_uri_ex;
     http_server.interface.send_response=http_server_send_response;
     http_server.interface.send_error_response=http_server_send_error;
+    http_server.interface.send_status_response=http_server_send_status_response;
     http_server.interface.close_async_connection=http_server_close_async_connection;
     http_server.interface.send_chunked_response=http_server_send_chunked_response; 
+    http_server.interface.send_chunked_response_ref=http_server_send_chunked_response_ref;
+    http_server.interface.trace_mark=http_server_trace_mark;
+    http_server.interface.get_query_value=http_server_get_query_value;
     
 
-    ESP_LOGI(TAG, "Starting HTTP Server");
-    if( httpd_start(&http_server.server_handle, &http_config) != ESP_OK){
-
-    
-        ESP_LOGI(TAG,"Server Init Failed");
-        return ESP_FAIL;
-    }
-
+    //Pools first, a request can arrive as soon as the server is started
     http_server.pool_mutex = xSemaphoreCreateMutex();
+    if(http_server.pool_mutex==NULL){
+        ESP_LOGE(TAG,"Failed to create pool mutex");
+        return ESP_ERR_NO_MEM;
+    }
 
-    bank_register_pool(&g_chunk_bank,
-                       g_chunk_objs,
-                       sizeof(http_chunk_t),
-                       LOG_CHUNK_POOL
-                       );
+    for(int i=0;i<MAX_ASYNC_REQUESTS;i++){
+        g_job_credits[i]=xSemaphoreCreateCountingStatic(CHUNKS_PER_REQUEST,
+                                                        CHUNKS_PER_REQUEST,
+                                                        &g_job_credits_buffers[i]);
+    }
 
     bank_register_pool(&g_async_bank,
                        g_async_objs,
                        sizeof(async_slot_t),
                        MAX_ASYNC_REQUESTS);
 
-    bank_register_pool(&g_job_bank,
-                       g_job_objs,
-                       sizeof(http_send_job_t),
-                       SEND_JOB_POOL);
+    http_server.chunks_sent=metrics_register_counter("http_chunks_sent_total",NULL,
+                                                     "Chunks handed to httpd_resp_send_chunk");
+    http_server.chunks_dropped=metrics_register_counter("http_chunks_dropped_total",NULL,
+                                                        "Chunks given up after waiting for a free send job");
+    http_server.backpressure_waits=metrics_register_counter("http_backpressure_waits_total",NULL,
+                                                            "Times a producer blocked for a free send job");
+
 
+    ESP_LOGI(TAG, "Starting HTTP Server");
+    if( httpd_start(&http_server.server_handle, &http_config) != ESP_OK){
+
+    
+        ESP_LOGI(TAG,"Server Init Failed");
+        return ESP_FAIL;
+    }
+
+    //Served straight from the server task out of the metrics registry, it does not take a uri record or an async slot
+    httpd_uri_t metrics_uri = {
+        .uri = "/metrics",
+        .method = HTTP_GET,
+        .handler = metrics_request_handler,
+        .user_ctx = NULL
+    };
+    httpd_register_uri_handler(http_server.server_handle, &metrics_uri);
 
     return ESP_OK;
 }
@@ -1,6 +1,7 @@
 #ifndef RELAY_SERVER_H
 #define RELAY_SERVER_H
 
+#include <stdbool.h>
 #include "esp_err.h"
 
 
@@ -13,23 +14,60 @@ typedef struct http_request_t http_request_t;
 //The req here is just a context pointer which will be sent back in the reply
 typedef void (*request_callback)(http_request_t* req,const char* uri);
 
+//Called from the server task once a chunk sent by reference is on the wire and its buffer can be reused
+typedef void (*chunk_release_callback)(void* arg);
+
 
 typedef enum {
     METHOD_GET,
     METHOD_POST
 } request_method_t;
 
+//Hops of a request on its way from httpd to the response, each one timestamped into the request
+typedef enum {
+    REQUEST_TRACE_DISPATCH,         //Picked up by the server (marked by the server)
+    REQUEST_TRACE_EVENT_POST,       //Command event posted by the request handler
+    REQUEST_TRACE_ROUTINE,          //Event reached the routine handler
+    REQUEST_TRACE_CODEC_SEND,       //Command handed to the ESP-NOW codec
+    REQUEST_TRACE_ACK,              //ESP-NOW send status arrived
+    REQUEST_TRACE_RESPONSE,         //Response sent (marked by the server)
+    REQUEST_TRACE_MAX
+} request_trace_stage_t;
+
+
+//Per URI options for register_uri_ex
+typedef struct {
+    bool keep_alive;        //Reply without "Connection: close" and keep the socket for the next request.
+                            //Meant for short command responses, idle sessions are closed by the LRU purge
+} uri_options_t;
+
 typedef struct {
     
     esp_err_t (*register_uri)(const char* uri,request_method_t method,request_callback cb);
+    //Same as register_uri, options may be NULL for the defaults
+    esp_err_t (*register_uri_ex)(const char* uri,request_method_t method,request_callback cb,const uri_options_t* options);
     //When it is desired to reply with a text
     esp_err_t (*send_response)(http_request_t* req,const char* buff);
     //When it is desired to reply with error. Right now only error is "Uri not found etc"
+    //Chunk senders block while the server drains earlier chunks and return ESP_ERR_TIMEOUT if it never does.
+    //So they must not be called from inside a request_callback, which runs in the server task
     esp_err_t (*send_chunked_response)(http_request_t* req,const char* data);
+    //Zero copy variant of send_chunked_response. The chunk is sent straight out of data, which must stay valid
+    //until release is called. On error release is not called and the caller keeps the buffer. data NULL ends the response
+    esp_err_t (*send_chunked_response_ref)(http_request_t* req,const void* data,size_t len,chunk_release_callback release,void* release_arg);
     
     esp_err_t (*send_error_response)(http_request_t* req,const char* message);
+    //Replies to an async request with an HTTP status other than 200, e.g. 504 when what it waited for never came
+    esp_err_t (*send_status_response)(http_request_t* req,int status_code,const char* message);
 
     esp_err_t (*close_async_connection)(http_request_t* req);
+
+    //Timestamps a hop of the request. Latencies from dispatch to each hop are aggregated per endpoint
+    //when the request completes and served on /metrics
+    void (*trace_mark)(http_request_t* req,request_trace_stage_t stage);
+    //Value of a query parameter of the request URI, e.g. "since" of /get-log?since=1760000000.
+    //ESP_ERR_NOT_FOUND if it is absent, ESP_ERR_HTTPD_RESULT_TRUNC if it did not fit in size
+    esp_err_t (*get_query_value)(http_request_t* req,const char* key,char* value,size_t size);
 }http_server_interface_t;
 
 
@@ -59,7 +97,16 @@ typedef struct {
 
 
 
+//Chunked response flow control counters, all monotonic since boot
+typedef struct {
+    uint32_t chunks_sent;               //Chunks handed to httpd_resp_send_chunk
+    uint32_t chunks_dropped;            //Chunks given up after waiting CONFIG_HTTP_SERVER_CHUNK_WAIT_TIMEOUT_MS
+    uint32_t backpressure_waits;        //Times a producer had to block for a free send job
+} http_server_stats_t;
+
+
 http_server_interface_t* http_server_get_interface();
+esp_err_t http_server_get_stats(http_server_stats_t* stats);
 esp_err_t http_server_init(http_server_config_t* config);
 
 
@@ -0,0 +1,80 @@
+#ifndef LZSS_H
+#define LZSS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "sdkconfig.h"
+
+
+/*
+ * heatshrink bit stream, bits packed most significant first:
+ *   1, 8 bit byte                                      literal
+ *   0, window bits (distance - 1), lookahead bits (length - 1)   back reference
+ * The last byte is zero padded, which the decoder sees as an unfinished back reference and ignores.
+ */
+
+#define LZSS_WINDOW_BITS        CONFIG_LZSS_WINDOW_BITS
+#define LZSS_LOOKAHEAD_BITS     CONFIG_LZSS_LOOKAHEAD_BITS
+#define LZSS_WINDOW_SIZE        (1 << LZSS_WINDOW_BITS)
+#define LZSS_OUTPUT_BUFFER_SIZE CONFIG_LZSS_OUTPUT_BUFFER_SIZE
+#define LZSS_HASH_BITS          10
+#define LZSS_HASH_NONE          0xFFFF
+
+
+typedef esp_err_t (*lzss_sink_t)(const uint8_t* data, size_t len, void* ctx);
+
+typedef struct {
+    uint8_t state;
+    uint32_t bits;                      //Input bits not consumed yet, right aligned
+    uint8_t bit_count;
+    uint16_t distance;                  //Back reference being read
+    uint32_t produced;
+    lzss_sink_t sink;
+    void* sink_ctx;
+    uint16_t window_pos;
+    uint16_t output_len;
+    uint8_t window[LZSS_WINDOW_SIZE];
+    uint8_t output[LZSS_OUTPUT_BUFFER_SIZE];
+} lzss_decoder_t;
+
+
+void lzss_decoder_init(lzss_decoder_t* decoder, lzss_sink_t sink, void* sink_ctx);
+
+/// @return the sink's error, the stream itself cannot be malformed, any bit sequence decodes
+esp_err_t lzss_decoder_feed(lzss_decoder_t* decoder, const uint8_t* data, size_t len);
+
+/// @brief Hands the last buffered bytes to the sink, to be called once the whole stream was fed
+esp_err_t lzss_decoder_finish(lzss_decoder_t* decoder);
+
+
+typedef struct {
+    uint32_t bits;                      //Output bits not making a whole byte yet, right aligned
+    uint8_t bit_count;
+    uint16_t fill;                      //Bytes in buffer, the window behind the next input
+    uint16_t hashed;                    //Next position to go into the hash chains
+    lzss_sink_t sink;
+    void* sink_ctx;
+    uint16_t output_len;
+    uint16_t head[1 << LZSS_HASH_BITS];     //Newest position per hash of 3 bytes
+    uint16_t prev[2 * LZSS_WINDOW_SIZE];    //Older position with the same hash, per position
+    uint8_t buffer[2 * LZSS_WINDOW_SIZE];
+    uint8_t output[LZSS_OUTPUT_BUFFER_SIZE];
+} lzss_encoder_t;
+
+
+void lzss_encoder_init(lzss_encoder_t* encoder, lzss_sink_t sink, void* sink_ctx);
+
+/// @brief Encodes all of data, matches reach back into earlier feeds but not ahead into later ones
+/// @return the sink's error
+esp_err_t lzss_encoder_feed(lzss_encoder_t* encoder, const uint8_t* data, size_t len);
+
+/// @brief Hands the whole bytes encoded so far to the sink, the stream goes on.
+/// Up to 7 bits of the last back reference or literal stay behind until more output completes the byte
+esp_err_t lzss_encoder_flush(lzss_encoder_t* encoder);
+
+/// @brief Pads the last byte and hands everything to the sink, the stream ends here
+esp_err_t lzss_encoder_finish(lzss_encoder_t* encoder);
+
+#endif
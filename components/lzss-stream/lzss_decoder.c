@@ -0,0 +1,106 @@
+#include <string.h>
+#include "lzss.h"
+
+
+#if LZSS_LOOKAHEAD_BITS >= LZSS_WINDOW_BITS
+#error "LZSS lookahead bits must be smaller than the window bits"
+#endif
+
+enum {
+    LZSS_STATE_TAG,
+    LZSS_STATE_LITERAL,
+    LZSS_STATE_DISTANCE,
+    LZSS_STATE_LENGTH
+};
+
+
+void lzss_decoder_init(lzss_decoder_t *decoder, lzss_sink_t sink, void *sink_ctx)
+{
+    memset(decoder, 0, sizeof(*decoder));
+    decoder->sink = sink;
+    decoder->sink_ctx = sink_ctx;
+}
+
+
+static esp_err_t flush(lzss_decoder_t *decoder)
+{
+    if (decoder->output_len == 0) return ESP_OK;
+
+    esp_err_t err = decoder->sink(decoder->output, decoder->output_len, decoder->sink_ctx);
+    decoder->output_len = 0;
+    return err;
+}
+
+
+static esp_err_t put(lzss_decoder_t *decoder, uint8_t c)
+{
+    decoder->window[decoder->window_pos] = c;
+    decoder->window_pos = (decoder->window_pos + 1) & (LZSS_WINDOW_SIZE - 1);
+    decoder->produced++;
+
+    decoder->output[decoder->output_len++] = c;
+    return decoder->output_len == LZSS_OUTPUT_BUFFER_SIZE ? flush(decoder) : ESP_OK;
+}
+
+
+/// @brief Takes count bits off the input, refilling from data a byte at a time
+/// @return false if the input ran out first, the bits gathered so far are kept for the next feed
+static bool get_bits(lzss_decoder_t *decoder, uint8_t count, const uint8_t **data, size_t *len, uint16_t *value)
+{
+    while (decoder->bit_count < count) {
+        if (*len == 0) return false;
+        decoder->bits = (decoder->bits << 8) | **data;
+        decoder->bit_count += 8;
+        (*data)++;
+        (*len)--;
+    }
+
+    decoder->bit_count -= count;
+    *value = (decoder->bits >> decoder->bit_count) & ((1u << count) - 1);
+    return true;
+}
+
+
+esp_err_t lzss_decoder_feed(lzss_decoder_t *decoder, const uint8_t *data, size_t len)
+{
+    uint16_t value;
+    esp_err_t err = ESP_OK;
+
+    while (err == ESP_OK) {
+        switch (decoder->state) {
+            case LZSS_STATE_TAG:
+                if (!get_bits(decoder, 1, &data, &len, &value)) return ESP_OK;
+                decoder->state = value ? LZSS_STATE_LITERAL : LZSS_STATE_DISTANCE;
+                break;
+
+            case LZSS_STATE_LITERAL:
+                if (!get_bits(decoder, 8, &data, &len, &value)) return ESP_OK;
+                err = put(decoder, value);
+                decoder->state = LZSS_STATE_TAG;
+                break;
+
+            case LZSS_STATE_DISTANCE:
+                if (!get_bits(decoder, LZSS_WINDOW_BITS, &data, &len, &value)) return ESP_OK;
+                decoder->distance = value + 1;
+                decoder->state = LZSS_STATE_LENGTH;
+                break;
+
+            case LZSS_STATE_LENGTH: {
+                if (!get_bits(decoder, LZSS_LOOKAHEAD_BITS, &data, &len, &value)) return ESP_OK;
+                //Overlapping copies (distance < length) repeat the last bytes, as they should
+                for (uint32_t n = (uint32_t)value + 1; n > 0 && err == ESP_OK; n--) {
+                    err = put(decoder, decoder->window[(decoder->window_pos - decoder->distance) & (LZSS_WINDOW_SIZE - 1)]);
+                }
+                decoder->state = LZSS_STATE_TAG;
+                break;
+            }
+        }
+    }
+    return err;
+}
+
+
+esp_err_t lzss_decoder_finish(lzss_decoder_t *decoder)
+{
+    return flush(decoder);
+}
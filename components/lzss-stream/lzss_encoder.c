@@ -0,0 +1,153 @@
+#include <string.h>
+#include "lzss.h"
+
+
+#if LZSS_LOOKAHEAD_BITS >= LZSS_WINDOW_BITS
+#error "LZSS lookahead bits must be smaller than the window bits"
+#endif
+
+#define LZSS_MAX_LENGTH     (1 << LZSS_LOOKAHEAD_BITS)
+#define LZSS_MAX_CHAIN      CONFIG_LZSS_ENCODER_CHAIN
+//A back reference only pays when it is shorter than the literals it replaces, matches are found on 3 bytes
+#define LZSS_MIN_LENGTH     ((1 + LZSS_WINDOW_BITS + LZSS_LOOKAHEAD_BITS) / 9 + 1 > 3 ? \
+                             (1 + LZSS_WINDOW_BITS + LZSS_LOOKAHEAD_BITS) / 9 + 1 : 3)
+
+
+void lzss_encoder_init(lzss_encoder_t *encoder, lzss_sink_t sink, void *sink_ctx)
+{
+    memset(encoder, 0, sizeof(*encoder));
+    memset(encoder->head, 0xFF, sizeof(encoder->head));
+    encoder->sink = sink;
+    encoder->sink_ctx = sink_ctx;
+}
+
+
+esp_err_t lzss_encoder_flush(lzss_encoder_t *encoder)
+{
+    if (encoder->output_len == 0) return ESP_OK;
+
+    esp_err_t err = encoder->sink(encoder->output, encoder->output_len, encoder->sink_ctx);
+    encoder->output_len = 0;
+    return err;
+}
+
+
+static esp_err_t put_bits(lzss_encoder_t *encoder, uint16_t value, uint8_t count)
+{
+    encoder->bits = (encoder->bits << count) | value;
+    encoder->bit_count += count;
+
+    while (encoder->bit_count >= 8) {
+        encoder->bit_count -= 8;
+        encoder->output[encoder->output_len++] = encoder->bits >> encoder->bit_count;
+        if (encoder->output_len == LZSS_OUTPUT_BUFFER_SIZE) {
+            esp_err_t err = lzss_encoder_flush(encoder);
+            if (err != ESP_OK) return err;
+        }
+    }
+    encoder->bits &= (1u << encoder->bit_count) - 1;
+    return ESP_OK;
+}
+
+
+static uint16_t hash(const uint8_t *p)
+{
+    return ((((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 8) | p[2]) * 2654435761u) >> (32 - LZSS_HASH_BITS);
+}
+
+
+/// @brief Drops the older half of the buffer, the newer half is the window for the next input
+static void slide(lzss_encoder_t *encoder)
+{
+    memcpy(encoder->buffer, encoder->buffer + LZSS_WINDOW_SIZE, LZSS_WINDOW_SIZE);
+    encoder->fill -= LZSS_WINDOW_SIZE;
+    encoder->hashed -= LZSS_WINDOW_SIZE;
+
+    for (size_t i = 0; i < (1 << LZSS_HASH_BITS); i++) {
+        uint16_t pos = encoder->head[i];
+        encoder->head[i] = (pos == LZSS_HASH_NONE || pos < LZSS_WINDOW_SIZE) ? LZSS_HASH_NONE : pos - LZSS_WINDOW_SIZE;
+    }
+    for (size_t i = 0; i < LZSS_WINDOW_SIZE; i++) {
+        uint16_t pos = encoder->prev[i + LZSS_WINDOW_SIZE];
+        encoder->prev[i] = (pos == LZSS_HASH_NONE || pos < LZSS_WINDOW_SIZE) ? LZSS_HASH_NONE : pos - LZSS_WINDOW_SIZE;
+    }
+}
+
+
+/// @brief Greedy encoding of the buffer from fill to end, the newest of the longest matches wins
+static esp_err_t encode(lzss_encoder_t *encoder, uint16_t end)
+{
+    uint8_t *buffer = encoder->buffer;
+    uint16_t pos = encoder->fill;
+    esp_err_t err = ESP_OK;
+
+    while (pos < end && err == ESP_OK) {
+        for (; encoder->hashed < pos && encoder->hashed + 3 <= end; encoder->hashed++) {
+            uint16_t h = hash(buffer + encoder->hashed);
+            encoder->prev[encoder->hashed] = encoder->head[h];
+            encoder->head[h] = encoder->hashed;
+        }
+
+        uint16_t limit = (end - pos < LZSS_MAX_LENGTH) ? end - pos : LZSS_MAX_LENGTH;
+        uint16_t best_len = 0, best_dist = 0;
+        if (limit >= 3) {
+            uint16_t cand = encoder->head[hash(buffer + pos)];
+            for (int chain = LZSS_MAX_CHAIN; chain > 0 && cand != LZSS_HASH_NONE && pos - cand <= LZSS_WINDOW_SIZE;
+                 chain--, cand = encoder->prev[cand]) {
+                uint16_t len = 0;
+                while (len < limit && buffer[cand + len] == buffer[pos + len]) {
+                    len++;
+                }
+                if (len > best_len) {
+                    best_len = len;
+                    best_dist = pos - cand;
+                    if (len == limit) break;
+                }
+            }
+        }
+
+        if (best_len >= LZSS_MIN_LENGTH) {
+            err = put_bits(encoder, 0, 1);
+            if (err == ESP_OK) err = put_bits(encoder, best_dist - 1, LZSS_WINDOW_BITS);
+            if (err == ESP_OK) err = put_bits(encoder, best_len - 1, LZSS_LOOKAHEAD_BITS);
+            pos += best_len;
+        } else {
+            err = put_bits(encoder, 0x100 | buffer[pos], 9);
+            pos++;
+        }
+    }
+    encoder->fill = end;
+    return err;
+}
+
+
+esp_err_t lzss_encoder_feed(lzss_encoder_t *encoder, const uint8_t *data, size_t len)
+{
+    esp_err_t err = ESP_OK;
+
+    while (len > 0 && err == ESP_OK) {
+        if (encoder->fill == 2 * LZSS_WINDOW_SIZE) {
+            slide(encoder);
+        }
+        size_t n = 2 * LZSS_WINDOW_SIZE - encoder->fill;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(encoder->buffer + encoder->fill, data, n);
+        err = encode(encoder, encoder->fill + n);
+        data += n;
+        len -= n;
+    }
+    return err;
+}
+
+
+esp_err_t lzss_encoder_finish(lzss_encoder_t *encoder)
+{
+    //Zero padding reads as the start of a back reference too short to complete, the decoder drops it
+    if (encoder->bit_count > 0) {
+        esp_err_t err = put_bits(encoder, 0, 8 - encoder->bit_count);
+        if (err != ESP_OK) return err;
+    }
+    return lzss_encoder_flush(encoder);
+}
@@ -0,0 +1,354 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "sdkconfig.h"
+#include "metrics.h"
+
+
+#define MAX_METRICS         CONFIG_METRICS_MAX_METRICS
+#define MAX_HISTOGRAMS      CONFIG_METRICS_MAX_HISTOGRAMS
+#define MAX_BUCKETS         CONFIG_METRICS_MAX_BUCKETS
+#define NUM_CORES           portNUM_PROCESSORS
+
+static const char* TAG="metrics";
+
+
+//Per core bucket counters, a core only ever adds to its own row
+typedef struct {
+    const uint32_t *bounds;
+    uint8_t bucket_count;
+    uint32_t counts[NUM_CORES][MAX_BUCKETS + 1];
+    uint64_t sum[NUM_CORES];
+} histogram_t;
+
+struct metric {
+    metric_type_t type;
+    char name[METRICS_NAME_LENGTH];
+    char labels[METRICS_LABELS_LENGTH];
+    const char *help;
+    union {
+        uint32_t counter[NUM_CORES];
+        int32_t gauge;
+        histogram_t *histogram;
+    } value;
+};
+
+
+static struct {
+    metric_t metrics[MAX_METRICS];
+    histogram_t histograms[MAX_HISTOGRAMS];
+    uint16_t metric_count;          //Published with release order once the entry is filled
+    uint16_t histogram_count;
+    portMUX_TYPE lock;              //Only taken by registration
+} registry = {.lock = portMUX_INITIALIZER_UNLOCKED};
+
+
+/// @brief Fills the next free entry and publishes it in one go, so readers never see a half written metric
+static metric_t* metric_register(metric_type_t type, const char* name, const char* labels, const char* help,
+                                 const uint32_t* bounds, uint8_t bucket_count)
+{
+    if (name == NULL || strlen(name) >= METRICS_NAME_LENGTH) return NULL;
+    if (labels != NULL && strlen(labels) >= METRICS_LABELS_LENGTH) return NULL;
+
+    metric_t *metric = NULL;
+
+    portENTER_CRITICAL(&registry.lock);
+    if (registry.metric_count < MAX_METRICS &&
+        (type != METRIC_TYPE_HISTOGRAM || registry.histogram_count < MAX_HISTOGRAMS)) {
+
+        metric = &registry.metrics[registry.metric_count];
+        metric->type = type;
+        strlcpy(metric->name, name, sizeof(metric->name));
+        strlcpy(metric->labels, labels ? labels : "", sizeof(metric->labels));
+        metric->help = help;
+
+        if (type == METRIC_TYPE_HISTOGRAM) {
+            histogram_t *histogram = &registry.histograms[registry.histogram_count++];
+            histogram->bounds = bounds;
+            histogram->bucket_count = bucket_count;
+            metric->value.histogram = histogram;
+        }
+
+        __atomic_store_n(&registry.metric_count, registry.metric_count + 1, __ATOMIC_RELEASE);
+    }
+    portEXIT_CRITICAL(&registry.lock);
+
+    if (metric == NULL) {
+        ESP_LOGE(TAG, "registry full (%d metrics, %d histograms), %s not registered",
+                 MAX_METRICS, MAX_HISTOGRAMS, name);
+    }
+    return metric;
+}
+
+
+metric_t* metrics_register_counter(const char* name, const char* labels, const char* help)
+{
+    return metric_register(METRIC_TYPE_COUNTER, name, labels, help, NULL, 0);
+}
+
+
+metric_t* metrics_register_gauge(const char* name, const char* labels, const char* help)
+{
+    return metric_register(METRIC_TYPE_GAUGE, name, labels, help, NULL, 0);
+}
+
+
+metric_t* metrics_register_histogram(const char* name, const char* labels, const char* help,
+                                     const uint32_t* bounds, uint8_t bucket_count)
+{
+    if (bounds == NULL || bucket_count == 0 || bucket_count > MAX_BUCKETS) return NULL;
+
+    return metric_register(METRIC_TYPE_HISTOGRAM, name, labels, help, bounds, bucket_count);
+}
+
+
+void metrics_counter_add(metric_t* metric, uint32_t value)
+{
+    if (metric == NULL || metric->type != METRIC_TYPE_COUNTER) return;
+
+    __atomic_fetch_add(&metric->value.counter[xPortGetCoreID()], value, __ATOMIC_RELAXED);
+}
+
+
+void metrics_gauge_set(metric_t* metric, int32_t value)
+{
+    if (metric == NULL || metric->type != METRIC_TYPE_GAUGE) return;
+
+    __atomic_store_n(&metric->value.gauge, value, __ATOMIC_RELAXED);
+}
+
+
+void metrics_histogram_observe(metric_t* metric, uint32_t value)
+{
+    if (metric == NULL || metric->type != METRIC_TYPE_HISTOGRAM) return;
+
+    histogram_t *histogram = metric->value.histogram;
+    uint8_t bucket = 0;
+    while (bucket < histogram->bucket_count && value > histogram->bounds[bucket]) {
+        bucket++;
+    }
+
+    int core = xPortGetCoreID();
+    __atomic_fetch_add(&histogram->counts[core][bucket], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->sum[core], value, __ATOMIC_RELAXED);
+}
+
+
+uint64_t metrics_counter_read(const metric_t* metric)
+{
+    if (metric == NULL || metric->type != METRIC_TYPE_COUNTER) return 0;
+
+    uint64_t total = 0;
+    for (int core = 0; core < NUM_CORES; core++) {
+        total += __atomic_load_n(&metric->value.counter[core], __ATOMIC_RELAXED);
+    }
+    return total;
+}
+
+
+static uint32_t histogram_bucket_read(const histogram_t* histogram, uint8_t bucket)
+{
+    uint32_t total = 0;
+    for (int core = 0; core < NUM_CORES; core++) {
+        total += __atomic_load_n(&histogram->counts[core][bucket], __ATOMIC_RELAXED);
+    }
+    return total;
+}
+
+
+static uint64_t histogram_sum_read(const histogram_t* histogram)
+{
+    uint64_t total = 0;
+    for (int core = 0; core < NUM_CORES; core++) {
+        total += __atomic_load_n(&histogram->sum[core], __ATOMIC_RELAXED);
+    }
+    return total;
+}
+
+
+static const char* type_names[] = {
+    [METRIC_TYPE_COUNTER] = "counter",
+    [METRIC_TYPE_GAUGE] = "gauge",
+    [METRIC_TYPE_HISTOGRAM] = "histogram",
+};
+
+
+/// @brief name{labels[,extra]} into buf, braces left out when there is no label at all
+static void text_series(char* buf, size_t size, const metric_t* metric, const char* suffix, const char* extra)
+{
+    bool has_labels = metric->labels[0] != '\0';
+    bool has_extra = extra != NULL;
+
+    snprintf(buf, size, "%s%s%s%s%s%s%s", metric->name, suffix,
+             (has_labels || has_extra) ? "{" : "",
+             metric->labels,
+             (has_labels && has_extra) ? "," : "",
+             has_extra ? extra : "",
+             (has_labels || has_extra) ? "}" : "");
+}
+
+
+/// @brief The sample lines of one metric, no HELP or TYPE
+static esp_err_t text_metric(metrics_write_t write, void* ctx, const metric_t* metric)
+{
+    char series[METRICS_NAME_LENGTH + METRICS_LABELS_LENGTH + 32];
+    char line[sizeof(series) + 48];
+    esp_err_t err = ESP_OK;
+    int len;
+
+    switch (metric->type) {
+        case METRIC_TYPE_COUNTER:
+            text_series(series, sizeof(series), metric, "", NULL);
+            len = snprintf(line, sizeof(line), "%s %llu\n", series,
+                           (unsigned long long)metrics_counter_read(metric));
+            err = write(ctx, line, len);
+            break;
+
+        case METRIC_TYPE_GAUGE:
+            text_series(series, sizeof(series), metric, "", NULL);
+            len = snprintf(line, sizeof(line), "%s %ld\n", series,
+                           (long)__atomic_load_n(&metric->value.gauge, __ATOMIC_RELAXED));
+            err = write(ctx, line, len);
+            break;
+
+        case METRIC_TYPE_HISTOGRAM: {
+            const histogram_t *histogram = metric->value.histogram;
+            char le[24];
+            uint32_t cumulative = 0;
+
+            for (int b = 0; b <= histogram->bucket_count && err == ESP_OK; b++) {
+                cumulative += histogram_bucket_read(histogram, b);
+                if (b < histogram->bucket_count)
+                    snprintf(le, sizeof(le), "le=\"%lu\"", (unsigned long)histogram->bounds[b]);
+                else
+                    snprintf(le, sizeof(le), "le=\"+Inf\"");
+
+                text_series(series, sizeof(series), metric, "_bucket", le);
+                len = snprintf(line, sizeof(line), "%s %lu\n", series, (unsigned long)cumulative);
+                err = write(ctx, line, len);
+            }
+            if (err != ESP_OK) break;
+
+            text_series(series, sizeof(series), metric, "_sum", NULL);
+            len = snprintf(line, sizeof(line), "%s %llu\n", series,
+                           (unsigned long long)histogram_sum_read(histogram));
+            err = write(ctx, line, len);
+            if (err != ESP_OK) break;
+
+            text_series(series, sizeof(series), metric, "_count", NULL);
+            len = snprintf(line, sizeof(line), "%s %lu\n", series, (unsigned long)cumulative);
+            err = write(ctx, line, len);
+            break;
+        }
+    }
+    return err;
+}
+
+
+static bool name_seen_before(int index)
+{
+    for (int i = 0; i < index; i++) {
+        if (strcmp(registry.metrics[i].name, registry.metrics[index].name) == 0) return true;
+    }
+    return false;
+}
+
+
+esp_err_t metrics_render_text(metrics_write_t write, void* ctx)
+{
+    if (write == NULL) return ESP_ERR_INVALID_ARG;
+
+    char line[METRICS_NAME_LENGTH + 48];
+    uint16_t count = __atomic_load_n(&registry.metric_count, __ATOMIC_ACQUIRE);
+    esp_err_t err = ESP_OK;
+
+    //A family goes out whole, with one HELP and TYPE, where its first metric was registered.
+    //Its other metrics can have been registered anywhere after, they are picked up from there
+    for (int i = 0; i < count && err == ESP_OK; i++) {
+        const metric_t *metric = &registry.metrics[i];
+        if (name_seen_before(i)) continue;
+
+        //Help text is written as is, it can be longer than the line buffer
+        int len = snprintf(line, sizeof(line), "# HELP %s ", metric->name);
+        err = write(ctx, line, len);
+        if (err == ESP_OK && metric->help) err = write(ctx, metric->help, strlen(metric->help));
+        if (err != ESP_OK) break;
+
+        len = snprintf(line, sizeof(line), "\n# TYPE %s %s\n", metric->name, type_names[metric->type]);
+        err = write(ctx, line, len);
+
+        for (int j = i; j < count && err == ESP_OK; j++) {
+            if (strcmp(registry.metrics[j].name, metric->name) == 0) err = text_metric(write, ctx, &registry.metrics[j]);
+        }
+    }
+
+    return err;
+}
+
+
+//Little endian writers into a scratch buffer
+static uint8_t* put_u8(uint8_t* p, uint8_t v) { *p++ = v; return p; }
+static uint8_t* put_u16(uint8_t* p, uint16_t v) { *p++ = v; *p++ = v >> 8; return p; }
+static uint8_t* put_u32(uint8_t* p, uint32_t v) { for (int i = 0; i < 4; i++) *p++ = v >> (8 * i); return p; }
+static uint8_t* put_u64(uint8_t* p, uint64_t v) { for (int i = 0; i < 8; i++) *p++ = v >> (8 * i); return p; }
+
+static uint8_t* put_str(uint8_t* p, const char* s)
+{
+    size_t len = strlen(s);
+    *p++ = (uint8_t)len;
+    memcpy(p, s, len);
+    return p + len;
+}
+
+
+esp_err_t metrics_render_binary(metrics_write_t write, void* ctx)
+{
+    if (write == NULL) return ESP_ERR_INVALID_ARG;
+
+    //Largest record is a histogram with every bucket in use
+    uint8_t buf[3 + METRICS_NAME_LENGTH + METRICS_LABELS_LENGTH + 1 + (MAX_BUCKETS * 2 + 1) * 4 + 8];
+    uint16_t count = __atomic_load_n(&registry.metric_count, __ATOMIC_ACQUIRE);
+    uint8_t *p = buf;
+
+    memcpy(p, "MTR1", 4);
+    p = put_u16(p + 4, count);
+    esp_err_t err = write(ctx, buf, p - buf);
+
+    for (int i = 0; i < count && err == ESP_OK; i++) {
+        const metric_t *metric = &registry.metrics[i];
+
+        p = put_u8(buf, metric->type);
+        p = put_str(p, metric->name);
+        p = put_str(p, metric->labels);
+
+        switch (metric->type) {
+            case METRIC_TYPE_COUNTER:
+                p = put_u64(p, metrics_counter_read(metric));
+                break;
+
+            case METRIC_TYPE_GAUGE:
+                p = put_u32(p, (uint32_t)__atomic_load_n(&metric->value.gauge, __ATOMIC_RELAXED));
+                break;
+
+            case METRIC_TYPE_HISTOGRAM: {
+                const histogram_t *histogram = metric->value.histogram;
+                p = put_u8(p, histogram->bucket_count);
+                for (int b = 0; b < histogram->bucket_count; b++) {
+                    p = put_u32(p, histogram->bounds[b]);
+                }
+                for (int b = 0; b <= histogram->bucket_count; b++) {
+                    p = put_u32(p, histogram_bucket_read(histogram, b));
+                }
+                p = put_u64(p, histogram_sum_read(histogram));
+                break;
+            }
+        }
+
+        err = write(ctx, buf, p - buf);
+    }
+
+    return err;
+}
@@ -0,0 +1,56 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+
+
+#define METRICS_NAME_LENGTH     32
+#define METRICS_LABELS_LENGTH   48
+
+
+typedef enum {
+    METRIC_TYPE_COUNTER = 1,
+    METRIC_TYPE_GAUGE,
+    METRIC_TYPE_HISTOGRAM
+} metric_type_t;
+
+//Opaque handle returned at registration, valid for the lifetime of the program
+typedef struct metric metric_t;
+
+//Receives the rendered output piece by piece
+typedef esp_err_t (*metrics_write_t)(void* ctx, const void* data, size_t len);
+
+
+/// @brief Registers a monotonically increasing counter
+/// @param name prometheus metric name, metrics sharing a name are rendered as one family wherever they were
+/// registered, with the help text and type of the first one
+/// @param labels label set without braces e.g. uri="/open", may be NULL
+/// @return NULL if the table is full (logged as an error) or the arguments are invalid
+metric_t* metrics_register_counter(const char* name, const char* labels, const char* help);
+metric_t* metrics_register_gauge(const char* name, const char* labels, const char* help);
+/// @param bounds ascending upper bounds of the finite buckets, must stay valid (a static array).
+/// An overflow (+Inf) bucket is added implicitly
+metric_t* metrics_register_histogram(const char* name, const char* labels, const char* help,
+                                     const uint32_t* bounds, uint8_t bucket_count);
+
+//Hot path, safe from any task or core, no locks or allocation. NULL metrics are ignored
+void metrics_counter_add(metric_t* metric, uint32_t value);
+void metrics_gauge_set(metric_t* metric, int32_t value);
+void metrics_histogram_observe(metric_t* metric, uint32_t value);
+
+/// @brief Sum of the per core slots of a counter, 0 for other types
+uint64_t metrics_counter_read(const metric_t* metric);
+
+esp_err_t metrics_render_text(metrics_write_t write, void* ctx);
+
+/// @brief Binary layout, little endian, no padding:
+/// header: "MTR1", u16 metric count
+/// per metric: u8 type, u8 name_len, name, u8 labels_len, labels, then
+///     counter: u64 value
+///     gauge: i32 value
+///     histogram: u8 bucket_count, u32 bounds[bucket_count], u32 counts[bucket_count+1] (not cumulative), u64 sum
+esp_err_t metrics_render_binary(metrics_write_t write, void* ctx);
+
+#endif
@@ -0,0 +1,415 @@
+#include <string.h>
+#include "esp_log.h"
+#include "json_fields.h"
+
+
+static const char *TAG = "json_fields";
+
+enum {
+    JSON_STATE_START,           //Before the opening brace
+    JSON_STATE_KEY_OR_END,      //After { or a key/value pair
+    JSON_STATE_KEY,             //Inside a key
+    JSON_STATE_COLON,
+    JSON_STATE_VALUE,           //Before a value
+    JSON_STATE_STRING,          //Inside a string value
+    JSON_STATE_NUMBER,
+    JSON_STATE_LITERAL,         //true, false, null
+    JSON_STATE_SKIP,            //Inside a nested object or array
+    JSON_STATE_NEXT,            //After a value, expecting , or }
+    JSON_STATE_NEXT_KEY,        //After a comma, a key must follow
+    JSON_STATE_ELEMENT,         //Inside an object array, before an element or ]
+    JSON_STATE_NEXT_ELEMENT,    //After an element, expecting , or ]
+    JSON_STATE_ELEMENT_AFTER_COMMA,
+    JSON_STATE_DONE,
+    JSON_STATE_ERROR
+};
+
+
+static bool is_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+
+static int hex_digit(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+
+/// @brief Fields missing from the document read as empty or zero
+static void reset_fields(const json_field_t *fields, size_t field_count)
+{
+    for (size_t i = 0; i < field_count; i++) {
+        if (fields[i].type == JSON_FIELD_STRING && fields[i].size > 0) {
+            ((char *)fields[i].dest)[0] = '\0';
+        } else if (fields[i].type == JSON_FIELD_INT) {
+            *(int32_t *)fields[i].dest = 0;
+        }
+    }
+}
+
+
+void json_fields_init(json_fields_parser_t *parser, const json_field_t *fields, size_t field_count)
+{
+    memset(parser, 0, sizeof(*parser));
+    parser->fields = fields;
+    parser->field_count = field_count;
+    parser->top_fields = fields;
+    parser->top_field_count = field_count;
+    parser->field = -1;
+    reset_fields(fields, field_count);
+}
+
+
+static int8_t find_field(const json_fields_parser_t *parser, json_field_type_t type)
+{
+    if (parser->overflow) return -1;
+
+    for (size_t i = 0; i < parser->field_count; i++) {
+        if (parser->fields[i].type == type && strcmp(parser->fields[i].key, parser->key) == 0) {
+            return (int8_t)i;
+        }
+    }
+    return -1;
+}
+
+
+/// @brief Appends a decoded string character to the key or to the destination of the value
+static void string_put(json_fields_parser_t *parser, char c)
+{
+    if (parser->state == JSON_STATE_KEY) {
+        if (parser->key_len < JSON_FIELDS_KEY_LENGTH - 1) {
+            parser->key[parser->key_len++] = c;
+        } else {
+            parser->overflow = true;
+        }
+        return;
+    }
+
+    if (parser->field < 0) return;
+
+    const json_field_t *field = &parser->fields[parser->field];
+    if (parser->value_len < field->size - 1) {
+        ((char *)field->dest)[parser->value_len++] = c;
+    } else {
+        parser->overflow = true;
+    }
+}
+
+
+static void string_end(json_fields_parser_t *parser)
+{
+    if (parser->state == JSON_STATE_KEY) {
+        parser->key[parser->key_len] = '\0';
+        parser->state = JSON_STATE_COLON;
+        return;
+    }
+
+    if (parser->field >= 0) {
+        const json_field_t *field = &parser->fields[parser->field];
+        if (parser->overflow) {
+            //A cut short URL or checksum is worse than none
+            ESP_LOGW(TAG, "\"%s\" longer than %u bytes, ignored", field->key, (unsigned)field->size - 1);
+            parser->value_len = 0;
+        }
+        ((char *)field->dest)[parser->value_len] = '\0';
+    }
+    parser->state = JSON_STATE_NEXT;
+}
+
+
+/// @brief One character of a key or string value, escapes included
+static esp_err_t string_char(json_fields_parser_t *parser, char c)
+{
+    if (parser->unicode_left > 0) {
+        int digit = hex_digit(c);
+        if (digit < 0) return ESP_ERR_INVALID_RESPONSE;
+        parser->unicode_value = (parser->unicode_value << 4) | digit;
+        if (--parser->unicode_left == 0) {
+            //The fields of interest are ASCII, anything else is kept as a placeholder
+            string_put(parser, parser->unicode_value < 0x80 ? (char)parser->unicode_value : '?');
+        }
+        return ESP_OK;
+    }
+
+    if (parser->escape) {
+        parser->escape = false;
+        switch (c) {
+            case '"': case '\\': case '/': string_put(parser, c); break;
+            case 'b': string_put(parser, '\b'); break;
+            case 'f': string_put(parser, '\f'); break;
+            case 'n': string_put(parser, '\n'); break;
+            case 'r': string_put(parser, '\r'); break;
+            case 't': string_put(parser, '\t'); break;
+            case 'u': parser->unicode_left = 4; parser->unicode_value = 0; break;
+            default: return ESP_ERR_INVALID_RESPONSE;
+        }
+        return ESP_OK;
+    }
+
+    if (c == '\\') {
+        parser->escape = true;
+    } else if (c == '"') {
+        string_end(parser);
+    } else if ((unsigned char)c < 0x20) {
+        return ESP_ERR_INVALID_RESPONSE;
+    } else {
+        string_put(parser, c);
+    }
+    return ESP_OK;
+}
+
+
+static void number_end(json_fields_parser_t *parser)
+{
+    if (parser->field >= 0) {
+        //1.5e3 is 15 scaled by 10^2, anything past the int32 range only needs to stay past it
+        int32_t power = (parser->exponent_negative ? -parser->exponent_value : parser->exponent_value) + parser->scale;
+        int64_t value = parser->number;
+        for (; power > 0 && value != 0 && value <= INT32_MAX; power--) {
+            value *= 10;
+        }
+        for (; power < 0 && value != 0; power++) {
+            value /= 10;
+        }
+        if (parser->negative) value = -value;
+        if (value > INT32_MAX) value = INT32_MAX;
+        if (value < INT32_MIN) value = INT32_MIN;
+        *(int32_t *)parser->fields[parser->field].dest = (int32_t)value;
+    }
+    parser->state = JSON_STATE_NEXT;
+}
+
+
+/// @brief Digits, '.', exponent and its sign after the first character of a number
+static bool number_char(json_fields_parser_t *parser, char c)
+{
+    if (c >= '0' && c <= '9') {
+        if (parser->exponent) {
+            if (parser->exponent_value < 1000) {
+                parser->exponent_value = parser->exponent_value * 10 + (c - '0');
+            }
+        } else if (parser->number < (INT64_MAX - 9) / 10) {
+            parser->number = parser->number * 10 + (c - '0');
+            if (parser->fraction) parser->scale--;
+        } else if (!parser->fraction) {
+            parser->scale++;
+        }
+        return true;
+    }
+    if (c == '.' && !parser->fraction && !parser->exponent) {
+        parser->fraction = true;
+        return true;
+    }
+    if ((c == 'e' || c == 'E') && !parser->exponent) {
+        parser->exponent = true;
+        return true;
+    }
+    if ((c == '+' || c == '-') && parser->exponent && parser->exponent_value == 0) {
+        parser->exponent_negative = (c == '-');
+        return true;
+    }
+    return false;
+}
+
+
+/// @brief Characters of a nested object or array, only the nesting and strings matter
+static void skip_char(json_fields_parser_t *parser, char c)
+{
+    if (parser->skip_in_string) {
+        if (parser->escape) {
+            parser->escape = false;
+        } else if (c == '\\') {
+            parser->escape = true;
+        } else if (c == '"') {
+            parser->skip_in_string = false;
+        }
+        return;
+    }
+
+    if (c == '"') {
+        parser->skip_in_string = true;
+    } else if (c == '{' || c == '[') {
+        parser->depth++;
+    } else if (c == '}' || c == ']') {
+        if (--parser->depth == 0) parser->state = JSON_STATE_NEXT;
+    }
+}
+
+
+static esp_err_t value_start(json_fields_parser_t *parser, char c)
+{
+    //Object arrays are only walked one level down, deeper ones are skipped like any other array
+    int8_t array_field = (c == '[' && !parser->in_element) ? find_field(parser, JSON_FIELD_OBJECT_ARRAY) : -1;
+
+    if (c == '"') {
+        parser->field = find_field(parser, JSON_FIELD_STRING);
+        parser->value_len = 0;
+        parser->overflow = false;
+        parser->state = JSON_STATE_STRING;
+    } else if (c == '-' || (c >= '0' && c <= '9')) {
+        parser->field = find_field(parser, JSON_FIELD_INT);
+        parser->negative = (c == '-');
+        parser->fraction = false;
+        parser->exponent = false;
+        parser->exponent_negative = false;
+        parser->exponent_value = 0;
+        parser->scale = 0;
+        parser->number = parser->negative ? 0 : c - '0';
+        parser->state = JSON_STATE_NUMBER;
+    } else if (array_field >= 0) {
+        parser->array = parser->fields[array_field].dest;
+        parser->state = JSON_STATE_ELEMENT;
+    } else if (c == '{' || c == '[') {
+        parser->depth = 1;
+        parser->skip_in_string = false;
+        parser->escape = false;
+        parser->state = JSON_STATE_SKIP;
+    } else if (c == 't' || c == 'f' || c == 'n') {
+        parser->state = JSON_STATE_LITERAL;
+    } else {
+        return ESP_ERR_INVALID_RESPONSE;
+    }
+    return ESP_OK;
+}
+
+
+/// @brief Closing brace of the top level object or of an array element
+static void object_end(json_fields_parser_t *parser)
+{
+    if (!parser->in_element) {
+        parser->state = JSON_STATE_DONE;
+        return;
+    }
+
+    parser->array->element_done(parser->array->ctx);
+    parser->in_element = false;
+    parser->fields = parser->top_fields;
+    parser->field_count = parser->top_field_count;
+    parser->state = JSON_STATE_NEXT_ELEMENT;
+}
+
+
+/// @brief Elements of an object array and the separators between them
+static esp_err_t element_char(json_fields_parser_t *parser, char c)
+{
+    if (c == '{' && parser->state != JSON_STATE_NEXT_ELEMENT) {
+        reset_fields(parser->array->fields, parser->array->field_count);
+        parser->fields = parser->array->fields;
+        parser->field_count = parser->array->field_count;
+        parser->in_element = true;
+        parser->state = JSON_STATE_KEY_OR_END;
+    } else if (c == ']' && parser->state != JSON_STATE_ELEMENT_AFTER_COMMA) {
+        parser->array = NULL;
+        parser->state = JSON_STATE_NEXT;
+    } else if (c == ',' && parser->state == JSON_STATE_NEXT_ELEMENT) {
+        parser->state = JSON_STATE_ELEMENT_AFTER_COMMA;
+    } else if (!is_space(c)) {
+        return ESP_ERR_INVALID_RESPONSE;
+    }
+    return ESP_OK;
+}
+
+
+/// @brief Comma or closing brace after a value
+static esp_err_t value_next(json_fields_parser_t *parser, char c)
+{
+    if (c == ',') {
+        parser->state = JSON_STATE_NEXT_KEY;
+    } else if (c == '}') {
+        object_end(parser);
+    } else if (!is_space(c)) {
+        return ESP_ERR_INVALID_RESPONSE;
+    }
+    return ESP_OK;
+}
+
+
+static esp_err_t feed_char(json_fields_parser_t *parser, char c)
+{
+    switch (parser->state) {
+        case JSON_STATE_START:
+            if (c == '{') parser->state = JSON_STATE_KEY_OR_END;
+            else if (!is_space(c)) return ESP_ERR_INVALID_RESPONSE;
+            return ESP_OK;
+
+        case JSON_STATE_KEY_OR_END:
+        case JSON_STATE_NEXT_KEY:
+            if (c == '"') {
+                parser->key_len = 0;
+                parser->overflow = false;
+                parser->state = JSON_STATE_KEY;
+            } else if (c == '}' && parser->state == JSON_STATE_KEY_OR_END) {
+                object_end(parser);
+            } else if (!is_space(c)) {
+                return ESP_ERR_INVALID_RESPONSE;
+            }
+            return ESP_OK;
+
+        case JSON_STATE_KEY:
+        case JSON_STATE_STRING:
+            return string_char(parser, c);
+
+        case JSON_STATE_COLON:
+            if (c == ':') parser->state = JSON_STATE_VALUE;
+            else if (!is_space(c)) return ESP_ERR_INVALID_RESPONSE;
+            return ESP_OK;
+
+        case JSON_STATE_VALUE:
+            return is_space(c) ? ESP_OK : value_start(parser, c);
+
+        case JSON_STATE_NUMBER:
+            if (number_char(parser, c)) return ESP_OK;
+            number_end(parser);
+            return value_next(parser, c);
+
+        case JSON_STATE_LITERAL:
+            if (c >= 'a' && c <= 'z') return ESP_OK;
+            parser->state = JSON_STATE_NEXT;
+            return value_next(parser, c);
+
+        case JSON_STATE_SKIP:
+            skip_char(parser, c);
+            return ESP_OK;
+
+        case JSON_STATE_NEXT:
+            return value_next(parser, c);
+
+        case JSON_STATE_ELEMENT:
+        case JSON_STATE_NEXT_ELEMENT:
+        case JSON_STATE_ELEMENT_AFTER_COMMA:
+            return element_char(parser, c);
+
+        case JSON_STATE_DONE:
+            //Trailing whitespace is fine, anything else is not one object
+            return is_space(c) ? ESP_OK : ESP_ERR_INVALID_RESPONSE;
+
+        default:
+            return ESP_ERR_INVALID_RESPONSE;
+    }
+}
+
+
+esp_err_t json_fields_feed(json_fields_parser_t *parser, const char *data, size_t len)
+{
+    if (parser->state == JSON_STATE_ERROR) return ESP_ERR_INVALID_RESPONSE;
+
+    for (size_t i = 0; i < len; i++) {
+        if (feed_char(parser, data[i]) != ESP_OK) {
+            ESP_LOGE(TAG, "Malformed JSON near '%c'", data[i]);
+            parser->state = JSON_STATE_ERROR;
+            return ESP_ERR_INVALID_RESPONSE;
+        }
+    }
+    return ESP_OK;
+}
+
+
+esp_err_t json_fields_finish(const json_fields_parser_t *parser)
+{
+    return parser->state == JSON_STATE_DONE ? ESP_OK : ESP_ERR_INVALID_RESPONSE;
+}
@@ -0,0 +1,78 @@
+#ifndef JSON_FIELDS_H
+#define JSON_FIELDS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "esp_err.h"
+
+
+/*
+ * Streaming extractor for the top level fields of a JSON object.
+ * The document is fed in pieces of any size, fields in the table are written straight to their
+ * destination as they go past and everything else, nested objects and arrays included, is skipped.
+ * The parser state is fixed size and nothing is allocated, so the document size does not matter.
+ *
+ * One level down, a top level array of objects can be walked element by element: each element's
+ * fields are extracted with their own table and a callback decides what to keep before the next one.
+ */
+
+#define JSON_FIELDS_KEY_LENGTH  32      //Longer keys cannot match a field and are skipped
+
+typedef enum {
+    JSON_FIELD_STRING,                  //dest is a char array of size bytes, always terminated
+    JSON_FIELD_INT,                     //dest is an int32_t, exponents applied, fractions dropped, out of range clamped
+    JSON_FIELD_OBJECT_ARRAY             //dest is a json_object_array_t, only valid at the top level
+} json_field_type_t;
+
+typedef struct {
+    const char* key;
+    json_field_type_t type;
+    void* dest;
+    size_t size;
+} json_field_t;
+
+typedef struct {
+    const json_field_t* fields;         //Reset before each element
+    size_t field_count;
+    void (*element_done)(void* ctx);    //Called once an element's closing brace is seen
+    void* ctx;
+} json_object_array_t;
+
+typedef struct {
+    const json_field_t* fields;         //Table of the object being parsed
+    size_t field_count;
+    const json_field_t* top_fields;
+    size_t top_field_count;
+    const json_object_array_t* array;   //Set while inside an object array
+    bool in_element;
+    uint8_t state;
+    uint8_t depth;                      //Nesting below the top level object while skipping
+    bool skip_in_string;
+    bool escape;
+    uint8_t unicode_left;               //Hex digits of a \u escape still to come
+    uint16_t unicode_value;
+    char key[JSON_FIELDS_KEY_LENGTH];
+    uint8_t key_len;
+    int8_t field;                       //Table index the value belongs to, -1 if none
+    size_t value_len;
+    bool overflow;
+    bool negative;
+    bool fraction;                      //After the '.'
+    bool exponent;                      //After the 'e'
+    bool exponent_negative;
+    int16_t exponent_value;
+    int16_t scale;                      //Power of ten number is off by: fraction digits kept, integer digits dropped
+    int64_t number;                     //Significant digits
+} json_fields_parser_t;
+
+
+void json_fields_init(json_fields_parser_t* parser, const json_field_t* fields, size_t field_count);
+
+/// @return ESP_ERR_INVALID_RESPONSE as soon as the input cannot be a JSON object
+esp_err_t json_fields_feed(json_fields_parser_t* parser, const char* data, size_t len);
+
+/// @return ESP_OK only if the whole object was seen
+esp_err_t json_fields_finish(const json_fields_parser_t* parser);
+
+#endif
@@ -0,0 +1,181 @@
+#include <string.h>
+#include "esp_log.h"
+#include "ota_delta.h"
+
+
+static const char *TAG = "ota_delta";
+
+#define HEADER_SIZE     13
+
+enum {
+    DELTA_STATE_HEADER,
+    DELTA_STATE_OPCODE,
+    DELTA_STATE_ARGS,
+    DELTA_STATE_INSERT,
+    DELTA_STATE_DONE
+};
+
+enum {
+    DELTA_OP_END = 0,
+    DELTA_OP_COPY = 1,
+    DELTA_OP_INSERT = 2
+};
+
+
+static uint32_t get_u32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+
+static esp_err_t emit(ota_delta_t *delta, const uint8_t *data, size_t len)
+{
+    if (delta->produced + len > delta->target_size) {
+        ESP_LOGE(TAG, "Patch produces more than the %lu byte target", (unsigned long)delta->target_size);
+        return ESP_ERR_INVALID_RESPONSE;
+    }
+    delta->produced += len;
+    return delta->sink(data, len, delta->sink_ctx);
+}
+
+
+/// @brief Streams a source range to the sink through the small copy buffer
+static esp_err_t copy_from_source(ota_delta_t *delta, uint32_t offset, uint32_t len)
+{
+    if (offset > delta->source->size || len > delta->source->size - offset) {
+        ESP_LOGE(TAG, "COPY %lu+%lu outside the source partition", (unsigned long)offset, (unsigned long)len);
+        return ESP_ERR_INVALID_RESPONSE;
+    }
+
+    while (len > 0) {
+        uint32_t step = len < OTA_DELTA_COPY_BUFFER ? len : OTA_DELTA_COPY_BUFFER;
+        esp_err_t err = esp_partition_read(delta->source, offset, delta->copy_buffer, step);
+        if (err != ESP_OK) return err;
+
+        err = emit(delta, delta->copy_buffer, step);
+        if (err != ESP_OK) return err;
+
+        offset += step;
+        len -= step;
+    }
+    return ESP_OK;
+}
+
+
+static void expect_field(ota_delta_t *delta, uint8_t state, uint8_t len)
+{
+    delta->state = state;
+    delta->field_len = 0;
+    delta->field_need = len;
+}
+
+
+void ota_delta_init(ota_delta_t *delta, const esp_partition_t *source, ota_delta_sink_t sink, void *sink_ctx)
+{
+    memset(delta, 0, sizeof(*delta));
+    delta->source = source;
+    delta->sink = sink;
+    delta->sink_ctx = sink_ctx;
+    expect_field(delta, DELTA_STATE_HEADER, HEADER_SIZE);
+}
+
+
+/// @brief Acts on a completely collected header or op argument field
+static esp_err_t field_complete(ota_delta_t *delta)
+{
+    const uint8_t *f = delta->field;
+
+    if (delta->state == DELTA_STATE_HEADER) {
+        if (memcmp(f, OTA_DELTA_MAGIC, 4) != 0 || f[4] != OTA_DELTA_FORMAT_VERSION) {
+            ESP_LOGE(TAG, "Not a version %d delta patch", OTA_DELTA_FORMAT_VERSION);
+            return ESP_ERR_INVALID_RESPONSE;
+        }
+        delta->target_size = get_u32(&f[9]);
+        ESP_LOGI(TAG, "Patch for a %lu byte source, %lu byte target",
+                 (unsigned long)get_u32(&f[5]), (unsigned long)delta->target_size);
+        delta->state = DELTA_STATE_OPCODE;
+        return ESP_OK;
+    }
+
+    //DELTA_STATE_ARGS
+    if (delta->opcode == DELTA_OP_COPY) {
+        delta->state = DELTA_STATE_OPCODE;
+        return copy_from_source(delta, get_u32(&f[0]), get_u32(&f[4]));
+    }
+
+    delta->remaining = get_u32(&f[0]);
+    delta->state = delta->remaining > 0 ? DELTA_STATE_INSERT : DELTA_STATE_OPCODE;
+    return ESP_OK;
+}
+
+
+esp_err_t ota_delta_feed(ota_delta_t *delta, const uint8_t *data, size_t len)
+{
+    esp_err_t err = ESP_OK;
+
+    while (len > 0 && err == ESP_OK) {
+        switch (delta->state) {
+            case DELTA_STATE_HEADER:
+            case DELTA_STATE_ARGS: {
+                size_t take = delta->field_need - delta->field_len;
+                if (take > len) take = len;
+                memcpy(&delta->field[delta->field_len], data, take);
+                delta->field_len += take;
+                data += take;
+                len -= take;
+                if (delta->field_len == delta->field_need) {
+                    err = field_complete(delta);
+                }
+                break;
+            }
+
+            case DELTA_STATE_OPCODE:
+                delta->opcode = *data++;
+                len--;
+                if (delta->opcode == DELTA_OP_END) {
+                    delta->state = DELTA_STATE_DONE;
+                } else if (delta->opcode == DELTA_OP_COPY) {
+                    expect_field(delta, DELTA_STATE_ARGS, 8);
+                } else if (delta->opcode == DELTA_OP_INSERT) {
+                    expect_field(delta, DELTA_STATE_ARGS, 4);
+                } else {
+                    ESP_LOGE(TAG, "Unknown op 0x%02x", delta->opcode);
+                    err = ESP_ERR_INVALID_RESPONSE;
+                }
+                break;
+
+            case DELTA_STATE_INSERT: {
+                //Literal bytes go straight from the download buffer to the sink
+                size_t take = delta->remaining < len ? delta->remaining : len;
+                err = emit(delta, data, take);
+                data += take;
+                len -= take;
+                delta->remaining -= take;
+                if (delta->remaining == 0) {
+                    delta->state = DELTA_STATE_OPCODE;
+                }
+                break;
+            }
+
+            case DELTA_STATE_DONE:
+                ESP_LOGE(TAG, "Data after the END of the patch");
+                err = ESP_ERR_INVALID_RESPONSE;
+                break;
+        }
+    }
+    return err;
+}
+
+
+esp_err_t ota_delta_finish(const ota_delta_t *delta)
+{
+    if (delta->state != DELTA_STATE_DONE) {
+        ESP_LOGE(TAG, "Patch ended before its END op");
+        return ESP_ERR_INVALID_RESPONSE;
+    }
+    if (delta->produced != delta->target_size) {
+        ESP_LOGE(TAG, "Patch produced %lu of %lu bytes", (unsigned long)delta->produced, (unsigned long)delta->target_size);
+        return ESP_ERR_INVALID_RESPONSE;
+    }
+    return ESP_OK;
+}
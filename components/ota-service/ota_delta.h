@@ -0,0 +1,55 @@
+#ifndef OTA_DELTA_H
+#define OTA_DELTA_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "esp_partition.h"
+
+
+/*
+ * Streaming decoder of the delta patch format produced by ota_delta.py.
+ * The new image is rebuilt from the running partition plus the patch, the patch is fed in
+ * arbitrary sized pieces as it arrives and the image comes out through the sink in order.
+ *
+ * All integers little endian.
+ * header: "OTAD", u8 format version (1), u32 source size, u32 target size
+ * then ops until END:
+ *   0x00 END
+ *   0x01 COPY    u32 source offset, u32 length       bytes taken from the running partition
+ *   0x02 INSERT  u32 length, then length bytes       bytes taken from the patch
+ */
+
+#define OTA_DELTA_MAGIC             "OTAD"
+#define OTA_DELTA_FORMAT_VERSION    1
+#define OTA_DELTA_COPY_BUFFER       256
+
+
+typedef esp_err_t (*ota_delta_sink_t)(const uint8_t* data, size_t len, void* ctx);
+
+typedef struct {
+    uint8_t state;
+    uint8_t opcode;
+    uint8_t field[13];                  //Header or op arguments being collected
+    uint8_t field_len;
+    uint8_t field_need;
+    uint32_t remaining;                 //Bytes left of the INSERT being passed through
+    uint32_t target_size;
+    uint32_t produced;
+    const esp_partition_t* source;
+    ota_delta_sink_t sink;
+    void* sink_ctx;
+    uint8_t copy_buffer[OTA_DELTA_COPY_BUFFER];
+} ota_delta_t;
+
+
+void ota_delta_init(ota_delta_t* delta, const esp_partition_t* source, ota_delta_sink_t sink, void* sink_ctx);
+
+/// @return ESP_ERR_INVALID_RESPONSE on a malformed patch, or the sink's error
+esp_err_t ota_delta_feed(ota_delta_t* delta, const uint8_t* data, size_t len);
+
+/// @brief To be called once the whole patch was fed
+/// @return ESP_OK only if END was seen and exactly the announced target size was produced
+esp_err_t ota_delta_finish(const ota_delta_t* delta);
+
+#endif
@@ -0,0 +1,108 @@
+#include <string.h>
+#include "ota_scheduler.h"
+
+
+static int64_t now_s(const ota_scheduler_t *scheduler)
+{
+    return scheduler->env.now_s(scheduler->env.ctx);
+}
+
+
+/// @brief Uniform in [0, range]
+static uint32_t random_below(const ota_scheduler_t *scheduler, uint32_t range)
+{
+    if (range == 0) return 0;
+    return scheduler->env.random(scheduler->env.ctx) % (range + 1);
+}
+
+
+/// @brief Delay spread evenly over [delay - spread, delay + spread], never below 1 s
+static int64_t spread(const ota_scheduler_t *scheduler, uint32_t delay, uint32_t spread)
+{
+    int64_t value = (int64_t)delay - spread + random_below(scheduler, 2 * spread);
+    return value > 0 ? value : 1;
+}
+
+
+static uint32_t backoff_s(const ota_scheduler_t *scheduler)
+{
+    uint32_t backoff = scheduler->config.backoff_s;
+    for (uint16_t i = 1; i < scheduler->failures && backoff < scheduler->config.period_s; i++) {
+        backoff *= 2;
+    }
+    //A failing device checks no less often than a healthy one
+    return backoff < scheduler->config.period_s ? backoff : scheduler->config.period_s;
+}
+
+
+void ota_scheduler_init(ota_scheduler_t *scheduler, const ota_scheduler_config_t *config,
+                        const ota_scheduler_env_t *env, const ota_schedule_state_t *restored)
+{
+    memset(scheduler, 0, sizeof(*scheduler));
+    scheduler->config = *config;
+    scheduler->env = *env;
+
+    int64_t now = now_s(scheduler);
+    uint32_t longest = config->period_s + config->jitter_s;
+
+    if (restored != NULL && restored->valid) {
+        scheduler->failures = restored->failures;
+        scheduler->quick_retries = restored->quick_retries;
+        //A state from a build with a longer period is cut down to this one's
+        scheduler->next_s = now + (restored->remaining_s < longest ? restored->remaining_s : longest);
+    } else {
+        scheduler->next_s = now + random_below(scheduler, config->jitter_s);
+    }
+}
+
+
+uint32_t ota_scheduler_delay_s(const ota_scheduler_t *scheduler)
+{
+    int64_t delay = scheduler->next_s - now_s(scheduler);
+    return delay > 0 ? (uint32_t)delay : 0;
+}
+
+
+void ota_scheduler_report(ota_scheduler_t *scheduler, ota_check_result_t result)
+{
+    const ota_scheduler_config_t *config = &scheduler->config;
+    int64_t now = now_s(scheduler);
+
+    //Quick retries only bridge a short outage, once backing off a longer one just keeps backing off
+    if (result == OTA_CHECK_TRANSIENT && scheduler->failures == 0 &&
+        scheduler->quick_retries < config->quick_retries) {
+        scheduler->quick_retries++;
+        scheduler->next_s = now + spread(scheduler, config->retry_s, config->retry_s / 4);
+        return;
+    }
+
+    scheduler->quick_retries = 0;
+    if (result == OTA_CHECK_OK) {
+        scheduler->failures = 0;
+        scheduler->next_s = now + spread(scheduler, config->period_s, config->jitter_s);
+    } else {
+        if (scheduler->failures < UINT16_MAX) scheduler->failures++;
+        uint32_t backoff = backoff_s(scheduler);
+        scheduler->next_s = now + spread(scheduler, backoff, backoff / 4);
+    }
+}
+
+
+ota_check_result_t ota_scheduler_download_result(bool broken, bool fallback)
+{
+    //A fallback is taken once per version, so this cannot keep the quick retries going
+    if (fallback) return OTA_CHECK_TRANSIENT;
+    return broken ? OTA_CHECK_FAILED : OTA_CHECK_TRANSIENT;
+}
+
+
+void ota_scheduler_snapshot(const ota_scheduler_t *scheduler, uint32_t ahead_s, ota_schedule_state_t *state)
+{
+    uint32_t delay = ota_scheduler_delay_s(scheduler);
+
+    memset(state, 0, sizeof(*state));
+    state->remaining_s = delay > ahead_s ? delay - ahead_s : 0;
+    state->failures = scheduler->failures;
+    state->quick_retries = scheduler->quick_retries;
+    state->valid = 1;
+}
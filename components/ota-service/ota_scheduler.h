@@ -0,0 +1,76 @@
+#ifndef OTA_SCHEDULER_H
+#define OTA_SCHEDULER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+
+/*
+ * Decides when the next update check runs. Pure logic: time and randomness come in through
+ * ota_scheduler_env_t so it runs the same against esp_timer/esp_random or a fake clock on the host.
+ *
+ * - After a good check the next one is a base period away, give or take the jitter, so a fleet
+ *   powered up together drifts apart instead of hitting the server at the same moment
+ * - A transient failure (network) is retried quickly a few times
+ * - Any other failure, or transient ones that keep coming, back off exponentially up to the base period
+ */
+
+typedef enum {
+    OTA_CHECK_OK,                       //Checked, whether or not an update followed
+    OTA_CHECK_TRANSIENT,                //Connection or read failure, worth retrying soon
+    OTA_CHECK_FAILED                    //Server, manifest or image problem, retrying soon will not help
+} ota_check_result_t;
+
+typedef struct {
+    uint32_t period_s;
+    uint32_t jitter_s;                  //The period is spread by up to this much either way
+    uint32_t retry_s;                   //Delay of a quick retry
+    uint8_t quick_retries;              //Quick retries before a transient failure counts as a failure
+    uint32_t backoff_s;                 //First backoff, doubled on each further failure
+} ota_scheduler_config_t;
+
+typedef struct {
+    int64_t (*now_s)(void* ctx);        //Monotonic seconds
+    uint32_t (*random)(void* ctx);
+    void* ctx;
+} ota_scheduler_env_t;
+
+//What survives a reboot. The clock restarts with the device so the time left is kept, not a deadline
+typedef struct {
+    uint32_t remaining_s;
+    uint16_t failures;                  //Consecutive
+    uint8_t quick_retries;              //Used since the last good check
+    uint8_t valid;
+} ota_schedule_state_t;
+
+typedef struct {
+    ota_scheduler_config_t config;
+    ota_scheduler_env_t env;
+    int64_t next_s;
+    uint16_t failures;
+    uint8_t quick_retries;
+} ota_scheduler_t;
+
+
+/// @param restored state saved before a reboot, NULL or invalid on first boot.
+/// Without one the first check comes after a random part of the jitter
+void ota_scheduler_init(ota_scheduler_t* scheduler, const ota_scheduler_config_t* config,
+                        const ota_scheduler_env_t* env, const ota_schedule_state_t* restored);
+
+/// @return seconds until the next check is due, 0 if it is
+uint32_t ota_scheduler_delay_s(const ota_scheduler_t* scheduler);
+
+/// @brief Schedules the next check from the outcome of the one just run
+void ota_scheduler_report(ota_scheduler_t* scheduler, ota_check_result_t result);
+
+/// @brief What a download that failed part way counts as
+/// @param broken what was written cannot be resumed: flash did not take it, or it is not the image announced
+/// @param fallback it was a patch or compressed image that did not decode, the next attempt downloads the full one
+/// @return OTA_CHECK_TRANSIENT when the next attempt has a different download to try or a resume to make
+ota_check_result_t ota_scheduler_download_result(bool broken, bool fallback);
+
+/// @brief The state to save before waiting ahead_s. The time left is what it will be at the end of that wait,
+/// so a reboot anywhere in it brings the check forward instead of starting the wait over
+void ota_scheduler_snapshot(const ota_scheduler_t* scheduler, uint32_t ahead_s, ota_schedule_state_t* state);
+
+#endif
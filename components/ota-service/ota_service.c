@@ -7,25 +7,40 @@
    CONDITIONS OF ANY KIND, either express or implied.
 */
 #include <sys/time.h>
+#include <sys/param.h>
 
 #include <time.h>
 #include <string.h>
+#include <stdlib.h>
 #include <inttypes.h>
 #include <stdbool.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/timers.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
 #include "semaphore.h"
 #include "esp_system.h"
 #include "esp_event.h"
 #include "esp_log.h"
-#include "cJSON.h"
 #include "esp_ota_ops.h"
 #include "esp_app_format.h"
 #include "esp_http_client.h"
 #include "esp_flash_partitions.h"
 #include "esp_partition.h"
+#include "esp_timer.h"
+#include "esp_random.h"
+#include "esp_heap_caps.h"
 #include "errno.h"
+#include "nvs.h"
+#include "esp_rom_crc.h"
+#include "mbedtls/sha256.h"
+#include "metrics.h"
+#include "json_fields.h"
+#include "semver.h"
+#include "lzss.h"
+#include "ota_delta.h"
+#include "ota_scheduler.h"
 #include "ota_service.h"
 
 
@@ -34,20 +49,91 @@
 #define OTA_RECV_TIMEOUT        5000
 #define MANIFEST_URL            CONFIG_FIRMWARE_URL
 #define AUTO_CHECK_DURATION     CONFIG_AUTO_CHECK_DURATION
+#define OTA_BUFFER_COUNT        CONFIG_OTA_PIPELINE_BUFFER_COUNT
+#define OTA_BUFFER_SIZE         CONFIG_OTA_PIPELINE_BUFFER_SIZE
+#define OTA_RESUME_SAVE_INTERVAL    CONFIG_OTA_RESUME_SAVE_INTERVAL
+#define OTA_SECTOR_SIZE         4096
+#define OTA_NVS_NAMESPACE       "ota_service"
+#define OTA_NVS_PROGRESS_KEY    "progress"
+#define OTA_NVS_MANIFEST_KEY    "manifest"
+#define OTA_NVS_VALIDATORS_KEY  "mf_valid"
+#define OTA_NVS_SCHEDULE_KEY    "schedule"
+#define OTA_SCHEDULE_SLICE_S    300     //The wait is cut into slices so the time left can be saved along the way
+
+//Builds of the channels up to this one are candidates, a beta device also takes a newer stable build
+#if CONFIG_OTA_CHANNEL_DEV
+#define OTA_CHANNEL_RANK        2
+#elif CONFIG_OTA_CHANNEL_BETA
+#define OTA_CHANNEL_RANK        1
+#else
+#define OTA_CHANNEL_RANK        0
+#endif
 
 static const char *TAG = "native_ota_example";
 /*an ota data write buffer ready to write to the flash*/
 
 DEFINE_EVENT_ADAPTER(OTA_SERVICE);
 
+
+//A buffer of the download pipeline. len 0 marks the end of the image for the flash task
+typedef struct {
+    uint8_t *data;
+    int len;
+} ota_chunk_t;
+
 typedef struct {
         char version[64];
         char firmware_url[512];
         char checksum[65];
         size_t firmware_size;
+        char patch_url[512];        //Optional delta patch, only usable on top of patch_base
+        char patch_base[64];
+        char compressed_url[512];   //Same image as firmware_url, LZSS compressed with this build's window/lookahead
         bool update_available;
 } manifest_t;
 
+//Connections of an update check, each to its own host: the manifest on github.io, the release on
+//github.com and the asset it redirects to
+typedef enum {
+    OTA_PHASE_MANIFEST,
+    OTA_PHASE_IMAGE,
+    OTA_PHASE_REDIRECT,
+    OTA_PHASE_MAX
+} ota_phase_t;
+
+typedef struct {
+    int64_t start_us;
+    size_t free_before;
+} ota_phase_probe_t;
+
+//One entry of the manifest's builds array while it is parsed, with the raw fields that are checked
+//before it becomes a manifest_t
+typedef struct {
+        manifest_t manifest;
+        char channel[16];
+        char target[16];
+        int32_t firmware_size;
+        char compression[16];
+        int32_t compression_window;
+        int32_t compression_lookahead;
+} manifest_candidate_t;
+
+//Cache validators of the last manifest fetched, sent back so an unchanged manifest costs a 304 and no body.
+//Stored apart from the manifest itself so a check only reads this small blob unless the answer is 304
+typedef struct {
+        uint32_t url_crc;           //Of the manifest URL they belong to
+        char etag[72];
+        char last_modified[40];
+} manifest_validators_t;
+
+//Persisted while an image is being written so a dropped download can continue with a Range request.
+//offset is sector aligned, everything below it is known to be in flash
+typedef struct {
+        char version[64];
+        uint32_t partition_address;
+        uint32_t offset;
+} ota_progress_t;
+
 static void *ota_tls_heap_reserve = NULL;
 static struct{
     //char ota_write_data[BUFFSIZE + 1];
@@ -57,15 +143,58 @@ static struct{
     esp_http_client_handle_t client;
     char response_buffer[MAX_HTTP_RECV_BUFFER];
     manifest_t manifest;
+    manifest_candidate_t candidate;     //Build being parsed, copied to manifest if it is the best so far
+    semver_t best_version;              //Of the build in manifest
     int data_len;
     bool expect_redirect;
+    manifest_validators_t validators;   //Of the response being received, filled by the event handler
     TaskHandle_t ota_task_handle;
     //TimerHandle_t timer;
+    metric_t* checks;               //Manifest checks, whether or not an update followed
+    metric_t* not_modified;         //Checks answered from the cached manifest after a 304
+    metric_t* failures;             //Checks or downloads that went back to waiting on an error
+    ota_scheduler_t scheduler;      //When the next check is due
+    ota_check_result_t check_result;    //Of the check in progress, reported to the scheduler before the next wait
+    metric_t* bytes_written;        //Firmware bytes written to the update partition
+    metric_t* updates;              //Images downloaded, verified and set as boot partition
+    metric_t* last_duration_ms;     //Wall clock time of the last image download
+    metric_t* last_throughput;      //Bytes per second of the last image download
+    metric_t* connect_ms[OTA_PHASE_MAX];    //Connect, TLS handshake and request of each connection
+    metric_t* connect_heap[OTA_PHASE_MAX];  //Heap taken at the worst point of the last connect
+
+    //Download pipeline, ota_task receives into buffers while ota_flash_task writes them
+    QueueHandle_t free_chunks;
+    QueueHandle_t full_chunks;
+    SemaphoreHandle_t flash_done;   //Given by the flash task once it has consumed the end marker
+    uint8_t *chunk_memory;          //Allocated only for the duration of an update
+    esp_ota_handle_t update_handle;
+    volatile esp_err_t flash_err;   //First write error, later chunks are just recycled
+    ota_progress_t progress;        //Of the image being written, offset advanced by the flash task
+    uint32_t flash_written;         //Image offset up to which the flash task has written
+    mbedtls_sha256_context image_sha;   //Running hash of everything written, updated by the flash task
+    bool verify_checksum;           //The manifest carried a usable checksum
+    uint8_t expected_sha[HASH_LEN];
+    bool delta_active;              //The download is a patch decoded by the flash task, not the image itself
+    bool delta_failed;              //A patch did not decode or verify, the full image is taken instead
+    char fallback_version[64];      //The version the fallbacks were for, a new version tries the smaller downloads again
+    ota_delta_t delta;
+    bool compressed_active;         //The download is the image LZSS compressed, decoded by the flash task
+    bool compressed_failed;         //Same fallback as delta_failed, for the same version only
+    lzss_decoder_t *lzss;           //Allocated with the download buffers, only for a compressed download
     
 }ota_service_state={0};
 
 
 
+static const char *ota_phase_labels[OTA_PHASE_MAX] = {
+    [OTA_PHASE_MANIFEST] = "phase=\"manifest\"",
+    [OTA_PHASE_IMAGE] = "phase=\"image\"",
+    [OTA_PHASE_REDIRECT] = "phase=\"redirect\"",
+};
+
+//Upper bounds in ms of the connect histogram, a resumed session should land a bucket or two below a full handshake
+static const uint32_t connect_bounds_ms[] = { 100, 200, 400, 800, 1600, 3200, 6400 };
+
 extern const uint8_t server_cert_pem_start[] asm("_binary_ca_cert_pem_start");
 extern const uint8_t server_cert_pem_end[] asm("_binary_ca_cert_pem_end");
 
@@ -141,6 +270,12 @@ static esp_err_t _http_event_handler(esp_http_client_event_t *evt) {
             //notify_result = xTaskNotifyFromISR(ctx->ota_task_handle, 0,eSetValueWithOverwrite,&xHigherPriorityTaskWoken);
     
         }
+        else if (strcasecmp(evt->header_key, "ETag") == 0) {
+            strlcpy(ctx->validators.etag, evt->header_value, sizeof(ctx->validators.etag));
+        }
+        else if (strcasecmp(evt->header_key, "Last-Modified") == 0) {
+            strlcpy(ctx->validators.last_modified, evt->header_value, sizeof(ctx->validators.last_modified));
+        }
         break;
 
     
@@ -152,6 +287,136 @@ static esp_err_t _http_event_handler(esp_http_client_event_t *evt) {
 }
 
 
+/// @brief The cached manifest is the build picked for this channel, so a channel change invalidates it too
+static uint32_t manifest_url_crc(const char *manifest_url)
+{
+    uint32_t crc = esp_rom_crc32_le(0, (const uint8_t *)manifest_url, strlen(manifest_url));
+    return esp_rom_crc32_le(crc, (const uint8_t[]){ OTA_CHANNEL_RANK }, 1);
+}
+
+
+/// @brief Validators stored for this URL, if any. A cache left by another URL is not used
+static bool manifest_cache_validators(const char *manifest_url, manifest_validators_t *validators)
+{
+    nvs_handle_t nvs;
+    if (nvs_open(OTA_NVS_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK) return false;
+
+    size_t len = sizeof(*validators);
+    esp_err_t err = nvs_get_blob(nvs, OTA_NVS_VALIDATORS_KEY, validators, &len);
+    nvs_close(nvs);
+
+    return err == ESP_OK && len == sizeof(*validators) && validators->url_crc == manifest_url_crc(manifest_url) &&
+           (validators->etag[0] != '\0' || validators->last_modified[0] != '\0');
+}
+
+
+static esp_err_t manifest_cache_load(manifest_t *manifest)
+{
+    nvs_handle_t nvs;
+    esp_err_t err = nvs_open(OTA_NVS_NAMESPACE, NVS_READONLY, &nvs);
+    if (err != ESP_OK) return err;
+
+    size_t len = sizeof(*manifest);
+    err = nvs_get_blob(nvs, OTA_NVS_MANIFEST_KEY, manifest, &len);
+    nvs_close(nvs);
+    if (err == ESP_OK && len != sizeof(*manifest)) err = ESP_ERR_INVALID_SIZE;
+    return err;
+}
+
+
+/// @brief Stores the parsed manifest with the validators of the response it came in.
+/// Without any validator there is nothing to send next time, so the cache is dropped instead
+static void manifest_cache_save(const char *manifest_url, const manifest_t *manifest)
+{
+    nvs_handle_t nvs;
+    if (nvs_open(OTA_NVS_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK) return;
+
+    manifest_validators_t *validators = &ota_service_state.validators;
+    if (validators->etag[0] == '\0' && validators->last_modified[0] == '\0') {
+        nvs_erase_key(nvs, OTA_NVS_VALIDATORS_KEY);
+    } else {
+        validators->url_crc = manifest_url_crc(manifest_url);
+        //Manifest first, validators pointing at a stale manifest would make a 304 load the wrong one
+        if (nvs_set_blob(nvs, OTA_NVS_MANIFEST_KEY, manifest, sizeof(*manifest)) != ESP_OK ||
+            nvs_set_blob(nvs, OTA_NVS_VALIDATORS_KEY, validators, sizeof(*validators)) != ESP_OK) {
+            nvs_erase_key(nvs, OTA_NVS_VALIDATORS_KEY);
+        }
+    }
+    nvs_commit(nvs);
+    nvs_close(nvs);
+}
+
+
+static int channel_rank(const char *channel)
+{
+    if (channel[0] == '\0' || strcmp(channel, "stable") == 0) return 0;
+    if (strcmp(channel, "beta") == 0) return 1;
+    if (strcmp(channel, "dev") == 0) return 2;
+    return -1;
+}
+
+
+/// @brief Called by the parser at the end of each build, keeps it in the manifest if it is the newest usable one
+static void manifest_candidate_done(void *ctx)
+{
+    manifest_t *best = ctx;
+    manifest_candidate_t *candidate = &ota_service_state.candidate;
+    manifest_t *manifest = &candidate->manifest;
+
+    int rank = channel_rank(candidate->channel);
+    if (strcmp(candidate->target, CONFIG_IDF_TARGET) != 0 || rank < 0 || rank > OTA_CHANNEL_RANK) {
+        return;
+    }
+
+    semver_t version;
+    if (manifest->firmware_url[0] == '\0' || semver_parse(manifest->version, &version) != ESP_OK) {
+        ESP_LOGW(TAG, "Skipping build \"%s\", no url or not a version", manifest->version);
+        return;
+    }
+    if (best->version[0] != '\0' && semver_compare(&version, &ota_service_state.best_version) <= 0) {
+        return;
+    }
+
+    manifest->firmware_size = candidate->firmware_size > 0 ? candidate->firmware_size : 0;
+    //A patch is only of use with the version it applies to
+    if (manifest->patch_url[0] == '\0' || manifest->patch_base[0] == '\0') {
+        manifest->patch_url[0] = '\0';
+        manifest->patch_base[0] = '\0';
+    }
+    //A stream encoded with other parameters cannot be decoded here, firmware_url is used instead
+    if (strcmp(candidate->compression, "heatshrink") != 0 || candidate->compression_window != LZSS_WINDOW_BITS ||
+        candidate->compression_lookahead != LZSS_LOOKAHEAD_BITS) {
+        manifest->compressed_url[0] = '\0';
+    }
+
+    *best = *manifest;
+    ota_service_state.best_version = version;
+}
+
+
+/// @brief Starts timing a connection and tracking the lowest free heap while it is made
+static void ota_phase_begin(ota_phase_probe_t *probe)
+{
+    probe->free_before = heap_caps_get_free_size(MALLOC_CAP_DEFAULT);
+    heap_caps_monitor_local_minimum_free_size_start();
+    probe->start_us = esp_timer_get_time();
+}
+
+
+/// @brief Records how long the connection took and how much heap it needed at its peak, mostly the handshake
+static void ota_phase_end(ota_phase_t phase, const ota_phase_probe_t *probe)
+{
+    uint32_t elapsed_ms = (uint32_t)((esp_timer_get_time() - probe->start_us) / 1000);
+    size_t lowest = heap_caps_get_minimum_free_size(MALLOC_CAP_DEFAULT);
+    heap_caps_monitor_local_minimum_free_size_stop();
+
+    size_t peak = probe->free_before > lowest ? probe->free_before - lowest : 0;
+    metrics_histogram_observe(ota_service_state.connect_ms[phase], elapsed_ms);
+    metrics_gauge_set(ota_service_state.connect_heap[phase], (int32_t)peak);
+    ESP_LOGI(TAG, "%s connect %lu ms, peak heap %u bytes", ota_phase_labels[phase], (unsigned long)elapsed_ms, (unsigned)peak);
+}
+
+
 // assume this is allocated globally or in your OTA state struct
 
 static esp_err_t fetch_ota_manifest(const char *manifest_url,manifest_t* manifest) {
@@ -186,7 +451,23 @@ static esp_err_t fetch_ota_manifest(const char *manifest_url,manifest_t* manifes
     // set new url for this request
     esp_http_client_set_url(client, manifest_url);
     ESP_LOGI(TAG,"url %s",manifest_url);
+
+    //Conditional request, an unchanged manifest comes back as a bodyless 304
+    manifest_validators_t cached;
+    bool have_cache = manifest_cache_validators(manifest_url, &cached);
+    if (have_cache) {
+        if (cached.etag[0] != '\0') esp_http_client_set_header(client, "If-None-Match", cached.etag);
+        if (cached.last_modified[0] != '\0') esp_http_client_set_header(client, "If-Modified-Since", cached.last_modified);
+    }
+    memset(&ota_service_state.validators, 0, sizeof(ota_service_state.validators));
+
+    ota_phase_probe_t probe;
+    ota_phase_begin(&probe);
     esp_err_t err = esp_http_client_open(client, 0);
+    ota_phase_end(OTA_PHASE_MANIFEST, &probe);
+    //The client is reused for the firmware, the conditions must not stick to it
+    esp_http_client_delete_header(client, "If-None-Match");
+    esp_http_client_delete_header(client, "If-Modified-Since");
     if (err != ESP_OK) {
         ESP_LOGE(TAG, "open failed: %s", esp_err_to_name(err));
         return err;
@@ -195,76 +476,97 @@ static esp_err_t fetch_ota_manifest(const char *manifest_url,manifest_t* manifes
     int content_len = esp_http_client_fetch_headers(client);
     ESP_LOGI(TAG, "Manifest content length = %d", content_len);
 
+    //Nothing changed, no body to read and nothing to parse
+    if (have_cache && esp_http_client_get_status_code(client) == 304) {
+        esp_http_client_close(client);
+        err = manifest_cache_load(manifest);
+        if (err != ESP_OK) {
+            //Validators without their manifest, the next check asks unconditionally
+            ESP_LOGW(TAG, "Manifest not modified but the cached copy is unreadable (%s)", esp_err_to_name(err));
+            memset(&ota_service_state.validators, 0, sizeof(ota_service_state.validators));
+            manifest_cache_save(manifest_url, manifest);
+            return err;
+        }
+        ESP_LOGI(TAG, "Manifest not modified, using cached version %s", manifest->version);
+        metrics_counter_add(ota_service_state.not_modified, 1);
+        return ESP_OK;
+    }
+
+    int status = esp_http_client_get_status_code(client);
+    if (status != 200) {
+        ESP_LOGE(TAG, "Bad HTTP status = %d", status);
+        esp_http_client_close(client);
+        return ESP_ERR_INVALID_RESPONSE;
+    }
+
+    //Parsed as it arrives, each build into the candidate and the best one kept in the manifest.
+    //response_buffer only holds one read at a time, so the manifest can be any size and nothing is allocated
+    manifest_candidate_t *candidate = &ota_service_state.candidate;
+    const json_field_t build_fields[] = {
+        { "version",                JSON_FIELD_STRING,  candidate->manifest.version,        sizeof(candidate->manifest.version) },
+        { "channel",                JSON_FIELD_STRING,  candidate->channel,                 sizeof(candidate->channel) },
+        { "target",                 JSON_FIELD_STRING,  candidate->target,                  sizeof(candidate->target) },
+        { "firmware_url",           JSON_FIELD_STRING,  candidate->manifest.firmware_url,   sizeof(candidate->manifest.firmware_url) },
+        { "checksum",               JSON_FIELD_STRING,  candidate->manifest.checksum,       sizeof(candidate->manifest.checksum) },
+        { "firmware_size",          JSON_FIELD_INT,     &candidate->firmware_size,          sizeof(candidate->firmware_size) },
+        { "patch_url",              JSON_FIELD_STRING,  candidate->manifest.patch_url,      sizeof(candidate->manifest.patch_url) },
+        { "patch_base",             JSON_FIELD_STRING,  candidate->manifest.patch_base,     sizeof(candidate->manifest.patch_base) },
+        { "compressed_url",         JSON_FIELD_STRING,  candidate->manifest.compressed_url, sizeof(candidate->manifest.compressed_url) },
+        { "compression",            JSON_FIELD_STRING,  candidate->compression,             sizeof(candidate->compression) },
+        { "compression_window",     JSON_FIELD_INT,     &candidate->compression_window,     sizeof(candidate->compression_window) },
+        { "compression_lookahead",  JSON_FIELD_INT,     &candidate->compression_lookahead,  sizeof(candidate->compression_lookahead) },
+    };
+    const json_object_array_t builds = {
+        .fields = build_fields,
+        .field_count = sizeof(build_fields) / sizeof(build_fields[0]),
+        .element_done = manifest_candidate_done,
+        .ctx = manifest,
+    };
+    const json_field_t fields[] = {
+        { "builds",                 JSON_FIELD_OBJECT_ARRAY, (void *)&builds,           0 },
+    };
+    json_fields_parser_t parser;
+    json_fields_init(&parser, fields, sizeof(fields) / sizeof(fields[0]));
+    memset(candidate, 0, sizeof(*candidate));
+    memset(manifest, 0, sizeof(*manifest));
+
     int total_read = 0;
-    while (1) {
-        int bytes_read = esp_http_client_read(
-            client,
-            ota_service_state.response_buffer + total_read,
-            MAX_HTTP_RECV_BUFFER - total_read - 1);
+    while (err == ESP_OK) {
+        int bytes_read = esp_http_client_read(client, ota_service_state.response_buffer, MAX_HTTP_RECV_BUFFER);
 
         if (bytes_read < 0) {
             ESP_LOGE(TAG, "Read error");
             err = ESP_FAIL;
-            break;
         } else if (bytes_read == 0) {
             if (esp_http_client_is_complete_data_received(client)) {
                 break;
             }
             vTaskDelay(pdMS_TO_TICKS(10));
-            continue;
         } else {
             total_read += bytes_read;
-            if (total_read >= MAX_HTTP_RECV_BUFFER - 1) {
-                ESP_LOGW(TAG, "Manifest truncated to %d bytes", total_read);
-                break;
-            }
+            err = json_fields_feed(&parser, ota_service_state.response_buffer, bytes_read);
         }
     }
 
-        // After reading 1023 bytes, log the actual content
-    ESP_LOGI(TAG, "First 200 chars:");
-    ESP_LOG_BUFFER_CHAR(TAG, ota_service_state.response_buffer, 200);
-
-    ESP_LOGI(TAG, "Last 200 chars of truncated data:");
-    ESP_LOG_BUFFER_CHAR(TAG, ota_service_state.response_buffer + 823, 200);
-
-    
-    ota_service_state.response_buffer[total_read] = '\0';
+    esp_http_client_close(client); // keep client for reuse
     ESP_LOGI(TAG, "Manifest received (%d bytes)", total_read);
 
-    int status = esp_http_client_get_status_code(client);
-    if (status != 200) {
-        ESP_LOGE(TAG, "Bad HTTP status = %d", status);
-        err = ESP_FAIL;
-    } else {
-        cJSON *json = cJSON_Parse(ota_service_state.response_buffer);
-        if (!json) {
-            ESP_LOGE(TAG, "JSON parse failed");
-            err = ESP_FAIL;
-        } else {
-            cJSON *jver = cJSON_GetObjectItem(json, "version");
-            if (cJSON_IsString(jver)) {
-                strncpy(manifest->version, jver->valuestring, sizeof(manifest->version)-1);
-            }
-            cJSON *jurl = cJSON_GetObjectItem(json, "firmware_url");
-            if (cJSON_IsString(jurl)) {
-                strncpy(manifest->firmware_url, jurl->valuestring, sizeof(manifest->firmware_url)-1);
-            }
-            cJSON *jck = cJSON_GetObjectItem(json, "checksum");
-            if (cJSON_IsString(jck)) {
-                strncpy(manifest->checksum, jck->valuestring, sizeof(manifest->checksum)-1);
-            }
-            cJSON *jsz = cJSON_GetObjectItem(json, "firmware_size");
-            if (cJSON_IsNumber(jsz)) {
-                manifest->firmware_size = jsz->valueint;
-            }
-            cJSON_Delete(json);
-        }
+    if (err == ESP_OK) {
+        err = json_fields_finish(&parser);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "JSON parse failed");
+        return err == ESP_FAIL ? ESP_FAIL : ESP_ERR_INVALID_RESPONSE;
     }
 
-    esp_http_client_close(client); // keep client for reuse
+    if (manifest->version[0] == '\0') {
+        ESP_LOGW(TAG, "No %s build for channel rank %d in the manifest", CONFIG_IDF_TARGET, OTA_CHANNEL_RANK);
+    } else {
+        ESP_LOGI(TAG, "Best build %s", manifest->version);
+    }
 
-    return err;
+    manifest_cache_save(manifest_url, manifest);
+    return ESP_OK;
 }
 
 
@@ -274,7 +576,6 @@ static bool is_update_available(char* new_version){
     if (new_version==NULL || new_version[0] == '\0') {
         return false;
     }
-    esp_err_t ret=0;
     const esp_partition_t *running = esp_ota_get_running_partition();
 
     esp_app_desc_t running_app_info;
@@ -289,17 +590,19 @@ static bool is_update_available(char* new_version){
         return false;
     }
 
-    
-
-    
-    
-    int comparison = strcmp(new_version, running_app_info.version);
-
-    if (comparison > 0) {
-        ret = true;
+    semver_t available;
+    semver_t current;
+    if (semver_parse(new_version, &available) != ESP_OK) {
+        ESP_LOGW(TAG, "Manifest version %s is not a version number", new_version);
+        return false;
+    }
+    //A build from an untagged tree (a bare commit hash) has no place in the order, any release replaces it
+    if (semver_parse(running_app_info.version, &current) != ESP_OK) {
+        ESP_LOGW(TAG, "Running version %s is not a version number", running_app_info.version);
+        return true;
     }
 
-    return ret;
+    return semver_compare(&available, &current) > 0;
 }
 
 
@@ -331,6 +634,508 @@ static esp_err_t detect_last_invalid_app(const char *new_version){
 }
 
 
+static int64_t ota_schedule_now_s(void *ctx)
+{
+    return esp_timer_get_time() / 1000000;
+}
+
+
+static uint32_t ota_schedule_random(void *ctx)
+{
+    return esp_random();
+}
+
+
+static void ota_schedule_load(ota_schedule_state_t *state)
+{
+    memset(state, 0, sizeof(*state));
+
+    nvs_handle_t nvs;
+    if (nvs_open(OTA_NVS_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK) return;
+
+    size_t len = sizeof(*state);
+    if (nvs_get_blob(nvs, OTA_NVS_SCHEDULE_KEY, state, &len) != ESP_OK || len != sizeof(*state)) {
+        state->valid = 0;
+    }
+    nvs_close(nvs);
+}
+
+
+/// @param ahead_s about to be waited, it already counts as elapsed in what is saved
+static void ota_schedule_save(uint32_t ahead_s)
+{
+    ota_schedule_state_t state;
+    ota_scheduler_snapshot(&ota_service_state.scheduler, ahead_s, &state);
+
+    nvs_handle_t nvs;
+    if (nvs_open(OTA_NVS_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK) return;
+
+    if (nvs_set_blob(nvs, OTA_NVS_SCHEDULE_KEY, &state, sizeof(state)) == ESP_OK) {
+        nvs_commit(nvs);
+    }
+    nvs_close(nvs);
+}
+
+
+static void ota_schedule_init(void)
+{
+    const ota_scheduler_config_t config = {
+        .period_s = AUTO_CHECK_DURATION * 3600UL,
+        .jitter_s = CONFIG_OTA_CHECK_JITTER_MINUTES * 60UL,
+        .retry_s = CONFIG_OTA_RETRY_SECONDS,
+        .quick_retries = CONFIG_OTA_QUICK_RETRIES,
+        .backoff_s = CONFIG_OTA_BACKOFF_MINUTES * 60UL,
+    };
+    const ota_scheduler_env_t env = {
+        .now_s = ota_schedule_now_s,
+        .random = ota_schedule_random,
+        .ctx = NULL,
+    };
+    ota_schedule_state_t restored;
+    ota_schedule_load(&restored);
+    ota_scheduler_init(&ota_service_state.scheduler, &config, &env, &restored);
+    ESP_LOGI(TAG, "First check in %lu s", (unsigned long)ota_scheduler_delay_s(&ota_service_state.scheduler));
+}
+
+
+/// @brief Waits until the scheduled check is due or ota_process_start asks for one
+/// @return true if it was asked for
+static bool ota_schedule_wait(void)
+{
+    uint32_t delay;
+    while ((delay = ota_scheduler_delay_s(&ota_service_state.scheduler)) > 0) {
+        //Saved as it will be at the end of the slice, a device rebooting more often than once a
+        //slice still gets a slice closer to its check on every boot
+        uint32_t slice = delay < OTA_SCHEDULE_SLICE_S ? delay : OTA_SCHEDULE_SLICE_S;
+        ota_schedule_save(slice);
+        if (xSemaphoreTake(ota_service_state.start_update, pdMS_TO_TICKS(slice * 1000ULL)) == pdTRUE) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/// @brief Counts the failure and keeps it as the result of the check in progress
+static void ota_check_failed(ota_check_result_t result)
+{
+    metrics_counter_add(ota_service_state.failures, 1);
+    ota_service_state.check_result = result;
+}
+
+
+static esp_err_t ota_progress_load(ota_progress_t *progress)
+{
+    nvs_handle_t nvs;
+    esp_err_t err = nvs_open(OTA_NVS_NAMESPACE, NVS_READONLY, &nvs);
+    if (err != ESP_OK) return err;
+
+    size_t len = sizeof(*progress);
+    err = nvs_get_blob(nvs, OTA_NVS_PROGRESS_KEY, progress, &len);
+    nvs_close(nvs);
+    if (err == ESP_OK && len != sizeof(*progress)) err = ESP_ERR_INVALID_SIZE;
+    return err;
+}
+
+
+static void ota_progress_save(const ota_progress_t *progress)
+{
+    nvs_handle_t nvs;
+    if (nvs_open(OTA_NVS_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK) return;
+
+    if (nvs_set_blob(nvs, OTA_NVS_PROGRESS_KEY, progress, sizeof(*progress)) == ESP_OK) {
+        nvs_commit(nvs);
+    }
+    nvs_close(nvs);
+}
+
+
+static void ota_progress_clear(void)
+{
+    nvs_handle_t nvs;
+    if (nvs_open(OTA_NVS_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK) return;
+
+    nvs_erase_key(nvs, OTA_NVS_PROGRESS_KEY);
+    nvs_commit(nvs);
+    nvs_close(nvs);
+}
+
+
+/// @brief Offset to resume the given image at, 0 if there is no usable progress for it
+static uint32_t ota_resume_offset(const char *version, const esp_partition_t *update_partition)
+{
+    ota_progress_t progress;
+    if (ota_progress_load(&progress) != ESP_OK) return 0;
+
+    if (strncmp(progress.version, version, sizeof(progress.version)) != 0 ||
+        progress.partition_address != update_partition->address) {
+        //Left over from another image, it is of no use any more
+        ota_progress_clear();
+        return 0;
+    }
+    return progress.offset;
+}
+
+
+/// @brief The download is the image itself, not a patch or a compressed stream.
+/// Only then do download offsets match image offsets, for the header check, the size check and resuming
+static bool ota_download_is_image(void)
+{
+    return !ota_service_state.delta_active && !ota_service_state.compressed_active;
+}
+
+
+/// @brief Writes image bytes to the update partition, keeping the hash and resume progress up to date.
+/// Called with the downloaded image, or as the delta decoder's sink with the rebuilt one
+static esp_err_t ota_image_write(const uint8_t *data, size_t len, void *ctx)
+{
+    esp_err_t err = esp_ota_write(ota_service_state.update_handle, data, len);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "esp_ota_write failed (%s)", esp_err_to_name(err));
+        return err;
+    }
+
+    ota_service_state.flash_written += len;
+    if (ota_service_state.verify_checksum) {
+        mbedtls_sha256_update(&ota_service_state.image_sha, data, len);
+    }
+
+    //Only whole sectors count as progress, a resume rewrites the partial one.
+    //A patch or compressed stream is not resumable, its offsets do not line up with the image
+    uint32_t aligned = ota_service_state.flash_written & ~(OTA_SECTOR_SIZE - 1);
+    if (ota_download_is_image() && aligned - ota_service_state.progress.offset >= OTA_RESUME_SAVE_INTERVAL) {
+        ota_service_state.progress.offset = aligned;
+        ota_progress_save(&ota_service_state.progress);
+    }
+    return ESP_OK;
+}
+
+
+/// @brief Drains full chunks into esp_ota_write, so flash erase/write overlaps the next TLS read
+static void ota_flash_task(void *pvParameter)
+{
+    ota_chunk_t chunk;
+
+    while (1) {
+        xQueueReceive(ota_service_state.full_chunks, &chunk, portMAX_DELAY);
+
+        if (chunk.len == 0) {
+            xSemaphoreGive(ota_service_state.flash_done);
+            continue;
+        }
+
+        if (ota_service_state.flash_err == ESP_OK) {
+            esp_err_t err;
+            if (ota_service_state.delta_active) {
+                err = ota_delta_feed(&ota_service_state.delta, chunk.data, chunk.len);
+            } else if (ota_service_state.compressed_active) {
+                err = lzss_decoder_feed(ota_service_state.lzss, chunk.data, chunk.len);
+            } else {
+                err = ota_image_write(chunk.data, chunk.len, NULL);
+            }
+            if (err != ESP_OK) {
+                ota_service_state.flash_err = err;
+            }
+        }
+        xQueueSend(ota_service_state.free_chunks, &chunk, portMAX_DELAY);
+    }
+}
+
+
+static int hex_value(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+
+/// @brief Parses the 64 hex digit sha256 of the manifest
+static bool parse_sha256_hex(const char *hex, uint8_t *out)
+{
+    if (strlen(hex) != HASH_LEN * 2) return false;
+
+    for (int i = 0; i < HASH_LEN; i++) {
+        int hi = hex_value(hex[2 * i]);
+        int lo = hex_value(hex[2 * i + 1]);
+        if (hi < 0 || lo < 0) return false;
+        out[i] = (uint8_t)((hi << 4) | lo);
+    }
+    return true;
+}
+
+
+/// @brief Brings the running hash up to the resume offset by hashing the prefix already in flash.
+/// The hash state itself is not persisted, flash is the record of what was written
+static esp_err_t ota_hash_flash_prefix(const esp_partition_t *update_partition, uint32_t length, uint8_t *buffer)
+{
+    for (uint32_t offset = 0; offset < length; offset += OTA_BUFFER_SIZE) {
+        uint32_t len = MIN(OTA_BUFFER_SIZE, length - offset);
+        esp_err_t err = esp_partition_read(update_partition, offset, buffer, len);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Reading back written image failed (%s)", esp_err_to_name(err));
+            return err;
+        }
+        mbedtls_sha256_update(&ota_service_state.image_sha, buffer, len);
+    }
+    return ESP_OK;
+}
+
+
+static esp_err_t ota_pipeline_start(void)
+{
+    ota_service_state.chunk_memory = malloc(OTA_BUFFER_COUNT * OTA_BUFFER_SIZE);
+    if (ota_service_state.chunk_memory == NULL) {
+        ESP_LOGE(TAG, "No memory for %d download buffers of %d bytes", OTA_BUFFER_COUNT, OTA_BUFFER_SIZE);
+        return ESP_ERR_NO_MEM;
+    }
+
+    if (ota_service_state.compressed_active) {
+        //Fixed size, the window set in Kconfig is the only RAM decompression takes
+        ota_service_state.lzss = malloc(sizeof(lzss_decoder_t));
+        if (ota_service_state.lzss == NULL) {
+            ESP_LOGE(TAG, "No memory for the %u byte decompressor", (unsigned)sizeof(lzss_decoder_t));
+            free(ota_service_state.chunk_memory);
+            ota_service_state.chunk_memory = NULL;
+            return ESP_ERR_NO_MEM;
+        }
+    }
+
+    xQueueReset(ota_service_state.free_chunks);
+    xQueueReset(ota_service_state.full_chunks);
+    for (int i = 0; i < OTA_BUFFER_COUNT; i++) {
+        ota_chunk_t chunk = { .data = ota_service_state.chunk_memory + i * OTA_BUFFER_SIZE, .len = 0 };
+        xQueueSend(ota_service_state.free_chunks, &chunk, 0);
+    }
+    ota_service_state.flash_err = ESP_OK;
+    return ESP_OK;
+}
+
+
+/// @brief Waits for the flash task to write everything queued so far, then releases the buffers
+/// @return The first flash write error, if any
+static esp_err_t ota_pipeline_finish(void)
+{
+    ota_chunk_t end = { .data = NULL, .len = 0 };
+    xQueueSend(ota_service_state.full_chunks, &end, portMAX_DELAY);
+    xSemaphoreTake(ota_service_state.flash_done, portMAX_DELAY);
+
+    //The decompressor holds back a partly filled output buffer until the end
+    if (ota_service_state.lzss != NULL) {
+        if (ota_service_state.flash_err == ESP_OK) {
+            ota_service_state.flash_err = lzss_decoder_finish(ota_service_state.lzss);
+        }
+        free(ota_service_state.lzss);
+        ota_service_state.lzss = NULL;
+    }
+
+    free(ota_service_state.chunk_memory);
+    ota_service_state.chunk_memory = NULL;
+    return ota_service_state.flash_err;
+}
+
+
+static esp_err_t ota_begin_session(const esp_partition_t *update_partition);
+
+
+/// @brief Checks the app header in the first chunk and starts the OTA session on the partition
+static esp_err_t ota_begin_from_header(const ota_chunk_t *chunk, const esp_partition_t *update_partition,
+                                       const esp_partition_t *running)
+{
+    //The header must be read as a whole not chunks (needs improvement in future). So consider it fail if data_read<header size
+    if (chunk->len <= sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t) + sizeof(esp_app_desc_t)) {
+        ESP_LOGE(TAG, "received package is not fit len");
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    esp_app_desc_t new_app_info;
+    // check current version with downloading
+    memcpy(&new_app_info, &chunk->data[sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t)], sizeof(esp_app_desc_t));
+    ESP_LOGI(TAG, "New firmware version: %s", new_app_info.version);
+
+    esp_app_desc_t running_app_info;
+    if (esp_ota_get_partition_description(running, &running_app_info) == ESP_OK) {
+        ESP_LOGI(TAG, "Running firmware version: %s", running_app_info.version);
+    }
+
+    return ota_begin_session(update_partition);
+}
+
+
+static esp_err_t ota_begin_session(const esp_partition_t *update_partition)
+{
+    //With a known size the needed range is erased once up front, otherwise sector by sector while writing
+    size_t image_size = ota_service_state.manifest.firmware_size;
+    if (image_size == 0 || image_size > update_partition->size) {
+        image_size = OTA_WITH_SEQUENTIAL_WRITES;
+    }
+
+    esp_err_t err = esp_ota_begin(update_partition, image_size, &ota_service_state.update_handle);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "esp_ota_begin failed (%s)", esp_err_to_name(err));
+        return err;
+    }
+    ESP_LOGI(TAG, "esp_ota_begin succeeded");
+    return ESP_OK;
+}
+
+
+/// @brief Receives the image into the pipeline buffers and hands each full one to the flash task.
+/// Buffers are filled completely before being queued so flash sees few, large writes
+/// @param resume_offset image offset the response starts at, 0 for a full download
+/// @param begun set once esp_ota_begin succeeded, the session then has to be ended or aborted by the caller
+static esp_err_t ota_stream_image(esp_http_client_handle_t client, const esp_partition_t *update_partition,
+                                  const esp_partition_t *running, uint32_t resume_offset,
+                                  int *image_length, bool *begun)
+{
+    ota_chunk_t chunk = { .data = NULL, .len = 0 };
+    uint8_t attempts = 0;     // a workaround to read the chunked data from the firmware url. forst 0 read length will be ignored
+    int64_t flash_wait_us = 0;
+    int64_t start_us = esp_timer_get_time();
+    esp_err_t err = ESP_OK;
+    bool done = false;
+
+    *image_length = 0;
+    *begun = false;
+    ota_service_state.flash_written = resume_offset;
+    ota_service_state.progress.offset = resume_offset;
+    //A patch or compressed stream is smaller than the image, ota_verify_image checks the decoded size instead
+    size_t expected_size = ota_download_is_image() ? ota_service_state.manifest.firmware_size : 0;
+
+    if (ota_service_state.verify_checksum) {
+        mbedtls_sha256_starts(&ota_service_state.image_sha, 0);
+        if (resume_offset > 0) {
+            xQueueReceive(ota_service_state.free_chunks, &chunk, portMAX_DELAY);
+            err = ota_hash_flash_prefix(update_partition, resume_offset, chunk.data);
+            xQueueSend(ota_service_state.free_chunks, &chunk, portMAX_DELAY);
+            chunk.data = NULL;
+            if (err != ESP_OK) return err;
+        }
+    }
+
+    while (!done) {
+        if (chunk.data == NULL) {
+            int64_t wait_start = esp_timer_get_time();
+            xQueueReceive(ota_service_state.free_chunks, &chunk, portMAX_DELAY);
+            flash_wait_us += esp_timer_get_time() - wait_start;
+            chunk.len = 0;
+        }
+
+        int data_read = esp_http_client_read(client, (char *)chunk.data + chunk.len, OTA_BUFFER_SIZE - chunk.len);
+        if (data_read < 0) {
+            ESP_LOGE(TAG, "Error: SSL data read error");
+            err = ESP_FAIL;
+            break;
+        } else if (data_read > 0) {
+            chunk.len += data_read;
+        } else {
+            /*
+             * As esp_http_client_read never returns negative error code, we rely on
+             * `errno` to check for underlying transport connectivity closure if any
+             */
+            if (attempts == 0) {     //A workaround to ignore the first 0 read incase of chunked data which is the case for firmware
+                attempts++;
+                continue;
+            }
+            if (errno == ECONNRESET || errno == ENOTCONN) {
+                ESP_LOGE(TAG, "Connection closed, errno = %d", errno);
+                err = ESP_FAIL;
+                break;
+            }
+            if (esp_http_client_is_complete_data_received(client) == true) {
+                ESP_LOGI(TAG, "Connection closed bcz completed");
+                done = true;
+            }
+        }
+
+        //More than the manifest announced, this is not the image it describes
+        if (expected_size > 0 && resume_offset + *image_length + chunk.len > expected_size) {
+            ESP_LOGE(TAG, "Image exceeds the manifest size of %u bytes", (unsigned)expected_size);
+            err = ESP_ERR_INVALID_SIZE;
+            break;
+        }
+
+        if (chunk.len == OTA_BUFFER_SIZE || (done && chunk.len > 0)) {
+            if (*begun == false) {
+                if (!ota_download_is_image()) {
+                    //The decoder's output is checked by esp_ota_write itself, the download has no app header to look at
+                    err = ota_begin_session(update_partition);
+                    if (ota_service_state.delta_active) {
+                        ota_delta_init(&ota_service_state.delta, running, ota_image_write, NULL);
+                    } else {
+                        lzss_decoder_init(ota_service_state.lzss, ota_image_write, NULL);
+                    }
+                    if (err == ESP_OK) ota_progress_clear();
+                } else if (resume_offset > 0) {
+                    //The header went out with the earlier attempt, carry on writing after what is in flash
+                    err = esp_ota_resume(update_partition, OTA_WITH_SEQUENTIAL_WRITES, resume_offset,
+                                         &ota_service_state.update_handle);
+                    if (err != ESP_OK) ESP_LOGE(TAG, "esp_ota_resume failed (%s)", esp_err_to_name(err));
+                } else {
+                    err = ota_begin_from_header(&chunk, update_partition, running);
+                    //Progress of an earlier attempt no longer describes what is in flash
+                    if (err == ESP_OK) ota_progress_clear();
+                }
+                if (err != ESP_OK) break;
+                *begun = true;
+            }
+            //A write already failed, no point downloading the rest
+            if (ota_service_state.flash_err != ESP_OK) {
+                err = ota_service_state.flash_err;
+                break;
+            }
+            *image_length += chunk.len;
+            metrics_counter_add(ota_service_state.bytes_written, chunk.len);
+            xQueueSend(ota_service_state.full_chunks, &chunk, portMAX_DELAY);
+            chunk.data = NULL;
+            ESP_LOGD(TAG, "Written image length %d", *image_length);
+        }
+    }
+
+    //Hand back a buffer that was being filled when the loop stopped
+    if (chunk.data != NULL) {
+        xQueueSend(ota_service_state.free_chunks, &chunk, portMAX_DELAY);
+    }
+
+    int64_t elapsed_us = esp_timer_get_time() - start_us;
+    if (err == ESP_OK && elapsed_us > 0) {
+        uint32_t throughput = (uint32_t)((int64_t)*image_length * 1000000 / elapsed_us);
+        ESP_LOGI(TAG, "Downloaded %d bytes in %lld ms, %lu B/s, %lld ms waiting for flash",
+                 *image_length, (long long)(elapsed_us / 1000), (unsigned long)throughput, (long long)(flash_wait_us / 1000));
+        metrics_gauge_set(ota_service_state.last_duration_ms, (int32_t)(elapsed_us / 1000));
+        metrics_gauge_set(ota_service_state.last_throughput, (int32_t)throughput);
+    }
+    return err;
+}
+
+
+/// @brief Compares the written image with the size and sha256 announced by the manifest
+static esp_err_t ota_verify_image(uint32_t image_length)
+{
+    size_t expected_size = ota_service_state.manifest.firmware_size;
+    if (expected_size > 0 && image_length != expected_size) {
+        ESP_LOGE(TAG, "Image is %lu bytes, manifest says %u", (unsigned long)image_length, (unsigned)expected_size);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    if (!ota_service_state.verify_checksum) {
+        return ESP_OK;
+    }
+
+    uint8_t sha[HASH_LEN];
+    mbedtls_sha256_finish(&ota_service_state.image_sha, sha);
+    if (memcmp(sha, ota_service_state.expected_sha, HASH_LEN) != 0) {
+        print_sha256(sha, "Image sha256");
+        print_sha256(ota_service_state.expected_sha, "Manifest sha256");
+        ESP_LOGE(TAG, "Checksum mismatch, image discarded");
+        return ESP_ERR_INVALID_CRC;
+    }
+    ESP_LOGI(TAG, "Image sha256 matches the manifest");
+    return ESP_OK;
+}
+
+
 static void ota_task(void *pvParameter)
 {
     esp_err_t err=0;
@@ -361,18 +1166,28 @@ static void ota_task(void *pvParameter)
 
 
 
+    ota_schedule_init();
+    bool checked = false;
+
     while(1){
-    
-        //Wait till either signal arrives or time expires
-        BaseType_t sem_result = xSemaphoreTake( ota_service_state.start_update,pdMS_TO_TICKS(24UL * 60UL * 60UL * 1000UL) );// 24h 
 
-        if (sem_result != pdTRUE) {
-            ESP_LOGI(TAG, "24 hours passed, running update.");
-        } else {
+        //Every way out of the previous iteration lands here, its outcome decides the next wait
+        if (checked) {
+            ota_scheduler_report(&ota_service_state.scheduler, ota_service_state.check_result);
+            checked = false;
+        }
+
+        //Wait till either signal arrives or the scheduled check is due
+        if (ota_schedule_wait()) {
             ESP_LOGI(TAG, "Semaphore signaled, running update.");
+        } else {
+            ESP_LOGI(TAG, "Scheduled check, running update.");
         }
+        checked = true;
+        ota_service_state.check_result = OTA_CHECK_OK;
 
-        //If validation pending then go back
+        //If validation pending then go back. ota_set_valid starts the check once it is decided,
+        //until then the schedule simply moves on a period
         if (ota_service_state.validation_pending==true)
         {
             ota_service_state.update_pending=true;
@@ -380,12 +1195,16 @@ static void ota_task(void *pvParameter)
         }
         
         ota_service_state.update_pending=false;
+        metrics_counter_add(ota_service_state.checks,1);
         
         esp_err_t err = fetch_ota_manifest(manifest_url, manifest);
 
-        //Skip if manifest not available and wait again
-        if(err!=ESP_OK)
+        //Skip if manifest not available and wait again. Only a bad response or manifest
+        //is the server's fault, anything else is the network and worth a quick retry
+        if(err!=ESP_OK){
+            ota_check_failed(err == ESP_ERR_INVALID_RESPONSE ? OTA_CHECK_FAILED : OTA_CHECK_TRANSIENT);
             continue;
+        }
 
         //if last used invalid ap detected then skip
         if(detect_last_invalid_app(manifest->version)==ERR_OTA_INVALID_VERSION){
@@ -397,15 +1216,55 @@ static void ota_task(void *pvParameter)
         if(!is_update_available(manifest->version))
             continue;
 
-        ESP_LOGI(TAG,"url %s",manifest->firmware_url);
+        update_partition = esp_ota_get_next_update_partition(NULL);
+        //assert(update_partition != NULL);
+        //Gp back to waiting if update partition is NULL
+        if(update_partition == NULL){
+            continue;
+        }
+
+        ota_service_state.verify_checksum = parse_sha256_hex(manifest->checksum, ota_service_state.expected_sha);
+        if (!ota_service_state.verify_checksum) {
+            ESP_LOGW(TAG, "Manifest has no usable checksum, relying on image validation only");
+        }
+
+        if (strncmp(ota_service_state.fallback_version, manifest->version, sizeof(ota_service_state.fallback_version)) != 0) {
+            ota_service_state.delta_failed = false;
+            ota_service_state.compressed_failed = false;
+        }
+
+        //A patch against the running version is far smaller than the image, use it unless one already failed
+        const char *image_url = manifest->firmware_url;
+        ota_service_state.delta_active = false;
+        ota_service_state.compressed_active = false;
+        if (manifest->patch_url[0] != '\0' && !ota_service_state.delta_failed &&
+            strncmp(manifest->patch_base, esp_app_get_description()->version, sizeof(manifest->patch_base)) == 0) {
+            ota_service_state.delta_active = true;
+            image_url = manifest->patch_url;
+            ESP_LOGI(TAG, "Delta update from %s", manifest->patch_base);
+        } else if (manifest->compressed_url[0] != '\0' && !ota_service_state.compressed_failed) {
+            //Decompressed between the download and esp_ota_write
+            ota_service_state.compressed_active = true;
+            image_url = manifest->compressed_url;
+            ESP_LOGI(TAG, "Compressed update");
+        }
+
+        //An earlier attempt at this image that dropped part way is continued rather than started over
+        uint32_t resume_offset = ota_download_is_image() ? ota_resume_offset(manifest->version, update_partition) : 0;
+
+        ESP_LOGI(TAG,"url %s",image_url);
         
-        esp_http_client_set_url(client,manifest->firmware_url);
+        esp_http_client_set_url(client,image_url);
         //This one is perform, beacuse open is not working in blocking way with event handler
+        ota_phase_probe_t probe;
+        ota_phase_begin(&probe);
         err = esp_http_client_perform(client);
+        ota_phase_end(OTA_PHASE_IMAGE, &probe);
         //If unable to open connection then too skip an go back to waiting
         if (err != ESP_OK) {
             ESP_LOGE(TAG, "Failed to open HTTP connection: %s", esp_err_to_name(err));
             esp_http_client_close(client);
+            ota_check_failed(OTA_CHECK_TRANSIENT);
             continue;
             //task_fatal_error();
         }
@@ -472,29 +1331,43 @@ static void ota_task(void *pvParameter)
             
 
 
+            if (resume_offset > 0) {
+                char range[32];
+                snprintf(range, sizeof(range), "bytes=%lu-", (unsigned long)resume_offset);
+                esp_http_client_set_header(client, "Range", range);
+                ESP_LOGI(TAG, "Resuming download at %lu", (unsigned long)resume_offset);
+            }
+
             // Now open the redirected URL
+            ota_phase_begin(&probe);
             err = esp_http_client_open(client, 0);
+            ota_phase_end(OTA_PHASE_REDIRECT, &probe);
+            //The client is reused for the manifest, the range must not stick to it
+            esp_http_client_delete_header(client, "Range");
             //Clear it because ota firmware will be copied in it
             memset(ota_service_state.response_buffer, 0, sizeof(ota_service_state.response_buffer));
 
             if (err != ESP_OK) {
                 ESP_LOGE(TAG, "Failed to open redirected connection: %s", esp_err_to_name(err));
                 esp_http_client_close(client);
+                ota_check_failed(OTA_CHECK_TRANSIENT);
                 continue;
             }
             
-            int status_code = esp_http_client_get_status_code(client);
             int content_length = esp_http_client_fetch_headers(client);
+            int status_code = esp_http_client_get_status_code(client);
+
+            //A server that ignores the range sends the whole image, so start over
+            if (resume_offset > 0 && status_code != 206) {
+                ESP_LOGW(TAG, "Range not honoured (status %d), downloading the whole image", status_code);
+                resume_offset = 0;
+            }
             ESP_LOGI(TAG, "why not coming");
             ESP_LOGI(TAG, "After redirect - Status: %d, Content-Length: %d", status_code, content_length);
         }
-        
-        
-        update_partition = esp_ota_get_next_update_partition(NULL);
-        //assert(update_partition != NULL);
-        //Gp back to waiting if update partition is NULL
-        if(update_partition == NULL){
-            continue;
+        else {
+            //No redirect, the perform above already consumed the response so a range cannot apply
+            resume_offset = 0;
         }
 
 
@@ -502,107 +1375,76 @@ static void ota_task(void *pvParameter)
                 update_partition->subtype, update_partition->address);
 
         int binary_file_length = 0;
-        /*deal with all receive packet*/
-        bool image_header_was_checked = false;
-        bool read_success=false;
-        uint8_t attempts=0;     // a workaround to read the chunked data from the firmware url. forst 0 read length will be ignored
-        while (1) {
-            int data_read = esp_http_client_read(client, ota_write_data, MAX_HTTP_RECV_BUFFER);
-            //ESP_LOGI(TAG,"data read length %d",data_read);
-            if (data_read < 0) {
-                ESP_LOGE(TAG, "Error: SSL data read error");
-                read_success=false;
-                esp_http_client_close(client);
-                //Actually the policy is to continue but continue in this nested, so break and then continue
-                break;
-                //task_fatal_error();
-            } else if (data_read > 0) {
-                if (image_header_was_checked == false) {
-                    esp_app_desc_t new_app_info;
-                    if (data_read > sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t) + sizeof(esp_app_desc_t)){
-                        // check current version with downloading
-                        memcpy(&new_app_info, &ota_write_data[sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t)], sizeof(esp_app_desc_t));
-                        ESP_LOGI(TAG, "New firmware version: %s", new_app_info.version);
-
-                        esp_app_desc_t running_app_info;
-                        if (esp_ota_get_partition_description(running, &running_app_info) == ESP_OK) {
-                            ESP_LOGI(TAG, "Running firmware version: %s", running_app_info.version);
-                        }
-
-                        image_header_was_checked = true;
-
-                        err = esp_ota_begin(update_partition, OTA_WITH_SEQUENTIAL_WRITES, &update_handle);
-                        if (err != ESP_OK) {
-                            ESP_LOGE(TAG, "esp_ota_begin failed (%s)", esp_err_to_name(err));
-                            read_success=false;
-                            esp_http_client_close(client);
-                            //Actually the policy is to continue but continue in this nested, so break and then continue
-                            break;
-                            //task_fatal_error();
-                        }
-                        ESP_LOGI(TAG, "esp_ota_begin succeeded");
-                    } 
-					//The header must be read as a whole not chunks (needs improvement in future). So consider it fail if data_read<header size
-					else {
-                        ESP_LOGE(TAG, "received package is not fit len");
-                        read_success=false;
-                        esp_http_client_close(client);
-						break;
-                    }
-                }
-				
-				//If the break statement didnt run it means data read > header size so write as ota
-                err = esp_ota_write( update_handle, (const void *)ota_write_data, data_read);
-                if (err != ESP_OK) {
-                    read_success=false;
-                    esp_http_client_close(client);
-                    esp_ota_abort(update_handle);
-					break;
-                }
-                binary_file_length += data_read;
-                ESP_LOGD(TAG, "Written image length %d", binary_file_length);
-            } else if (data_read == 0) {
-            /*
-                * As esp_http_client_read never returns negative error code, we rely on
-                * `errno` to check for underlying transport connectivity closure if any
-                */
-                if(attempts==0){     //A workaround to ignore the first 0 read incase of chunked data which is the case for firmware
-                    attempts++;
-                    continue;
-                }
+        bool ota_begun = false;
 
-                if (errno == ECONNRESET || errno == ENOTCONN) {
-                    read_success=false;
-                    ESP_LOGE(TAG, "Connection closed, errno = %d", errno);
-                    break;
-                }
-                if (esp_http_client_is_complete_data_received(client) == true) {
-                    read_success=true;
-                    ESP_LOGI(TAG, "Connection closed bcz completed");
-                    break;
-                }
-            }
+        strlcpy(ota_service_state.progress.version, manifest->version, sizeof(ota_service_state.progress.version));
+        ota_service_state.progress.partition_address = update_partition->address;
 
-            
-            
+        if (ota_pipeline_start() != ESP_OK) {
+            esp_http_client_close(client);
+            ota_check_failed(OTA_CHECK_FAILED);
+            continue;
         }
 
-        //If there was read_success=failure in the while loop and thus break statement which meant skip so continue
-        if(read_success==false){
-            continue;
+        err = ota_stream_image(client, update_partition, running, resume_offset, &binary_file_length, &ota_begun);
+        //Always wait for the flash task, even on failure, so the buffers can be freed
+        esp_err_t flash_err = ota_pipeline_finish();
+        if (err == ESP_OK) {
+            err = flash_err;
         }
-        
-            ESP_LOGI(TAG, "Total Write binary data length: %d", binary_file_length);
-        if (esp_http_client_is_complete_data_received(client) != true) {
+        bool decode_failed = ota_service_state.flash_err != ESP_OK;
+        if (err == ESP_OK && ota_service_state.delta_active) {
+            err = ota_delta_finish(&ota_service_state.delta);
+            decode_failed = err != ESP_OK;
+        }
+        update_handle = ota_service_state.update_handle;
+
+        if (err == ESP_OK && esp_http_client_is_complete_data_received(client) != true) {
             ESP_LOGE(TAG, "Error in receiving complete file");
-        
+            err = ESP_FAIL;
+        }
+
+        //Checked before esp_ota_end, a bad image never gets as far as validation or the boot partition
+        if (err == ESP_OK) {
+            err = ota_verify_image(ota_service_state.flash_written);
+        }
+
+        //Stream, flash or completeness failure. Skip and go back to waiting
+        if (err != ESP_OK) {
             esp_http_client_close(client);
-            esp_ota_abort(update_handle);
+            if (ota_begun) {
+                esp_ota_abort(update_handle);
+            }
+            //Saved progress survives a dropped connection, but not flash that could not be written
+            //or an image that turned out to be the wrong one
+            bool broken = ota_service_state.flash_err != ESP_OK || err == ESP_ERR_INVALID_CRC || err == ESP_ERR_INVALID_SIZE;
+            if (broken) {
+                ota_progress_clear();
+            }
+            //Only the patch itself going wrong falls back, a dropped connection just resumes it
+            decode_failed |= err == ESP_ERR_INVALID_CRC;
+            bool fallback = decode_failed && (ota_service_state.delta_active || ota_service_state.compressed_active);
+            if (ota_service_state.delta_active && decode_failed) {
+                ESP_LOGW(TAG, "Delta update failed, the next attempt downloads the full image");
+                ota_service_state.delta_failed = true;
+                strlcpy(ota_service_state.fallback_version, manifest->version, sizeof(ota_service_state.fallback_version));
+            }
+            if (ota_service_state.compressed_active && decode_failed) {
+                ESP_LOGW(TAG, "Compressed update failed, the next attempt downloads the raw image");
+                ota_service_state.compressed_failed = true;
+                strlcpy(ota_service_state.fallback_version, manifest->version, sizeof(ota_service_state.fallback_version));
+            }
+            //A dropped download resumes, and a failed patch falls back, on the quick retry. A patch that
+            //did not decode also sets flash_err, so it counts as broken but still falls back quickly.
+            //An image that cannot be written or is not the one announced waits for the backoff
+            ota_check_failed(ota_scheduler_download_result(broken, fallback));
             continue;
-            //break;
-            //task_fatal_error();
         }
 
+        ESP_LOGI(TAG, "Total Write binary data length: %d (resumed at %lu)", binary_file_length, (unsigned long)resume_offset);
+
+        //Whatever the outcome, this image is not resumed any more
+        ota_progress_clear();
         err = esp_ota_end(update_handle);
         if (err != ESP_OK) {
             if (err == ESP_ERR_OTA_VALIDATE_FAILED) {
@@ -611,6 +1453,7 @@ static void ota_task(void *pvParameter)
                 ESP_LOGE(TAG, "esp_ota_end failed (%s)!", esp_err_to_name(err));
             }
             esp_http_client_close(client);
+            ota_check_failed(OTA_CHECK_FAILED);
             //http_cleanup(client);
             //task_fatal_error();
             continue;
@@ -619,11 +1462,16 @@ static void ota_task(void *pvParameter)
         err = esp_ota_set_boot_partition(update_partition);
         if (err != ESP_OK) {
             ESP_LOGE(TAG, "esp_ota_set_boot_partition failed (%s)!", esp_err_to_name(err));
+            ota_check_failed(OTA_CHECK_FAILED);
             continue;
             //http_cleanup(client);
             //task_fatal_error();
         }
         ESP_LOGI(TAG, "Prepare to restart system!");
+        ota_service_state.delta_failed = false;
+        ota_service_state.compressed_failed = false;
+        ota_service_state.fallback_version[0] = '\0';
+        metrics_counter_add(ota_service_state.updates,1);
         OTA_SERVICE_post_event(OTA_SERVICE_ROUTINE_EVENT_REBOOT_REQUIRED,NULL,0);
         //esp_restart();
         //return ;
@@ -688,6 +1536,11 @@ esp_err_t ota_service_init(){
     config.disable_auto_redirect=true;
     config.event_handler=_http_event_handler;
     config.user_data=&ota_service_state;
+#if CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS
+    //The session of the last connection is kept and offered on the next one, a server that still
+    //knows it skips the certificate exchange and key agreement, the costly part of the handshake
+    config.save_client_session=true;
+#endif
 
 
     esp_http_client_handle_t* client = &ota_service_state.client;
@@ -708,13 +1561,44 @@ esp_err_t ota_service_init(){
 
 
      ota_service_state.start_update=xSemaphoreCreateBinary();
+    mbedtls_sha256_init(&ota_service_state.image_sha);
 
     if(ota_service_state.start_update==NULL)
         return ERR_OTA_SERVICE_INIT_FAIL;
 
+    //Only the queues live for good, the buffers are allocated when an update starts
+    ota_service_state.free_chunks=xQueueCreate(OTA_BUFFER_COUNT,sizeof(ota_chunk_t));
+    ota_service_state.full_chunks=xQueueCreate(OTA_BUFFER_COUNT+1,sizeof(ota_chunk_t));    //+1 for the end marker
+    ota_service_state.flash_done=xSemaphoreCreateBinary();
+    if(ota_service_state.free_chunks==NULL || ota_service_state.full_chunks==NULL || ota_service_state.flash_done==NULL)
+        return ERR_OTA_SERVICE_INIT_FAIL;
+
+    ota_service_state.checks=metrics_register_counter("ota_checks_total",NULL,"Manifest checks");
+    ota_service_state.not_modified=metrics_register_counter("ota_manifest_not_modified_total",NULL,"Manifest checks answered 304 from the cache");
+    ota_service_state.failures=metrics_register_counter("ota_failures_total",NULL,"Checks or downloads abandoned on an error");
+    ota_service_state.bytes_written=metrics_register_counter("ota_bytes_written_total",NULL,"Firmware bytes written to flash");
+    ota_service_state.updates=metrics_register_counter("ota_updates_total",NULL,"Updates installed and awaiting reboot");
+    ota_service_state.last_duration_ms=metrics_register_gauge("ota_last_download_ms",NULL,"Wall clock time of the last firmware download");
+    ota_service_state.last_throughput=metrics_register_gauge("ota_last_download_bytes_per_second",NULL,"Throughput of the last firmware download");
+    //One family after the other, so each is a single block on /metrics
+    for(int i=0;i<OTA_PHASE_MAX;i++){
+        ota_service_state.connect_ms[i]=metrics_register_histogram("ota_connect_ms",ota_phase_labels[i],
+                                                                   "Connect, TLS handshake and request of an update check connection",
+                                                                   connect_bounds_ms,
+                                                                   sizeof(connect_bounds_ms)/sizeof(connect_bounds_ms[0]));
+    }
+    for(int i=0;i<OTA_PHASE_MAX;i++){
+        ota_service_state.connect_heap[i]=metrics_register_gauge("ota_connect_heap_peak_bytes",ota_phase_labels[i],
+                                                                 "Heap taken at the low point of the last connect");
+    }
+
  
     //Task creation at end so that the client handle and semaphore are created before it
     BaseType_t ret;
+    ret=xTaskCreate(&ota_flash_task, "ota_flash", 4096, NULL, 5, NULL);
+    if(ret==pdFAIL)
+        return ERR_OTA_SERVICE_INIT_FAIL;
+
     ret=xTaskCreate(&ota_task, "ota_task", 8192, NULL, 5, NULL);
     if(ret==pdFAIL)
         return ERR_OTA_SERVICE_INIT_FAIL;
@@ -0,0 +1,148 @@
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include "semver.h"
+
+
+static bool parse_number(const char **p, uint32_t *value)
+{
+    if (!isdigit((unsigned char)**p)) return false;
+
+    uint32_t n = 0;
+    while (isdigit((unsigned char)**p)) {
+        n = n * 10 + (**p - '0');
+        (*p)++;
+    }
+    *value = n;
+    return true;
+}
+
+
+static bool all_digits(const char *s, size_t len)
+{
+    if (len == 0) return false;
+    for (size_t i = 0; i < len; i++) {
+        if (!isdigit((unsigned char)s[i])) return false;
+    }
+    return true;
+}
+
+
+static bool all_hex(const char *s, size_t len)
+{
+    if (len == 0) return false;
+    for (size_t i = 0; i < len; i++) {
+        if (!isxdigit((unsigned char)s[i])) return false;
+    }
+    return true;
+}
+
+
+esp_err_t semver_parse(const char *text, semver_t *version)
+{
+    if (text == NULL || version == NULL) return ESP_ERR_INVALID_ARG;
+
+    memset(version, 0, sizeof(*version));
+    const char *p = text;
+    if (*p == 'v' || *p == 'V') p++;
+
+    //Missing minor or patch count as 0, "v2" is 2.0.0
+    if (!parse_number(&p, &version->major)) return ESP_ERR_INVALID_ARG;
+    if (*p == '.') {
+        p++;
+        if (!parse_number(&p, &version->minor)) return ESP_ERR_INVALID_ARG;
+        if (*p == '.') {
+            p++;
+            if (!parse_number(&p, &version->patch)) return ESP_ERR_INVALID_ARG;
+        }
+    }
+
+    if (*p != '\0' && *p != '-' && *p != '+') return ESP_ERR_INVALID_ARG;
+    if (*p != '-') return ESP_OK;
+    p++;
+
+    //The suffix up to build metadata. CI appends -dev to git describe for untagged builds, it is
+    //only dropped with -dirty or -N-gHASH before it so a tag like v1.2.3-rc.1-dev keeps its pre-release
+    size_t len = strcspn(p, "+");
+    bool ci_dev = len >= 4 && strncmp(&p[len - 4], "-dev", 4) == 0;
+    if (ci_dev) len -= 4;
+
+    bool described = false;
+    if (len >= 6 && strncmp(&p[len - 6], "-dirty", 6) == 0) {
+        len -= 6;
+        described = true;
+    } else if (len == 5 && strncmp(p, "dirty", 5) == 0) {
+        return ESP_OK;
+    }
+
+    //git describe's -N-gHASH at the end
+    const char *g = NULL;
+    for (const char *q = p + len - 1; q > p; q--) {
+        if (*q == '-') { g = q; break; }
+    }
+    if (g != NULL && g[1] == 'g' && all_hex(g + 2, p + len - g - 2)) {
+        const char *n = g - 1;
+        while (n > p && *n != '-') n--;
+        const char *digits = (*n == '-') ? n + 1 : n;
+        if (all_digits(digits, g - digits)) {
+            version->commits = strtoul(digits, NULL, 10);
+            len = (*n == '-') ? (size_t)(n - p) : 0;
+            described = true;
+        }
+    }
+    if (ci_dev && !described) len += 4;
+
+    if (len >= SEMVER_PRERELEASE_LENGTH) len = SEMVER_PRERELEASE_LENGTH - 1;
+    memcpy(version->prerelease, p, len);
+    version->prerelease[len] = '\0';
+    return ESP_OK;
+}
+
+
+/// @brief Dot separated identifiers, numeric ones compare numerically and below alphanumeric ones
+static int compare_prerelease(const char *a, const char *b)
+{
+    //A release is newer than any of its pre-releases
+    if (a[0] == '\0' || b[0] == '\0') {
+        return (a[0] == '\0') - (b[0] == '\0');
+    }
+
+    while (*a != '\0' && *b != '\0') {
+        size_t la = strcspn(a, ".");
+        size_t lb = strcspn(b, ".");
+        bool na = all_digits(a, la);
+        bool nb = all_digits(b, lb);
+
+        int c;
+        if (na && nb) {
+            unsigned long va = strtoul(a, NULL, 10);
+            unsigned long vb = strtoul(b, NULL, 10);
+            c = (va > vb) - (va < vb);
+        } else if (na != nb) {
+            c = na ? -1 : 1;
+        } else {
+            c = strncmp(a, b, la < lb ? la : lb);
+            if (c == 0) c = (la > lb) - (la < lb);
+        }
+        if (c != 0) return c;
+
+        a += la + (a[la] == '.');
+        b += lb + (b[lb] == '.');
+    }
+
+    //More identifiers win when all before are equal
+    return (*a != '\0') - (*b != '\0');
+}
+
+
+int semver_compare(const semver_t *a, const semver_t *b)
+{
+    if (a->major != b->major) return a->major > b->major ? 1 : -1;
+    if (a->minor != b->minor) return a->minor > b->minor ? 1 : -1;
+    if (a->patch != b->patch) return a->patch > b->patch ? 1 : -1;
+
+    int c = compare_prerelease(a->prerelease, b->prerelease);
+    if (c != 0) return c;
+
+    return (a->commits > b->commits) - (a->commits < b->commits);
+}
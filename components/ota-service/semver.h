@@ -0,0 +1,37 @@
+#ifndef SEMVER_H
+#define SEMVER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+
+
+/*
+ * Versions as produced by version.cmake: a tag, optionally followed by git describe's distance,
+ * e.g. v1.9.0, 1.10.0-beta.2, v1.2.3-4-g1a2b3c4, v1.2.3-rc.1-4-g1a2b3c4-dirty, and CI dev builds
+ * which append -dev to that, v1.2.3-4-g1a2b3c4-dev or v1.2.3-4-g1a2b3c4-dirty-dev
+ *
+ * Ordering follows semver (numbers numerically, a pre-release below its release, pre-release
+ * identifiers compared field by field), extended for git describe: a build N commits past a tag
+ * is newer than the tag and older than the next one. -dirty, CI's -dev and +build metadata are
+ * ignored.
+ */
+
+#define SEMVER_PRERELEASE_LENGTH    32
+
+typedef struct {
+    uint32_t major;
+    uint32_t minor;
+    uint32_t patch;
+    char prerelease[SEMVER_PRERELEASE_LENGTH];  //Without the leading '-', empty for a release
+    uint32_t commits;                           //Past the tag, from git describe
+} semver_t;
+
+
+/// @return ESP_ERR_INVALID_ARG if text does not start with a version number (a bare commit hash for instance)
+esp_err_t semver_parse(const char* text, semver_t* version);
+
+/// @return negative, zero or positive as a is older than, the same as or newer than b
+int semver_compare(const semver_t* a, const semver_t* b);
+
+#endif
@@ -0,0 +1,480 @@
+#include "log_segments.h"
+#include "esp_log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "sdkconfig.h"
+#if CONFIG_SD_LOG_COMPRESS
+#include "lzss.h"
+#endif
+
+#define SEGMENT_COUNT   CONFIG_SD_LOG_SEGMENT_COUNT
+
+// Binary records get their own set of files, a text and a binary build never share segments.
+// Nor do a compressed and a plain one, each has its own index too
+#if CONFIG_BINARY_LOG
+#define SEGMENT_PREFIX  "BLG"
+#else
+#define SEGMENT_PREFIX  "LOG"
+#endif
+#if CONFIG_SD_LOG_COMPRESS
+#define SEGMENT_EXT     "LZS"
+#define INDEX_EXT       "LZI"
+#elif CONFIG_BINARY_LOG
+#define SEGMENT_EXT     "BIN"
+#define INDEX_EXT       "BIN"
+#else
+#define SEGMENT_EXT     "TXT"
+#define INDEX_EXT       "BIN"
+#endif
+#define INDEX_PATH      CONFIG_SD_MOUNT_POINT "/" SEGMENT_PREFIX "INDEX." INDEX_EXT
+#define INDEX_MAGIC     0x5844494cUL    // "LIDX"
+
+typedef struct {
+    uint32_t magic;
+    uint32_t count;
+} index_header_t;
+
+#if CONFIG_SD_LOG_COMPRESS
+/* Fed a byte at a time, one byte completes at most two back references on top of what the decoder
+ * had buffered, so that is all the decoded data ever waiting here
+ */
+#define PENDING_SIZE    (LZSS_OUTPUT_BUFFER_SIZE + 2 * (1 << LZSS_LOOKAHEAD_BITS))
+
+struct log_reader_lzss {
+    lzss_decoder_t decoder;
+    uint64_t skip;              // Decoded bytes still to drop to reach the offset asked for
+    bool finished;              // The whole segment went through the decoder
+    size_t in_len, in_pos;
+    size_t pending_len, pending_pos;
+    uint8_t in[256];
+    uint8_t pending[PENDING_SIZE];
+};
+#endif
+
+static log_segment_t s_segments[SEGMENT_COUNT];
+static size_t s_count = 0;
+static SemaphoreHandle_t s_lock = NULL;     // The log task changes the index while the HTTP server reads it
+
+
+void log_segments_path(uint32_t seq, char *path, size_t size)
+{
+    snprintf(path, size, CONFIG_SD_MOUNT_POINT "/" SEGMENT_PREFIX "%05lu." SEGMENT_EXT, (unsigned long)seq);
+}
+
+
+static bool index_save(void)
+{
+    int fd = open(INDEX_PATH, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+
+    index_header_t header = { .magic = INDEX_MAGIC, .count = s_count };
+    size_t len = s_count * sizeof(log_segment_t);
+    bool ok = write(fd, &header, sizeof(header)) == sizeof(header) &&
+              write(fd, s_segments, len) == (ssize_t)len &&
+              fsync(fd) == 0;
+    close(fd);
+    return ok;
+}
+
+
+static bool index_read(void)
+{
+    int fd = open(INDEX_PATH, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    index_header_t header;
+    bool ok = read(fd, &header, sizeof(header)) == sizeof(header) &&
+              header.magic == INDEX_MAGIC && header.count <= SEGMENT_COUNT;
+    if (ok) {
+        size_t len = header.count * sizeof(log_segment_t);
+        ok = read(fd, s_segments, len) == (ssize_t)len;
+        s_count = header.count;
+    }
+    close(fd);
+
+    for (size_t i = 1; ok && i < s_count; i++) {
+        ok = s_segments[i].seq > s_segments[i - 1].seq;
+    }
+    return ok;
+}
+
+
+/* A lost or torn index is rebuilt from the files, only the timestamps are gone.
+ * Compressed segments count their file size here, so offsets only approximate the log's after a rebuild
+ */
+static void index_rebuild(void)
+{
+    s_count = 0;
+
+    DIR *dir = opendir(CONFIG_SD_MOUNT_POINT);
+    if (dir == NULL) {
+        return;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        unsigned long seq;
+        char ext[4];
+        if (sscanf(entry->d_name, SEGMENT_PREFIX "%5lu.%3s", &seq, ext) != 2 || strcmp(ext, SEGMENT_EXT) != 0 || seq == 0) {
+            continue;
+        }
+
+        // Insertion keeps them sorted, the newest SEGMENT_COUNT win
+        size_t i = s_count;
+        if (s_count == SEGMENT_COUNT) {
+            if (seq < s_segments[0].seq) {
+                continue;
+            }
+            memmove(&s_segments[0], &s_segments[1], (--s_count) * sizeof(log_segment_t));
+            i = s_count;
+        }
+        while (i > 0 && s_segments[i - 1].seq > seq) {
+            s_segments[i] = s_segments[i - 1];
+            i--;
+        }
+        s_segments[i] = (log_segment_t){ .seq = seq };
+        s_count++;
+    }
+    closedir(dir);
+
+    uint64_t offset = 0;
+    for (size_t i = 0; i < s_count; i++) {
+        char path[LOG_SEGMENT_PATH_MAX];
+        struct stat st;
+        log_segments_path(s_segments[i].seq, path, sizeof(path));
+        s_segments[i].offset = offset;
+        offset += (stat(path, &st) == 0) ? st.st_size : 0;
+    }
+    if (s_count > 0) {
+        ESP_LOGW("SD_LOG", "Log index rebuilt from %u segments", (unsigned)s_count);
+    }
+    index_save();
+}
+
+
+bool log_segments_load(void)
+{
+    if (s_lock == NULL) {
+        s_lock = xSemaphoreCreateMutex();
+        if (s_lock == NULL) {
+            return false;
+        }
+    }
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    if (!index_read()) {
+        index_rebuild();
+    }
+    xSemaphoreGive(s_lock);
+    return true;
+}
+
+
+bool log_segments_add(uint32_t first_time, uint64_t offset, log_segment_t *added)
+{
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+
+    if (s_count == SEGMENT_COUNT) {
+        char path[LOG_SEGMENT_PATH_MAX];
+        log_segments_path(s_segments[0].seq, path, sizeof(path));
+        unlink(path);
+        memmove(&s_segments[0], &s_segments[1], (--s_count) * sizeof(log_segment_t));
+    }
+
+    uint32_t seq = (s_count > 0) ? s_segments[s_count - 1].seq + 1 : 1;
+    if (seq > 99999) {
+        seq = 1;    // Out of 8.3 names, the log starts over
+        s_count = 0;
+    }
+    s_segments[s_count] = (log_segment_t){ .seq = seq, .first_time = first_time, .offset = offset };
+    *added = s_segments[s_count++];
+
+    bool ok = index_save();
+    xSemaphoreGive(s_lock);
+    return ok;
+}
+
+
+bool log_segments_newest(log_segment_t *seg)
+{
+    if (s_lock == NULL) {
+        return false;
+    }
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    bool found = s_count > 0;
+    if (found) {
+        *seg = s_segments[s_count - 1];
+    }
+    xSemaphoreGive(s_lock);
+    return found;
+}
+
+
+size_t log_segments_list(log_segment_t *out, size_t max)
+{
+    if (s_lock == NULL) {
+        return 0;
+    }
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    size_t n = s_count < max ? s_count : max;
+    memcpy(out, s_segments, n * sizeof(log_segment_t));
+    xSemaphoreGive(s_lock);
+    return n;
+}
+
+
+bool log_segments_find(time_t t, log_segment_t *seg)
+{
+    if (s_lock == NULL) {
+        return false;
+    }
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    bool found = s_count > 0;
+    if (found) {
+        size_t i = s_count - 1;
+        // A segment without a time could start anywhere, stepping past it only reads more.
+        // Lines of the second a segment starts in can still be at the end of the one before
+        while (i > 0 && (s_segments[i].first_time == 0 || (time_t)s_segments[i].first_time >= t)) {
+            i--;
+        }
+        *seg = s_segments[i];
+    }
+    xSemaphoreGive(s_lock);
+    return found;
+}
+
+
+bool log_segments_range(time_t since, time_t until, uint64_t *start, uint64_t *end)
+{
+    if (s_lock == NULL) {
+        return false;
+    }
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    bool found = s_count > 0;
+    if (found) {
+        *start = s_segments[0].offset;
+        *end = UINT64_MAX;
+
+        // The last segment starting before since holds it, the one before also has lines of the second it starts in
+        for (size_t i = s_count - 1; since != 0 && i > 0; i--) {
+            if (s_segments[i].first_time != 0 && (time_t)s_segments[i].first_time < since) {
+                *start = s_segments[i].offset;
+                break;
+            }
+        }
+        // The first segment starting after until ends it
+        for (size_t i = 1; until != 0 && i < s_count; i++) {
+            if ((time_t)s_segments[i].first_time > until) {
+                *end = s_segments[i].offset;
+                break;
+            }
+        }
+    }
+    xSemaphoreGive(s_lock);
+    return found;
+}
+
+
+#if CONFIG_SD_LOG_COMPRESS
+static esp_err_t reader_sink(const uint8_t *data, size_t len, void *ctx)
+{
+    struct log_reader_lzss *lzss = ctx;
+
+    size_t drop = (lzss->skip < len) ? lzss->skip : len;
+    lzss->skip -= drop;
+    memcpy(lzss->pending + lzss->pending_len, data + drop, len - drop);
+    lzss->pending_len += len - drop;
+    return ESP_OK;
+}
+#endif
+
+
+/* read() on the open segment, decoded for a compressed one */
+static ssize_t reader_segment_read(log_reader_t *reader, char *buf, size_t len)
+{
+#if CONFIG_SD_LOG_COMPRESS
+    struct log_reader_lzss *lzss = reader->lzss;
+
+    while (lzss->pending_pos == lzss->pending_len) {
+        lzss->pending_len = lzss->pending_pos = 0;
+        if (lzss->in_pos == lzss->in_len) {
+            if (lzss->finished) {
+                return 0;
+            }
+            ssize_t n = read(reader->fd, lzss->in, sizeof(lzss->in));
+            if (n < 0) {
+                return n;
+            }
+            if (n == 0) {
+                lzss->finished = true;
+                lzss_decoder_finish(&lzss->decoder);
+                continue;
+            }
+            lzss->in_len = n;
+            lzss->in_pos = 0;
+        }
+        lzss_decoder_feed(&lzss->decoder, &lzss->in[lzss->in_pos++], 1);
+    }
+
+    size_t n = lzss->pending_len - lzss->pending_pos;
+    if (n > len) {
+        n = len;
+    }
+    memcpy(buf, lzss->pending + lzss->pending_pos, n);
+    lzss->pending_pos += n;
+    return n;
+#else
+    return read(reader->fd, buf, len);
+#endif
+}
+
+
+static void reader_close_segment(log_reader_t *reader)
+{
+    if (reader->fd >= 0) {
+        close(reader->fd);
+        reader->fd = -1;
+    }
+}
+
+
+/* The segment holding offset, or the first one after it when it falls in a deleted segment */
+static bool reader_seek(log_reader_t *reader, uint64_t offset)
+{
+    log_segment_t seg;
+    bool found = false;
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    for (size_t i = 0; i < s_count; i++) {
+        if (i + 1 == s_count || s_segments[i + 1].offset > offset) {
+            seg = s_segments[i];
+            found = true;
+            break;
+        }
+    }
+    xSemaphoreGive(s_lock);
+    if (!found) {
+        return false;
+    }
+
+    if (offset < seg.offset) {
+        offset = seg.offset;
+    }
+
+    char path[LOG_SEGMENT_PATH_MAX];
+    log_segments_path(seg.seq, path, sizeof(path));
+    reader->fd = open(path, O_RDONLY);
+    if (reader->fd < 0) {
+        return false;
+    }
+#if CONFIG_SD_LOG_COMPRESS
+    // A stream only decodes from its start, what comes before offset is decoded and dropped
+    struct log_reader_lzss *lzss = reader->lzss;
+    lzss_decoder_init(&lzss->decoder, reader_sink, lzss);
+    lzss->skip = offset - seg.offset;
+    lzss->finished = false;
+    lzss->in_len = lzss->in_pos = 0;
+    lzss->pending_len = lzss->pending_pos = 0;
+#else
+    if (lseek(reader->fd, (off_t)(offset - seg.offset), SEEK_SET) < 0) {
+        reader_close_segment(reader);
+        return false;
+    }
+#endif
+    reader->seq = seg.seq;
+    reader->offset = offset;
+    return true;
+}
+
+
+/* First offset of the segment after the open one, false if it is the newest */
+static bool reader_next_offset(const log_reader_t *reader, uint64_t *next)
+{
+    bool found = false;
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    for (size_t i = 0; i < s_count; i++) {
+        if (s_segments[i].seq > reader->seq) {
+            *next = s_segments[i].offset;
+            found = true;
+            break;
+        }
+    }
+    xSemaphoreGive(s_lock);
+    return found;
+}
+
+
+bool log_reader_open(log_reader_t *reader, uint64_t offset, uint64_t end)
+{
+    reader->fd = -1;
+    reader->end = end;
+    reader->lzss = NULL;
+    if (s_lock == NULL) {
+        return false;
+    }
+#if CONFIG_SD_LOG_COMPRESS
+    reader->lzss = malloc(sizeof(struct log_reader_lzss));
+    if (reader->lzss == NULL) {
+        return false;
+    }
+#endif
+    if (!reader_seek(reader, offset)) {
+        log_reader_close(reader);
+        return false;
+    }
+    return true;
+}
+
+
+size_t log_reader_read(log_reader_t *reader, char *buf, size_t len)
+{
+    size_t done = 0;
+
+    while (done < len && reader->fd >= 0 && reader->offset < reader->end) {
+        size_t want = len - done;
+        if (want > reader->end - reader->offset) {
+            want = reader->end - reader->offset;
+        }
+
+        ssize_t n = reader_segment_read(reader, buf + done, want);
+        if (n > 0) {
+            done += n;
+            reader->offset += n;
+            continue;
+        }
+
+        // End of this segment, the newest one ends the log
+        uint64_t next;
+        bool more = n == 0 && reader_next_offset(reader, &next);
+        reader_close_segment(reader);
+        if (!more || !reader_seek(reader, next)) {
+            break;
+        }
+    }
+    return done;
+}
+
+
+void log_reader_close(log_reader_t *reader)
+{
+    reader_close_segment(reader);
+    free(reader->lzss);
+    reader->lzss = NULL;
+}
@@ -0,0 +1,62 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+/* The SD log is a run of fixed size segment files, LOG00001.TXT, LOG00002.TXT ...
+ * (BLG00001.BIN ... holding binary_log records with CONFIG_BINARY_LOG).
+ * With CONFIG_SD_LOG_COMPRESS each segment is one LZSS stream, LOG00001.LZS (BLG00001.LZS) ... indexed in LOGINDEX.LZI.
+ * Offsets always count log bytes before compression, the reader decompresses.
+ * LOGINDEX.BIN (BLGINDEX.BIN) records each segment's first timestamp and its offset in the whole log,
+ * so a time range maps to a segment without reading any log.
+ * The oldest segments are deleted beyond CONFIG_SD_LOG_SEGMENT_COUNT.
+ */
+
+#define LOG_SEGMENT_PATH_MAX  32
+
+typedef struct {
+    uint32_t seq;           // Number in the file name
+    uint32_t first_time;    // Unix time the first line was logged, 0 if not known. No later line is older
+    uint64_t offset;        // Of the segment's first byte in the whole log
+} log_segment_t;
+
+/* Reads the index, or rebuilds it from the segment files found on the card */
+bool log_segments_load(void);
+
+/* Starts the segment after the newest, deleting the oldest beyond the retention count */
+bool log_segments_add(uint32_t first_time, uint64_t offset, log_segment_t *added);
+
+/* false if there is no segment yet */
+bool log_segments_newest(log_segment_t *seg);
+
+/* Oldest first, returns how many were copied */
+size_t log_segments_list(log_segment_t *out, size_t max);
+
+/* The segment holding time t, the oldest one if t is before all of them */
+bool log_segments_find(time_t t, log_segment_t *seg);
+
+void log_segments_path(uint32_t seq, char *path, size_t size);
+
+/* Offsets in the whole log of the segments covering [since, until], 0 for either leaves that end open.
+ * Segment granularity, the range can hold a little more than asked for but never less
+ */
+bool log_segments_range(time_t since, time_t until, uint64_t *start, uint64_t *end);
+
+
+/* Sequential reader over the segments, from any offset of the whole log onwards */
+typedef struct {
+    int fd;
+    uint32_t seq;           // Segment open in fd
+    uint64_t offset;        // Of the next byte to be read
+    uint64_t end;           // Reading stops here
+    struct log_reader_lzss *lzss;   // Decoder state, allocated by log_reader_open with CONFIG_SD_LOG_COMPRESS
+} log_reader_t;
+
+/* An offset older than the oldest segment starts at the oldest */
+bool log_reader_open(log_reader_t *reader, uint64_t offset, uint64_t end);
+
+/* Fills buf as far as the data goes, moving on to the next segment at the end of one. 0 at the end */
+size_t log_reader_read(log_reader_t *reader, char *buf, size_t len);
+
+void log_reader_close(log_reader_t *reader);
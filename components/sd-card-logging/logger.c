@@ -3,17 +3,80 @@
 #include "esp_log.h"
 #include <stdio.h>
 #include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "esp_timer.h"
 #include "sd_mount.h"
 #include "time_service.h"
-
-#define LOG_FILE_PATH "/sdcard/loghome.txt"
-#define CHUNK_SIZE    256
+#include "metrics.h"
+#include "log_segments.h"
+#if CONFIG_BINARY_LOG
+#include "binary_log.h"
+#endif
+#if CONFIG_SD_LOG_COMPRESS
+#include "lzss.h"
+#endif
+
+#define SECTOR_SIZE   512
+#define SEGMENT_SIZE  (CONFIG_SD_LOG_SEGMENT_SIZE_KB * 1024UL)
+#define BUFFER_SIZE   CONFIG_SD_LOG_BUFFER_SIZE
+#define SYNC_INTERVAL_US  (CONFIG_SD_LOG_SYNC_INTERVAL_S * 1000000LL)
+
+/* Binary records are written as they are, whole, so a read needs room for the largest one */
+#if CONFIG_BINARY_LOG
+#define READ_ROOM     BINARY_LOG_MAX_RECORD
+typedef binary_log_snapshot_t sd_log_snapshot_t;
+#else
+#define READ_ROOM     1
+typedef log_snapshot_t sd_log_snapshot_t;
+#endif
+
+/* A compressed segment is a single stream, it can only end between two cycles, see sd_log_task() */
+#if CONFIG_SD_LOG_COMPRESS
+#define SEGMENT_LIMIT UINT32_MAX
+#define RAW_SIZE      1024    // Logs go through here to the encoder
+#else
+#define SEGMENT_LIMIT SEGMENT_SIZE
+#endif
+
+/* The segment file stays open and logs collect in a cluster sized buffer. Only whole sectors ending
+ * on a sector boundary of the file go to the card, the partial tail waits for more data, so FAT sees
+ * few large aligned writes instead of an open, seek and directory update per flush.
+ * Everything, tail included, is written and fsync'ed per the sync interval.
+ * A segment is filled to exactly SEGMENT_SIZE before the next one is started.
+ */
+typedef struct {
+    int fd;
+    char *buf;
+    size_t len;                 // Bytes waiting in buf
+    log_segment_t segment;      // Being written
+    uint32_t file_size;         // Where the next write lands
+    int64_t last_sync_us;
+    uint32_t next_time;         // When the first byte of the next segment was logged, 0 until it is buffered
+#if CONFIG_SD_LOG_COMPRESS
+    lzss_encoder_t *encoder;    // Its output collects in buf
+    char *raw;
+    uint64_t log_size;          // Log bytes in the segment before compression
+#endif
+} sd_log_file_t;
 
 static TaskHandle_t s_task = NULL;
+static bool s_mounted = false;
 static uint32_t s_interval_ms = 4000;  // default 2 sec
+static sd_log_file_t s_log = { .fd = -1 };
+static metric_t *s_bytes_written = NULL;
+static metric_t *s_write_errors = NULL;
+static metric_t *s_sectors_written = NULL;
+static metric_t *s_syncs = NULL;
+static metric_t *s_rotations = NULL;
+#if CONFIG_SD_LOG_COMPRESS
+static metric_t *s_bytes_compressed = NULL;
+#endif
 
 
 static void sync_cb(const time_sync_result_t *res)
@@ -31,69 +94,323 @@ static void sync_cb(const time_sync_result_t *res)
     );
 }
 
+/* ---------- Buffered file ---------- */
+
+static bool sd_log_flush(bool all);
+
+
+/* The next segment only starts once the buffer is written out, up to a sync interval after its first
+ * byte was logged. Its index time is when that byte came in, so time lookups find the lines in it
+ */
+static void sd_log_buffered(void)
+{
+#if !CONFIG_SD_LOG_COMPRESS
+    if (s_log.next_time == 0 && s_log.file_size + s_log.len > SEGMENT_SIZE) {
+        s_log.next_time = (uint32_t)time(NULL);
+    }
+#endif
+}
+
+
+/* Copies into the buffer, writing out whole sectors whenever it fills */
+static esp_err_t sd_log_append(const uint8_t *data, size_t len, void *ctx)
+{
+    while (len > 0) {
+        if (s_log.len == BUFFER_SIZE && !sd_log_flush(false)) {
+            return ESP_FAIL;
+        }
+        size_t n = BUFFER_SIZE - s_log.len;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(s_log.buf + s_log.len, data, n);
+        s_log.len += n;
+        data += n;
+        len -= n;
+        sd_log_buffered();
+    }
+    return ESP_OK;
+}
+
+
+/* Log text from anywhere but the snapshot, through the encoder when compressing */
+static bool sd_log_put(const char *data, size_t len)
+{
+#if CONFIG_SD_LOG_COMPRESS
+    s_log.log_size += len;
+    metrics_counter_add(s_bytes_compressed, len);
+    return lzss_encoder_feed(s_log.encoder, (const uint8_t *)data, len) == ESP_OK;
+#else
+    return sd_log_append((const uint8_t *)data, len, NULL) == ESP_OK;
+#endif
+}
+
+
+static void sd_log_snapshot_take(sd_log_snapshot_t *snap)
+{
+#if CONFIG_BINARY_LOG
+    /* Records carry ms since boot, a time record places them */
+    binary_log_mark_time();
+    binary_log_snapshot_take(snap);
+#else
+    log_snapshot_take(snap);
+#endif
+}
+
+
+static size_t sd_log_snapshot_read(sd_log_snapshot_t *snap, char *buf, size_t len)
+{
+#if CONFIG_BINARY_LOG
+    return binary_log_snapshot_read(snap, buf, len);
+#else
+    return log_snapshot_read(snap, buf, len);
+#endif
+}
+
+static bool sd_log_open_segment(int flags)
+{
+    char path[LOG_SEGMENT_PATH_MAX];
+    log_segments_path(s_log.segment.seq, path, sizeof(path));
+
+    s_log.fd = open(path, O_WRONLY | O_CREAT | flags, 0644);
+    if (s_log.fd < 0) {
+        return false;
+    }
+
+    struct stat st;
+    s_log.file_size = (fstat(s_log.fd, &st) == 0) ? (uint32_t)st.st_size : 0;
+    s_log.last_sync_us = esp_timer_get_time();
+#if CONFIG_SD_LOG_COMPRESS
+    lzss_encoder_init(s_log.encoder, sd_log_append, NULL);
+    s_log.log_size = 0;
+#endif
+    return true;
+}
+
+
+/* A compressed segment starts between two cycles, before any of its logs */
+static bool sd_log_new_segment(uint64_t offset)
+{
+    uint32_t first_time = s_log.next_time ? s_log.next_time : (uint32_t)time(NULL);
+    s_log.next_time = 0;
+    if (!log_segments_add(first_time, offset, &s_log.segment)) {
+        ESP_LOGW("SD_LOG", "Log index not saved");
+    }
+    return sd_log_open_segment(O_TRUNC);
+}
+
+
+#if CONFIG_SD_LOG_COMPRESS
+/* A stream cannot be continued after a restart or a failed write, a new segment starts where the
+ * newest one's log ends. Finding that decodes the newest segment once
+ */
+static bool sd_log_open(void)
+{
+    log_segment_t newest;
+    if (!log_segments_newest(&newest)) {
+        return sd_log_new_segment(0);
+    }
+
+    log_reader_t reader;
+    uint64_t end = newest.offset;
+    if (log_reader_open(&reader, newest.offset, UINT64_MAX)) {
+        size_t n;
+        while ((n = log_reader_read(&reader, s_log.buf, BUFFER_SIZE)) > 0) {
+            end += n;
+        }
+        log_reader_close(&reader);
+    }
+    return sd_log_new_segment(end);
+}
+#else
+/* Continues the newest segment, the first one on an empty card */
+static bool sd_log_open(void)
+{
+    if (log_segments_newest(&s_log.segment)) {
+        return sd_log_open_segment(O_APPEND);
+    }
+    return sd_log_new_segment(0);
+}
+#endif
+
+
+static void sd_log_close(void)
+{
+    close(s_log.fd);
+    s_log.fd = -1;
+}
+
+
+/* Writes the first len bytes of the buffer and keeps the rest */
+static bool sd_log_write(size_t len)
+{
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = write(s_log.fd, s_log.buf + done, len - done);
+        if (n <= 0) {
+            return false;
+        }
+        done += n;
+    }
+
+    // Sectors the card had to program, a partly filled one again each time it grows
+    uint32_t first = s_log.file_size / SECTOR_SIZE;
+    uint32_t last = (s_log.file_size + len - 1) / SECTOR_SIZE;
+    metrics_counter_add(s_sectors_written, last - first + 1);
+    metrics_counter_add(s_bytes_written, len);
+
+    s_log.file_size += len;
+    s_log.len -= len;
+    memmove(s_log.buf, s_log.buf + len, s_log.len);
+    return true;
+}
+
+
+static bool sd_log_rotate(void)
+{
+    bool synced = fsync(s_log.fd) == 0;
+    sd_log_close();
+    if (!synced) {
+        return false;
+    }
+    metrics_counter_add(s_rotations, 1);
+#if CONFIG_SD_LOG_COMPRESS
+    return sd_log_new_segment(s_log.segment.offset + s_log.log_size);
+#else
+    return sd_log_new_segment(s_log.segment.offset + s_log.file_size);
+#endif
+}
+
+
+/* all=false writes up to the last sector boundary the buffer reaches, all=true everything.
+ * Both stop at the end of the segment and carry on in the next one
+ */
+static bool sd_log_flush(bool all)
+{
+    while (true) {
+        if (s_log.file_size >= SEGMENT_LIMIT && !sd_log_rotate()) {
+            return false;
+        }
+
+        size_t len = s_log.len;
+        if (!all) {
+            uint32_t end = (s_log.file_size + s_log.len) / SECTOR_SIZE * SECTOR_SIZE;
+            len = end > s_log.file_size ? end - s_log.file_size : 0;
+        }
+        if (len > SEGMENT_LIMIT - s_log.file_size) {
+            len = SEGMENT_LIMIT - s_log.file_size;
+        }
+        if (len == 0) {
+            return true;
+        }
+        if (!sd_log_write(len)) {
+            return false;
+        }
+    }
+}
+
+
+static bool sd_log_sync(void)
+{
+    s_log.last_sync_us = esp_timer_get_time();
+#if CONFIG_SD_LOG_COMPRESS
+    // The bits of an unfinished byte wait for the next cycle, they cannot be padded mid stream
+    if (lzss_encoder_flush(s_log.encoder) != ESP_OK) {
+        return false;
+    }
+#endif
+    if (!sd_log_flush(true) || fsync(s_log.fd) != 0) {
+        return false;
+    }
+    metrics_counter_add(s_syncs, 1);
+    return true;
+}
+
+
+/* Data that could not be written is dropped and the file reopened on the next cycle */
+static void sd_log_fail(void)
+{
+    ESP_LOGE("SD_LOG", "Write failed!");
+    metrics_counter_add(s_write_errors, 1);
+    s_log.len = 0;
+    s_log.next_time = 0;
+    if (s_log.fd >= 0) {
+        sd_log_close();
+    }
+}
+
 /* ---------- Internal Task ---------- */
 
-static void sd_log_task(void *arg)
+#if CONFIG_SD_LOG_COMPRESS
+/* Ends the stream and the segment once it holds SEGMENT_SIZE, a segment is one whole stream */
+static bool sd_log_end_segment(void)
 {
-    log_snapshot_t snap={0};
-    char buf[CHUNK_SIZE];
+    if (s_log.file_size + s_log.len < SEGMENT_SIZE) {
+        return true;
+    }
+    return lzss_encoder_finish(s_log.encoder) == ESP_OK && sd_log_flush(true) && sd_log_rotate();
+}
+#endif
 
-    FILE *f = NULL;
+
+static void sd_log_task(void *arg)
+{
+    sd_log_snapshot_t snap={0};
 
     while (1) {
 
         /* Try to open file if not open */
-        if (!f) {
-            f = fopen(LOG_FILE_PATH, "a");
-
-            if (!f) {
-                ESP_LOGW("SD_LOG", "Failed to open file, retrying...");
-                vTaskDelay(pdMS_TO_TICKS(2000)); // retry delay
-                continue;
-            }
-
-            ///ESP_LOGI("SD_LOG", "File opened successfully");
+        if (s_log.fd < 0 && !sd_log_open()) {
+            ESP_LOGW("SD_LOG", "Failed to open file, retrying...");
+            vTaskDelay(pdMS_TO_TICKS(2000)); // retry delay
+            continue;
         }
 
 
+        bool ok = true;
+
+#if !CONFIG_BINARY_LOG
         ///Adding Time stamp to logs
         char timestamp[TIME_SERVICE_STR_BUF_SIZE];
 
-        if (time_service_now_str(5 * 3600, timestamp, sizeof(timestamp)) > 0) {
-            fwrite(timestamp, 1, strlen(timestamp), f);
-            fwrite("\n", 1, 1, f);   // next line after timestamp
+        int ts_len = time_service_now_str(5 * 3600, timestamp, sizeof(timestamp));
+        if (ts_len > 0) {
+            ok = sd_log_put(timestamp, ts_len) && sd_log_put("\n", 1);   // next line after timestamp
         }
         ///Adding Time stamp to logs
-
+#endif
 
         /* Take snapshot */
-        log_snapshot_take(&snap);
+        sd_log_snapshot_take(&snap);
 
-        /* Write logs */
         size_t bytes_read;
-
-
-        do{
-            bytes_read=log_snapshot_read(&snap,buf,sizeof(buf)-1);
-            //ESP_LOGI(TAG,"bytes read %d",bytes_read);
-            if(bytes_read>0){
-                buf[bytes_read]='\0';   //null terminate
-                if (fwrite(buf, 1, bytes_read, f) != bytes_read) {
-                    ESP_LOGE("SD_LOG", "Write failed!");
-
-                    fflush(f);
-                    fclose(f);
-                    f = NULL;   // force reopen
-                    break;
-                }
-
-            }
-            else{
-                fflush(f);
-                fclose(f);
-                f = NULL;   // force reopen
+        do {
+#if CONFIG_SD_LOG_COMPRESS
+            bytes_read = ok ? sd_log_snapshot_read(&snap, s_log.raw, RAW_SIZE) : 0;
+            ok = ok && sd_log_put(s_log.raw, bytes_read);
+#else
+            /* Read straight into the free end of the buffer, writing out whole sectors whenever it fills */
+            if (BUFFER_SIZE - s_log.len < READ_ROOM || s_log.len == BUFFER_SIZE) {
+                ok = sd_log_flush(false);
             }
-        }while(bytes_read>0);
+            bytes_read = ok ? sd_log_snapshot_read(&snap, s_log.buf + s_log.len, BUFFER_SIZE - s_log.len) : 0;
+            s_log.len += bytes_read;
+            sd_log_buffered();
+#endif
+        } while (bytes_read > 0);
+
+#if CONFIG_SD_LOG_COMPRESS
+        if (ok) {
+            ok = sd_log_end_segment();
+        }
+#endif
+
+        if (ok && (SYNC_INTERVAL_US == 0 || esp_timer_get_time() - s_log.last_sync_us >= SYNC_INTERVAL_US)) {
+            ok = sd_log_sync();
+        }
+        if (!ok) {
+            sd_log_fail();
+        }
 
 
         vTaskDelay(pdMS_TO_TICKS(s_interval_ms));
@@ -101,10 +418,32 @@ static void sd_log_task(void *arg)
 }
 /* ---------- Public API ---------- */
 
+/* Once for the writer and the reader both, the SPI bus cannot be initialised twice */
+static bool sd_log_mount(void)
+{
+    if (!s_mounted) {
+        s_mounted = sd_mount_init();
+    }
+    return s_mounted;
+}
+
+bool sd_log_reader_start(void)
+{
+    if (!sd_log_mount()) {
+        ESP_LOGW("SD_LOG","No SD card, /get-log has no SD log to read");
+        return false;
+    }
+    if (!log_segments_load()) {
+        ESP_LOGE("SD_LOG","Failed to load the log index");
+        return false;
+    }
+    return true;
+}
+
 bool sd_log_writer_start(uint32_t interval_ms)
 {
 
-    bool ret=sd_mount_init();
+    bool ret=sd_log_mount();
     time_init_result_t init_res;
 
     time_service_init(&init_res);
@@ -129,6 +468,46 @@ bool sd_log_writer_start(uint32_t interval_ms)
 
     s_interval_ms = interval_ms;
 
+    if (!log_segments_load()) {
+        ESP_LOGE("SD_LOG","Failed to load the log index");
+        return false;
+    }
+
+    if (s_log.buf == NULL) {
+        s_log.buf = malloc(BUFFER_SIZE);
+        if (s_log.buf == NULL) {
+            ESP_LOGE("SD_LOG","No memory for the write buffer");
+            return false;
+        }
+    }
+#if CONFIG_SD_LOG_COMPRESS
+    if (s_log.encoder == NULL) {
+        s_log.encoder = malloc(sizeof(lzss_encoder_t));
+        s_log.raw = malloc(RAW_SIZE);
+        if (s_log.encoder == NULL || s_log.raw == NULL) {
+            ESP_LOGE("SD_LOG","No memory for the %u byte compressor", (unsigned)(sizeof(lzss_encoder_t) + RAW_SIZE));
+            free(s_log.encoder);
+            free(s_log.raw);
+            s_log.encoder = NULL;
+            s_log.raw = NULL;
+            return false;
+        }
+    }
+#endif
+
+    if (s_bytes_written == NULL) {
+        s_bytes_written = metrics_register_counter("sd_log_bytes_written_total", NULL, "Log bytes written to the SD card");
+        s_write_errors = metrics_register_counter("sd_log_write_errors_total", NULL, "Failed writes to the SD log file");
+        s_sectors_written = metrics_register_counter("sd_log_sectors_written_total", NULL,
+                                                     "SD sectors programmed by log writes, over bytes written gives the write amplification");
+        s_syncs = metrics_register_counter("sd_log_syncs_total", NULL, "fsync calls on the SD log file");
+        s_rotations = metrics_register_counter("sd_log_rotations_total", NULL, "SD log segments filled and closed");
+#if CONFIG_SD_LOG_COMPRESS
+        s_bytes_compressed = metrics_register_counter("sd_log_compressed_input_bytes_total", NULL,
+                                                      "Log bytes into the SD log compressor, over bytes written gives the ratio");
+#endif
+    }
+
     BaseType_t res = xTaskCreate(
         sd_log_task,
         "sd_log",
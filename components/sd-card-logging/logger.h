@@ -7,5 +7,10 @@
  */
 bool sd_log_writer_start(uint32_t interval_ms);
 
+/* Mount the card and load the segment index so the log already on it can be read back,
+ * without writing to it. sd_log_writer_start does the same before it starts writing
+ */
+bool sd_log_reader_start(void);
+
 /* Stop logging (optional) */
 void sd_log_writer_stop(void);
\ No newline at end of file
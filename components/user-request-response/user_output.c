@@ -43,6 +43,30 @@ esp_err_t user_request_response_send_log(char* log_data,size_t length,void* cont
     //return ESP_OK;
 }   
 
+//Zero copy version of send_log. log_data must stay valid until release is called by the server
+esp_err_t user_request_response_send_log_ref(const char* log_data,size_t length,void (*release)(void* arg),void* release_arg,void* context){
+
+    http_request_t* req=(http_request_t*)context;
+
+    return user_interaction.server_interface->send_chunked_response_ref(req,log_data,length,release,release_arg);
+}
+
+void user_request_response_trace(void* context,request_trace_stage_t stage){
+
+    if(user_interaction.server_interface==NULL)
+        return;
+
+    user_interaction.server_interface->trace_mark((http_request_t*)context,stage);
+}
+
+esp_err_t user_request_response_get_query(void* context,const char* key,char* value,size_t size){
+
+    if(user_interaction.server_interface==NULL)
+        return ESP_ERR_INVALID_STATE;
+
+    return user_interaction.server_interface->get_query_value((http_request_t*)context,key,value,size);
+}
+
 esp_err_t user_request_response_inform_command_status(bool success,void* context){  
     
     http_request_t* req=(http_request_t*)context;
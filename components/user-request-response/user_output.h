@@ -6,6 +6,7 @@
 
 #include "stdint.h"
 #include "esp_err.h"
+#include "http_server.h"
 
 
 /// @brief Inform whether request was sent successfully using espnow
@@ -13,7 +14,15 @@
 /// @return 
 
 esp_err_t user_request_response_send_log(char* log_data,size_t length,void* context);
+/// @brief Send a log chunk without copying it. log_data is owned by the server until release(release_arg) is called
+/// @return On error release is not called and the caller still owns log_data
+esp_err_t user_request_response_send_log_ref(const char* log_data,size_t length,void (*release)(void* arg),void* release_arg,void* context);
 esp_err_t user_request_response_inform_command_status(bool success,void* context);
+/// @brief Timestamp a hop of the command on its request, for the latency figures on /metrics
+void user_request_response_trace(void* context,request_trace_stage_t stage);
+/// @brief Query parameter of the request, e.g. "since" of /get-log?since=...
+/// @return ESP_ERR_NOT_FOUND if the request does not carry it
+esp_err_t user_request_response_get_query(void* context,const char* key,char* value,size_t size);
 esp_err_t user_request_response_create();
 
 #endif
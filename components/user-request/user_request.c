@@ -1,28 +1,222 @@
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
 #include "esp_log.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/queue.h"
+#include "esp_timer.h"
 #include "user_request.h"
 #include "http_server.h"
 
 
 #define     QUEUE_SIZE          10
+#define     MAX_COALESCED_REQUESTS      4       //As many as the server can hold open at once
+#define     COMMAND_TIMEOUT_MS_DEFAULT  5000
 
 DEFINE_EVENT_ADAPTER(USER_REQUEST);
 
 static const char* TAG="user request";
 
+//A gate command that has been sent and is waiting for its ESP-NOW ack.
+//Identical commands arriving meanwhile attach to it instead of being sent again
+//A lost ack must not hold the waiters (and their async slots) forever, the command expires after the timeout
+//It goes out with a token of its sequence number as context, not the request: the async slot of an expired
+//command is reused, so only the token tells its late ack from the ack of the slot's next request
+typedef struct{
+    int32_t event_id;
+    bool in_flight;
+    uint8_t waiter_count;
+    http_request_t* waiters[MAX_COALESCED_REQUESTS];    //waiters[0] is the request the command was sent for
+    uint32_t seq;
+    int64_t sent_us;
+    esp_timer_handle_t timer;
+}pending_command_t;
+
+//Async slots are aligned, a context with the low bit set is a command token
+#define     COMMAND_TOKEN(seq)          ((void*)(((uintptr_t)(seq)<<1)|1))
+#define     IS_COMMAND_TOKEN(context)   (((uintptr_t)(context)&1)!=0)
+#define     COMMAND_TOKEN_SEQ(context)  ((uint32_t)((uintptr_t)(context)>>1))
+
+
 static struct{
 
 
 
     http_server_interface_t* server_interface;    //Required by it
 //  QueueHandle_t response_queue;
+    pending_command_t pending[2];
+    portMUX_TYPE pending_lock;
+    uint32_t next_seq;
+    int64_t command_timeout_us;
+
+
+}user_request_state={
+    .pending={
+        {.event_id=USER_REQUEST_ROUTINE_EVENT_USER_COMMAND_GATE_OPEN},
+        {.event_id=USER_REQUEST_ROUTINE_EVENT_USER_COMMAND_GATE_CLOSE},
+    },
+    .pending_lock=portMUX_INITIALIZER_UNLOCKED,
+};
+
+
+
+static esp_err_t reply_failure(bool success,void* context){
+    http_request_t* request=(http_request_t*)context;
+    user_request_state.server_interface->send_response(request,"failure");
+    user_request_state.server_interface->close_async_connection(request);
+    return ESP_OK;
+}
+
+
+static esp_err_t reply_timeout(bool success,void* context){
+    http_request_t* request=(http_request_t*)context;
+    user_request_state.server_interface->send_status_response(request,504,"no ack from the gate");
+    user_request_state.server_interface->close_async_connection(request);
+    return ESP_OK;
+}
 
 
-}user_request_state={0};
+static pending_command_t* find_pending_by_event(int32_t event_id){
+    for(int i=0;i<sizeof(user_request_state.pending)/sizeof(user_request_state.pending[0]);i++){
+        if(user_request_state.pending[i].event_id==event_id)
+            return &user_request_state.pending[i];
+    }
+    return NULL;
+}
+
+
+/// @brief Detaches every request waiting on the command the token was sent for.
+/// @return Number of requests copied to waiters, 0 if that command already expired or was answered
+static uint8_t take_waiters(void* token,http_request_t** waiters){
+    uint8_t count=0;
+
+    taskENTER_CRITICAL(&user_request_state.pending_lock);
+    for(int i=0;i<sizeof(user_request_state.pending)/sizeof(user_request_state.pending[0]);i++){
+        pending_command_t* cmd=&user_request_state.pending[i];
+        if(cmd->in_flight && cmd->seq==COMMAND_TOKEN_SEQ(token)){
+            count=cmd->waiter_count;
+            memcpy(waiters,cmd->waiters,count*sizeof(http_request_t*));
+            cmd->in_flight=false;
+            cmd->waiter_count=0;
+            break;
+        }
+    }
+    taskEXIT_CRITICAL(&user_request_state.pending_lock);
+
+    return count;
+}
+
+
+/// @brief Runs in the esp_timer task. The timer of an earlier send can still fire after a new one started,
+/// so the age of the command decides, not the timer
+static void command_timeout(void* arg){
+    pending_command_t* cmd=(pending_command_t*)arg;
+    http_request_t* waiters[MAX_COALESCED_REQUESTS];
+    uint8_t count=0;
+
+    taskENTER_CRITICAL(&user_request_state.pending_lock);
+    if(cmd->in_flight && esp_timer_get_time()-cmd->sent_us>=user_request_state.command_timeout_us){
+        count=cmd->waiter_count;
+        memcpy(waiters,cmd->waiters,count*sizeof(http_request_t*));
+        cmd->in_flight=false;
+        cmd->waiter_count=0;
+    }
+    taskEXIT_CRITICAL(&user_request_state.pending_lock);
+
+    if(count>0)
+        ESP_LOGW(TAG,"command %ld got no ack, failing %d requests",(long)cmd->event_id,count);
+    for(int i=0;i<count;i++){
+        reply_timeout(false,waiters[i]);
+    }
+}
+
+
+void* user_request_context_request(void* context){
+    if(!IS_COMMAND_TOKEN(context))
+        return context;
+
+    http_request_t* request=NULL;
+    taskENTER_CRITICAL(&user_request_state.pending_lock);
+    for(int i=0;i<sizeof(user_request_state.pending)/sizeof(user_request_state.pending[0]);i++){
+        pending_command_t* cmd=&user_request_state.pending[i];
+        if(cmd->in_flight && cmd->seq==COMMAND_TOKEN_SEQ(context))
+            request=cmd->waiters[0];
+    }
+    taskEXIT_CRITICAL(&user_request_state.pending_lock);
+    return request;
+}
+
+
+esp_err_t user_request_command_complete(bool success,void* context,user_request_reply_t reply){
+    if(reply==NULL)
+        return ESP_ERR_INVALID_ARG;
+
+    //Not a coalesced command (log, ota or one sent on its own), so just this request
+    if(!IS_COMMAND_TOKEN(context))
+        return reply(success,context);
+
+    http_request_t* waiters[MAX_COALESCED_REQUESTS];
+    uint8_t count=take_waiters(context,waiters);
+
+    if(count==0){
+        ESP_LOGW(TAG,"late ack for an expired command dropped");
+        return ESP_OK;
+    }
+
+    if(count>1)
+        ESP_LOGI(TAG,"one ack answers %d coalesced requests",count);
+
+    for(int i=0;i<count;i++){
+        reply(success,waiters[i]);
+    }
+    return ESP_OK;
+}
+
+
+/// @brief Sends a gate command, unless the same command is already waiting for its ack,
+/// in which case the request just waits for that result
+static void gate_command_request(http_request_t* request,int32_t event_id){
+    pending_command_t* cmd=find_pending_by_event(event_id);
+    bool attached=false;
+    bool owner=false;
+    void* context=request;
+
+    taskENTER_CRITICAL(&user_request_state.pending_lock);
+    if(!cmd->in_flight){
+        cmd->in_flight=true;
+        cmd->waiters[0]=request;
+        cmd->waiter_count=1;
+        cmd->seq=++user_request_state.next_seq&(UINTPTR_MAX>>1);     //What a token carries
+        cmd->sent_us=esp_timer_get_time();
+        context=COMMAND_TOKEN(cmd->seq);
+        owner=true;
+    }
+    else if(cmd->waiter_count<MAX_COALESCED_REQUESTS){
+        cmd->waiters[cmd->waiter_count++]=request;
+        attached=true;
+    }
+    taskEXIT_CRITICAL(&user_request_state.pending_lock);
+
+    if(attached){
+        ESP_LOGI(TAG,"command %ld already in flight, request coalesced",(long)event_id);
+        return;
+    }
+
+    if(owner){
+        esp_timer_stop(cmd->timer);     //Not running unless an earlier timeout is still due, which then sees a fresh command
+        esp_timer_start_once(cmd->timer,user_request_state.command_timeout_us);
+    }
+
+    //Either it owns the pending command or the waiter list is full and it goes out on its own
+    user_request_state.server_interface->trace_mark(request,REQUEST_TRACE_EVENT_POST);
+    esp_err_t err=USER_REQUEST_post_event(event_id,&context,sizeof(context));
+
+    if (err != ESP_OK) {
+        user_request_command_complete(false,context,reply_failure);
+    }
+}
 
 
 
@@ -73,58 +267,17 @@ static void log_request_handler(http_request_t* request,const char* uri){
 
 
 static void gate_close_request_handler(http_request_t* request,const char* uri){
-    BaseType_t ret=pdTRUE;
  
     ESP_LOGI(TAG,"gate close handler entered");
-    //Keep reading from queue until it is free from previous entries
-    //bool success;
-    //while(ret==pdTRUE){
-     //   ret=get_from_queue(0,&success);      //0 wait time
-   /// }
-    
-    //ESP_LOGI(TAG,"gate close proceed");
-    //Now send new command. The data that will arrive in queue now belongs to this request
-    esp_err_t err=0;
-    err=USER_REQUEST_post_event(USER_REQUEST_ROUTINE_EVENT_USER_COMMAND_GATE_CLOSE,&request,sizeof(request));
-
-    if (err != ESP_OK) {
-        user_request_state.server_interface->send_response(request,"failure");
-        user_request_state.server_interface->close_async_connection(request);
-        return;
-    }
-
-    //return ESP_OK;
+    gate_command_request(request,USER_REQUEST_ROUTINE_EVENT_USER_COMMAND_GATE_CLOSE);
 
 }
 
 static void gate_open_request_handler(http_request_t* request,const char* uri){
     
-    
-    BaseType_t ret=pdTRUE;
     ESP_LOGI(TAG,"gate open handler entered");
-    //Keep reading from queue until it is free from previous entries
-    //bool success;
-    //while(ret==pdTRUE){
-     //   ret=get_from_queue(0,&success);      //0 wait time
-   /// }
-    
-    //ESP_LOGI(TAG,"gate open proceed");
-    //Now send new command. The data that will arrive in queue now belongs to this request
-    esp_err_t err=0;
     ESP_LOGI(TAG,"req address print %p",(void*)request);
-    ESP_LOGI(TAG,"req ptr address print %p",(void*)&request);
-    err=USER_REQUEST_post_event(USER_REQUEST_ROUTINE_EVENT_USER_COMMAND_GATE_OPEN,&request,sizeof(request));
-
-    if (err != ESP_OK) {
-        user_request_state.server_interface->send_response(request,"failure");
-        user_request_state.server_interface->close_async_connection(request);
-        return;
-    }
-
-    //return ESP_OK;
-    
- //   return ESP_OK;
-    
+    gate_command_request(request,USER_REQUEST_ROUTINE_EVENT_USER_COMMAND_GATE_OPEN);
     
 }
 
@@ -151,9 +304,23 @@ esp_err_t user_request_create(user_request_config_t* config){
     
     user_request_state.server_interface=http_server_get_interface();
 
+    user_request_state.command_timeout_us=1000LL*(config->command_timeout_ms?config->command_timeout_ms:COMMAND_TIMEOUT_MS_DEFAULT);
+    for(int i=0;i<sizeof(user_request_state.pending)/sizeof(user_request_state.pending[0]);i++){
+        pending_command_t* cmd=&user_request_state.pending[i];
+        if(cmd->timer!=NULL)
+            continue;
+        esp_timer_create_args_t timer_args={.callback=command_timeout,.arg=cmd,.name="gate_cmd_timeout"};
+        ret=esp_timer_create(&timer_args,&cmd->timer);
+        if(ret!=ESP_OK){
+            ESP_LOGE(TAG,"command timer create failed");
+            return ret;
+        }
+    }
+
     
-    user_request_state.server_interface->register_uri(config->gate_close_endpoint,METHOD_GET,gate_close_request_handler);
-    user_request_state.server_interface->register_uri(config->gate_open_endpoint,METHOD_GET,gate_open_request_handler);
+    uri_options_t command_options={.keep_alive=config->keep_alive_commands};
+    user_request_state.server_interface->register_uri_ex(config->gate_close_endpoint,METHOD_GET,gate_close_request_handler,&command_options);
+    user_request_state.server_interface->register_uri_ex(config->gate_open_endpoint,METHOD_GET,gate_open_request_handler,&command_options);
     user_request_state.server_interface->register_uri(config->log_endpoint,METHOD_GET,log_request_handler);
     user_request_state.server_interface->register_uri(config->ota_update_endpoint,METHOD_GET,ota_update_request_handler);
 
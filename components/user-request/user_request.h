@@ -5,6 +5,7 @@
 
 #include "event_system_adapter.h"
 #include "stdint.h"
+#include "stdbool.h"
 
 DECLARE_EVENT_ADAPTER(USER_REQUEST);
 
@@ -30,13 +31,29 @@ typedef struct{
     const char* gate_close_endpoint;
     const char* log_endpoint;
     const char* ota_update_endpoint;
+    bool keep_alive_commands;       //Gate command endpoints reuse the connection, saves a TCP handshake per command
+    uint32_t command_timeout_ms;    //A gate command without an ack by then fails its requests with 504, 0 for the default
 
 }user_request_config_t;
 
 
+//Delivers a command result to one request, same shape as user_request_response_inform_command_status
+typedef esp_err_t (*user_request_reply_t)(bool success,void* context);
+
+
 /// @brief Inform whether request was sent successfully using espnow
 /// @param success 
 /// @return 
 
 esp_err_t user_request_create(user_request_config_t* config);
+
+/// @brief Completes the command that was posted with context. A coalesced gate command is posted with a token of
+/// its own, identical gate commands that arrived while it was in flight get the same result through reply.
+/// The token of a command that already expired matches nothing and is dropped.
+/// Any other context is a request and is simply passed to reply
+esp_err_t user_request_command_complete(bool success,void* context,user_request_reply_t reply);
+
+/// @brief The request a posted context stands for, to trace it. NULL for the token of a command that already
+/// expired or was answered, its request may belong to someone else by now
+void* user_request_context_request(void* context);
 #endif
@@ -0,0 +1,215 @@
+import sys
+import json
+import random
+import argparse
+import subprocess
+from decimal import Decimal
+
+# Feeds random manifests through test_json_fields, which parses them with components/ota-service's
+# json_fields in random sized pieces, and checks every extracted field against Python's json.
+# The peak heap of each parse must be zero, it is printed against what the cJSON path took.
+#
+#   python3 json_fields_fuzz.py build/test_json_fields [--count N] [--seed S]
+
+# Destination sizes in test_json_fields.c, a longer string is dropped rather than cut short
+STRING_FIELDS = {"version": 24, "url": 96, "sha256": 65}
+INT_FIELDS = ("size", "delta_size")
+ELEMENT_STRING_FIELDS = {"target": 16}
+ELEMENT_INT_FIELDS = ("size",)
+
+WORDS = ["v1.2.3", "esp32c3", "https://ota.example/fw.bin", "a" * 64, "café", "日本",
+         "\U0001f600", "tab\there", "quote\"d", "back\\slash", "line\nbreak", "", "x" * 200]
+
+
+def random_string(rng):
+    parts = [rng.choice(WORDS) for _ in range(rng.randint(1, 3))]
+    return "".join(parts)[:rng.choice((8, 30, 120, 300))]
+
+
+def random_number(rng):
+    """Literal text, all the forms JSON allows"""
+    sign = rng.choice(("", "", "-"))
+    kind = rng.randint(0, 5)
+    if kind == 0:
+        digits = str(rng.randint(0, 1000))
+    elif kind == 1:
+        digits = str(rng.choice((2**31 - 1, 2**31, 2**32, 10**25, rng.randint(0, 2**31))))
+    elif kind == 2:
+        digits = "%d.%0*d" % (rng.randint(0, 99999), rng.randint(1, 6), rng.randint(0, 999999))
+    else:
+        mantissa = str(rng.randint(0, 9999))
+        if rng.random() < 0.5:
+            mantissa += ".%d" % rng.randint(0, 99999)
+        exponent = rng.choice(("", "+", "-")) + str(rng.randint(0, 40))
+        digits = mantissa + rng.choice("eE") + exponent
+    return sign + digits
+
+
+class Numbers:
+    """Number literals go in as placeholders and are spliced into json.dumps' output"""
+    def __init__(self):
+        self.literals = []
+
+    def add(self, text):
+        self.literals.append(text)
+        return "@@%d@@" % (len(self.literals) - 1)
+
+    def splice(self, doc):
+        for i, text in enumerate(self.literals):
+            doc = doc.replace('"@@%d@@"' % i, text, 1)
+        return doc
+
+
+def random_value(rng, numbers, depth=0):
+    kind = rng.randint(0, 7 if depth < 3 else 4)
+    if kind == 0:
+        return numbers.add(random_number(rng))
+    if kind == 1:
+        return random_string(rng)
+    if kind == 2:
+        return rng.choice((True, False, None))
+    if kind in (3, 4):
+        return rng.randint(-5, 5)
+    if kind == 5:
+        return [random_value(rng, numbers, depth + 1) for _ in range(rng.randint(0, 3))]
+    # Nested objects reuse the field names, none of them may leak into the result
+    return {rng.choice(("size", "url", "version", "junk")): random_value(rng, numbers, depth + 1)
+            for _ in range(rng.randint(0, 3))}
+
+
+def field_value(rng, numbers, is_string):
+    if rng.random() < 0.8:
+        return random_string(rng) if is_string else numbers.add(random_number(rng))
+    return random_value(rng, numbers)
+
+
+def random_object(rng, numbers, string_fields, int_fields):
+    obj = {}
+    for name in string_fields:
+        if rng.random() < 0.8:
+            obj[name] = field_value(rng, numbers, True)
+    for name in int_fields:
+        if rng.random() < 0.8:
+            obj[name] = field_value(rng, numbers, False)
+    for i in range(rng.randint(0, 4)):
+        obj[rng.choice(("notes", "sizes", "x" * 40, "size_kb", "ver")) + str(i)] = random_value(rng, numbers)
+    keys = list(obj)
+    rng.shuffle(keys)
+    return {k: obj[k] for k in keys}
+
+
+def random_document(rng):
+    numbers = Numbers()
+    doc = random_object(rng, numbers, STRING_FIELDS, INT_FIELDS)
+    if rng.random() < 0.6:
+        doc["builds"] = [random_object(rng, numbers, ELEMENT_STRING_FIELDS, ELEMENT_INT_FIELDS)
+                         for _ in range(rng.randint(0, 4))]
+    ensure_ascii = rng.random() < 0.5
+    text = json.dumps(doc, ensure_ascii=ensure_ascii,
+                      indent=rng.choice((None, 0, 2, "\t")),
+                      separators=rng.choice(((",", ":"), (", ", ": "), (" , ", " : "))))
+    return numbers.splice(text), ensure_ascii
+
+
+# cJSON as ESP-IDF's json component builds it on a 32 bit target: next, prev, child, type,
+# valuestring, valueint, valuedouble and string, padded for the double
+CJSON_NODE_SIZE = 40
+# What fetch_ota_manifest read into its buffer before handing it to cJSON_Parse
+CJSON_BUFFER = 1024
+
+
+def cjson_heap(value):
+    """Bytes the cJSON tree of a document holds at once: a node per value, each key and string copied
+    with its terminator. Allocator overhead is not counted, so this is the least cJSON_Parse takes"""
+    size = CJSON_NODE_SIZE
+    if isinstance(value, str):
+        size += len(value.encode("utf-8")) + 1
+    elif isinstance(value, list):
+        size += sum(cjson_heap(v) for v in value)
+    elif isinstance(value, dict):
+        size += sum(len(k.encode("utf-8")) + 1 + cjson_heap(v) for k, v in value.items())
+    return size
+
+
+def print_heap(docs, heaps):
+    cjson = sorted(cjson_heap(json.loads(text)) for text, _ in docs)
+    fitting = sorted(cjson_heap(json.loads(text)) for text, _ in docs if len(text.encode("utf-8")) < CJSON_BUFFER)
+    print("Peak heap: json_fields %d bytes at most, cJSON at least %d median, %d max, "
+          "%d max of the %d documents its %d byte buffer could hold" %
+          (max(heaps), cjson[len(cjson) // 2], cjson[-1], fitting[-1] if fitting else 0, len(fitting), CJSON_BUFFER))
+
+
+def expected_string(value, size, ensure_ascii):
+    """What the parser stores: \\u escapes above ASCII become '?', raw UTF-8 is kept byte for byte"""
+    if not isinstance(value, str):
+        return ""
+    if ensure_ascii:
+        units = value.encode("utf-16-le")
+        data = bytes(b if (b < 0x80 and h == 0) else ord("?") for b, h in zip(units[0::2], units[1::2]))
+    else:
+        data = value.encode("utf-8")
+    return "" if len(data) > size - 1 else data.decode("latin-1")
+
+
+def expected_int(value):
+    if isinstance(value, bool) or not isinstance(value, (int, Decimal)):
+        return 0
+    return max(-2**31, min(2**31 - 1, int(value)))
+
+
+def expected_fields(obj, string_fields, int_fields, ensure_ascii):
+    result = {name: expected_string(obj.get(name), size, ensure_ascii) for name, size in string_fields.items()}
+    result.update({name: expected_int(obj.get(name)) for name in int_fields})
+    return result
+
+
+def expected(text, ensure_ascii):
+    doc = json.loads(text, parse_float=Decimal, parse_int=int)
+    result = expected_fields(doc, STRING_FIELDS, INT_FIELDS, ensure_ascii)
+    builds = doc.get("builds")
+    result["builds"] = [expected_fields(e, ELEMENT_STRING_FIELDS, ELEMENT_INT_FIELDS, ensure_ascii)
+                        for e in builds] if isinstance(builds, list) else []
+    result["ok"] = True
+    result["cut_ok"] = False
+    return result
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Chunk split fuzz of json_fields against Python's json")
+    parser.add_argument("harness", help="test_json_fields executable")
+    parser.add_argument("--count", type=int, default=2000)
+    parser.add_argument("--seed", type=int, default=1)
+    args = parser.parse_args()
+
+    rng = random.Random(args.seed)
+    docs = [random_document(rng) for _ in range(args.count)]
+    stdin = b"\0".join(text.encode("utf-8") for text, _ in docs)
+    out = subprocess.run([args.harness, str(args.seed)], input=stdin, stdout=subprocess.PIPE, check=True).stdout
+
+    lines = out.decode("utf-8").splitlines()
+    if len(lines) != len(docs):
+        print("%d documents in, %d results out" % (len(docs), len(lines)))
+        return 1
+
+    failures = 0
+    heaps = []
+    for (text, ensure_ascii), line in zip(docs, lines):
+        want = expected(text, ensure_ascii)
+        got = json.loads(line)
+        heaps.append(got.pop("heap"))
+        if got != want:
+            failures += 1
+            if failures <= 5:
+                print("Document:", text)
+                print("  parsed:  ", got)
+                print("  expected:", want)
+    print("%d of %d documents differ" % (failures, len(docs)))
+    print_heap(docs, heaps)
+    if max(heaps) != 0:
+        print("json_fields allocated while parsing")
+        return 1
+    return 1 if failures else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,66 @@
+import os
+import sys
+import random
+import argparse
+import subprocess
+import tempfile
+
+# Streams from lzss_stream.py must decode with components/lzss-stream, and the device encoder's
+# streams must decode with lzss_stream.py, with the Kconfig defaults test_lzss is built with
+#
+#   python3 lzss_cross.py build/test_lzss
+
+ROOT = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..")
+sys.path.insert(0, ROOT)
+import lzss_stream  # noqa: E402
+
+WINDOW_BITS = 10
+LOOKAHEAD_BITS = 5
+
+
+def samples(rng):
+    yield b""
+    yield b"a"
+    yield bytes(rng.randrange(256) for _ in range(5000))
+    yield b"\0" * 20000
+    text = b"".join(b"I (%d) gate: Door %d unlocked by user %d\n" % (i * 37, rng.randrange(4), rng.randrange(32))
+                    for i in range(600))
+    yield text
+    with open(os.path.join(ROOT, "lzss_stream.py"), "rb") as f:
+        yield f.read()
+
+
+def run(harness, mode, data, seed):
+    with tempfile.TemporaryDirectory() as tmp:
+        src = os.path.join(tmp, "in")
+        dst = os.path.join(tmp, "out")
+        with open(src, "wb") as f:
+            f.write(data)
+        subprocess.run([harness, mode, src, dst, str(seed)], check=True)
+        with open(dst, "rb") as f:
+            return f.read()
+
+
+def main():
+    parser = argparse.ArgumentParser(description="lzss_stream.py against the device encoder and decoder")
+    parser.add_argument("harness", help="test_lzss executable")
+    parser.add_argument("--seed", type=int, default=1)
+    args = parser.parse_args()
+
+    rng = random.Random(args.seed)
+    failures = 0
+    for i, raw in enumerate(samples(rng)):
+        packed = lzss_stream.compress(raw, WINDOW_BITS, LOOKAHEAD_BITS)
+        if run(args.harness, "decode", packed, args.seed + i) != raw:
+            print("sample %d: lzss_stream.py stream of %d bytes does not decode on the device" % (i, len(raw)))
+            failures += 1
+        device = run(args.harness, "encode", raw, args.seed + i)
+        if lzss_stream.decompress(device, WINDOW_BITS, LOOKAHEAD_BITS) != raw:
+            print("sample %d: device stream of %d bytes does not decode with lzss_stream.py" % (i, len(raw)))
+            failures += 1
+    print("%d failures" % failures)
+    return 1 if failures else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,70 @@
+import os
+import sys
+import random
+
+# Regenerates vectors/ota_delta: old.bin, and <case>.new with its <case>.patch from ota_delta.py.
+# test_ota_delta replays the patches through components/ota-service/ota_delta.c.
+# The files are checked in so a change to either side shows up as a failing replay.
+#
+#   python3 ota_delta_vectors.py
+
+ROOT = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..")
+sys.path.insert(0, ROOT)
+import ota_delta  # noqa: E402
+
+OUT = os.path.join(os.path.dirname(os.path.abspath(__file__)), "vectors", "ota_delta")
+
+
+def fake_image(rng, size):
+    """Code-like: a few hundred distinct 32..200 byte functions and tables, many of them repeated"""
+    pieces = [bytes(rng.randrange(256) for _ in range(rng.randint(32, 200))) for _ in range(40)]
+    out = bytearray(b"\xe9\x03\x02\x20" + b"\0" * 28)
+    while len(out) < size:
+        out += rng.choice(pieces) if rng.random() < 0.7 else b"home-node v1.4.%d\0" % rng.randrange(10)
+    return bytes(out[:size])
+
+
+def cases(rng, old):
+    yield "same", old
+
+    edit = bytearray(old)
+    for _ in range(6):
+        edit[rng.randrange(len(edit))] ^= 0xFF
+    edit[100:116] = b"home-node v1.5.0"
+    yield "edit", bytes(edit)
+
+    # New code in the middle and a function moved to the end
+    insert = old[:2000] + bytes(rng.randrange(256) for _ in range(700)) + old[2000:5000] + old[5200:] + old[5000:5200]
+    yield "insert", insert
+
+    yield "shrink", old[:1500] + old[3500:6000]
+
+    yield "grow", old + old[1000:3000] + bytes(rng.randrange(256) for _ in range(300))
+
+    yield "unrelated", bytes(rng.randrange(256) for _ in range(1200))
+
+    yield "empty", b""
+
+
+def main():
+    rng = random.Random(1)
+    old = fake_image(rng, 6144)
+    os.makedirs(OUT, exist_ok=True)
+    with open(os.path.join(OUT, "old.bin"), "wb") as f:
+        f.write(old)
+
+    for name, new in cases(rng, old):
+        patch = ota_delta.make_patch(old, new)
+        if ota_delta.apply_patch(old, patch) != new:
+            print("%s: patch does not rebuild the new image" % name)
+            return 1
+        with open(os.path.join(OUT, name + ".new"), "wb") as f:
+            f.write(new)
+        with open(os.path.join(OUT, name + ".patch"), "wb") as f:
+            f.write(patch)
+        print("%-10s %5d bytes, patch %5d" % (name, len(new), len(patch)))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,10 @@
+#pragma once
+#include <stddef.h>
+
+//Fixed size object pool, the test provides it
+
+typedef void* bank_pool_handle_t;
+
+int bank_register_pool(bank_pool_handle_t* handle, void* objects, size_t object_size, size_t count);
+void* bank_alloc(bank_pool_handle_t handle);
+void bank_free(bank_pool_handle_t handle, void* object);
@@ -0,0 +1,62 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+
+//The part of esp_http_server the http-server component uses, the test is the server: it implements
+//these, calls the registered handlers and runs the queued work
+
+typedef void* httpd_handle_t;
+typedef enum { HTTP_GET = 1, HTTP_POST = 3 } httpd_method_t;
+
+typedef struct httpd_req {
+    httpd_handle_t handle;
+    int method;
+    char uri[513];
+    size_t content_len;
+    void* aux;
+    void* user_ctx;
+    void* sess_ctx;
+} httpd_req_t;
+
+typedef struct {
+    const char* uri;
+    httpd_method_t method;
+    esp_err_t (*handler)(httpd_req_t* req);
+    void* user_ctx;
+} httpd_uri_t;
+
+typedef bool (*httpd_uri_match_func_t)(const char* reference_uri, const char* uri_to_match, size_t match_upto);
+
+typedef struct {
+    uint16_t server_port;
+    uint16_t max_open_sockets;
+    uint16_t max_uri_handlers;
+    bool lru_purge_enable;
+    httpd_uri_match_func_t uri_match_fn;
+} httpd_config_t;
+
+#define HTTPD_DEFAULT_CONFIG()      { .server_port = 80, .max_open_sockets = 7, .max_uri_handlers = 8 }
+#define HTTPD_RESP_USE_STRLEN       -1
+
+typedef void (*httpd_work_fn_t)(void* arg);
+
+bool httpd_uri_match_wildcard(const char* reference_uri, const char* uri_to_match, size_t match_upto);
+esp_err_t httpd_start(httpd_handle_t* handle, const httpd_config_t* config);
+esp_err_t httpd_stop(httpd_handle_t handle);
+esp_err_t httpd_register_uri_handler(httpd_handle_t handle, const httpd_uri_t* uri_handler);
+esp_err_t httpd_resp_set_type(httpd_req_t* req, const char* type);
+esp_err_t httpd_resp_set_hdr(httpd_req_t* req, const char* field, const char* value);
+esp_err_t httpd_resp_set_status(httpd_req_t* req, const char* status);
+esp_err_t httpd_resp_send(httpd_req_t* req, const char* buf, ssize_t len);
+esp_err_t httpd_resp_send_chunk(httpd_req_t* req, const char* buf, ssize_t len);
+esp_err_t httpd_queue_work(httpd_handle_t handle, httpd_work_fn_t work, void* arg);
+esp_err_t httpd_req_async_handler_begin(httpd_req_t* req, httpd_req_t** out);
+esp_err_t httpd_req_async_handler_complete(httpd_req_t* req);
+int httpd_req_to_sockfd(httpd_req_t* req);
+esp_err_t httpd_sess_trigger_close(httpd_handle_t handle, int sockfd);
+esp_err_t httpd_req_get_url_query_str(httpd_req_t* req, char* buf, size_t len);
+esp_err_t httpd_query_key_value(const char* query, const char* key, char* val, size_t len);
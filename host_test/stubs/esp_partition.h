@@ -0,0 +1,12 @@
+#pragma once
+#include "esp_err.h"
+
+//Just enough of a partition for the host tests, which provide esp_partition_read over a buffer
+
+typedef struct {
+    uint32_t address;
+    uint32_t size;
+    char label[17];
+} esp_partition_t;
+
+esp_err_t esp_partition_read(const esp_partition_t* partition, size_t src_offset, void* dst, size_t size);
@@ -0,0 +1,16 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+
+//The adapter's functions are the test's, it sees every posted event and decides whether the post succeeds
+
+typedef const char* esp_event_base_t;
+
+#define DECLARE_EVENT_ADAPTER(name) \
+    extern esp_event_base_t name##_ROUTINE_EVENT_BASE; \
+    esp_err_t name##_post_event(int32_t id, const void* data, size_t len); \
+    esp_err_t name##_register_event(int32_t id, void* handler, void* arg);
+
+#define DEFINE_EVENT_ADAPTER(name) \
+    esp_event_base_t name##_ROUTINE_EVENT_BASE = #name;
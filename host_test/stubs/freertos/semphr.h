@@ -0,0 +1,53 @@
+#pragma once
+#include <stdlib.h>
+#include "freertos/FreeRTOS.h"
+
+//Counting semaphores on a single thread. A take that would block calls the test's host_semaphore_blocked,
+//if it has one, as whatever other task runs while this one waits. If that gave nothing the take fails.
+//A mutex is a semaphore of one
+
+void host_semaphore_blocked(SemaphoreHandle_t sem, TickType_t ticks) __attribute__((weak));
+
+struct host_semaphore {
+    UBaseType_t count;
+    UBaseType_t max;
+};
+
+typedef struct host_semaphore StaticSemaphore_t;
+
+static inline SemaphoreHandle_t xSemaphoreCreateCountingStatic(UBaseType_t max, UBaseType_t initial,
+                                                               StaticSemaphore_t* buffer)
+{
+    buffer->count = initial;
+    buffer->max = max;
+    return buffer;
+}
+
+static inline SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+    return xSemaphoreCreateCountingStatic(1, 1, malloc(sizeof(StaticSemaphore_t)));
+}
+
+static inline BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t ticks)
+{
+    struct host_semaphore* s = sem;
+    if (s->count == 0 && ticks > 0 && host_semaphore_blocked != NULL) {
+        host_semaphore_blocked(sem, ticks);
+    }
+    if (s->count == 0) return pdFALSE;
+    s->count--;
+    return pdTRUE;
+}
+
+static inline BaseType_t xSemaphoreGive(SemaphoreHandle_t sem)
+{
+    struct host_semaphore* s = sem;
+    if (s->count == s->max) return pdFALSE;
+    s->count++;
+    return pdTRUE;
+}
+
+static inline UBaseType_t uxSemaphoreGetCount(SemaphoreHandle_t sem)
+{
+    return ((struct host_semaphore*)sem)->count;
+}
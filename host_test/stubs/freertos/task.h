@@ -0,0 +1,20 @@
+#pragma once
+#include "freertos/FreeRTOS.h"
+
+//No scheduler: tasks are not started, a test calls the task function itself.
+//vTaskDelay is the test's, it is where a task's loop hands control back
+
+void vTaskDelay(TickType_t ticks);
+
+static inline BaseType_t xTaskCreate(void (*task)(void*), const char* name, uint32_t stack, void* arg,
+                                     int priority, TaskHandle_t* handle)
+{
+    static int created;
+    if (handle != NULL) *handle = &created;
+    return pdPASS;
+}
+
+static inline void vTaskDelete(TaskHandle_t task) {}
+
+static inline void taskENTER_CRITICAL(portMUX_TYPE* mux) {}
+static inline void taskEXIT_CRITICAL(portMUX_TYPE* mux) {}
@@ -0,0 +1,14 @@
+#pragma once
+#include <stddef.h>
+#include <stdbool.h>
+
+//The log-capture component's snapshot API, provided by the test
+
+typedef struct {
+    bool initialized;
+    size_t cursor;
+    size_t end;
+} log_snapshot_t;
+
+void log_snapshot_take(log_snapshot_t* snap);
+size_t log_snapshot_read(log_snapshot_t* snap, char* buf, size_t len);
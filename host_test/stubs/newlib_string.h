@@ -0,0 +1,15 @@
+#pragma once
+#include <string.h>
+
+//What ESP-IDF's newlib has in string.h and glibc before 2.38 does not
+
+static inline size_t strlcpy(char* dst, const char* src, size_t size)
+{
+    size_t len = strlen(src);
+    if (size > 0) {
+        size_t n = len < size - 1 ? len : size - 1;
+        memcpy(dst, src, n);
+        dst[n] = '\0';
+    }
+    return len;
+}
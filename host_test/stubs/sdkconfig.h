@@ -0,0 +1,68 @@
+#pragma once
+
+//Kconfig defaults of the host tested components, a test overrides one with a compile definition
+
+#ifndef CONFIG_LZSS_WINDOW_BITS
+#define CONFIG_LZSS_WINDOW_BITS             10
+#endif
+#ifndef CONFIG_LZSS_LOOKAHEAD_BITS
+#define CONFIG_LZSS_LOOKAHEAD_BITS          5
+#endif
+#ifndef CONFIG_LZSS_OUTPUT_BUFFER_SIZE
+#define CONFIG_LZSS_OUTPUT_BUFFER_SIZE      512
+#endif
+#ifndef CONFIG_LZSS_ENCODER_CHAIN
+#define CONFIG_LZSS_ENCODER_CHAIN           16
+#endif
+
+#ifndef CONFIG_SD_MOUNT_POINT
+#define CONFIG_SD_MOUNT_POINT               "/sdcard"
+#endif
+#ifndef CONFIG_SD_LOG_BUFFER_SIZE
+#define CONFIG_SD_LOG_BUFFER_SIZE           16384
+#endif
+#ifndef CONFIG_SD_LOG_SYNC_INTERVAL_S
+#define CONFIG_SD_LOG_SYNC_INTERVAL_S       30
+#endif
+#ifndef CONFIG_SD_LOG_SEGMENT_SIZE_KB
+#define CONFIG_SD_LOG_SEGMENT_SIZE_KB       1024
+#endif
+#ifndef CONFIG_SD_LOG_SEGMENT_COUNT
+#define CONFIG_SD_LOG_SEGMENT_COUNT         16
+#endif
+
+#ifndef CONFIG_METRICS_MAX_METRICS
+#define CONFIG_METRICS_MAX_METRICS          96
+#endif
+#ifndef CONFIG_METRICS_MAX_HISTOGRAMS
+#define CONFIG_METRICS_MAX_HISTOGRAMS       32
+#endif
+#ifndef CONFIG_METRICS_MAX_BUCKETS
+#define CONFIG_METRICS_MAX_BUCKETS          16
+#endif
+
+#ifndef CONFIG_HTTP_SERVER_MAX_URIS
+#define CONFIG_HTTP_SERVER_MAX_URIS             5
+#endif
+#ifndef CONFIG_HTTP_SERVER_MAX_ASYNC_REQUESTS
+#define CONFIG_HTTP_SERVER_MAX_ASYNC_REQUESTS   4
+#endif
+#ifndef CONFIG_HTTP_SERVER_CHUNKS_PER_REQUEST
+#define CONFIG_HTTP_SERVER_CHUNKS_PER_REQUEST   4
+#endif
+#ifndef CONFIG_HTTP_SERVER_CHUNK_SIZE
+#define CONFIG_HTTP_SERVER_CHUNK_SIZE           256
+#endif
+#ifndef CONFIG_HTTP_SERVER_CHUNK_WAIT_TIMEOUT_MS
+#define CONFIG_HTTP_SERVER_CHUNK_WAIT_TIMEOUT_MS 2000
+#endif
+
+#ifndef CONFIG_DELEGATE_WORKER_COUNT
+#define CONFIG_DELEGATE_WORKER_COUNT            2
+#endif
+#ifndef CONFIG_DELEGATE_LANE_DEPTH
+#define CONFIG_DELEGATE_LANE_DEPTH              4
+#endif
+#ifndef CONFIG_DELEGATE_WORKER_STACK_SIZE
+#define CONFIG_DELEGATE_WORKER_STACK_SIZE       4096
+#endif
@@ -0,0 +1,64 @@
+#pragma once
+#include <stdlib.h>
+#include "freertos/FreeRTOS.h"
+
+//Tasks are detached threads, pinning is ignored. Notifications are a counter under the task's own
+//mutex, only the portMAX_DELAY wait is supported
+
+struct host_task {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t notified;
+    uint32_t notifications;
+    void (*func)(void*);
+    void* arg;
+};
+
+static __thread struct host_task* host_task_self;
+
+static inline void* host_task_main(void* arg)
+{
+    host_task_self = arg;
+    host_task_self->func(host_task_self->arg);
+    return NULL;
+}
+
+static inline BaseType_t xTaskCreatePinnedToCore(void (*func)(void*), const char* name, uint32_t stack, void* arg,
+                                                 UBaseType_t priority, TaskHandle_t* handle, BaseType_t core)
+{
+    struct host_task* task = calloc(1, sizeof(*task));
+    if (task == NULL) return pdFALSE;
+    pthread_mutex_init(&task->lock, NULL);
+    pthread_cond_init(&task->notified, NULL);
+    task->func = func;
+    task->arg = arg;
+    if (handle != NULL) *handle = task;
+    if (pthread_create(&task->thread, NULL, host_task_main, task) != 0) return pdFALSE;
+    pthread_detach(task->thread);
+    return pdPASS;
+}
+
+static inline uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t ticks)
+{
+    struct host_task* task = host_task_self;
+    pthread_mutex_lock(&task->lock);
+    while (task->notifications == 0) {
+        pthread_cond_wait(&task->notified, &task->lock);
+    }
+    uint32_t value = task->notifications;
+    task->notifications = clear ? 0 : value - 1;
+    pthread_mutex_unlock(&task->lock);
+    return value;
+}
+
+static inline BaseType_t xTaskNotifyGive(TaskHandle_t task)
+{
+    pthread_mutex_lock(&task->lock);
+    task->notifications++;
+    pthread_cond_signal(&task->notified);
+    pthread_mutex_unlock(&task->lock);
+    return pdPASS;
+}
+
+#define taskENTER_CRITICAL(mux)     pthread_mutex_lock(mux)
+#define taskEXIT_CRITICAL(mux)      pthread_mutex_unlock(mux)
@@ -0,0 +1,25 @@
+#pragma once
+#include <stddef.h>
+#include <stdbool.h>
+#include <time.h>
+
+//The time-service component's API as the SD logger uses it, provided by the test
+
+#define TIME_SERVICE_STR_BUF_SIZE   32
+
+typedef struct {
+    bool success;
+    struct {
+        long delta_sec;
+        time_t old_time;
+        time_t new_time;
+    } jump;
+} time_sync_result_t;
+
+typedef struct {
+    bool synced;
+} time_init_result_t;
+
+int time_service_now_str(int offset_s, char* buf, size_t size);
+void time_service_init(time_init_result_t* result);
+void time_service_sync_async(void (*callback)(const time_sync_result_t* result));
@@ -0,0 +1,130 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "check.h"
+
+/*
+ * Delegate executor throughput against its worker count, built once per count. The workers are
+ * threads (stubs/threaded), jobs are posted from the main thread as the event loop would, never more
+ * than the lanes hold so none is rejected.
+ *
+ * Delegated jobs mostly wait, on a socket for a log dump or on flash for OTA, so the job that has
+ * to scale is a sleep: JOB_US of it should run WORKER_COUNT at a time on the high lane, and one
+ * fewer on the low lane, where one worker is kept free. A job that only computes is timed too, it
+ * can only scale with the host's cores and is not checked.
+ */
+
+#include "delegate_executor.c"
+
+#define JOBS        1000
+#define JOB_US      500
+#define CPU_JOBS    500
+
+struct metric {
+    uint64_t value;
+};
+
+static struct metric counters[8];
+static int counter_count;
+
+static uint64_t jobs_done;
+static volatile uint32_t cpu_sink;
+
+
+metric_t *metrics_register_counter(const char *name, const char *labels, const char *help)
+{
+    return &counters[counter_count++];
+}
+
+
+void metrics_counter_add(metric_t *metric, uint32_t value)
+{
+    __atomic_fetch_add(&metric->value, value, __ATOMIC_RELAXED);
+}
+
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static void sleep_job(void *ctx)
+{
+    usleep(JOB_US);
+    __atomic_fetch_add(&jobs_done, 1, __ATOMIC_RELEASE);
+}
+
+
+static void cpu_job(void *ctx)
+{
+    uint32_t x = (uint32_t)(uintptr_t)ctx;
+    for (int i = 0; i < 100000; i++) {
+        x = x * 1103515245 + 12345;
+    }
+    cpu_sink = x;
+    __atomic_fetch_add(&jobs_done, 1, __ATOMIC_RELEASE);
+}
+
+
+/// @return jobs a second
+static double run(delegate_lane_t lane, delegate_func_t func, int jobs)
+{
+    int capacity = WORKER_COUNT * LANE_DEPTH;
+    uint64_t saturated = delegate_executor.saturated[lane]->value;
+
+    __atomic_store_n(&jobs_done, 0, __ATOMIC_RELEASE);
+    double start = now_s();
+    for (int posted = 0; posted < jobs; posted++) {
+        //The lanes hold capacity jobs waiting, the ones running are out of them already
+        while (posted - (int)__atomic_load_n(&jobs_done, __ATOMIC_ACQUIRE) >= capacity) {
+            usleep(20);
+        }
+        CHECK_INT(delegate_post(lane, func, (void *)(uintptr_t)posted), ESP_OK);
+    }
+    while (__atomic_load_n(&jobs_done, __ATOMIC_ACQUIRE) < (uint64_t)jobs) {
+        usleep(100);
+    }
+    double elapsed = now_s() - start;
+
+    CHECK_INT(delegate_executor.saturated[lane]->value, saturated);
+    return jobs / elapsed;
+}
+
+
+/// @return what one thread gets through, one sleep after the other
+static double serial_rate(void)
+{
+    double start = now_s();
+    for (int i = 0; i < JOBS / 10; i++) {
+        usleep(JOB_US);
+    }
+    return JOBS / 10 / (now_s() - start);
+}
+
+
+int main(void)
+{
+    CHECK_INT(delegate_executor_init(), ESP_OK);
+
+    double serial = serial_rate();
+    double high = run(DELEGATE_LANE_HIGH, sleep_job, JOBS);
+    double low = run(DELEGATE_LANE_LOW, sleep_job, JOBS);
+    double cpu = run(DELEGATE_LANE_HIGH, cpu_job, CPU_JOBS);
+
+    printf("%d workers, %d us jobs: %6.0f jobs/s high lane (x%.2f serial), %6.0f jobs/s low lane (x%.2f), "
+           "compute %6.0f jobs/s on %ld cores, %llu steals\n",
+           WORKER_COUNT, JOB_US, high, high / serial, low, low / serial, cpu, sysconf(_SC_NPROCESSORS_ONLN),
+           (unsigned long long)delegate_executor.steals->value);
+
+    //Workers sleep side by side, however few cores the host has
+    CHECK(high > serial * WORKER_COUNT * 0.75);
+    CHECK(high < serial * WORKER_COUNT * 1.25);
+    CHECK(low > serial * MAX_LOW_LANE_RUNNING * 0.75);
+    CHECK(low < serial * MAX_LOW_LANE_RUNNING * 1.25);
+    return check_failures != 0;
+}
@@ -0,0 +1,442 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "check.h"
+#include "newlib_string.h"
+
+/*
+ * http_server's async requests and chunked responses, with the test as esp_http_server: it calls
+ * the registered handlers as httpd would and runs the queued work when it chooses, which is when
+ * the server task would get to it, or while a producer waits for a free job.
+ * Built with a larger route table than the default, to time dispatch as routes are added.
+ */
+
+#include "http_server.c"
+
+#define WORK_QUEUE_SIZE     64
+#define RESPONSE_SIZE       8192
+#define SLOW_CHUNKS         100
+#define BENCH_REQUESTS      20000
+#define BENCH_ROUNDS        5
+
+typedef struct {
+    httpd_work_fn_t work;
+    void *arg;
+} work_t;
+
+static work_t work_queue[WORK_QUEUE_SIZE];
+static int work_head, work_tail;
+static int queue_failures;          //The next this many httpd_queue_work calls fail
+static int consumer_batch;          //Jobs the server task gets through while a producer waits, 0 when stalled
+
+static httpd_uri_t handlers[64];
+static int handler_count;
+
+static char response[RESPONSE_SIZE + 1];
+static size_t response_len;
+static bool response_ended;
+
+static http_request_t *last_request;
+static httpd_config_t started_config;
+
+
+//---------- metrics-registry ----------
+
+struct metric {
+    uint64_t value;
+};
+
+static struct metric metric_table[256];
+static int metric_count;
+
+
+metric_t *metrics_register_counter(const char *name, const char *labels, const char *help)
+{
+    return &metric_table[metric_count++];
+}
+
+
+metric_t *metrics_register_histogram(const char *name, const char *labels, const char *help,
+                                     const uint32_t *bounds, uint8_t bucket_count)
+{
+    return &metric_table[metric_count++];
+}
+
+
+void metrics_counter_add(metric_t *metric, uint32_t value)
+{
+    metric->value += value;
+}
+
+
+void metrics_histogram_observe(metric_t *metric, uint32_t value)
+{
+    metric->value++;
+}
+
+
+uint64_t metrics_counter_read(const metric_t *metric)
+{
+    return metric->value;
+}
+
+
+esp_err_t metrics_render_text(metrics_write_t write, void *ctx)
+{
+    return ESP_OK;
+}
+
+
+esp_err_t metrics_render_binary(metrics_write_t write, void *ctx)
+{
+    return ESP_OK;
+}
+
+
+int64_t esp_timer_get_time(void)
+{
+    static int64_t now_us;
+    return now_us += 10;
+}
+
+
+//---------- bank-pool ----------
+
+static void *bank_objects;
+static size_t bank_object_size;
+static bool bank_used[MAX_ASYNC_REQUESTS];
+
+
+int bank_register_pool(bank_pool_handle_t *handle, void *objects, size_t object_size, size_t count)
+{
+    bank_objects = objects;
+    bank_object_size = object_size;
+    *handle = objects;
+    return 0;
+}
+
+
+void *bank_alloc(bank_pool_handle_t handle)
+{
+    for (int i = 0; i < MAX_ASYNC_REQUESTS; i++) {
+        if (!bank_used[i]) {
+            bank_used[i] = true;
+            return (char *)bank_objects + i * bank_object_size;
+        }
+    }
+    return NULL;
+}
+
+
+void bank_free(bank_pool_handle_t handle, void *object)
+{
+    bank_used[((char *)object - (char *)bank_objects) / bank_object_size] = false;
+}
+
+
+//---------- esp_http_server ----------
+
+bool httpd_uri_match_wildcard(const char *reference_uri, const char *uri_to_match, size_t match_upto)
+{
+    return strncmp(reference_uri, uri_to_match, match_upto) == 0;
+}
+
+
+esp_err_t httpd_start(httpd_handle_t *handle, const httpd_config_t *config)
+{
+    static int server;
+    *handle = &server;
+    started_config = *config;
+    return ESP_OK;
+}
+
+
+esp_err_t httpd_stop(httpd_handle_t handle)
+{
+    return ESP_OK;
+}
+
+
+esp_err_t httpd_register_uri_handler(httpd_handle_t handle, const httpd_uri_t *uri_handler)
+{
+    handlers[handler_count++] = *uri_handler;
+    return ESP_OK;
+}
+
+
+esp_err_t httpd_resp_set_type(httpd_req_t *req, const char *type) { return ESP_OK; }
+esp_err_t httpd_resp_set_hdr(httpd_req_t *req, const char *field, const char *value) { return ESP_OK; }
+esp_err_t httpd_resp_set_status(httpd_req_t *req, const char *status) { return ESP_OK; }
+
+
+esp_err_t httpd_resp_send_chunk(httpd_req_t *req, const char *buf, ssize_t len)
+{
+    if (buf == NULL) {
+        response_ended = true;
+        return ESP_OK;
+    }
+    if (len == HTTPD_RESP_USE_STRLEN) len = strlen(buf);
+    CHECK(response_len + len <= RESPONSE_SIZE);
+    memcpy(response + response_len, buf, len);
+    response_len += len;
+    return ESP_OK;
+}
+
+
+esp_err_t httpd_resp_send(httpd_req_t *req, const char *buf, ssize_t len)
+{
+    httpd_resp_send_chunk(req, buf, len);
+    return httpd_resp_send_chunk(req, NULL, 0);
+}
+
+
+esp_err_t httpd_queue_work(httpd_handle_t handle, httpd_work_fn_t work, void *arg)
+{
+    if (queue_failures > 0) {
+        queue_failures--;
+        return ESP_FAIL;
+    }
+    CHECK(work_tail - work_head < WORK_QUEUE_SIZE);
+    work_queue[work_tail++ % WORK_QUEUE_SIZE] = (work_t){work, arg};
+    return ESP_OK;
+}
+
+
+esp_err_t httpd_req_async_handler_begin(httpd_req_t *req, httpd_req_t **out)
+{
+    *out = malloc(sizeof(httpd_req_t));
+    **out = *req;
+    return ESP_OK;
+}
+
+
+esp_err_t httpd_req_async_handler_complete(httpd_req_t *req)
+{
+    free(req);
+    return ESP_OK;
+}
+
+
+int httpd_req_to_sockfd(httpd_req_t *req) { return 3; }
+esp_err_t httpd_sess_trigger_close(httpd_handle_t handle, int sockfd) { return ESP_OK; }
+esp_err_t httpd_req_get_url_query_str(httpd_req_t *req, char *buf, size_t len) { return ESP_ERR_NOT_FOUND; }
+esp_err_t httpd_query_key_value(const char *query, const char *key, char *val, size_t len) { return ESP_ERR_NOT_FOUND; }
+
+
+static void run_one(void)
+{
+    work_t item = work_queue[work_head++ % WORK_QUEUE_SIZE];
+    item.work(item.arg);
+}
+
+
+/// @brief The server task catching up with everything queued so far
+static void run_work(void)
+{
+    while (work_head < work_tail) {
+        run_one();
+    }
+}
+
+
+/// @brief A producer waits for a job, the server task sends consumer_batch chunks in the meantime
+void host_semaphore_blocked(SemaphoreHandle_t sem, TickType_t ticks)
+{
+    CHECK_INT(ticks, pdMS_TO_TICKS(CHUNK_WAIT_TIMEOUT_MS));
+    for (int i = 0; i < consumer_batch && work_head < work_tail; i++) {
+        run_one();
+    }
+}
+
+
+/// @brief httpd matching a request to its handler and calling it
+static esp_err_t dispatch(const char *uri)
+{
+    httpd_req_t req = {0};
+    snprintf(req.uri, sizeof(req.uri), "%s", uri);
+    for (int i = 0; i < handler_count; i++) {
+        if (strcmp(handlers[i].uri, uri) == 0) {
+            req.user_ctx = handlers[i].user_ctx;
+            return handlers[i].handler(&req);
+        }
+    }
+    return ESP_ERR_NOT_FOUND;
+}
+
+
+static void keep_request(http_request_t *req, const char *uri)
+{
+    last_request = req;
+}
+
+
+static void reset_response(void)
+{
+    response_len = 0;
+    response_ended = false;
+}
+
+
+/// @brief A chunk whose queueing failed hands its job back, the jobs still queued keep their data
+static void test_queue_failure(void)
+{
+    reset_response();
+    CHECK_INT(dispatch("/log"), ESP_OK);
+    http_request_t *req = last_request;
+    uint64_t dropped = metrics_counter_read(http_server.chunks_dropped);
+
+    //The server task is busy: A waits in the queue while B fails to be queued
+    CHECK_INT(http_server_send_chunked_response(req, "A"), ESP_OK);
+    queue_failures = 1;
+    CHECK_INT(http_server_send_chunked_response(req, "B"), ESP_FAIL);
+    CHECK_INT(http_server_send_chunked_response(req, "C"), ESP_OK);
+    CHECK_INT(http_server_send_chunked_response(req, "D"), ESP_OK);
+    CHECK_INT(http_server_send_chunked_response(req, "E"), ESP_OK);
+    CHECK_INT(metrics_counter_read(http_server.chunks_dropped), dropped + 1);
+
+    run_work();
+    response[response_len] = '\0';
+    CHECK_STR(response, "ACDE");
+
+    CHECK_INT(http_server_send_chunked_response(req, NULL), ESP_OK);
+    run_work();
+    CHECK(response_ended);
+    CHECK(!bank_used[0] && !bank_used[1]);
+}
+
+
+/// @brief A client reading slower than the log is produced blocks the producer, and loses nothing
+static void test_slow_consumer(void)
+{
+    static char expected[RESPONSE_SIZE];
+    size_t expected_len = 0;
+
+    reset_response();
+    CHECK_INT(dispatch("/log"), ESP_OK);
+    http_request_t *req = last_request;
+    uint64_t sent = metrics_counter_read(http_server.chunks_sent);
+    uint64_t dropped = metrics_counter_read(http_server.chunks_dropped);
+    uint64_t waits = metrics_counter_read(http_server.backpressure_waits);
+
+    //One chunk goes out for each one the producer waits on
+    consumer_batch = 1;
+    for (int i = 0; i < SLOW_CHUNKS; i++) {
+        char chunk[64];
+        int len = snprintf(chunk, sizeof(chunk), "I (%d) gate: line %d of the log\n", i * 10, i);
+        CHECK_INT(http_server_send_chunked_response(req, chunk), ESP_OK);
+        memcpy(expected + expected_len, chunk, len);
+        expected_len += len;
+    }
+    CHECK_INT(http_server_send_chunked_response(req, NULL), ESP_OK);
+    run_work();
+
+    CHECK(response_ended);
+    CHECK_INT(response_len, expected_len);
+    CHECK(memcmp(response, expected, expected_len) == 0);
+    CHECK_INT(metrics_counter_read(http_server.chunks_sent), sent + SLOW_CHUNKS);
+    CHECK_INT(metrics_counter_read(http_server.chunks_dropped), dropped);
+    CHECK_INT(metrics_counter_read(http_server.backpressure_waits), waits + SLOW_CHUNKS - CHUNKS_PER_REQUEST);
+
+    //A client that stops reading costs the chunk only once the wait times out
+    reset_response();
+    CHECK_INT(dispatch("/log"), ESP_OK);
+    req = last_request;
+    consumer_batch = 0;
+    for (int i = 0; i < CHUNKS_PER_REQUEST; i++) {
+        CHECK_INT(http_server_send_chunked_response(req, "x"), ESP_OK);
+    }
+    CHECK_INT(http_server_send_chunked_response(req, "y"), ESP_ERR_TIMEOUT);
+    CHECK_INT(metrics_counter_read(http_server.chunks_dropped), dropped + 1);
+    CHECK_INT(http_server_send_chunked_response(req, NULL), ESP_OK);
+    run_work();
+    CHECK(response_ended);
+    CHECK_INT(response_len, CHUNKS_PER_REQUEST);
+}
+
+
+static void end_request(http_request_t *req, const char *uri)
+{
+    http_server_send_chunked_response(req, NULL);
+}
+
+
+/// @brief The lookup dispatch made before the route came in user_ctx, a strcmp over the table
+static const http_uri_record_t *scan_records(const char *uri)
+{
+    for (int i = 0; i < http_server.uri_count; i++) {
+        if (strcmp(http_server.uri_record[i].uri, uri) == 0) return &http_server.uri_record[i];
+    }
+    return NULL;
+}
+
+
+/// @return the fastest of BENCH_ROUNDS, in ns per request
+static double time_requests(httpd_req_t *req, bool scan)
+{
+    double best = 0;
+    int found = 0;
+
+    for (int round = 0; round < BENCH_ROUNDS; round++) {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = 0; i < BENCH_REQUESTS; i++) {
+            if (scan) {
+                found += scan_records(req->uri) == req->user_ctx;
+            } else {
+                master_request_handler(req);
+                run_work();
+            }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double ns = ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / BENCH_REQUESTS;
+        if (round == 0 || ns < best) best = ns;
+    }
+    CHECK_INT(found, scan ? BENCH_REQUESTS * BENCH_ROUNDS : 0);
+    return best;
+}
+
+
+/// @brief Requests to the last registered route as the table fills up to MAX_URIS. The route comes
+/// through user_ctx, so a request costs the same however many there are. The strcmp scan it replaced
+/// is timed alone, for the last route it is the worst case
+static void bench_dispatch(void)
+{
+    http_server_interface_t *server = http_server_get_interface();
+    double first = 0;
+
+    CHECK_INT(started_config.max_uri_handlers, MAX_URIS);
+    printf("%d requests a round, best of %d\n", BENCH_REQUESTS, BENCH_ROUNDS);
+    for (int routes = http_server.uri_count + 1; routes <= MAX_URIS; routes++) {
+        char uri[24];
+        snprintf(uri, sizeof(uri), "/route-%02d", routes);
+        CHECK_INT(server->register_uri(uri, METHOD_GET, end_request), ESP_OK);
+        if (routes != 2 && routes != 5 && routes % 8 != 0) continue;
+
+        httpd_req_t req = {.user_ctx = &http_server.uri_record[routes - 1]};
+        snprintf(req.uri, sizeof(req.uri), "%s", uri);
+        double dispatch = time_requests(&req, false);
+        double scan = time_requests(&req, true);
+        printf("%2d routes: %6.1f ns a request, the scan alone %6.1f ns\n", routes, dispatch, scan);
+
+        if (first == 0) first = dispatch;
+        //Generous, the host is shared, but a lookup growing with the table would pass it by far
+        CHECK(dispatch < first * 2);
+    }
+    CHECK(!bank_used[0] && !bank_used[1]);
+    CHECK_INT(server->register_uri("/one-too-many", METHOD_GET, end_request), ESP_ERR_NO_MEM);
+}
+
+
+int main(void)
+{
+    http_server_config_t config = HTTP_SERVER_DEFAULT_CONFIG();
+    CHECK_INT(http_server_init(&config), ESP_OK);
+    http_server_interface_t *server = http_server_get_interface();
+    CHECK_INT(server->register_uri("/log", METHOD_GET, keep_request), ESP_OK);
+
+    test_queue_failure();
+    test_slow_consumer();
+    bench_dispatch();
+    return check_failures != 0;
+}
@@ -0,0 +1,186 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "json_fields.h"
+
+/*
+ * Replays documents through json_fields in random sized pieces for json_fields_fuzz.py.
+ * stdin holds the documents separated by NUL bytes; for each one a line of JSON with the fields
+ * the parser extracted goes to stdout, the script compares them to what Python's json reads.
+ * The line also has the heap the parse took: malloc is wrapped at link time and counted while
+ * json_fields runs, the script holds it against what cJSON would have allocated.
+ *
+ *   test_json_fields <seed>
+ */
+
+#define MAX_DOCUMENT    (64 * 1024)
+#define MAX_ELEMENTS    16
+
+static char version[24];
+static char url[96];
+static char sha256[65];
+static int32_t size;
+static int32_t delta_size;
+
+static char element_target[16];
+static int32_t element_size;
+
+static struct {
+    char target[sizeof(element_target)];
+    int32_t size;
+} elements[MAX_ELEMENTS];
+static int element_count;
+
+
+static bool counting;
+static size_t heap_used;
+static size_t heap_peak;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+
+//Frees are not matched to their blocks, json_fields should not allocate at all so the peak is the total
+static void heap_count(size_t size)
+{
+    if (counting) {
+        heap_used += size;
+        if (heap_used > heap_peak) heap_peak = heap_used;
+    }
+}
+
+
+void *__wrap_malloc(size_t size)
+{
+    heap_count(size);
+    return __real_malloc(size);
+}
+
+
+void *__wrap_calloc(size_t count, size_t size)
+{
+    heap_count(count * size);
+    return __real_calloc(count, size);
+}
+
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    heap_count(size);
+    return __real_realloc(ptr, size);
+}
+
+
+static void element_done(void *ctx)
+{
+    if (element_count < MAX_ELEMENTS) {
+        strcpy(elements[element_count].target, element_target);
+        elements[element_count].size = element_size;
+    }
+    element_count++;
+}
+
+static const json_field_t element_fields[] = {
+    {"target", JSON_FIELD_STRING, element_target, sizeof(element_target)},
+    {"size", JSON_FIELD_INT, &element_size, sizeof(element_size)},
+};
+
+static const json_object_array_t builds = {
+    element_fields, sizeof(element_fields) / sizeof(element_fields[0]), element_done, NULL
+};
+
+static const json_field_t fields[] = {
+    {"version", JSON_FIELD_STRING, version, sizeof(version)},
+    {"url", JSON_FIELD_STRING, url, sizeof(url)},
+    {"sha256", JSON_FIELD_STRING, sha256, sizeof(sha256)},
+    {"size", JSON_FIELD_INT, &size, sizeof(size)},
+    {"delta_size", JSON_FIELD_INT, &delta_size, sizeof(delta_size)},
+    {"builds", JSON_FIELD_OBJECT_ARRAY, (void *)&builds, 0},
+};
+
+
+static void print_string(const char *s)
+{
+    putchar('"');
+    for (; *s != '\0'; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') printf("\\%c", c);
+        else if (c < 0x20 || c >= 0x7F) printf("\\u%04x", c);
+        else putchar(c);
+    }
+    putchar('"');
+}
+
+
+/// @brief Mostly small pieces, byte at a time and whole buffers now and then
+static size_t piece_size(size_t left)
+{
+    size_t n;
+    switch (rand() % 4) {
+        case 0: n = 1; break;
+        case 1: n = 1 + rand() % 8; break;
+        case 2: n = 1 + rand() % 256; break;
+        default: n = left; break;
+    }
+    return n < left ? n : left;
+}
+
+
+static void run(const char *doc, size_t len)
+{
+    //The document cut short by its closing brace must never count as whole
+    json_fields_parser_t parser;
+    size_t cut_len = len;
+    while (cut_len > 0 && doc[cut_len - 1] != '}') cut_len--;
+    json_fields_init(&parser, fields, sizeof(fields) / sizeof(fields[0]));
+    bool cut_finished = cut_len > 0 && json_fields_feed(&parser, doc, cut_len - 1) == ESP_OK &&
+                        json_fields_finish(&parser) == ESP_OK;
+
+    element_count = 0;
+    heap_used = heap_peak = 0;
+    counting = true;
+    json_fields_init(&parser, fields, sizeof(fields) / sizeof(fields[0]));
+    esp_err_t err = ESP_OK;
+    for (size_t pos = 0; pos < len && err == ESP_OK; ) {
+        size_t n = piece_size(len - pos);
+        err = json_fields_feed(&parser, doc + pos, n);
+        pos += n;
+    }
+    bool finished = err == ESP_OK && json_fields_finish(&parser) == ESP_OK;
+    counting = false;
+
+    printf("{\"ok\": %s, \"cut_ok\": %s, \"version\": ", finished ? "true" : "false", cut_finished ? "true" : "false");
+    print_string(version);
+    printf(", \"url\": ");
+    print_string(url);
+    printf(", \"sha256\": ");
+    print_string(sha256);
+    printf(", \"size\": %ld, \"delta_size\": %ld, \"builds\": [", (long)size, (long)delta_size);
+    for (int i = 0; i < element_count && i < MAX_ELEMENTS; i++) {
+        printf("%s{\"target\": ", i ? ", " : "");
+        print_string(elements[i].target);
+        printf(", \"size\": %ld}", (long)elements[i].size);
+    }
+    printf("], \"heap\": %zu}\n", heap_peak);
+}
+
+
+int main(int argc, char **argv)
+{
+    srand(argc > 1 ? (unsigned)strtoul(argv[1], NULL, 0) : 1);
+
+    static char doc[MAX_DOCUMENT];
+    size_t len = 0;
+    int c;
+    while ((c = getchar()) != EOF) {
+        if (c == '\0') {
+            run(doc, len);
+            len = 0;
+        } else if (len < sizeof(doc)) {
+            doc[len++] = (char)c;
+        }
+    }
+    if (len > 0) run(doc, len);
+    return 0;
+}
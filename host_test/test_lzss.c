@@ -0,0 +1,262 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "check.h"
+#include "lzss.h"
+
+/*
+ * lzss_encoder and lzss_decoder round trips with random feed sizes and flushes, plus the ratio and
+ * host throughput on a synthetic gate log, the kind of text SD log compression sees.
+ *
+ *   test_lzss                          round trips and numbers
+ *   test_lzss encode <in> <out> <seed> for lzss_cross.py, against lzss_stream.py
+ *   test_lzss decode <in> <out> <seed>
+ */
+
+typedef struct {
+    uint8_t *data;
+    size_t len;
+    size_t cap;
+} buffer_t;
+
+static lzss_encoder_t encoder;
+static lzss_decoder_t decoder;
+
+
+static esp_err_t buffer_sink(const uint8_t *data, size_t len, void *ctx)
+{
+    buffer_t *b = ctx;
+    if (b->len + len > b->cap) {
+        b->cap = (b->len + len) * 2;
+        b->data = realloc(b->data, b->cap);
+    }
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+    return ESP_OK;
+}
+
+
+static size_t piece_size(size_t left)
+{
+    size_t n;
+    switch (rand() % 4) {
+        case 0: n = 1; break;
+        case 1: n = 1 + rand() % 16; break;
+        case 2: n = 1 + rand() % 4096; break;
+        default: n = left; break;
+    }
+    return n < left ? n : left;
+}
+
+
+/// @brief Encodes in random pieces, flushing now and then; each flush must leave a decodable prefix
+static void encode(const uint8_t *data, size_t len, buffer_t *out, bool flushes)
+{
+    lzss_encoder_init(&encoder, buffer_sink, out);
+    for (size_t pos = 0; pos < len; ) {
+        size_t n = piece_size(len - pos);
+        CHECK_INT(lzss_encoder_feed(&encoder, data + pos, n), ESP_OK);
+        pos += n;
+        if (flushes && rand() % 8 == 0) {
+            CHECK_INT(lzss_encoder_flush(&encoder), ESP_OK);
+        }
+    }
+    CHECK_INT(lzss_encoder_finish(&encoder), ESP_OK);
+}
+
+
+static void decode(const uint8_t *data, size_t len, buffer_t *out)
+{
+    lzss_decoder_init(&decoder, buffer_sink, out);
+    for (size_t pos = 0; pos < len; ) {
+        size_t n = piece_size(len - pos);
+        CHECK_INT(lzss_decoder_feed(&decoder, data + pos, n), ESP_OK);
+        pos += n;
+    }
+    CHECK_INT(lzss_decoder_finish(&decoder), ESP_OK);
+}
+
+
+static size_t log_line(char *line, size_t size, unsigned i)
+{
+    static const char *const messages[] = {
+        "gate: Door %u unlocked by user %u, rssi %d",
+        "espnow: Ack from 24:6f:28:%02x:%02x:%02x after %u ms, rssi %d",
+        "http: GET /status 200 in %u ms, %u bytes, rssi %d",
+        "ota: No update, running v1.4.%u-%u-g3f2a91c-dev, rssi %d",
+    };
+    unsigned r = (unsigned)rand();
+    int rssi = -40 - (int)(r % 50);
+    int n = snprintf(line, size, "I (%u) ", 1000 + i * 37 + r % 30);
+    switch (r % 4) {
+        case 0: n += snprintf(line + n, size - n, messages[0], r % 4, r % 32, rssi); break;
+        case 1: n += snprintf(line + n, size - n, messages[1], r & 0xff, (r >> 8) & 0xff, (r >> 16) & 0xff, r % 90, rssi); break;
+        case 2: n += snprintf(line + n, size - n, messages[2], r % 200, 200 + r % 900, rssi); break;
+        default: n += snprintf(line + n, size - n, messages[3], r % 10, r % 40, rssi); break;
+    }
+    n += snprintf(line + n, size - n, "\n");
+    return (size_t)n;
+}
+
+
+static buffer_t synthetic_log(size_t len)
+{
+    buffer_t b = {0};
+    char line[160];
+    for (unsigned i = 0; b.len < len; i++) {
+        size_t n = log_line(line, sizeof(line), i);
+        buffer_sink((const uint8_t *)line, n < len - b.len ? n : len - b.len, &b);
+    }
+    return b;
+}
+
+
+static void round_trip(const char *name, const uint8_t *data, size_t len, bool flushes)
+{
+    buffer_t packed = {0}, unpacked = {0};
+    encode(data, len, &packed, flushes);
+    decode(packed.data, packed.len, &unpacked);
+    if (unpacked.len != len || (len > 0 && memcmp(unpacked.data, data, len) != 0)) {
+        fprintf(stderr, "%s: %zu bytes round trip to %zu, %s\n", name, len, unpacked.len,
+                unpacked.len == len ? "different" : "length differs");
+        check_failures++;
+    }
+    free(packed.data);
+    free(unpacked.data);
+}
+
+
+/// @brief What a flush promises: the stream so far decodes to a prefix of the input fed so far
+static void flush_prefix(const uint8_t *data, size_t len)
+{
+    buffer_t packed = {0};
+    lzss_encoder_init(&encoder, buffer_sink, &packed);
+    for (size_t pos = 0; pos < len; ) {
+        size_t n = piece_size(len - pos);
+        lzss_encoder_feed(&encoder, data + pos, n);
+        pos += n;
+        lzss_encoder_flush(&encoder);
+
+        buffer_t unpacked = {0};
+        decode(packed.data, packed.len, &unpacked);
+        if (unpacked.len > pos || (unpacked.len > 0 && memcmp(unpacked.data, data, unpacked.len) != 0)) {
+            fprintf(stderr, "flush at %zu decodes to %zu bytes that are not a prefix\n", pos, unpacked.len);
+            check_failures++;
+        }
+        free(unpacked.data);
+    }
+    free(packed.data);
+}
+
+
+static double seconds(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+
+static void bench(void)
+{
+    buffer_t log = synthetic_log(1024 * 1024);
+    buffer_t packed = {0}, unpacked = {0};
+
+    double start = seconds();
+    lzss_encoder_init(&encoder, buffer_sink, &packed);
+    for (size_t pos = 0; pos < log.len; pos += 256) {
+        lzss_encoder_feed(&encoder, log.data + pos, log.len - pos < 256 ? log.len - pos : 256);
+    }
+    lzss_encoder_finish(&encoder);
+    double encode_s = seconds() - start;
+
+    start = seconds();
+    lzss_decoder_init(&decoder, buffer_sink, &unpacked);
+    lzss_decoder_feed(&decoder, packed.data, packed.len);
+    lzss_decoder_finish(&decoder);
+    double decode_s = seconds() - start;
+
+    CHECK(unpacked.len == log.len && memcmp(unpacked.data, log.data, log.len) == 0);
+    printf("synthetic log   %zu -> %zu bytes (%.1f%%), -w %d -l %d, chain %d\n", log.len, packed.len,
+           100.0 * packed.len / log.len, LZSS_WINDOW_BITS, LZSS_LOOKAHEAD_BITS, CONFIG_LZSS_ENCODER_CHAIN);
+    printf("host encode     %.1f MB/s\n", log.len / 1e6 / (encode_s > 0 ? encode_s : 1e-9));
+    printf("host decode     %.1f MB/s\n", log.len / 1e6 / (decode_s > 0 ? decode_s : 1e-9));
+    printf("encoder state   %zu bytes, decoder state %zu bytes\n", sizeof(lzss_encoder_t), sizeof(lzss_decoder_t));
+    free(log.data);
+    free(packed.data);
+    free(unpacked.data);
+}
+
+
+static buffer_t read_file(const char *path)
+{
+    buffer_t b = {0};
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        perror(path);
+        exit(2);
+    }
+    uint8_t chunk[4096];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0) buffer_sink(chunk, n, &b);
+    fclose(f);
+    return b;
+}
+
+
+static int convert(char **argv)
+{
+    srand((unsigned)strtoul(argv[4], NULL, 0));
+    buffer_t in = read_file(argv[2]), out = {0};
+    if (strcmp(argv[1], "encode") == 0) {
+        encode(in.data, in.len, &out, true);
+    } else {
+        decode(in.data, in.len, &out);
+    }
+    FILE *f = fopen(argv[3], "wb");
+    if (f == NULL || fwrite(out.data, 1, out.len, f) != out.len) {
+        perror(argv[3]);
+        return 2;
+    }
+    fclose(f);
+    return check_failures != 0;
+}
+
+
+int main(int argc, char **argv)
+{
+    if (argc == 5) return convert(argv);
+
+    srand(1);
+    static uint8_t data[64 * 1024];
+
+    round_trip("empty", data, 0, false);
+    for (size_t len = 1; len <= 8; len++) {
+        memset(data, 'a', len);
+        round_trip("short", data, len, true);
+    }
+
+    memset(data, 0, sizeof(data));
+    round_trip("zeros", data, sizeof(data), true);
+
+    for (size_t i = 0; i < sizeof(data); i++) data[i] = (uint8_t)rand();
+    round_trip("random", data, sizeof(data), true);
+
+    //Repeats further back than the window, and matches longer than the lookahead
+    for (size_t i = 0; i < sizeof(data); i++) data[i] = (uint8_t)((i % 1500) < 700 ? (int)(i % 7) : rand() % 4);
+    round_trip("repeats", data, sizeof(data), true);
+
+    for (int i = 0; i < 20; i++) {
+        buffer_t log = synthetic_log(1 + rand() % (48 * 1024));
+        round_trip("log", log.data, log.len, i % 2);
+        free(log.data);
+    }
+
+    buffer_t log = synthetic_log(6000);
+    flush_prefix(log.data, log.len);
+    free(log.data);
+
+    bench();
+    return check_failures != 0;
+}
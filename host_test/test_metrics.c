@@ -0,0 +1,113 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "check.h"
+
+/*
+ * The metrics registry rendered as prometheus text: a family is one HELP and TYPE followed by all
+ * of its series, however its metrics were interleaved with others at registration, and a full
+ * table fails registration instead of dropping metrics silently. Built with a small table.
+ */
+
+#include "newlib_string.h"
+#include "metrics.c"
+
+static char text[8192];
+static size_t text_len;
+
+static const uint32_t bounds[] = {10, 100};
+
+
+static esp_err_t collect(void *ctx, const void *data, size_t len)
+{
+    CHECK(text_len + len < sizeof(text));
+    memcpy(text + text_len, data, len);
+    text_len += len;
+    text[text_len] = '\0';
+    return ESP_OK;
+}
+
+
+static int occurrences(const char *needle)
+{
+    int n = 0;
+    for (const char *p = strstr(text, needle); p != NULL; p = strstr(p + 1, needle)) n++;
+    return n;
+}
+
+
+/// @brief Every sample line belongs to the family of the TYPE line above it, and no family appears twice
+static void check_families(void)
+{
+    char family[METRICS_NAME_LENGTH] = "";
+    char seen[16][METRICS_NAME_LENGTH];
+    int seen_count = 0;
+
+    for (char *line = text; *line != '\0'; line = strchr(line, '\n') + 1) {
+        if (strncmp(line, "# TYPE ", 7) == 0) {
+            sscanf(line + 7, "%31s", family);
+            for (int i = 0; i < seen_count; i++) {
+                if (strcmp(seen[i], family) == 0) {
+                    fprintf(stderr, "family %s rendered twice\n", family);
+                    check_failures++;
+                }
+            }
+            strcpy(seen[seen_count++], family);
+        }
+        else if (line[0] != '#') {
+            size_t len = strlen(family);
+            if (len == 0 || strncmp(line, family, len) != 0) {
+                fprintf(stderr, "%.*s is not in family %s\n", (int)(strchr(line, '\n') - line), line, family);
+                check_failures++;
+            }
+        }
+    }
+}
+
+
+int main(void)
+{
+    //Interleaved the way ota_service registers one histogram and one gauge per phase
+    metric_t *open_cmd = metrics_register_counter("door_commands_total", "cmd=\"open\"", "Door commands");
+    metric_t *connect_a = metrics_register_histogram("connect_ms", "phase=\"a\"", "Connect time", bounds, 2);
+    metric_t *heap_a = metrics_register_gauge("connect_heap_bytes", "phase=\"a\"", "Connect heap");
+    metric_t *connect_b = metrics_register_histogram("connect_ms", "phase=\"b\"", "Connect time", bounds, 2);
+    metric_t *heap_b = metrics_register_gauge("connect_heap_bytes", "phase=\"b\"", "Connect heap");
+    metric_t *close_cmd = metrics_register_counter("door_commands_total", "cmd=\"close\"", "Door commands");
+    CHECK(open_cmd && connect_a && heap_a && connect_b && heap_b && close_cmd);
+
+    metrics_counter_add(open_cmd, 3);
+    metrics_counter_add(close_cmd, 1);
+    metrics_histogram_observe(connect_a, 50);
+    metrics_histogram_observe(connect_b, 500);
+    metrics_gauge_set(heap_a, 1000);
+    metrics_gauge_set(heap_b, 2000);
+
+    CHECK_INT(metrics_render_text(collect, NULL), ESP_OK);
+    CHECK_INT(occurrences("# HELP door_commands_total "), 1);
+    CHECK_INT(occurrences("# TYPE connect_ms histogram"), 1);
+    CHECK_INT(occurrences("# TYPE connect_heap_bytes gauge"), 1);
+    CHECK(strstr(text, "door_commands_total{cmd=\"close\"} 1\n") != NULL);
+    CHECK(strstr(text, "connect_ms_bucket{phase=\"b\",le=\"+Inf\"} 1\n") != NULL);
+    CHECK(strstr(text, "connect_heap_bytes{phase=\"b\"} 2000\n") != NULL);
+    //First registered first, the close counter right after the open one
+    CHECK(strstr(text, "door_commands_total{cmd=\"close\"}") < strstr(text, "# HELP connect_ms "));
+    check_families();
+
+    //The rest of the table, then registration fails and the NULL handle is ignored
+    int registered = 6;
+    char name[METRICS_NAME_LENGTH];
+    metric_t *metric;
+    do {
+        snprintf(name, sizeof(name), "filler_%d_total", registered);
+        metric = metrics_register_counter(name, NULL, "Filler");
+    } while (metric != NULL && ++registered < 100);
+    CHECK_INT(registered, CONFIG_METRICS_MAX_METRICS);
+    metrics_counter_add(metric, 1);
+
+    text_len = 0;
+    CHECK_INT(metrics_render_text(collect, NULL), ESP_OK);
+    CHECK_INT(occurrences("# TYPE "), CONFIG_METRICS_MAX_METRICS - 3);
+    check_families();
+    return check_failures != 0;
+}
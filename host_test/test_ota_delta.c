@@ -0,0 +1,189 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "check.h"
+#include "ota_delta.h"
+
+/*
+ * Replays the patches in vectors/ota_delta, made by ota_delta.py from old.bin, through ota_delta.c
+ * in random sized pieces, the way they arrive over HTTP, and checks the image that comes out.
+ * Then the same patches damaged: every one must be rejected by feed or finish.
+ *
+ *   test_ota_delta <vectors/ota_delta>
+ */
+
+#define SOURCE_PARTITION_SIZE   (16 * 1024)
+#define SEEDS                   20
+
+static const char *const cases[] = {"same", "edit", "insert", "shrink", "grow", "unrelated", "empty"};
+
+static uint8_t source[SOURCE_PARTITION_SIZE];
+static const esp_partition_t source_partition = {
+    .address = 0x10000, .size = SOURCE_PARTITION_SIZE, .label = "ota_0"
+};
+
+typedef struct {
+    uint8_t *data;
+    size_t len;
+} file_t;
+
+static file_t image;
+
+
+esp_err_t esp_partition_read(const esp_partition_t *partition, size_t src_offset, void *dst, size_t size)
+{
+    if (partition != &source_partition || src_offset + size > partition->size) return ESP_ERR_INVALID_ARG;
+    memcpy(dst, &source[src_offset], size);
+    return ESP_OK;
+}
+
+
+static esp_err_t image_sink(const uint8_t *data, size_t len, void *ctx)
+{
+    image.data = realloc(image.data, image.len + len + 1);
+    memcpy(image.data + image.len, data, len);
+    image.len += len;
+    return ESP_OK;
+}
+
+
+static file_t read_vector(const char *dir, const char *name, const char *ext)
+{
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s%s", dir, name, ext);
+    file_t file = {malloc(1), 0};
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        perror(path);
+        exit(2);
+    }
+    uint8_t chunk[1024];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0) {
+        file.data = realloc(file.data, file.len + n);
+        memcpy(file.data + file.len, chunk, n);
+        file.len += n;
+    }
+    fclose(f);
+    return file;
+}
+
+
+static size_t piece_size(size_t left)
+{
+    size_t n;
+    switch (rand() % 4) {
+        case 0: n = 1; break;
+        case 1: n = 1 + rand() % 13; break;
+        case 2: n = 1 + rand() % 1500; break;
+        default: n = left; break;
+    }
+    return n < left ? n : left;
+}
+
+
+/// @return feed's first error, or finish's result
+static esp_err_t replay(const uint8_t *patch, size_t len)
+{
+    static ota_delta_t delta;
+    image.len = 0;
+    ota_delta_init(&delta, &source_partition, image_sink, NULL);
+    for (size_t pos = 0; pos < len; ) {
+        size_t n = piece_size(len - pos);
+        esp_err_t err = ota_delta_feed(&delta, patch + pos, n);
+        if (err != ESP_OK) return err;
+        pos += n;
+    }
+    return ota_delta_finish(&delta);
+}
+
+
+static void test_vector(const char *dir, const char *name)
+{
+    file_t patch = read_vector(dir, name, ".patch");
+    file_t expected = read_vector(dir, name, ".new");
+
+    for (unsigned seed = 1; seed <= SEEDS; seed++) {
+        srand(seed);
+        esp_err_t err = replay(patch.data, patch.len);
+        if (err != ESP_OK || image.len != expected.len || memcmp(image.data, expected.data, expected.len) != 0) {
+            fprintf(stderr, "%s, seed %u: 0x%x, %zu of %zu bytes\n", name, seed, err, image.len, expected.len);
+            check_failures++;
+            break;
+        }
+    }
+
+    //Cut anywhere before the END op
+    for (size_t cut = 0; cut < patch.len; cut += 1 + patch.len / 40) {
+        CHECK(replay(patch.data, cut) != ESP_OK);
+    }
+
+    uint8_t *damaged = malloc(patch.len + 1);
+
+    //Trailing data after END
+    memcpy(damaged, patch.data, patch.len);
+    damaged[patch.len] = 0;
+    CHECK_INT(replay(damaged, patch.len + 1), ESP_ERR_INVALID_RESPONSE);
+
+    //Magic, format version and the announced target size
+    memcpy(damaged, patch.data, patch.len);
+    damaged[0] = 'X';
+    CHECK_INT(replay(damaged, patch.len), ESP_ERR_INVALID_RESPONSE);
+    memcpy(damaged, patch.data, patch.len);
+    damaged[4] = OTA_DELTA_FORMAT_VERSION + 1;
+    CHECK_INT(replay(damaged, patch.len), ESP_ERR_INVALID_RESPONSE);
+    memcpy(damaged, patch.data, patch.len);
+    damaged[9]++;
+    CHECK_INT(replay(damaged, patch.len), ESP_ERR_INVALID_RESPONSE);
+
+    //Unknown op in place of the first one
+    memcpy(damaged, patch.data, patch.len);
+    damaged[13] = 0x7F;
+    CHECK_INT(replay(damaged, patch.len), ESP_ERR_INVALID_RESPONSE);
+
+    free(damaged);
+    free(patch.data);
+    free(expected.data);
+}
+
+
+static void test_copy_outside_source(void)
+{
+    static const uint8_t patches[][27] = {
+        //COPY starting past the partition
+        {'O', 'T', 'A', 'D', 1, 0, 0x18, 0, 0, 4, 0, 0, 0,
+         1, 0, 0x40, 0, 0, 4, 0, 0, 0, 0},
+        //COPY running off its end
+        {'O', 'T', 'A', 'D', 1, 0, 0x18, 0, 0, 0, 2, 0, 0,
+         1, 0, 0x3F, 0, 0, 0, 2, 0, 0, 0},
+        //Length wrapping offset + length around 32 bits
+        {'O', 'T', 'A', 'D', 1, 0, 0x18, 0, 0, 4, 0, 0, 0,
+         1, 0, 0x10, 0, 0, 0xFF, 0xFF, 0xFF, 0xFF, 0},
+    };
+    for (size_t i = 0; i < sizeof(patches) / sizeof(patches[0]); i++) {
+        CHECK_INT(replay(patches[i], 23), ESP_ERR_INVALID_RESPONSE);
+    }
+}
+
+
+int main(int argc, char **argv)
+{
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <vectors/ota_delta>\n", argv[0]);
+        return 2;
+    }
+
+    //The running partition holds the old image, erased flash after it
+    file_t old = read_vector(argv[1], "old", ".bin");
+    memset(source, 0xFF, sizeof(source));
+    memcpy(source, old.data, old.len);
+    free(old.data);
+
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        test_vector(argv[1], cases[i]);
+    }
+    test_copy_outside_source();
+
+    free(image.data);
+    return check_failures != 0;
+}
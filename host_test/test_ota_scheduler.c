@@ -0,0 +1,202 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "check.h"
+#include "ota_scheduler.h"
+
+/*
+ * ota_scheduler against a fake clock, across simulated reboots. The wait loop is the one in
+ * ota_service.c's ota_schedule_wait: the state is saved before each slice, as it will be once the
+ * slice is over, and a reboot restores whatever was saved last.
+ */
+
+#define SLICE_S         300             //OTA_SCHEDULE_SLICE_S
+#define PERIOD_S        (24 * 3600)
+#define JITTER_S        3600
+#define DAYS            20
+
+typedef struct {
+    int64_t uptime_s;                   //What the scheduler sees, restarts on every boot
+    int64_t wall_s;                     //What the test measures with
+    uint32_t random;
+} fake_env_t;
+
+static const ota_scheduler_config_t config = {
+    .period_s = PERIOD_S,
+    .jitter_s = JITTER_S,
+    .retry_s = 60,
+    .quick_retries = 3,
+    .backoff_s = 15 * 60,
+};
+
+
+static int64_t fake_now_s(void *ctx)
+{
+    return ((fake_env_t *)ctx)->uptime_s;
+}
+
+
+static uint32_t fake_random(void *ctx)
+{
+    fake_env_t *env = ctx;
+    env->random = env->random * 1103515245 + 12345;
+    return env->random >> 8;
+}
+
+
+typedef struct {
+    int checks;
+    int64_t first_s;                    //Wall time of the first check
+    int64_t longest_gap_s;              //Between checks
+    int64_t shortest_gap_s;
+} run_result_t;
+
+
+/// @brief DAYS of a device rebooting every reboot_s (0 for never), every check succeeding
+static run_result_t run(int64_t reboot_s)
+{
+    fake_env_t fake = {.random = 1};
+    const ota_scheduler_env_t env = {fake_now_s, fake_random, &fake};
+    ota_schedule_state_t saved = {0};
+    run_result_t result = {.first_s = -1, .shortest_gap_s = INT64_MAX};
+    int64_t last_check_s = -1;
+
+    while (fake.wall_s < DAYS * 24 * 3600) {
+        //Boot
+        fake.uptime_s = 0;
+        int64_t reboot_at = reboot_s > 0 ? fake.wall_s + reboot_s : INT64_MAX;
+        ota_scheduler_t scheduler;
+        ota_scheduler_init(&scheduler, &config, &env, &saved);
+
+        while (fake.wall_s < reboot_at && fake.wall_s < DAYS * 24 * 3600) {
+            uint32_t delay = ota_scheduler_delay_s(&scheduler);
+            if (delay == 0) {
+                if (last_check_s >= 0) {
+                    int64_t gap = fake.wall_s - last_check_s;
+                    if (gap > result.longest_gap_s) result.longest_gap_s = gap;
+                    if (gap < result.shortest_gap_s) result.shortest_gap_s = gap;
+                } else {
+                    result.first_s = fake.wall_s;
+                }
+                last_check_s = fake.wall_s;
+                result.checks++;
+                //A check takes a while
+                fake.uptime_s += 20;
+                fake.wall_s += 20;
+                ota_scheduler_report(&scheduler, OTA_CHECK_OK);
+                continue;
+            }
+
+            uint32_t slice = delay < SLICE_S ? delay : SLICE_S;
+            ota_scheduler_snapshot(&scheduler, slice, &saved);
+            int64_t step = reboot_at - fake.wall_s < slice ? reboot_at - fake.wall_s : slice;
+            fake.uptime_s += step;
+            fake.wall_s += step;
+        }
+    }
+    return result;
+}
+
+
+static void test_reboots(void)
+{
+    //Never rebooting, and rebooting more and less often than a slice
+    static const int64_t intervals[] = {0, 7 * 24 * 3600, 5 * 3600, 3600 + 7, 30 * 60, SLICE_S, 4 * 60, 61};
+
+    for (size_t i = 0; i < sizeof(intervals) / sizeof(intervals[0]); i++) {
+        run_result_t r = run(intervals[i]);
+        printf("reboot every %7lld s: %3d checks, first after %6lld s, gaps %6lld..%6lld s\n",
+               (long long)intervals[i], r.checks, (long long)r.first_s,
+               (long long)r.shortest_gap_s, (long long)r.longest_gap_s);
+
+        //No reboot pattern may hold a check back past its period and jitter. A reboot in the
+        //middle of a check runs it again, the shortest gaps are then a check's length
+        CHECK(r.first_s >= 0 && r.first_s <= JITTER_S);
+        CHECK(r.checks >= DAYS - 1);
+        CHECK(r.longest_gap_s <= PERIOD_S + JITTER_S + 20);
+
+        //Each boot brings the check forward by at most a slice, so unless the device reboots
+        //within minutes the period mostly holds
+        if (intervals[i] == 0 || intervals[i] >= 3600) {
+            int64_t boots_per_period = intervals[i] ? PERIOD_S / intervals[i] + 1 : 0;
+            CHECK(r.shortest_gap_s >= PERIOD_S - JITTER_S - boots_per_period * SLICE_S);
+        }
+    }
+}
+
+
+static void test_snapshot(void)
+{
+    fake_env_t fake = {.random = 7};
+    const ota_scheduler_env_t env = {fake_now_s, fake_random, &fake};
+    ota_scheduler_t scheduler;
+    ota_schedule_state_t state;
+
+    ota_scheduler_init(&scheduler, &config, &env, NULL);
+    ota_scheduler_report(&scheduler, OTA_CHECK_OK);
+    uint32_t delay = ota_scheduler_delay_s(&scheduler);
+
+    ota_scheduler_snapshot(&scheduler, 0, &state);
+    CHECK_INT(state.remaining_s, delay);
+    ota_scheduler_snapshot(&scheduler, SLICE_S, &state);
+    CHECK_INT(state.remaining_s, delay - SLICE_S);
+    ota_scheduler_snapshot(&scheduler, delay + 1, &state);
+    CHECK_INT(state.remaining_s, 0);
+    CHECK_INT(state.valid, 1);
+
+    //Failures and quick retries survive the reboot
+    ota_scheduler_report(&scheduler, OTA_CHECK_FAILED);
+    ota_scheduler_report(&scheduler, OTA_CHECK_FAILED);
+    ota_scheduler_snapshot(&scheduler, 0, &state);
+    CHECK_INT(state.failures, 2);
+
+    fake.uptime_s = 0;
+    ota_scheduler_t restored;
+    ota_scheduler_init(&restored, &config, &env, &state);
+    CHECK_INT(ota_scheduler_delay_s(&restored), state.remaining_s);
+    ota_scheduler_report(&restored, OTA_CHECK_FAILED);
+    uint32_t backoff = ota_scheduler_delay_s(&restored);
+    CHECK(backoff >= 4 * config.backoff_s * 3 / 4 && backoff <= 4 * config.backoff_s * 5 / 4);
+
+    //A state saved by a build with a longer period is cut down to this one's
+    state.remaining_s = 10 * PERIOD_S;
+    ota_scheduler_init(&restored, &config, &env, &state);
+    CHECK_INT(ota_scheduler_delay_s(&restored), PERIOD_S + JITTER_S);
+}
+
+
+/// @brief A patch that did not decode falls back to the full image on the quick retry, a broken full image backs off
+static void test_fallback(void)
+{
+    fake_env_t fake = {.random = 3};
+    const ota_scheduler_env_t env = {fake_now_s, fake_random, &fake};
+    ota_scheduler_t scheduler;
+
+    CHECK_INT(ota_scheduler_download_result(false, false), OTA_CHECK_TRANSIENT);
+    CHECK_INT(ota_scheduler_download_result(true, false), OTA_CHECK_FAILED);
+    //The decode failure left flash_err set, so the attempt is broken as well
+    CHECK_INT(ota_scheduler_download_result(true, true), OTA_CHECK_TRANSIENT);
+
+    ota_scheduler_init(&scheduler, &config, &env, NULL);
+    ota_scheduler_report(&scheduler, OTA_CHECK_OK);
+    fake.uptime_s += ota_scheduler_delay_s(&scheduler);
+
+    ota_scheduler_report(&scheduler, ota_scheduler_download_result(true, true));
+    CHECK(ota_scheduler_delay_s(&scheduler) <= config.retry_s * 5 / 4);
+    CHECK_INT(scheduler.failures, 0);
+
+    //The full image fails to write too, that one waits
+    fake.uptime_s += ota_scheduler_delay_s(&scheduler);
+    ota_scheduler_report(&scheduler, ota_scheduler_download_result(true, false));
+    CHECK(ota_scheduler_delay_s(&scheduler) >= config.backoff_s * 3 / 4);
+    CHECK_INT(scheduler.failures, 1);
+}
+
+
+int main(void)
+{
+    test_snapshot();
+    test_fallback();
+    test_reboots();
+    return check_failures != 0;
+}
@@ -0,0 +1,396 @@
+#include <stdint.h>
+#include <time.h>
+#include <setjmp.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "check.h"
+
+/*
+ * The SD log writer and reader against a directory standing in for the card: segments rotate and
+ * are deleted beyond the retention count, the index survives a reload and is rebuilt when lost,
+ * a restart carries on where the log ended, and log_reader_t gives back exactly what was logged
+ * from any offset, with or without CONFIG_SD_LOG_COMPRESS (test_sd_log_lzss).
+ *
+ * logger.c is included so single cycles of its task can run: vTaskDelay at the end of a cycle
+ * jumps back here. log_segments.c is, for its index path and retention count.
+ * The clock is fake, segment times and timestamp lines follow it.
+ */
+
+static time_t fake_time(time_t *t);
+#define time(t) fake_time(t)
+#include "logger.c"
+#undef time
+#include "log_segments.c"
+
+#define WALL_BASE_S     1760000000LL
+#define RESTARTS        3
+
+struct metric {
+    const char *name;
+    uint64_t value;
+};
+
+static struct metric counters[8];
+static size_t counter_count;
+
+static int64_t now_us;
+static jmp_buf cycle_done;
+
+//Everything handed to the writer, indexed by offset in the whole log
+static char *logged;
+static size_t logged_len;
+static size_t logged_cap;
+
+static char cycle_text[8192];
+static size_t cycle_len;
+static unsigned line_number;
+
+
+metric_t *metrics_register_counter(const char *name, const char *labels, const char *help)
+{
+    counters[counter_count].name = name;
+    return &counters[counter_count++];
+}
+
+
+void metrics_counter_add(metric_t *metric, uint32_t value)
+{
+    metric->value += value;
+}
+
+
+static uint64_t counter(const char *name)
+{
+    for (size_t i = 0; i < counter_count; i++) {
+        if (strcmp(counters[i].name, name) == 0) return counters[i].value;
+    }
+    return 0;
+}
+
+
+bool sd_mount_init(void)
+{
+    mkdir(CONFIG_SD_MOUNT_POINT, 0755);
+    return true;
+}
+
+
+int64_t esp_timer_get_time(void)
+{
+    return now_us;
+}
+
+
+static time_t fake_time(time_t *t)
+{
+    time_t now = (time_t)(WALL_BASE_S + now_us / 1000000);
+    if (t != NULL) *t = now;
+    return now;
+}
+
+
+static void log_append(const char *text, size_t len)
+{
+    if (logged_len + len > logged_cap) {
+        logged_cap = (logged_len + len) * 2;
+        logged = realloc(logged, logged_cap);
+    }
+    memcpy(logged + logged_len, text, len);
+    logged_len += len;
+}
+
+
+void time_service_init(time_init_result_t *result)
+{
+    result->synced = true;
+}
+
+
+void time_service_sync_async(void (*callback)(const time_sync_result_t *result))
+{
+}
+
+
+//"@<unix time>", so the test finds each cycle's time in the log
+int time_service_now_str(int offset_s, char *buf, size_t size)
+{
+    int n = snprintf(buf, size, "@%lld", (long long)fake_time(NULL));
+    log_append(buf, n);
+    log_append("\n", 1);
+    return n;
+}
+
+
+//A cycle's worth of lines, some cycles quiet, some busy
+void log_snapshot_take(log_snapshot_t *snap)
+{
+    snap->cursor = 0;
+    cycle_len = 0;
+    int lines = rand() % 4 == 0 ? 0 : rand() % 80;
+    for (int i = 0; i < lines; i++) {
+        cycle_len += snprintf(cycle_text + cycle_len, sizeof(cycle_text) - cycle_len,
+                              "I (%u) gate: door %d rssi %d%s\n", line_number++, rand() % 4, -(rand() % 90),
+                              rand() % 5 ? "" : " after a retry of the ESP-NOW command");
+    }
+    log_append(cycle_text, cycle_len);
+}
+
+
+size_t log_snapshot_read(log_snapshot_t *snap, char *buf, size_t len)
+{
+    size_t n = cycle_len - snap->cursor;
+    if (n > len) n = len;
+    memcpy(buf, cycle_text + snap->cursor, n);
+    snap->cursor += n;
+    return n;
+}
+
+
+void vTaskDelay(TickType_t ticks)
+{
+    now_us += (int64_t)ticks * 1000;
+    longjmp(cycle_done, 1);
+}
+
+
+static void run_cycles(int cycles)
+{
+    for (int i = 0; i < cycles; i++) {
+        if (!setjmp(cycle_done)) {
+            sd_log_task(NULL);
+        }
+    }
+}
+
+
+/// @brief Reads [offset, end) back with random sized reads
+/// @return bytes read, where the reader started in *start
+static size_t read_back(uint64_t offset, uint64_t end, char *out, uint64_t *start)
+{
+    log_reader_t reader;
+    if (!log_reader_open(&reader, offset, end)) {
+        return 0;
+    }
+    *start = reader.offset;
+
+    size_t total = 0, n;
+    char buf[3000];
+    while ((n = log_reader_read(&reader, buf, 1 + rand() % sizeof(buf))) > 0) {
+        memcpy(out + total, buf, n);
+        total += n;
+    }
+    log_reader_close(&reader);
+    return total;
+}
+
+
+static bool file_exists(uint32_t seq)
+{
+    char path[LOG_SEGMENT_PATH_MAX];
+    struct stat st;
+    log_segments_path(seq, path, sizeof(path));
+    return stat(path, &st) == 0;
+}
+
+
+static uint32_t file_size(uint32_t seq)
+{
+    char path[LOG_SEGMENT_PATH_MAX];
+    struct stat st;
+    log_segments_path(seq, path, sizeof(path));
+    return stat(path, &st) == 0 ? (uint32_t)st.st_size : 0;
+}
+
+
+/// @brief Segments in order, consecutive and sized as configured, the deleted ones gone
+static size_t check_segments(log_segment_t *segs)
+{
+    size_t count = log_segments_list(segs, SEGMENT_COUNT + 1);
+    CHECK(count > 0 && count <= SEGMENT_COUNT);
+
+    for (size_t i = 0; i < count; i++) {
+        CHECK(file_exists(segs[i].seq));
+        if (i == 0) continue;
+        CHECK_INT(segs[i].seq, segs[i - 1].seq + 1);
+        CHECK(segs[i].offset > segs[i - 1].offset);
+        CHECK(segs[i].first_time >= segs[i - 1].first_time);
+#if CONFIG_SD_LOG_COMPRESS
+        //Ended once the compressed stream reached the size, each decodes to its offset span
+        CHECK(file_size(segs[i - 1].seq) >= SEGMENT_SIZE);
+        char *buf = malloc(segs[i].offset - segs[i - 1].offset + 1);
+        uint64_t start;
+        CHECK_INT(read_back(segs[i - 1].offset, segs[i].offset, buf, &start), segs[i].offset - segs[i - 1].offset);
+        free(buf);
+#else
+        CHECK_INT(file_size(segs[i - 1].seq), SEGMENT_SIZE);
+        CHECK_INT(segs[i].offset - segs[i - 1].offset, SEGMENT_SIZE);
+#endif
+    }
+    if (segs[0].seq > 1) {
+        CHECK(!file_exists(segs[0].seq - 1));
+    }
+    return count;
+}
+
+
+/// @brief What the card holds from the oldest segment on must be what was logged.
+/// A compressed stream keeps the bits of its last unfinished byte in the encoder, up to a few bytes short
+/// @return where the readable log ends
+static uint64_t check_log(uint64_t oldest)
+{
+    char *buf = malloc(logged_len + 1);
+    uint64_t start = 0;
+    size_t n = read_back(0, UINT64_MAX, buf, &start);
+    CHECK_INT(start, oldest);
+    CHECK(start + n <= logged_len);
+#if CONFIG_SD_LOG_COMPRESS
+    CHECK(start + n + 32 >= logged_len);
+#else
+    CHECK_INT(start + n, logged_len);
+#endif
+    if (start + n <= logged_len && memcmp(buf, logged + start, n) != 0) {
+        fprintf(stderr, "log read back from %llu differs from what was logged\n", (unsigned long long)start);
+        check_failures++;
+    }
+    free(buf);
+    return start + n;
+}
+
+
+/// @brief Random offsets and ranges, from before the oldest segment to past the end
+static void check_reader(uint64_t oldest, uint64_t end)
+{
+    char *buf = malloc(logged_len + 1);
+    for (int i = 0; i < 40; i++) {
+        uint64_t offset = rand() % (end + 100);
+        uint64_t until = rand() % 2 ? UINT64_MAX : offset + rand() % 20000;
+        uint64_t start = 0;
+        size_t n = read_back(offset, until, buf, &start);
+
+        if (offset > end) {
+            CHECK(n == 0);
+            continue;
+        }
+        uint64_t from = offset > oldest ? offset : oldest;
+        uint64_t to = until < end ? until : end;
+        CHECK_INT(start, from);
+        CHECK_INT(n, to > from ? to - from : 0);
+        if (n > 0 && memcmp(buf, logged + start, n) != 0) {
+            fprintf(stderr, "read of [%llu, %llu) differs\n", (unsigned long long)offset, (unsigned long long)until);
+            check_failures++;
+        }
+    }
+    free(buf);
+}
+
+
+/// @brief Every timestamp line inside [since, until] lies within the range the index gives
+static void check_time_ranges(const log_segment_t *segs, size_t count, uint64_t end)
+{
+    for (int i = 0; i < 20; i++) {
+        time_t since = segs[0].first_time + rand() % (segs[count - 1].first_time - segs[0].first_time + 60);
+        time_t until = since + rand() % 600;
+        uint64_t start, stop;
+        CHECK(log_segments_range(since, until, &start, &stop));
+
+        for (uint64_t pos = segs[0].offset; pos < end; pos++) {
+            if (logged[pos] != '@' || (pos > 0 && logged[pos - 1] != '\n')) continue;
+            time_t t = (time_t)strtoll(&logged[pos + 1], NULL, 10);
+            if (t >= since && t <= until && (pos < start || pos >= stop)) {
+                fprintf(stderr, "time %lld at %llu outside [%llu, %llu) for [%lld, %lld]\n", (long long)t,
+                        (unsigned long long)pos, (unsigned long long)start, (unsigned long long)stop,
+                        (long long)since, (long long)until);
+                check_failures++;
+                break;
+            }
+        }
+    }
+}
+
+
+/// @brief Reloading gives the same index, losing it rebuilds the same segments minus their times
+static void check_index(const log_segment_t *segs, size_t count)
+{
+    log_segment_t again[SEGMENT_COUNT];
+    CHECK(log_segments_load());
+    CHECK_INT(log_segments_list(again, SEGMENT_COUNT), count);
+    CHECK(memcmp(again, segs, count * sizeof(log_segment_t)) == 0);
+
+    FILE *f = fopen(INDEX_PATH, "rb");
+    char saved[sizeof(index_header_t) + sizeof(again)];
+    size_t saved_len = f != NULL ? fread(saved, 1, sizeof(saved), f) : 0;
+    if (f != NULL) fclose(f);
+
+    unlink(INDEX_PATH);
+    CHECK(log_segments_load());
+    CHECK_INT(log_segments_list(again, SEGMENT_COUNT), count);
+    for (size_t i = 0; i < count; i++) {
+        CHECK_INT(again[i].seq, segs[i].seq);
+        CHECK_INT(again[i].first_time, 0);
+#if !CONFIG_SD_LOG_COMPRESS
+        CHECK_INT(again[i].offset - again[0].offset, segs[i].offset - segs[0].offset);
+#endif
+    }
+
+    //Put the real one back for the writer
+    f = fopen(INDEX_PATH, "wb");
+    CHECK(f != NULL && fwrite(saved, 1, saved_len, f) == saved_len);
+    if (f != NULL) fclose(f);
+    CHECK(log_segments_load());
+    CHECK(log_segments_list(again, SEGMENT_COUNT) == count && memcmp(again, segs, count * sizeof(log_segment_t)) == 0);
+}
+
+
+/// @brief A clean reboot: synced, closed, the index read again from the card
+static void restart(void)
+{
+    CHECK(sd_log_sync());
+    sd_log_close();
+    s_log.len = 0;
+    CHECK(log_segments_load());
+}
+
+
+static void clear_card(void)
+{
+    DIR *dir = opendir(CONFIG_SD_MOUNT_POINT);
+    if (dir == NULL) return;
+    struct dirent *entry;
+    char path[300];
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') continue;
+        snprintf(path, sizeof(path), "%s/%s", CONFIG_SD_MOUNT_POINT, entry->d_name);
+        unlink(path);
+    }
+    closedir(dir);
+}
+
+
+int main(void)
+{
+    srand(1);
+    mkdir(CONFIG_SD_MOUNT_POINT, 0755);
+    clear_card();
+    CHECK(sd_log_writer_start(4000));
+
+    log_segment_t segs[SEGMENT_COUNT + 1];
+    for (int round = 0; round <= RESTARTS; round++) {
+        run_cycles(150 + rand() % 150);
+        restart();
+
+        size_t count = check_segments(segs);
+        uint64_t end = check_log(segs[0].offset);
+        check_reader(segs[0].offset, end);
+        check_time_ranges(segs, count, end);
+        check_index(segs, count);
+
+        //What a compressed stream held back is gone with the restart, the log goes on from what is readable
+        logged_len = end;
+        printf("round %d: segments %lu..%lu, log %llu..%llu\n", round, (unsigned long)segs[0].seq,
+               (unsigned long)segs[count - 1].seq, (unsigned long long)segs[0].offset, (unsigned long long)end);
+    }
+
+    CHECK(counter("sd_log_rotations_total") > SEGMENT_COUNT);
+    CHECK_INT(counter("sd_log_write_errors_total"), 0);
+    return check_failures != 0;
+}
@@ -0,0 +1,395 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <time.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "check.h"
+
+/*
+ * What the SD log writer costs the card, against the writer it replaced: that one opened
+ * loghome.txt every cycle, wrote the cycle's logs through stdio and closed the file again.
+ * Both log the same cycles, the same text, at the default 4 s interval and Kconfig defaults.
+ *
+ * There is no FatFs on the host, the files are plain files and the card is a model of what FatFs
+ * programs on it, with a 16 KB cluster (allocation_unit_size in sd_mount.c) and two FATs:
+ *  - a data sector once it is complete, written from the file's sector buffer or directly;
+ *  - the partial tail sector again on every sync or close, it is programmed again once it fills;
+ *  - on a sync or close of a modified file, its directory entry sector, and both FAT sectors
+ *    when clusters were allocated or freed;
+ *  - a delete, the directory entry and the FAT sectors of the chain.
+ * The card's own erase blocks and wear levelling are not modelled. The MB/s are of the host
+ * file system, they compare the system calls of the two writers, not the card. An fsync only goes
+ * to the model: a FatFs close syncs as much as an fsync does, a host close does not.
+ */
+
+#define CARD_SECTOR     512
+#define CLUSTER_SIZE    (16 * 1024)
+#define FAT_COPIES      2
+#define FAT_ENTRIES     128     // FAT32 entries per FAT sector
+#define CYCLES          2700    // 3 hours at 4 s
+#define WALL_BASE_S     1760000000LL
+
+typedef struct {
+    uint32_t size;
+    bool modified;
+    bool tail_dirty;            // The partial last sector sits in the file's sector buffer
+    bool fat_dirty;
+} fat_file_t;
+
+typedef struct {
+    uint64_t data;
+    uint64_t tail;
+    uint64_t dir;
+    uint64_t fat;
+    uint64_t opens;
+    uint64_t writes;
+    uint64_t syncs;
+} card_t;
+
+static fat_file_t files[64];
+static card_t card;
+
+
+static uint32_t clusters(uint32_t size)
+{
+    return (size + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+}
+
+
+static void fat_opened(fat_file_t *file, uint32_t size, bool created, bool truncated)
+{
+    file->fat_dirty = truncated && clusters(size) > 0;
+    file->modified = created || file->fat_dirty;
+    file->size = truncated ? 0 : size;
+    file->tail_dirty = false;
+    card.opens++;
+}
+
+
+static void fat_written(fat_file_t *file, size_t len)
+{
+    if (len == 0) {
+        return;
+    }
+    uint32_t end = file->size + len;
+    card.data += end / CARD_SECTOR - file->size / CARD_SECTOR;
+    file->tail_dirty = end % CARD_SECTOR != 0;
+    file->fat_dirty |= clusters(end) > clusters(file->size);
+    file->modified = true;
+    file->size = end;
+    card.writes++;
+}
+
+
+static void fat_synced(fat_file_t *file)
+{
+    if (file->modified) {
+        card.tail += file->tail_dirty;
+        card.dir++;
+        card.fat += file->fat_dirty ? FAT_COPIES : 0;
+    }
+    file->modified = file->tail_dirty = file->fat_dirty = false;
+}
+
+
+static int fat_open(const char *path, int flags, ...)
+{
+    va_list args;
+    va_start(args, flags);
+    int mode = (flags & O_CREAT) ? va_arg(args, int) : 0;
+    va_end(args);
+
+    struct stat st;
+    bool existed = stat(path, &st) == 0;
+    int fd = open(path, flags, mode);
+    if (fd >= 0 && fd < 64) {
+        fat_opened(&files[fd], existed ? (uint32_t)st.st_size : 0, !existed && (flags & O_CREAT),
+                   existed && (flags & O_TRUNC));
+    }
+    return fd;
+}
+
+
+static ssize_t fat_write(int fd, const void *buf, size_t len)
+{
+    ssize_t n = write(fd, buf, len);
+    if (n > 0) {
+        fat_written(&files[fd], n);
+    }
+    return n;
+}
+
+
+static int fat_fsync(int fd)
+{
+    fat_synced(&files[fd]);
+    card.syncs++;
+    return 0;
+}
+
+
+static int fat_close(int fd)
+{
+    fat_synced(&files[fd]);
+    return close(fd);
+}
+
+
+static int fat_unlink(const char *path)
+{
+    struct stat st;
+    if (stat(path, &st) == 0) {
+        card.dir++;
+        card.fat += FAT_COPIES * ((clusters(st.st_size) + FAT_ENTRIES - 1) / FAT_ENTRIES);
+    }
+    return unlink(path);
+}
+
+
+static uint64_t card_sectors(void)
+{
+    return card.data + card.tail + card.dir + card.fat;
+}
+
+
+#define open        fat_open
+#define write       fat_write
+#define fsync       fat_fsync
+#define close       fat_close
+#define unlink      fat_unlink
+#include "logger.c"
+#include "log_segments.c"
+#undef open
+#undef write
+#undef fsync
+#undef close
+#undef unlink
+
+struct metric {
+    const char *name;
+    uint64_t value;
+};
+
+static struct metric counters[8];
+static size_t counter_count;
+
+static int64_t now_us;
+static jmp_buf cycle_done;
+static char cycle_text[8192];
+static size_t cycle_len;
+static unsigned line_number;
+static uint64_t logged;
+
+
+metric_t *metrics_register_counter(const char *name, const char *labels, const char *help)
+{
+    counters[counter_count].name = name;
+    return &counters[counter_count++];
+}
+
+
+void metrics_counter_add(metric_t *metric, uint32_t value)
+{
+    metric->value += value;
+}
+
+
+static uint64_t counter(const char *name)
+{
+    for (size_t i = 0; i < counter_count; i++) {
+        if (strcmp(counters[i].name, name) == 0) return counters[i].value;
+    }
+    return 0;
+}
+
+
+bool sd_mount_init(void)
+{
+    mkdir(CONFIG_SD_MOUNT_POINT, 0755);
+    return true;
+}
+
+
+int64_t esp_timer_get_time(void)
+{
+    return now_us;
+}
+
+
+void time_service_init(time_init_result_t *result)
+{
+    result->synced = true;
+}
+
+
+void time_service_sync_async(void (*callback)(const time_sync_result_t *result))
+{
+}
+
+
+int time_service_now_str(int offset_s, char *buf, size_t size)
+{
+    time_t t = (time_t)(WALL_BASE_S + offset_s + now_us / 1000000);
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    int n = (int)strftime(buf, size, "%Y-%m-%d %H:%M:%S", &tm);
+    logged += n + 1;
+    return n;
+}
+
+
+//The same lines as test_sd_log, some cycles quiet, some busy
+void log_snapshot_take(log_snapshot_t *snap)
+{
+    snap->cursor = 0;
+    cycle_len = 0;
+    int lines = rand() % 4 == 0 ? 0 : rand() % 80;
+    for (int i = 0; i < lines; i++) {
+        cycle_len += snprintf(cycle_text + cycle_len, sizeof(cycle_text) - cycle_len,
+                              "I (%u) gate: door %d rssi %d%s\n", line_number++, rand() % 4, -(rand() % 90),
+                              rand() % 5 ? "" : " after a retry of the ESP-NOW command");
+    }
+    logged += cycle_len;
+}
+
+
+size_t log_snapshot_read(log_snapshot_t *snap, char *buf, size_t len)
+{
+    size_t n = cycle_len - snap->cursor;
+    if (n > len) n = len;
+    memcpy(buf, cycle_text + snap->cursor, n);
+    snap->cursor += n;
+    return n;
+}
+
+
+void vTaskDelay(TickType_t ticks)
+{
+    now_us += (int64_t)ticks * 1000;
+    longjmp(cycle_done, 1);
+}
+
+
+/// @brief The writer this one replaced, one cycle of it: open, 256 byte chunks through stdio, flush, close
+static bool old_writer_cycle(const char *path, fat_file_t *file)
+{
+    struct stat st;
+    bool existed = stat(path, &st) == 0;
+    FILE *f = fopen(path, "a");
+    if (f == NULL) {
+        return false;
+    }
+    fat_opened(file, existed ? (uint32_t)st.st_size : 0, !existed, false);
+
+    char timestamp[TIME_SERVICE_STR_BUF_SIZE];
+    int ts_len = time_service_now_str(5 * 3600, timestamp, sizeof(timestamp));
+    if (ts_len > 0) {
+        fwrite(timestamp, 1, ts_len, f);
+        fwrite("\n", 1, 1, f);
+        fat_written(file, ts_len + 1);
+    }
+
+    log_snapshot_t snap;
+    char buf[256];
+    size_t n;
+    log_snapshot_take(&snap);
+    while ((n = log_snapshot_read(&snap, buf, sizeof(buf) - 1)) > 0) {
+        fwrite(buf, 1, n, f);
+        fat_written(file, n);
+    }
+    fflush(f);
+    fclose(f);
+    fat_synced(file);
+    now_us += 4000 * 1000LL;
+    return true;
+}
+
+
+static void clear_card(void)
+{
+    DIR *dir = opendir(CONFIG_SD_MOUNT_POINT);
+    if (dir == NULL) return;
+    struct dirent *entry;
+    char path[300];
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') continue;
+        snprintf(path, sizeof(path), "%s/%s", CONFIG_SD_MOUNT_POINT, entry->d_name);
+        unlink(path);
+    }
+    closedir(dir);
+}
+
+
+static double seconds(const struct timespec *start)
+{
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+
+/// @return the write amplification, card sectors * 512 / bytes logged
+static double report(const char *name, double elapsed)
+{
+    double amplification = (double)card_sectors() * CARD_SECTOR / logged;
+    printf("%-10s %8llu bytes, %6llu sectors (data %llu, tail %llu, dir %llu, fat %llu), x%.2f, "
+           "%llu opens %llu writes %llu fsyncs, %.1f MB/s host\n", name, (unsigned long long)logged,
+           (unsigned long long)card_sectors(), (unsigned long long)card.data, (unsigned long long)card.tail,
+           (unsigned long long)card.dir, (unsigned long long)card.fat, amplification,
+           (unsigned long long)card.opens, (unsigned long long)card.writes, (unsigned long long)card.syncs,
+           logged / elapsed / 1e6);
+    return amplification;
+}
+
+
+int main(void)
+{
+    mkdir(CONFIG_SD_MOUNT_POINT, 0755);
+    clear_card();
+    printf("%d cycles, buffer %d, sync every %d s, segments %d KB\n", CYCLES, BUFFER_SIZE,
+           CONFIG_SD_LOG_SYNC_INTERVAL_S, CONFIG_SD_LOG_SEGMENT_SIZE_KB);
+
+    srand(1);
+    fat_file_t old_file = { 0 };
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < CYCLES; i++) {
+        CHECK(old_writer_cycle(CONFIG_SD_MOUNT_POINT "/loghome.txt", &old_file));
+    }
+    double old_amplification = report("open/close", seconds(&start));
+    uint64_t old_logged = logged;
+
+    clear_card();
+    memset(&card, 0, sizeof(card));
+    logged = 0;
+    line_number = 0;
+    now_us = 0;
+    srand(1);
+    CHECK(sd_log_writer_start(4000));
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < CYCLES; i++) {
+        if (!setjmp(cycle_done)) {
+            sd_log_task(NULL);
+        }
+    }
+    CHECK(sd_log_sync());
+    double amplification = report("kept open", seconds(&start));
+
+    CHECK_INT(logged, old_logged);
+    CHECK_INT(counter("sd_log_bytes_written_total"), logged);
+    CHECK_INT(counter("sd_log_write_errors_total"), 0);
+#if CONFIG_SD_LOG_SYNC_INTERVAL_S >= 30
+    CHECK(amplification < 1.2 && amplification < old_amplification * 0.7);
+#else
+    //A sync per cycle costs what a close did, plus the index of each new segment
+    CHECK(amplification < old_amplification + 0.01);
+#endif
+    return check_failures != 0;
+}
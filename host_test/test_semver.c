@@ -0,0 +1,116 @@
+#include <stdio.h>
+#include "check.h"
+#include "semver.h"
+
+/*
+ * Version strings as version.cmake and the CI workflow produce them, and their ordering
+ */
+
+typedef struct {
+    const char *text;
+    uint32_t major, minor, patch;
+    const char *prerelease;
+    uint32_t commits;
+} parse_vector_t;
+
+static const parse_vector_t parse_vectors[] = {
+    {"v1.2.3",                          1, 2, 3, "",        0},
+    {"1.10.0-beta.2",                   1, 10, 0, "beta.2", 0},
+    {"v2",                              2, 0, 0, "",        0},
+    {"v1.2.3-rc.1",                     1, 2, 3, "rc.1",    0},
+    {"v1.2.3-4-gabc1234",               1, 2, 3, "",        4},
+    {"v1.2.3-4-gabc1234-dirty",         1, 2, 3, "",        4},
+    {"v1.2.3-4-gabc1234-dev",           1, 2, 3, "",        4},
+    {"v1.2.3-4-gabc1234-dirty-dev",     1, 2, 3, "",        4},
+    {"v1.2.3-dirty",                    1, 2, 3, "",        0},
+    {"v1.2.3-dirty-dev",                1, 2, 3, "",        0},
+    {"v1.2.3-rc.1-4-gabc1234",          1, 2, 3, "rc.1",    4},
+    {"v1.2.3-rc.1-4-gabc1234-dirty-dev", 1, 2, 3, "rc.1",   4},
+    {"v1.2.3-rc.1-dirty-dev",           1, 2, 3, "rc.1",    0},
+    {"v1.2.3-dev",                      1, 2, 3, "dev",     0},
+    {"v1.2.3-rc.1-dev",                 1, 2, 3, "rc.1-dev", 0},
+    {"v1.2.3+build.5",                  1, 2, 3, "",        0},
+    {"v1.2.3-12-g0123abcdef+meta",      1, 2, 3, "",        12},
+};
+
+
+//Each one newer than the one before
+static const char *ordered[] = {
+    "v1.2.3-alpha",
+    "v1.2.3-alpha.1",
+    "v1.2.3-alpha.beta",
+    "v1.2.3-beta.2",
+    "v1.2.3-beta.11",
+    "v1.2.3-rc.1",
+    "v1.2.3-rc.1-2-gabc1234-dev",
+    "v1.2.3",
+    "v1.2.3-1-gabc1234-dirty-dev",
+    "v1.2.3-4-gabc1234-dev",
+    "v1.2.3-10-gabc1234",
+    "v1.2.4-rc.1",
+    "v1.2.4",
+    "v1.10.0",
+    "v2",
+};
+
+
+static void test_parse(void)
+{
+    for (size_t i = 0; i < sizeof(parse_vectors) / sizeof(parse_vectors[0]); i++) {
+        const parse_vector_t *v = &parse_vectors[i];
+        semver_t version;
+        esp_err_t err = semver_parse(v->text, &version);
+        if (err != ESP_OK) {
+            fprintf(stderr, "%s: parse failed\n", v->text);
+            check_failures++;
+            continue;
+        }
+        if (version.major != v->major || version.minor != v->minor || version.patch != v->patch ||
+            strcmp(version.prerelease, v->prerelease) != 0 || version.commits != v->commits) {
+            fprintf(stderr, "%s: parsed %u.%u.%u \"%s\" +%u\n", v->text,
+                    (unsigned)version.major, (unsigned)version.minor, (unsigned)version.patch,
+                    version.prerelease, (unsigned)version.commits);
+            check_failures++;
+        }
+    }
+
+    semver_t version;
+    CHECK_INT(semver_parse("abc1234", &version), ESP_ERR_INVALID_ARG);
+    CHECK_INT(semver_parse("abc1234-dev", &version), ESP_ERR_INVALID_ARG);
+    CHECK_INT(semver_parse("v1.x", &version), ESP_ERR_INVALID_ARG);
+    CHECK_INT(semver_parse("", &version), ESP_ERR_INVALID_ARG);
+    CHECK_INT(semver_parse(NULL, &version), ESP_ERR_INVALID_ARG);
+}
+
+
+static void test_order(void)
+{
+    size_t count = sizeof(ordered) / sizeof(ordered[0]);
+    for (size_t i = 0; i < count; i++) {
+        for (size_t j = 0; j < count; j++) {
+            semver_t a, b;
+            CHECK_INT(semver_parse(ordered[i], &a), ESP_OK);
+            CHECK_INT(semver_parse(ordered[j], &b), ESP_OK);
+            int c = semver_compare(&a, &b);
+            int expected = (i > j) - (i < j);
+            if ((c > 0) - (c < 0) != expected) {
+                fprintf(stderr, "%s vs %s: %d, expected %d\n", ordered[i], ordered[j], c, expected);
+                check_failures++;
+            }
+        }
+    }
+
+    //-dirty and -dev do not make a build newer than the same commit
+    semver_t a, b;
+    semver_parse("v1.2.3-4-gabc1234", &a);
+    semver_parse("v1.2.3-4-gabc1234-dirty-dev", &b);
+    CHECK_INT(semver_compare(&a, &b), 0);
+}
+
+
+int main(void)
+{
+    test_parse();
+    test_order();
+    return check_failures != 0;
+}
@@ -0,0 +1,289 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "check.h"
+#include "esp_timer.h"
+#include "user_request.h"
+#include "http_server.h"
+
+/*
+ * Gate command coalescing in user_request against a fake server, event loop and timer. Requests
+ * are async slots the server reuses, so a slot whose command expired comes back as a new request
+ * while the old command's ack may still arrive, and must not be answered by it.
+ */
+
+#define GATE_OPEN_URI   "/gate-open"
+#define GATE_CLOSE_URI  "/gate-close"
+#define TIMEOUT_MS      5000
+
+typedef struct {
+    int replies;                    //Every response or reply the request got
+    int status;                     //504 for a timeout, 200 otherwise
+    char body[16];
+} fake_request_t;
+
+static fake_request_t requests[4];
+
+static request_callback gate_open;
+static request_callback gate_close;
+
+static int64_t now_us;
+static esp_timer_cb_t timer_callbacks[2];
+static void *timer_args[2];
+static int timer_count;
+
+static int posts;
+static void *posted;                //Context of the last posted event
+static esp_err_t post_result = ESP_OK;
+
+
+static http_request_t *request(int i)
+{
+    return (http_request_t *)&requests[i];
+}
+
+
+static esp_err_t fake_register_uri_ex(const char *uri, request_method_t method, request_callback cb,
+                                      const uri_options_t *options)
+{
+    if (strcmp(uri, GATE_OPEN_URI) == 0) gate_open = cb;
+    if (strcmp(uri, GATE_CLOSE_URI) == 0) gate_close = cb;
+    return ESP_OK;
+}
+
+
+static esp_err_t fake_register_uri(const char *uri, request_method_t method, request_callback cb)
+{
+    return ESP_OK;
+}
+
+
+static esp_err_t fake_send_response(http_request_t *req, const char *data)
+{
+    fake_request_t *r = (fake_request_t *)req;
+    r->replies++;
+    r->status = 200;
+    snprintf(r->body, sizeof(r->body), "%s", data);
+    return ESP_OK;
+}
+
+
+static esp_err_t fake_send_status_response(http_request_t *req, int status_code, const char *message)
+{
+    fake_request_t *r = (fake_request_t *)req;
+    r->replies++;
+    r->status = status_code;
+    r->body[0] = '\0';
+    return ESP_OK;
+}
+
+
+static esp_err_t fake_close(http_request_t *req)
+{
+    return ESP_OK;
+}
+
+
+static void fake_trace_mark(http_request_t *req, request_trace_stage_t stage)
+{
+    //Only ever a request, never a command token
+    CHECK(req == NULL || ((uintptr_t)req & 1) == 0);
+}
+
+
+static http_server_interface_t server = {
+    .register_uri = fake_register_uri,
+    .register_uri_ex = fake_register_uri_ex,
+    .send_response = fake_send_response,
+    .send_status_response = fake_send_status_response,
+    .close_async_connection = fake_close,
+    .trace_mark = fake_trace_mark,
+};
+
+
+http_server_interface_t *http_server_get_interface()
+{
+    return &server;
+}
+
+
+esp_err_t http_server_init(http_server_config_t *config)
+{
+    return ESP_OK;
+}
+
+
+int64_t esp_timer_get_time(void)
+{
+    return now_us;
+}
+
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t *args, esp_timer_handle_t *handle)
+{
+    timer_callbacks[timer_count] = args->callback;
+    timer_args[timer_count] = args->arg;
+    *handle = (esp_timer_handle_t)&timer_callbacks[timer_count++];
+    return ESP_OK;
+}
+
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us)
+{
+    return ESP_OK;
+}
+
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer)
+{
+    return ESP_OK;
+}
+
+
+esp_err_t USER_REQUEST_post_event(int32_t id, const void *data, size_t len)
+{
+    CHECK_INT(len, sizeof(void *));
+    memcpy(&posted, data, sizeof(posted));
+    posts++;
+    return post_result;
+}
+
+
+esp_err_t USER_REQUEST_register_event(int32_t id, void *handler, void *arg)
+{
+    return ESP_OK;
+}
+
+
+//What the routine handler answers with, user_request_response_inform_command_status
+static esp_err_t reply(bool success, void *context)
+{
+    return fake_send_response((http_request_t *)context, success ? "success" : "Failed");
+}
+
+
+//The command times out, its timer fires after the full timeout
+static void expire(void)
+{
+    now_us += TIMEOUT_MS * 1000LL;
+    for (int i = 0; i < timer_count; i++) {
+        timer_callbacks[i](timer_args[i]);
+    }
+}
+
+
+static void reset(void)
+{
+    memset(requests, 0, sizeof(requests));
+    posts = 0;
+    posted = NULL;
+    post_result = ESP_OK;
+}
+
+
+/// @brief Identical commands share one send, its ack answers them all
+static void test_coalesced(void)
+{
+    reset();
+    gate_open(request(0), GATE_OPEN_URI);
+    void *token = posted;
+    gate_open(request(1), GATE_OPEN_URI);
+    CHECK_INT(posts, 1);
+    CHECK(user_request_context_request(token) == request(0));
+
+    gate_close(request(2), GATE_CLOSE_URI);
+    CHECK_INT(posts, 2);
+
+    CHECK_INT(user_request_command_complete(true, token, reply), ESP_OK);
+    CHECK_INT(requests[0].replies, 1);
+    CHECK_INT(requests[1].replies, 1);
+    CHECK_STR(requests[1].body, "success");
+    CHECK_INT(requests[2].replies, 0);
+    CHECK(user_request_context_request(token) == NULL);
+
+    //A second ack for the same command answers nobody
+    user_request_command_complete(true, token, reply);
+    CHECK_INT(requests[0].replies, 1);
+    expire();
+    CHECK_INT(requests[2].replies, 1);
+    CHECK_INT(requests[2].status, 504);
+}
+
+
+/// @brief An expired command's slot serves a log request whose delegate post fails, it still gets its reply
+static void test_reused_slot_log(void)
+{
+    reset();
+    gate_open(request(0), GATE_OPEN_URI);
+    expire();
+    CHECK_INT(requests[0].replies, 1);
+    CHECK_INT(requests[0].status, 504);
+
+    //Request 0 is now /get-log on the same slot, posted as itself
+    CHECK_INT(user_request_command_complete(false, request(0), reply), ESP_OK);
+    CHECK_INT(requests[0].replies, 2);
+    CHECK_STR(requests[0].body, "Failed");
+}
+
+
+/// @brief The late ack of an expired command must not answer the newer command on the same slot
+static void test_reused_slot_late_ack(void)
+{
+    reset();
+    gate_open(request(0), GATE_OPEN_URI);
+    void *old = posted;
+    expire();
+    CHECK_INT(requests[0].replies, 1);
+
+    gate_open(request(0), GATE_OPEN_URI);
+    void *token = posted;
+    CHECK_INT(posts, 2);
+    CHECK(token != old);
+
+    user_request_command_complete(true, old, reply);
+    CHECK_INT(requests[0].replies, 1);
+
+    user_request_command_complete(false, token, reply);
+    CHECK_INT(requests[0].replies, 2);
+    CHECK_STR(requests[0].body, "Failed");
+}
+
+
+/// @brief A failed post fails the command's requests at once, the next one is sent again
+static void test_post_failure(void)
+{
+    reset();
+    post_result = ESP_FAIL;
+    gate_close(request(0), GATE_CLOSE_URI);
+    CHECK_INT(requests[0].replies, 1);
+    CHECK_STR(requests[0].body, "failure");
+
+    post_result = ESP_OK;
+    gate_close(request(1), GATE_CLOSE_URI);
+    CHECK_INT(posts, 2);
+    CHECK(user_request_context_request(posted) == request(1));
+    user_request_command_complete(true, posted, reply);
+    CHECK_INT(requests[1].replies, 1);
+    CHECK_INT(requests[0].replies, 1);
+}
+
+
+int main(void)
+{
+    user_request_config_t config = {
+        .gate_open_endpoint = GATE_OPEN_URI,
+        .gate_close_endpoint = GATE_CLOSE_URI,
+        .log_endpoint = "/get-log",
+        .ota_update_endpoint = "/ota-update",
+        .command_timeout_ms = TIMEOUT_MS,
+    };
+    CHECK_INT(user_request_create(&config), ESP_OK);
+    CHECK(gate_open != NULL && gate_close != NULL);
+    CHECK_INT(timer_count, 2);
+
+    test_coalesced();
+    test_reused_slot_log();
+    test_reused_slot_late_ack();
+    test_post_failure();
+    return check_failures != 0;
+}
@@ -0,0 +1,207 @@
+import sys
+import argparse
+import hashlib
+import time
+
+# LZSS in the heatshrink bit format, decoded on the device by components/lzss-stream
+#
+# Bits packed most significant first:
+#   1, 8 bit byte                                              literal
+#   0, window bits (distance - 1), lookahead bits (length - 1)   back reference
+# The last byte is zero padded.
+#
+# --window and --lookahead must match CONFIG_LZSS_WINDOW_BITS and CONFIG_LZSS_LOOKAHEAD_BITS
+
+MAX_CHAIN = 128     # Candidates tried per position, trades ratio for encoding time
+DEVICE_CHAIN = 16   # CONFIG_LZSS_ENCODER_CHAIN, what components/lzss-stream's encoder tries
+
+
+class BitWriter:
+    def __init__(self):
+        self.out = bytearray()
+        self.acc = 0
+        self.count = 0
+
+    def put(self, value, bits):
+        self.acc = (self.acc << bits) | value
+        self.count += bits
+        while self.count >= 8:
+            self.count -= 8
+            self.out.append((self.acc >> self.count) & 0xFF)
+        self.acc &= (1 << self.count) - 1
+
+    def finish(self):
+        if self.count:
+            self.out.append((self.acc << (8 - self.count)) & 0xFF)
+        return bytes(self.out)
+
+
+def compress(data, window_bits, lookahead_bits, max_chain=MAX_CHAIN):
+    window = 1 << window_bits
+    max_len = 1 << lookahead_bits
+    # A back reference only pays when it is shorter than the literals it replaces
+    min_len = (1 + window_bits + lookahead_bits) // 9 + 1
+
+    bits = BitWriter()
+    chains = {}
+    pos = 0
+    n = len(data)
+
+    def index(p):
+        if p + 3 <= n:
+            chains.setdefault(data[p:p + 3], []).append(p)
+
+    while pos < n:
+        best_len, best_dist = 0, 0
+        candidates = chains.get(data[pos:pos + 3], ())
+        limit = min(max_len, n - pos)
+        for cand in reversed(candidates[-max_chain:]):
+            dist = pos - cand
+            if dist > window:
+                break
+            length = 3
+            while length < limit and data[cand + length] == data[pos + length]:
+                length += 1
+            if length > best_len:
+                best_len, best_dist = length, dist
+                if length == limit:
+                    break
+
+        if best_len >= max(min_len, 3):
+            bits.put(0, 1)
+            bits.put(best_dist - 1, window_bits)
+            bits.put(best_len - 1, lookahead_bits)
+            for p in range(pos, pos + best_len):
+                index(p)
+            pos += best_len
+        else:
+            bits.put(1, 1)
+            bits.put(data[pos], 8)
+            index(pos)
+            pos += 1
+
+    return bits.finish()
+
+
+def decompress(data, window_bits, lookahead_bits):
+    """Reference decoder, the same state machine as lzss_decoder.c"""
+    out = bytearray()
+    acc = 0
+    count = 0
+    pos = 0
+
+    def get(bits):
+        nonlocal acc, count, pos
+        while count < bits:
+            if pos == len(data):
+                return None
+            acc = (acc << 8) | data[pos]
+            pos += 1
+            count += 8
+        count -= bits
+        value = (acc >> count) & ((1 << bits) - 1)
+        acc &= (1 << count) - 1
+        return value
+
+    while True:
+        tag = get(1)
+        if tag is None:
+            break
+        if tag:
+            c = get(8)
+            if c is None:
+                break
+            out.append(c)
+        else:
+            dist = get(window_bits)
+            length = get(lookahead_bits) if dist is not None else None
+            if length is None:
+                break   # Padding
+            dist += 1
+            for _ in range(length + 1):
+                # Before the window fills, heatshrink reads zeros
+                out.append(out[-dist] if dist <= len(out) else 0)
+    return bytes(out)
+
+
+def read(path):
+    with open(path, "rb") as f:
+        return f.read()
+
+
+def main():
+    parser = argparse.ArgumentParser(description="LZSS (heatshrink format) streams for OTA images and logs")
+    parser.add_argument("-w", "--window", type=int, default=10, help="window bits, CONFIG_LZSS_WINDOW_BITS")
+    parser.add_argument("-l", "--lookahead", type=int, default=5, help="lookahead bits, CONFIG_LZSS_LOOKAHEAD_BITS")
+    sub = parser.add_subparsers(dest="command", required=True)
+
+    p = sub.add_parser("compress", help="Compress a file, checking it decompresses back")
+    p.add_argument("input")
+    p.add_argument("output")
+
+    p = sub.add_parser("decompress", help="Decompress a file")
+    p.add_argument("input")
+    p.add_argument("output")
+
+    p = sub.add_parser("bench", help="Ratio, throughput and the device's fixed RAM for a file, e.g. an SD log segment")
+    p.add_argument("input")
+    p.add_argument("--output-buffer", type=int, default=512, help="CONFIG_LZSS_OUTPUT_BUFFER_SIZE")
+    p.add_argument("--chain", type=int, default=DEVICE_CHAIN, help="CONFIG_LZSS_ENCODER_CHAIN")
+
+    args = parser.parse_args()
+    if not 4 <= args.window <= 14 or not 3 <= args.lookahead < args.window:
+        print("Error: window must be 4..14 and lookahead 3..window-1")
+        return 1
+
+    if args.command == "compress":
+        raw = read(args.input)
+        packed = compress(raw, args.window, args.lookahead)
+        if decompress(packed, args.window, args.lookahead) != raw:
+            print("Error: round trip failed")
+            return 1
+        with open(args.output, "wb") as f:
+            f.write(packed)
+        print("%d -> %d bytes (%.1f%%), -w %d -l %d" % (len(raw), len(packed), 100.0 * len(packed) / max(len(raw), 1),
+                                                      args.window, args.lookahead))
+        print("sha256 of the uncompressed image %s" % hashlib.sha256(raw).hexdigest())
+
+    elif args.command == "decompress":
+        raw = decompress(read(args.input), args.window, args.lookahead)
+        with open(args.output, "wb") as f:
+            f.write(raw)
+        print("%d bytes" % len(raw))
+
+    elif args.command == "bench":
+        raw = read(args.input)
+        start = time.perf_counter()
+        packed = compress(raw, args.window, args.lookahead)
+        encode_s = time.perf_counter() - start
+        # What the device encoder gets with its shorter candidate chains, the SD log compression
+        start = time.perf_counter()
+        device = compress(raw, args.window, args.lookahead, args.chain)
+        device_s = time.perf_counter() - start
+        start = time.perf_counter()
+        ok = decompress(packed, args.window, args.lookahead) == raw
+        decode_s = time.perf_counter() - start
+
+        # Everything the device decoder owns is in lzss_decoder_t, there is no other allocation
+        state_ram = (1 << args.window) + args.output_buffer + 32
+        encoder_ram = 6 * (1 << args.window) + 2 * 1024 + args.output_buffer + 16
+        print("input           %d bytes" % len(raw))
+        print("compressed      %d bytes (%.1f%%)" % (len(packed), 100.0 * len(packed) / max(len(raw), 1)))
+        print("round trip      %s" % ("ok" if ok else "FAILED"))
+        print("device encoder  %d bytes (%.1f%%), chain %d, %.2f s" %
+              (len(device), 100.0 * len(device) / max(len(raw), 1), args.chain, device_s))
+        print("encode          %.2f s" % encode_s)
+        print("decode (python) %.0f KB/s" % (len(raw) / 1024 / max(decode_s, 1e-9)))
+        print("device RAM      %d bytes fixed (window %d + output buffer %d + state)" %
+              (state_ram, 1 << args.window, args.output_buffer))
+        print("encoder RAM     %d bytes fixed (buffer %d + hash chains %d + output buffer %d + state)" %
+              (encoder_ram, 2 << args.window, (4 << args.window) + 2 * 1024, args.output_buffer))
+        return 0 if ok else 1
+
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,243 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "sdkconfig.h"
+#include "metrics.h"
+#include "delegate_executor.h"
+
+
+static const char* TAG="Delegate";
+
+#define WORKER_COUNT        CONFIG_DELEGATE_WORKER_COUNT
+#define LANE_DEPTH          CONFIG_DELEGATE_LANE_DEPTH      //Per worker and lane
+#define WORKER_STACK_SIZE   CONFIG_DELEGATE_WORKER_STACK_SIZE
+#define WORKER_PRIORITY     5
+
+//With more than one worker, one is always kept off the low lane so high lane jobs never wait behind a log dump
+#define MAX_LOW_LANE_RUNNING    (WORKER_COUNT > 1 ? WORKER_COUNT - 1 : 1)
+
+
+//A job is just the function and its context, so it is stored by value in the worker's deque
+typedef struct {
+    delegate_func_t func;
+    void* ctx;
+} delegate_job_t;
+
+//Ring deque. The owner pops from the head, thieves take from the tail
+typedef struct {
+    delegate_job_t jobs[LANE_DEPTH];
+    uint8_t head;
+    uint8_t count;
+} job_deque_t;
+
+typedef struct {
+    job_deque_t lanes[DELEGATE_LANE_MAX];
+    portMUX_TYPE lock;                  //Guards both deques, only held for a push or pop
+    TaskHandle_t task;
+    volatile bool idle;                 //Blocked waiting for a notification
+} delegate_worker_t;
+
+static struct{
+    delegate_worker_t workers[WORKER_COUNT];
+    uint8_t next_worker;                //Round robin target of delegate_post
+    uint8_t low_lane_running;
+    portMUX_TYPE lock;                  //Guards next_worker and low_lane_running
+    bool started;
+    metric_t* saturated[DELEGATE_LANE_MAX];
+    metric_t* steals;
+}delegate_executor={.lock=portMUX_INITIALIZER_UNLOCKED};
+
+
+static bool deque_push(job_deque_t* deque, const delegate_job_t* job) {
+    if (deque->count == LANE_DEPTH)
+        return false;
+    deque->jobs[(deque->head + deque->count) % LANE_DEPTH] = *job;
+    deque->count++;
+    return true;
+}
+
+static bool deque_pop_head(job_deque_t* deque, delegate_job_t* job) {
+    if (deque->count == 0)
+        return false;
+    *job = deque->jobs[deque->head];
+    deque->head = (deque->head + 1) % LANE_DEPTH;
+    deque->count--;
+    return true;
+}
+
+static bool deque_pop_tail(job_deque_t* deque, delegate_job_t* job) {
+    if (deque->count == 0)
+        return false;
+    deque->count--;
+    *job = deque->jobs[(deque->head + deque->count) % LANE_DEPTH];
+    return true;
+}
+
+
+/// @brief Takes a job of the lane, from the worker's own deque first and otherwise stolen from the others
+static bool take_from_lane(int self, delegate_lane_t lane, delegate_job_t* job) {
+    for (int i = 0; i < WORKER_COUNT; i++) {
+        int victim = (self + i) % WORKER_COUNT;
+        delegate_worker_t* worker = &delegate_executor.workers[victim];
+
+        taskENTER_CRITICAL(&worker->lock);
+        bool found = (victim == self) ? deque_pop_head(&worker->lanes[lane], job)
+                                      : deque_pop_tail(&worker->lanes[lane], job);
+        taskEXIT_CRITICAL(&worker->lock);
+
+        if (found) {
+            if (victim != self)
+                metrics_counter_add(delegate_executor.steals, 1);
+            return true;
+        }
+    }
+    return false;
+}
+
+
+static bool low_lane_enter(void) {
+    bool allowed = false;
+    taskENTER_CRITICAL(&delegate_executor.lock);
+    if (delegate_executor.low_lane_running < MAX_LOW_LANE_RUNNING) {
+        delegate_executor.low_lane_running++;
+        allowed = true;
+    }
+    taskEXIT_CRITICAL(&delegate_executor.lock);
+    return allowed;
+}
+
+static void low_lane_exit(void) {
+    taskENTER_CRITICAL(&delegate_executor.lock);
+    delegate_executor.low_lane_running--;
+    taskEXIT_CRITICAL(&delegate_executor.lock);
+}
+
+
+/// @brief Next job for the worker, the high lane of every worker is run dry before touching a low lane
+/// @param low set when the job came off a low lane, low_lane_exit is then due once it has run
+static bool find_job(int self, delegate_job_t* job, bool* low) {
+    *low = false;
+    if (take_from_lane(self, DELEGATE_LANE_HIGH, job))
+        return true;
+
+    if (low_lane_enter()) {
+        if (take_from_lane(self, DELEGATE_LANE_LOW, job)) {
+            *low = true;
+            return true;
+        }
+        low_lane_exit();
+    }
+    return false;
+}
+
+
+static void delegate_worker_task(void *arg) {
+    int self = (int)(intptr_t)arg;
+    delegate_worker_t* worker = &delegate_executor.workers[self];
+    delegate_job_t job;
+    bool low;
+
+    while (1) {
+        if (!find_job(self, &job, &low)) {
+            //Look once more after going idle, a post in between either sees the flag and wakes us or is found here
+            worker->idle = true;
+            if (!find_job(self, &job, &low)) {
+                ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+                worker->idle = false;
+                continue;
+            }
+            worker->idle = false;
+        }
+
+        job.func(job.ctx);
+        if (low)
+            low_lane_exit();
+    }
+}
+
+
+/// @brief Wakes the target, and an idle worker too if the target is busy so it can steal the job
+static void wake_workers(int target) {
+    xTaskNotifyGive(delegate_executor.workers[target].task);
+    if (!delegate_executor.workers[target].idle) {
+        for (int i = 1; i < WORKER_COUNT; i++) {
+            delegate_worker_t* worker = &delegate_executor.workers[(target + i) % WORKER_COUNT];
+            if (worker->idle) {
+                xTaskNotifyGive(worker->task);
+                break;
+            }
+        }
+    }
+}
+
+
+esp_err_t delegate_post(delegate_lane_t lane, delegate_func_t func, void* ctx) {
+    if (lane >= DELEGATE_LANE_MAX || func == NULL)
+        return ESP_ERR_INVALID_ARG;
+
+    if (!delegate_executor.started)
+        return ESP_ERR_INVALID_STATE;
+
+    delegate_job_t job = { .func = func, .ctx = ctx };
+
+    taskENTER_CRITICAL(&delegate_executor.lock);
+    int start = delegate_executor.next_worker;
+    delegate_executor.next_worker = (start + 1) % WORKER_COUNT;
+    taskEXIT_CRITICAL(&delegate_executor.lock);
+
+    //Round robin, falling over to the next worker when a deque is full
+    for (int i = 0; i < WORKER_COUNT; i++) {
+        int target = (start + i) % WORKER_COUNT;
+        delegate_worker_t* worker = &delegate_executor.workers[target];
+
+        taskENTER_CRITICAL(&worker->lock);
+        bool pushed = deque_push(&worker->lanes[lane], &job);
+        taskEXIT_CRITICAL(&worker->lock);
+
+        if (pushed) {
+            wake_workers(target);
+            return ESP_OK;
+        }
+    }
+
+    metrics_counter_add(delegate_executor.saturated[lane], 1);
+    ESP_LOGW(TAG, "lane %d saturated, job rejected", lane);
+    return ESP_ERR_NO_MEM;
+}
+
+
+esp_err_t delegate_executor_init() {
+
+    if (delegate_executor.started)
+        return ESP_OK;
+
+    delegate_executor.saturated[DELEGATE_LANE_HIGH] = metrics_register_counter("delegate_saturated_total", "lane=\"high\"",
+                                                                               "Jobs rejected because their lane was full");
+    delegate_executor.saturated[DELEGATE_LANE_LOW] = metrics_register_counter("delegate_saturated_total", "lane=\"low\"",
+                                                                              "Jobs rejected because their lane was full");
+    delegate_executor.steals = metrics_register_counter("delegate_steals_total", NULL,
+                                                        "Jobs run by a worker other than the one they were posted to");
+
+    for (int i = 0; i < WORKER_COUNT; i++) {
+        portMUX_INITIALIZE(&delegate_executor.workers[i].lock);
+    }
+
+    //One worker per core, wrapping round if there are more workers than cores
+    for (int i = 0; i < WORKER_COUNT; i++) {
+        char name[configMAX_TASK_NAME_LEN];
+        snprintf(name, sizeof(name), "delegate %d", i);
+
+        BaseType_t res = xTaskCreatePinnedToCore(delegate_worker_task, name, WORKER_STACK_SIZE,
+                                                 (void*)(intptr_t)i, WORKER_PRIORITY,
+                                                 &delegate_executor.workers[i].task, i % portNUM_PROCESSORS);
+        if (res != pdPASS) {
+            ESP_LOGE(TAG, "failed to create delegate worker %d", i);
+            return ESP_FAIL;
+        }
+    }
+
+    delegate_executor.started = true;
+    return ESP_OK;
+}
@@ -0,0 +1,25 @@
+#ifndef DELEGATE_EXECUTOR_H
+#define DELEGATE_EXECUTOR_H
+
+#include "esp_err.h"
+
+
+//Work that cannot run in the event loop task (blocking or long running) is delegated to worker tasks
+
+typedef void (*delegate_func_t)(void* ctx);
+
+//The high lane is always drained first. Short, latency sensitive jobs go there, bulk work like log dumps in the low lane
+typedef enum {
+    DELEGATE_LANE_HIGH,
+    DELEGATE_LANE_LOW,
+    DELEGATE_LANE_MAX
+} delegate_lane_t;
+
+
+esp_err_t delegate_executor_init();
+
+/// @brief Queues func(ctx) on a lane. Never blocks, so it is safe from the event loop task
+/// @return ESP_ERR_NO_MEM if the lane is saturated, the job is not queued and the caller has to fail it
+esp_err_t delegate_post(delegate_lane_t lane, delegate_func_t func, void* ctx);
+
+#endif
@@ -25,9 +25,13 @@
 #include "lcd_device.h"
 #include "sync_manager.h"
 #include "log_capture.h"
+#if CONFIG_BINARY_LOG
+#include "binary_log.h"
+#endif
 #include "user_output.h"
 #include "user_request.h"
-//#include "logger.h"
+#include "metrics.h"
+#include "logger.h"
 //#include "time_service.h"
 
 
@@ -147,8 +151,16 @@ void app_main(void)
         vTaskDelay(pdMS_TO_TICKS(500));
     }
 
+#if CONFIG_BINARY_LOG
+    binary_log_init();
+#else
     log_capture_init();
-    //sd_log_writer_start(4000);   // flush every 2 seconds, tune as needed
+#endif
+    //Takes the captured logs every 4 s into the segments /get-log?since= serves, the card itself
+    //is synced every CONFIG_SD_LOG_SYNC_INTERVAL_S. Without it only what is already on the card is read
+    if(!sd_log_writer_start(4000)){
+        sd_log_reader_start();
+    }
 
     gui_interface->gui_inform(SYSTEM_WIFI_STA_CONNECTED,NULL);
     ret=mdns_service_start();
@@ -230,7 +242,9 @@ void app_main(void)
     user_request_config_t request_config={ .gate_close_endpoint="/close-gate",
                                                     .gate_open_endpoint="/open-gate",
                                                     .log_endpoint="/get-log",
-                                                    .ota_update_endpoint="/ota-update"
+                                                    .ota_update_endpoint="/ota-update",
+                                                    .keep_alive_commands=true,
+                                                    .command_timeout_ms=5000
                                                   
                                          };
     ret=user_request_create(&request_config);
@@ -273,9 +287,14 @@ void app_main(void)
 
 //    ota_process_start();
 
+    metric_t* heap_free=metrics_register_gauge("heap_free_bytes",NULL,"Free heap");
+    metric_t* heap_min_free=metrics_register_gauge("heap_min_free_bytes",NULL,"Lowest free heap since boot");
+
     while(1){
         //user_command(USER_COMMAND_LOCK_CLOSE);
         vTaskDelay(pdMS_TO_TICKS(1000));
+        metrics_gauge_set(heap_free,(int32_t)esp_get_free_heap_size());
+        metrics_gauge_set(heap_min_free,(int32_t)esp_get_minimum_free_heap_size());
         //user_command(USER_COMMAND_LOCK_OPEN);
         //vTaskDelay(pdMS_TO_TICKS(500));
     }
@@ -1,6 +1,9 @@
 #include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/semphr.h"
 #include "esp_log.h"
 #include "event_system_adapter.h"
 #include "routine_event_handler.h"
@@ -14,6 +17,12 @@
 #include "smartconfig.h"
 #include "sync_manager.h"
 #include "log_capture.h"
+#include "metrics.h"
+#include "delegate_executor.h"
+#include "log_segments.h"
+#if CONFIG_BINARY_LOG
+#include "binary_log.h"
+#endif
 
 
 //static const uint8_t gate_node_mac[]={0xe4,0x65,0xb8,0x1b,0x1c,0xd8};
@@ -22,100 +31,214 @@ static const uint8_t gate_node_mac[]={0x24,0x0a,0xc4,0x5f,0x8a,0x90};
 static const char* TAG="Routine";
 
 #define     MAX_WIFI_CHANNEL        13
-#define     DELEGATE_QUEUE_LENGTH   4
 
-#define DELEGATE_ARG_MAX_SIZE 32   // tune as needed; small fixed buffer
 
-typedef void (*delegate_func_t)(void *arg, size_t len);
+//Log chunks are sent by reference, so the buffers are owned by the http server until released.
+//Chunks are released in the order they were queued, so the buffers are simply used round robin.
+//Several dumps can run at once on the low lane workers, so each one has its own buffers
+#define     LOG_SEND_BUFFER_SIZE    1024
+#define     LOG_SEND_BUFFER_COUNT   2
 
-typedef struct {
-    delegate_func_t func;
-    uint8_t arg_data[DELEGATE_ARG_MAX_SIZE];
-    size_t arg_len;
-} delegate_job_t;
+//Logs read back from the SD card go out in larger blocks, one sequential read per chunk
+#define     LOG_SD_READ_SIZE        4096
 
-static QueueHandle_t delegate_queue = NULL;
+typedef struct{
+    char* buffers;                  //LOG_SEND_BUFFER_COUNT of buffer_size
+    size_t buffer_size;
+    uint8_t next;
+    SemaphoreHandle_t free;         //Buffers not held by the server
+}log_dump_t;
 
 
-static TaskHandle_t delegate_task_handle=NULL;
+//Registered in routine_handler_init
+static struct{
+    metric_t* commands;             //Gate commands handed to the codec
+    metric_t* command_failures;     //Commands that failed before or at the ESP-NOW send
+    metric_t* acks_ok;
+    metric_t* acks_failed;
+    metric_t* log_bytes;            //Log bytes streamed to http clients
+}routine_metrics;
+
+
+static void log_send_buffer_release(void* arg){
+    log_dump_t* dump=(log_dump_t*)arg;
+    xSemaphoreGive(dump->free);
+}
+
+
+static bool log_dump_init(log_dump_t* dump,size_t buffer_size){
+    dump->buffer_size=buffer_size;
+    dump->next=0;
+    dump->buffers=malloc(LOG_SEND_BUFFER_COUNT*buffer_size);
+    dump->free=xSemaphoreCreateCounting(LOG_SEND_BUFFER_COUNT,LOG_SEND_BUFFER_COUNT);
+    if(dump->buffers==NULL || dump->free==NULL){
+        free(dump->buffers);
+        if(dump->free!=NULL)
+            vSemaphoreDelete(dump->free);
+        return false;
+    }
+    return true;
+}
+
+
+///Waits till the server hands a buffer back
+static char* log_dump_buffer(log_dump_t* dump){
+    xSemaphoreTake(dump->free,portMAX_DELAY);
+    return dump->buffers+dump->next*dump->buffer_size;
+}
+
+
+///The buffer from log_dump_buffer went out, the next one is used next time
+static void log_dump_sent(log_dump_t* dump,size_t len){
+    dump->next=(dump->next+1)%LOG_SEND_BUFFER_COUNT;
+    metrics_counter_add(routine_metrics.log_bytes,len);
+}
+
+
+///Every buffer must be back from the server before the memory goes
+static void log_dump_deinit(log_dump_t* dump){
+    for(int i=0;i<LOG_SEND_BUFFER_COUNT;i++)
+        xSemaphoreTake(dump->free,portMAX_DELAY);
+    vSemaphoreDelete(dump->free);
+    free(dump->buffers);
+}
+
+
+
+static bool log_query_u64(void* ctx,const char* key,uint64_t* value){
+    char text[24];
+    if(user_request_response_get_query(ctx,key,text,sizeof(text))!=ESP_OK)
+        return false;
+
+    *value=strtoull(text,NULL,10);
+    return true;
+}
+
+
+///Streams the SD log for /get-log?since=&until=&offset=
+///since and until are Unix times, offset a byte offset in the whole log, e.g. where an earlier dump stopped.
+///The first line gives the offset the dump starts at, the data follows it unchanged.
+///With CONFIG_BINARY_LOG that is binary records, decoded by binary_log.py against the ELF
+static void send_log_from_sd(void* ctx,uint64_t since,uint64_t until,uint64_t offset){
+    uint64_t start,end;
+    log_reader_t reader;
+
+    if(!log_segments_range((time_t)since,(time_t)until,&start,&end) ||
+       !log_reader_open(&reader,offset>start?offset:start,end)){
+        char message[]="No SD log\n";
+        user_request_response_send_log(message,strlen(message),ctx);
+        user_request_response_send_log(NULL,0,ctx);
+        return;
+    }
+
+    log_dump_t dump;
+    if(!log_dump_init(&dump,LOG_SD_READ_SIZE)){
+        log_reader_close(&reader);
+        user_request_response_send_log(NULL,0,ctx);
+        return;
+    }
+
+    char header[40];
+    int header_len=snprintf(header,sizeof(header),"#offset %llu\n",(unsigned long long)reader.offset);
+    esp_err_t ret=user_request_response_send_log(header,(size_t)header_len,ctx);
+
+    size_t bytes_read=0;
+    while(ret==ESP_OK){
+        char* block=log_dump_buffer(&dump);
+
+        bytes_read=log_reader_read(&reader,block,LOG_SD_READ_SIZE);
+        if(bytes_read==0){
+            xSemaphoreGive(dump.free);
+            break;
+        }
+        ret=user_request_response_send_log_ref(block,bytes_read,log_send_buffer_release,&dump,ctx);
+        if(ret!=ESP_OK){
+            xSemaphoreGive(dump.free);
+            ESP_LOGE(TAG,"failed to send log chunk (%s)",esp_err_to_name(ret));
+            break;
+        }
+        log_dump_sent(&dump,bytes_read);
+    }
+    log_reader_close(&reader);
+    user_request_response_send_log(NULL,0,ctx);
+    log_dump_deinit(&dump);
+}
 
 
 
 ///This function handles sending log data in chunks
 ///It was delegated by the event handler to the task context
 
-static void delegated_to_task_send_log(void *arg, size_t len){
+static void delegated_to_task_send_log(void *ctx){
+    uint64_t since=0,until=0,offset=0;
+    bool from_sd=log_query_u64(ctx,"since",&since);
+    from_sd|=log_query_u64(ctx,"until",&until);
+    from_sd|=log_query_u64(ctx,"offset",&offset);
+
+    //Without a range only the RAM capture is sent, as before
+    if(from_sd){
+        send_log_from_sd(ctx,since,until,offset);
+        return;
+    }
+
+
+#if CONFIG_BINARY_LOG
+    //Records are formatted here, the only place a binary log becomes text on the device
+    binary_log_snapshot_t snap = { .initialized = true, .cursor = 0 };
+#else
     log_snapshot_t snap = { .initialized = true, .cursor = 0 };
-    char buffer[256];       //Same as the temp buffer in log_capture.c, not neat, need to have some consistent way later
+#endif
     size_t bytes_read;
     esp_err_t ret=0;
+    log_dump_t dump;
 
+    if(!log_dump_init(&dump,LOG_SEND_BUFFER_SIZE)){
+        ESP_LOGE(TAG,"no memory for log buffers");
+        user_request_response_send_log(NULL,0,ctx);
+        return;
+    }
+
+#if CONFIG_BINARY_LOG
+    binary_log_snapshot_take(&snap);
+#else
     log_snapshot_take(&snap);
-    uint8_t count=0;
-    void* ctx= *(void**)arg;
+#endif
     //ESP_LOGI(TAG,"sending log data in chunks , ctc %p,", ctx);
     
     do{
-        bytes_read=log_snapshot_read(&snap,buffer,sizeof(buffer)-1);
+        char* buffer=log_dump_buffer(&dump);
+
+#if CONFIG_BINARY_LOG
+        bytes_read=binary_log_snapshot_read_text(&snap,buffer,LOG_SEND_BUFFER_SIZE);
+#else
+        bytes_read=log_snapshot_read(&snap,buffer,LOG_SEND_BUFFER_SIZE);
+#endif
         //ESP_LOGI(TAG,"bytes read %d",bytes_read);
         if(bytes_read>0){
-            buffer[bytes_read]='\0';   //null terminate
-            ret=user_request_response_send_log(buffer,bytes_read,ctx);
+            ret=user_request_response_send_log_ref(buffer,bytes_read,log_send_buffer_release,&dump,ctx);
 
             if(ret!=ESP_OK){
-                ESP_LOGE(TAG,"failed to send log chunk");
-                return;
+                xSemaphoreGive(dump.free);
+                ESP_LOGE(TAG,"failed to send log chunk (%s)",esp_err_to_name(ret));
+                //Still end the response so that the connection is not left hanging
+                user_request_response_send_log(NULL,0,ctx);
+                break;
             }
+            log_dump_sent(&dump,bytes_read);
         }
         else{
+            xSemaphoreGive(dump.free);
             ESP_LOGI(TAG,"no more log data");
             user_request_response_send_log(NULL,0,ctx);
         }
     }while(bytes_read>0);
 
-}
-
+    log_dump_deinit(&dump);
 
-
-/// @brief This task runs delegated functions posted to the delegate queue.
-/// @param arg 
-static void delegate_run_task(void *arg) {
-    delegate_job_t job;
-    while (1) {
-        if (xQueueReceive(delegate_queue, &job, portMAX_DELAY)) {
-            job.func(job.arg_data, job.arg_len);
-        }
-    }
-}
-
-/// @brief The tasks that are blocking or interative cannot be run directly in event handler context.
-/// This method delegates such tasks to a separate task via a queue.   
-/// @param func 
-/// @param arg 
-/// @param len 
-/// @return 
-static esp_err_t delegate_post(delegate_func_t func, const void *arg, size_t len) {
-    if (len > DELEGATE_ARG_MAX_SIZE) {
-        ESP_LOGE("DELEGATE", "Argument too large (%d > %d)", len, DELEGATE_ARG_MAX_SIZE);
-        return ESP_ERR_INVALID_ARG;
-    }
-
-    delegate_job_t job = { .func = func, .arg_len = len };
-    if (arg && len > 0) {
-        memcpy(job.arg_data, arg, len);
-    }
-
-    if (xQueueSend(delegate_queue, &job, portMAX_DELAY) != pdPASS) {
-        ESP_LOGE("DELEGATE", "Failed to post delegate job");
-        return ESP_FAIL;
-    }
-    return ESP_OK;
 }
 
 
 
-
-
 static void routine_ota_service_events_handler(void *handler_arg,
                                     int32_t id,
                                     void *event_data){
@@ -184,26 +307,37 @@ static void routine_user_request_events_handler (void *handler_arg,
     esp_err_t ret=0;
     void** context=(void**)event_data;
     void* ctx=*context;
+    //Gate commands carry a token as ctx, the request behind it is what gets traced
+    void* request=user_request_context_request(ctx);
 
     //ESP_LOGI(TAG,"ctx ptr address print %p",context);
     //ESP_LOGI(TAG,"ctx address print %p",ctx);
 
+    user_request_response_trace(request,REQUEST_TRACE_ROUTINE);
+
     switch(id){
 
         case USER_REQUEST_ROUTINE_EVENT_USER_COMMAND_GATE_OPEN:
+                user_request_response_trace(request,REQUEST_TRACE_CODEC_SEND);
+                metrics_counter_add(routine_metrics.commands,1);
                 ret=message_codec_send_command(gate_node_mac ,MESSAGE_COMMAND_OPEN_LOCK,ctx);
                 break;
 
 
         case USER_REQUEST_ROUTINE_EVENT_USER_COMMAND_GATE_CLOSE:
+                user_request_response_trace(request,REQUEST_TRACE_CODEC_SEND);
+                metrics_counter_add(routine_metrics.commands,1);
                 ret=message_codec_send_command(gate_node_mac,MESSAGE_COMMAND_CLOSE_LOCK,ctx);
                 break;
         case USER_REQUEST_ROUTINE_EVENT_USER_COMMAND_GATE_STATUS:
+                user_request_response_trace(request,REQUEST_TRACE_CODEC_SEND);
+                metrics_counter_add(routine_metrics.commands,1);
                 ret=message_codec_send_command(gate_node_mac,MESSAGE_COMMAND_LOCK_STATUS,ctx);
                 break;
         case USER_REQUEST_ROUTINE_EVENT_USER_COMMAND_LOG:
 
-           delegate_post(delegated_to_task_send_log,&ctx,sizeof(void*));
+           //Low lane, a long dump must not hold up anything more urgent. Saturation fails the request below
+           ret=delegate_post(DELEGATE_LANE_LOW,delegated_to_task_send_log,ctx);
            break;
 
         case USER_REQUEST_ROUTINE_EVENT_USER_COMMAND_OTA_UPDATE:
@@ -223,9 +357,11 @@ static void routine_user_request_events_handler (void *handler_arg,
     }
 
     //Right now responds true unconditionally
+    //Goes through user_request so that requests coalesced onto this command get the failure too
     if(ret!=ESP_OK){
         ESP_LOGI(TAG,"failure");
-        user_request_response_inform_command_status(false,ctx);
+        metrics_counter_add(routine_metrics.command_failures,1);
+        user_request_command_complete(false,ctx,user_request_response_inform_command_status);
     }
 
 }
@@ -246,7 +382,10 @@ static void routine_message_service_events_handler (void *handler_arg,
             message_send_ack_t* msg_send_ack=(message_send_ack_t*)event_data;
             //ESP_LOGI(TAG,"success in event handler %d",msg_send_ack->success);
             ///context=(void**)msg_send_ack->context;
-            user_request_response_inform_command_status(msg_send_ack->success,msg_send_ack->context);
+            //One ack answers every request that was coalesced onto this command
+            user_request_response_trace(user_request_context_request(msg_send_ack->context),REQUEST_TRACE_ACK);
+            metrics_counter_add(msg_send_ack->success ? routine_metrics.acks_ok : routine_metrics.acks_failed,1);
+            user_request_command_complete(msg_send_ack->success,msg_send_ack->context,user_request_response_inform_command_status);
             break;
         }
         
@@ -300,29 +439,13 @@ void routine_event_handler (void *handler_arg,
 
 esp_err_t routine_handler_init(){
 
-    if (delegate_queue == NULL) {
-        delegate_queue = xQueueCreate(DELEGATE_QUEUE_LENGTH, sizeof(delegate_job_t));
-        if (delegate_queue == NULL) {
-            ESP_LOGE(TAG, "failed to create delegate queue");
-            return ESP_FAIL;
-        }
-    }
-
-    if (delegate_task_handle == NULL) {
-        BaseType_t res = xTaskCreatePinnedToCore(
-            delegate_run_task,
-            "run delegated tasks",
-            4096,        // stack size
-            NULL,
-            5,             // priority
-            &delegate_task_handle,
-            tskNO_AFFINITY // can pin to core 0 or 1 if you prefer
-        );
-        if (res != pdPASS) {
-            ESP_LOGE(TAG, "failed to create delegate task");
-            return ESP_FAIL;
-        }
+    if (routine_metrics.commands == NULL) {
+        routine_metrics.commands = metrics_register_counter("gate_commands_total", NULL, "Gate commands sent over ESP-NOW");
+        routine_metrics.command_failures = metrics_register_counter("gate_command_failures_total", NULL, "Gate commands that could not be sent");
+        routine_metrics.acks_ok = metrics_register_counter("gate_command_acks_total", "result=\"ok\"", "ESP-NOW send status of gate commands");
+        routine_metrics.acks_failed = metrics_register_counter("gate_command_acks_total", "result=\"failed\"", "ESP-NOW send status of gate commands");
+        routine_metrics.log_bytes = metrics_register_counter("log_stream_bytes_total", NULL, "Log bytes streamed over http");
     }
 
-    return ESP_OK;
+    return delegate_executor_init();
 }
\ No newline at end of file
@@ -0,0 +1,169 @@
+import sys
+import argparse
+import hashlib
+import struct
+
+# Delta patches for OTA, decoded on the device by components/ota-service/ota_delta.c
+#
+# All integers little endian.
+# header: "OTAD", u8 format version (1), u32 source size, u32 target size
+# then ops until END:
+#   0x00 END
+#   0x01 COPY    u32 source offset, u32 length
+#   0x02 INSERT  u32 length, then length bytes
+
+MAGIC = b"OTAD"
+FORMAT_VERSION = 1
+OP_END = 0
+OP_COPY = 1
+OP_INSERT = 2
+
+BLOCK = 32          # Matches are searched for on block boundaries of the source
+MIN_COPY = 24       # Shorter matches cost more as a COPY op than as literal bytes
+
+
+def make_patch(source, target):
+    """Greedy block matching: index every source block, extend each hit both ways as far as it goes"""
+    index = {}
+    for off in range(0, len(source) - BLOCK + 1, BLOCK):
+        index.setdefault(source[off:off + BLOCK], off)
+
+    ops = []
+    literal = bytearray()
+    pos = 0
+
+    def flush():
+        if literal:
+            ops.append((OP_INSERT, bytes(literal)))
+            literal.clear()
+
+    while pos < len(target):
+        src = index.get(target[pos:pos + BLOCK]) if pos + BLOCK <= len(target) else None
+        if src is None:
+            literal.append(target[pos])
+            pos += 1
+            continue
+
+        # Grow backwards into the pending literal bytes, then forwards
+        back = 0
+        while back < len(literal) and src - back > 0 and source[src - back - 1] == literal[-back - 1]:
+            back += 1
+        length = BLOCK
+        while pos + length < len(target) and src + length < len(source) and target[pos + length] == source[src + length]:
+            length += 1
+
+        if back + length < MIN_COPY:
+            literal.append(target[pos])
+            pos += 1
+            continue
+
+        if back:
+            del literal[-back:]
+        flush()
+        ops.append((OP_COPY, src - back, back + length))
+        pos += length
+
+    flush()
+
+    out = bytearray(MAGIC)
+    out += struct.pack("<BII", FORMAT_VERSION, len(source), len(target))
+    for op in ops:
+        if op[0] == OP_COPY:
+            out += struct.pack("<BII", OP_COPY, op[1], op[2])
+        else:
+            out += struct.pack("<BI", OP_INSERT, len(op[1])) + op[1]
+    out.append(OP_END)
+    return bytes(out)
+
+
+def apply_patch(source, patch):
+    """Reference decoder, same checks as the device"""
+    if patch[:4] != MAGIC or patch[4] != FORMAT_VERSION:
+        raise ValueError("not a version %d delta patch" % FORMAT_VERSION)
+    source_size, target_size = struct.unpack_from("<II", patch, 5)
+    if source_size > len(source):
+        raise ValueError("patch expects a %d byte source" % source_size)
+
+    out = bytearray()
+    pos = 13
+    while True:
+        op = patch[pos]
+        pos += 1
+        if op == OP_END:
+            break
+        if op == OP_COPY:
+            off, length = struct.unpack_from("<II", patch, pos)
+            pos += 8
+            if off + length > len(source):
+                raise ValueError("COPY outside the source")
+            out += source[off:off + length]
+        elif op == OP_INSERT:
+            (length,) = struct.unpack_from("<I", patch, pos)
+            pos += 4
+            out += patch[pos:pos + length]
+            pos += length
+        else:
+            raise ValueError("unknown op 0x%02x" % op)
+
+    if pos != len(patch):
+        raise ValueError("data after END")
+    if len(out) != target_size:
+        raise ValueError("patch produced %d of %d bytes" % (len(out), target_size))
+    return bytes(out)
+
+
+def read(path):
+    with open(path, "rb") as f:
+        return f.read()
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Create and check delta OTA patches")
+    sub = parser.add_subparsers(dest="command", required=True)
+
+    p = sub.add_parser("diff", help="Create a patch taking the old image to the new one")
+    p.add_argument("old")
+    p.add_argument("new")
+    p.add_argument("patch")
+
+    p = sub.add_parser("apply", help="Rebuild the new image from the old one and a patch")
+    p.add_argument("old")
+    p.add_argument("patch")
+    p.add_argument("new")
+
+    p = sub.add_parser("verify", help="Check a patch rebuilds exactly the new image")
+    p.add_argument("old")
+    p.add_argument("new")
+    p.add_argument("patch")
+
+    args = parser.parse_args()
+
+    if args.command == "diff":
+        old, new = read(args.old), read(args.new)
+        patch = make_patch(old, new)
+        # Round trip before publishing, a bad patch only shows up on the device otherwise
+        if apply_patch(old, patch) != new:
+            print("Error: patch does not rebuild the new image")
+            return 1
+        with open(args.patch, "wb") as f:
+            f.write(patch)
+        print("Patch %d bytes for a %d byte image (%.1f%%)" % (len(patch), len(new), 100.0 * len(patch) / max(len(new), 1)))
+        print("sha256 %s" % hashlib.sha256(new).hexdigest())
+
+    elif args.command == "apply":
+        new = apply_patch(read(args.old), read(args.patch))
+        with open(args.new, "wb") as f:
+            f.write(new)
+        print("Rebuilt %d bytes, sha256 %s" % (len(new), hashlib.sha256(new).hexdigest()))
+
+    elif args.command == "verify":
+        if apply_patch(read(args.old), read(args.patch)) != read(args.new):
+            print("Error: patch does not rebuild the new image")
+            return 1
+        print("Patch OK")
+
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
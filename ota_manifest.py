@@ -0,0 +1,52 @@
+import sys
+import os
+import json
+import argparse
+
+# Maintains the combined OTA manifest read by the devices:
+#
+# {
+#   "builds": [
+#     { "channel": "stable", "target": "esp32c3", "version": "v1.4.0", "firmware_url": ..., "firmware_size": ...,
+#       "checksum": ..., optional "compressed_url"/"compression*" and "patch_url"/"patch_base" },
+#     ...
+#   ]
+# }
+#
+# Each release replaces the build of its channel and target and leaves the others, so a device
+# finds the newest build of every channel it accepts in one fetch.
+
+def merge(manifest_path, channel, build_manifests):
+    builds = []
+    if os.path.exists(manifest_path):
+        with open(manifest_path) as f:
+            builds = json.load(f).get("builds", [])
+
+    for path in build_manifests:
+        with open(path) as f:
+            build = json.load(f)
+        if "target" not in build or "version" not in build:
+            print("Error: %s has no target or version" % path)
+            return 1
+        build["channel"] = channel
+        builds = [b for b in builds if (b.get("channel"), b.get("target")) != (channel, build["target"])]
+        builds.append(build)
+        print("%s %s -> %s" % (build["target"], build["version"], channel))
+
+    builds.sort(key=lambda b: (b.get("target", ""), b.get("channel", "")))
+    with open(manifest_path, "w") as f:
+        json.dump({"builds": builds}, f, indent=2)
+    return 0
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Add per-target build manifests to the combined OTA manifest")
+    parser.add_argument("manifest", help="combined manifest, created if missing")
+    parser.add_argument("channel", choices=["stable", "beta", "dev"])
+    parser.add_argument("builds", nargs="+", help="per-target manifests of one release")
+    args = parser.parse_args()
+    return merge(args.manifest, args.channel, args.builds)
+
+
+if __name__ == "__main__":
+    sys.exit(main())